@@ -0,0 +1,100 @@
+#include "AccessList.h"
+#include <ws2tcpip.h>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+
+AccessList::AccessList()
+{
+}
+
+AccessList::~AccessList()
+{
+}
+
+bool AccessList::ParseRange(const char* entry, Range& range)
+{
+	std::string addrPart = entry;
+	int bits = 32;
+	size_t slash = addrPart.find('/');
+	if (slash != std::string::npos)
+	{
+		char* end = nullptr;
+		long parsed = strtol(addrPart.c_str() + slash + 1, &end, 10);
+		if (end == addrPart.c_str() + slash + 1 || *end || parsed < 0 || parsed > 32)
+		{
+			return false;
+		}
+		bits = (int)parsed;
+		addrPart.resize(slash);
+	}
+
+	in_addr addr;
+	if (inet_pton(AF_INET, addrPart.c_str(), &addr) != 1)
+	{
+		return false;
+	}
+
+	range.mask = bits ? 0xffffffffUL << (32 - bits) : 0;
+	range.net = ntohl(addr.s_addr) & range.mask;
+	return true;
+}
+
+bool AccessList::Set(const char* list)
+{
+	//Replaces the list, or leaves it as it was and returns false if any entry doesn't parse
+	std::vector<Range> parsed;
+	std::string all = list ? list : "";
+	size_t start = 0;
+	while (start <= all.size())
+	{
+		size_t end = all.find(',', start);
+		if (end == std::string::npos)
+		{
+			end = all.size();
+		}
+
+		std::string entry = all.substr(start, end - start);
+		size_t first = entry.find_first_not_of(" \t");
+		size_t last = entry.find_last_not_of(" \t");
+		if (first != std::string::npos)
+		{
+			Range range;
+			if (!ParseRange(entry.substr(first, last - first + 1).c_str(), range))
+			{
+				return false;
+			}
+			parsed.push_back(range);
+		}
+		start = end + 1;
+	}
+
+	std::lock_guard<std::mutex> lock(accessMutex);
+	ranges.swap(parsed);
+	return true;
+}
+
+bool AccessList::IsLoopback(unsigned long addr)
+{
+	//addr in network order, anything in 127.0.0.0/8
+	return (ntohl(addr) >> 24) == 127;
+}
+
+bool AccessList::Allows(unsigned long addr)
+{
+	if (IsLoopback(addr))
+	{
+		return true;
+	}
+
+	unsigned long host = ntohl(addr);
+	std::lock_guard<std::mutex> lock(accessMutex);
+	for (const Range& range : ranges)
+	{
+		if ((host & range.mask) == range.net)
+		{
+			return true;
+		}
+	}
+	return false;
+}
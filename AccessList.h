@@ -0,0 +1,25 @@
+#pragma once
+#include <WinSock2.h>
+#include <vector>
+#include <mutex>
+
+//Which client addresses may use the server's own pages (metrics and trace). Loopback always can, anyone else only if
+//listed. Entries are IPv4 addresses or CIDR ranges, "10.0.0.5, 192.168.1.0/24".
+class AccessList
+{
+public:
+	AccessList();
+	~AccessList();
+	bool Set(const char* list);
+	bool Allows(unsigned long addr);
+	static bool IsLoopback(unsigned long addr);
+private:
+	struct Range
+	{
+		unsigned long net; //Host order, already masked
+		unsigned long mask;
+	};
+	static bool ParseRange(const char* entry, Range& range);
+	std::mutex accessMutex;
+	std::vector<Range> ranges;
+};
@@ -0,0 +1,143 @@
+#include "Affinity.h"
+#include <thread>
+
+bool CpuTopology::Detect()
+{
+	cpus.clear();
+	nodeMasks.clear();
+	osNodes.clear();
+
+	ULONG highest = 0;
+	if (GetNumaHighestNodeNumber(&highest))
+	{
+		for (ULONG osNode = 0; osNode <= highest; osNode++)
+		{
+			GROUP_AFFINITY mask;
+			memset(&mask, 0, sizeof(mask));
+			if (!GetNumaNodeProcessorMaskEx((USHORT)osNode, &mask) || !mask.Mask)
+			{
+				//Memory only nodes have no processors
+				continue;
+			}
+
+			int node = (int)nodeMasks.size();
+			nodeMasks.push_back(mask);
+			osNodes.push_back((int)osNode);
+			for (BYTE bit = 0; bit < sizeof(KAFFINITY) * 8; bit++)
+			{
+				if (mask.Mask & ((KAFFINITY)1 << bit))
+				{
+					cpus.push_back({ mask.Group, bit, node });
+				}
+			}
+		}
+	}
+
+	if (cpus.empty())
+	{
+		//No NUMA information, treat it as one node of however many cores there are in group 0
+		GROUP_AFFINITY mask;
+		memset(&mask, 0, sizeof(mask));
+		int count = (int)std::thread::hardware_concurrency();
+		for (int i = 0; i < count && i < (int)sizeof(KAFFINITY) * 8; i++)
+		{
+			mask.Mask |= (KAFFINITY)1 << i;
+			cpus.push_back({ 0, (BYTE)i, 0 });
+		}
+		nodeMasks.push_back(mask);
+		osNodes.push_back(0);
+	}
+	return !cpus.empty();
+}
+
+int CpuTopology::GetNodeCount()
+{
+	return (int)nodeMasks.size();
+}
+
+int CpuTopology::GetCpuCount()
+{
+	return (int)cpus.size();
+}
+
+const std::vector<CpuSlot>& CpuTopology::GetCpus()
+{
+	return cpus;
+}
+
+std::vector<CpuSlot> CpuTopology::GetInterleaved()
+{
+	//First core of each node, then the second of each and so on, so taking the first N spreads evenly over the nodes
+	std::vector<std::vector<CpuSlot>> perNode(nodeMasks.size());
+	for (int i = 0; i < cpus.size(); i++)
+	{
+		perNode[cpus[i].node].push_back(cpus[i]);
+	}
+
+	std::vector<CpuSlot> order;
+	for (int round = 0; order.size() < cpus.size(); round++)
+	{
+		for (int n = 0; n < perNode.size(); n++)
+		{
+			if (round < perNode[n].size())
+			{
+				order.push_back(perNode[n][round]);
+			}
+		}
+	}
+	return order;
+}
+
+int CpuTopology::NodeIndex(int osNode)
+{
+	for (int i = 0; i < osNodes.size(); i++)
+	{
+		if (osNodes[i] == osNode)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int CpuTopology::OsNode(int node)
+{
+	return node >= 0 && node < osNodes.size() ? osNodes[node] : -1;
+}
+
+bool CpuTopology::GetNodeMask(int node, GROUP_AFFINITY& mask)
+{
+	if (node < 0 || node >= nodeMasks.size())
+	{
+		return false;
+	}
+	mask = nodeMasks[node];
+	return true;
+}
+
+bool CpuTopology::PinCurrentThread(const CpuSlot& cpu)
+{
+	GROUP_AFFINITY mask;
+	memset(&mask, 0, sizeof(mask));
+	mask.Group = cpu.group;
+	mask.Mask = (KAFFINITY)1 << cpu.number;
+	return SetThreadGroupAffinity(GetCurrentThread(), &mask, NULL) != 0;
+}
+
+bool CpuTopology::PinCurrentThreadToNode(const GROUP_AFFINITY& mask)
+{
+	GROUP_AFFINITY copy = mask;
+	return SetThreadGroupAffinity(GetCurrentThread(), &copy, NULL) != 0;
+}
+
+int CpuTopology::GetSocketNode(SOCKET socket)
+{
+	//The OS node of the processor RSS delivers this connection's packets to, -1 when the NIC or stack doesn't say
+	SOCKET_PROCESSOR_AFFINITY info;
+	DWORD bytes = 0;
+	if (socket == INVALID_SOCKET || WSAIoctl(socket, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &info, sizeof(info), &bytes, NULL, NULL) == SOCKET_ERROR)
+	{
+		return -1;
+	}
+	return info.NumaNodeId;
+}
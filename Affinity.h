@@ -0,0 +1,33 @@
+#pragma once
+#include <WinSock2.h>
+#include <Windows.h>
+#include <vector>
+
+struct CpuSlot
+{
+	WORD group;
+	BYTE number;
+	int node; //Index into the topology's nodes, not the OS node number
+};
+
+//Which logical processors sit on which NUMA node, read once at startup.
+//Nodes are numbered densely from 0 in the order the OS reports them, OS node numbers only come in through NodeIndex.
+class CpuTopology
+{
+public:
+	bool Detect();
+	int GetNodeCount();
+	int GetCpuCount();
+	const std::vector<CpuSlot>& GetCpus();
+	std::vector<CpuSlot> GetInterleaved();
+	int NodeIndex(int osNode);
+	int OsNode(int node);
+	bool GetNodeMask(int node, GROUP_AFFINITY& mask);
+	static bool PinCurrentThread(const CpuSlot& cpu);
+	static bool PinCurrentThreadToNode(const GROUP_AFFINITY& mask);
+	static int GetSocketNode(SOCKET socket);
+private:
+	std::vector<CpuSlot> cpus;
+	std::vector<GROUP_AFFINITY> nodeMasks;
+	std::vector<int> osNodes;
+};
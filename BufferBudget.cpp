@@ -0,0 +1,147 @@
+#include "BufferBudget.h"
+#include "IoLoop.h"
+#include <stdio.h>
+
+BufferBudget::BufferBudget()
+{
+}
+
+BufferBudget::~BufferBudget()
+{
+}
+
+void BufferBudget::SetLimit(long long bytes)
+{
+	//0 keeps the default
+	limit = bytes > 0 ? bytes : BUFFER_BUDGET_BYTES;
+}
+
+void BufferBudget::SetLoop(IoLoop* loop)
+{
+	this->loop = loop;
+}
+
+void BufferBudget::Charge(long long bytes)
+{
+	long long now = used += bytes;
+	long long seen = peak;
+	while (now > seen && !peak.compare_exchange_weak(seen, now))
+	{
+	}
+
+	//One thread evicts at a time, the rest carry on with their request
+	if (IsPressured() && !evicting.exchange(true))
+	{
+		EvictIdle();
+		evicting = false;
+	}
+}
+
+void BufferBudget::Refund(long long bytes)
+{
+	used -= bytes;
+}
+
+bool BufferBudget::IsPressured()
+{
+	return used * 100 >= limit * BUFFER_BUDGET_HIGH_PERCENT;
+}
+
+bool BufferBudget::IsExhausted()
+{
+	return used >= limit;
+}
+
+bool BufferBudget::ParkIdle(SOCKET socket, long long heldBytes)
+{
+	//A connection waiting for its next request, false if it should close now rather than wait
+	if (IsPressured())
+	{
+		++evictions;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(idleMutex);
+	auto it = idlePos.find(socket);
+	if (it != idlePos.end())
+	{
+		//Still parked from its last wait, keeps its place in line
+		return true;
+	}
+	idle.push_back({ socket, heldBytes });
+	idlePos[socket] = std::prev(idle.end());
+	return true;
+}
+
+void BufferBudget::UnparkIdle(SOCKET socket)
+{
+	std::lock_guard<std::mutex> lock(idleMutex);
+	auto it = idlePos.find(socket);
+	if (it != idlePos.end())
+	{
+		idle.erase(it->second);
+		idlePos.erase(it);
+	}
+}
+
+void BufferBudget::EvictIdle()
+{
+	//Expiring the wait wakes the connection as if its keep-alive had run out, it then closes itself.
+	//Done under idleMutex, a socket still in the list hasn't been closed or reused yet.
+	std::lock_guard<std::mutex> lock(idleMutex);
+	long long target = limit * BUFFER_BUDGET_LOW_PERCENT / 100;
+	long long projected = used;
+	while (!idle.empty() && projected > target && loop)
+	{
+		IdleConnection oldest = idle.front();
+		idle.pop_front();
+		idlePos.erase(oldest.socket);
+		loop->Expire(oldest.socket);
+		projected -= oldest.heldBytes;
+		++evictions;
+	}
+}
+
+void BufferBudget::CloseIdle()
+{
+	//Every parked keep-alive, for a drain. Not counted as evictions, memory isn't why they're going.
+	std::lock_guard<std::mutex> lock(idleMutex);
+	while (!idle.empty() && loop)
+	{
+		loop->Expire(idle.front().socket);
+		idlePos.erase(idle.front().socket);
+		idle.pop_front();
+	}
+}
+
+void BufferBudget::OnDeferred()
+{
+	++deferred;
+}
+
+void BufferBudget::OnSlowClient()
+{
+	++slowClients;
+}
+
+void BufferBudget::FormatMetrics(std::string& out)
+{
+	size_t idleCount = 0;
+	{
+		std::lock_guard<std::mutex> lock(idleMutex);
+		idleCount = idle.size();
+	}
+
+	char buf[512];
+	sprintf_s(buf,
+		"winweb_buffered_bytes %lld\n"
+		"winweb_buffered_bytes_peak %lld\n"
+		"winweb_buffer_budget_bytes %lld\n"
+		"winweb_idle_connections %zu\n"
+		"winweb_idle_evictions_total %llu\n"
+		"winweb_budget_deferred_total %llu\n"
+		"winweb_slow_client_drops_total %llu\n",
+		(long long)used, (long long)peak, (long long)limit, idleCount,
+		(unsigned long long)evictions, (unsigned long long)deferred, (unsigned long long)slowClients);
+	out += buf;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <WinSock2.h>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <string>
+
+#define BUFFER_BUDGET_BYTES (512LL * 1024 * 1024) //Default cap on memory held for requests in progress, across every connection
+#define BUFFER_BUDGET_HIGH_PERCENT 90 //Past this idle keep-alives are closed
+#define BUFFER_BUDGET_LOW_PERCENT 75 //Eviction stops once what it frees would bring us under this
+#define BUFFER_BUDGET_WAIT_MS 10 //How often a connection held back by a full budget looks again
+
+class IoLoop;
+
+struct IdleConnection
+{
+	SOCKET socket;
+	long long heldBytes;
+};
+
+//Counts what every connection has buffered (receive buffers, arena blocks, send chunks) against one budget.
+//Near the budget, idle keep-alive connections are closed oldest first to give their memory back. At the budget, connections
+//stop reading their next request until some has been freed, so a crowd of slow downloads can't push the process into swap.
+class BufferBudget
+{
+public:
+	BufferBudget();
+	~BufferBudget();
+	void SetLimit(long long bytes);
+	void SetLoop(IoLoop* loop);
+	void Charge(long long bytes);
+	void Refund(long long bytes);
+	bool IsPressured();
+	bool IsExhausted();
+	bool ParkIdle(SOCKET socket, long long heldBytes);
+	void UnparkIdle(SOCKET socket);
+	void CloseIdle();
+	void OnDeferred();
+	void OnSlowClient();
+	void FormatMetrics(std::string& out);
+private:
+	void EvictIdle();
+	IoLoop* loop = nullptr;
+	std::atomic<long long> limit{ BUFFER_BUDGET_BYTES };
+	std::atomic<long long> used{ 0 };
+	std::atomic<long long> peak{ 0 };
+	std::atomic<bool> evicting{ false };
+	std::mutex idleMutex;
+	std::list<IdleConnection> idle; //Oldest first
+	std::unordered_map<SOCKET, std::list<IdleConnection>::iterator> idlePos;
+	std::atomic<unsigned long long> evictions{ 0 };
+	std::atomic<unsigned long long> deferred{ 0 };
+	std::atomic<unsigned long long> slowClients{ 0 };
+};
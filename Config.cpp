@@ -0,0 +1,165 @@
+#include "Config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+static char* Trim(char* str)
+{
+	while (isspace((unsigned char)*str))
+	{
+		++str;
+	}
+	char* end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+	{
+		*--end = 0;
+	}
+	return str;
+}
+
+static bool ParseNumber(const char* value, long long& out)
+{
+	//Whole, non negative numbers only, 0 is left to each setting to decide on
+	char* end = nullptr;
+	long long parsed = strtoll(value, &end, 10);
+	if (end == value || *end || parsed < 0)
+	{
+		return false;
+	}
+	out = parsed;
+	return true;
+}
+
+bool ServerConfig::Load(const char* path, std::string& errors)
+{
+	//False if the file can't be read at all. Bad lines are skipped and described in errors, the rest still applies.
+	FILE* file = nullptr;
+	if (fopen_s(&file, path, "r") || !file)
+	{
+		errors = "Failed opening ";
+		errors += path;
+		return false;
+	}
+
+	struct
+	{
+		const char* key;
+		int* value;
+		long long* wideValue;
+	} numbers[] =
+	{
+		{ "port", &port, nullptr },
+		{ "tls_port", &tlsPort, nullptr },
+		{ "workers", &workers, nullptr },
+		{ "max_connections", &maxConnections, nullptr },
+		{ "header_timeout_ms", &headerTimeoutMs, nullptr },
+		{ "body_idle_timeout_ms", &bodyIdleTimeoutMs, nullptr },
+		{ "write_idle_timeout_ms", &writeIdleTimeoutMs, nullptr },
+		{ "min_transfer_rate", &minTransferRate, nullptr },
+		{ "min_rate_grace_ms", &minRateGraceMs, nullptr },
+		{ "buffer_budget_mb", nullptr, &bufferBudgetMb },
+		{ "file_cache_handles", &fileCacheHandles, nullptr },
+		{ "file_cache_revalidate_ms", &fileCacheRevalidateMs, nullptr },
+		{ "rate_conns_per_ip", &rateConnsPerIp, nullptr },
+		{ "rate_requests_per_sec", &rateRequestsPerSec, nullptr },
+		{ "rate_bytes_per_sec", nullptr, &rateBytesPerSec },
+		{ "trace_sampling", &traceSampling, nullptr },
+		{ "send_link_rate", nullptr, &sendLinkRate },
+		{ "send_connection_rate", nullptr, &sendConnectionRate },
+		{ "send_weight_interactive", &sendWeightInteractive, nullptr },
+		{ "send_weight_normal", &sendWeightNormal, nullptr },
+		{ "send_weight_bulk", &sendWeightBulk, nullptr },
+		{ "proxy_connect_timeout_ms", &proxyConnectTimeoutMs, nullptr },
+		{ "proxy_read_timeout_ms", &proxyReadTimeoutMs, nullptr },
+		{ "proxy_idle_timeout_ms", &proxyIdleTimeoutMs, nullptr }
+	};
+
+	char line[CONFIG_MAX_LINE];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		++lineNo;
+		char* comment = strchr(line, '#');
+		if (comment)
+		{
+			*comment = 0;
+		}
+
+		char* key = Trim(line);
+		if (!*key)
+		{
+			continue;
+		}
+
+		char err[CONFIG_MAX_LINE + 64];
+		char* eq = strchr(key, '=');
+		if (!eq)
+		{
+			sprintf_s(err, "Line %d: expected key = value\n", lineNo);
+			errors += err;
+			continue;
+		}
+		*eq = 0;
+		key = Trim(key);
+		char* value = Trim(eq + 1);
+
+		if (!strcmp(key, "ip"))
+		{
+			ip = value;
+			continue;
+		}
+		if (!strcmp(key, "cache_index_file"))
+		{
+			cacheIndexFile = value;
+			continue;
+		}
+		if (!strcmp(key, "admin_allow"))
+		{
+			adminAllow = value;
+			continue;
+		}
+
+		bool known = false;
+		for (auto& number : numbers)
+		{
+			if (strcmp(key, number.key))
+			{
+				continue;
+			}
+
+			known = true;
+			long long parsed = 0;
+			if (!ParseNumber(value, parsed) || (number.value && parsed > INT_MAX))
+			{
+				sprintf_s(err, "Line %d: %s wants a whole number, not '%s'\n", lineNo, key, value);
+				errors += err;
+			}
+			else if (number.value)
+			{
+				*number.value = (int)parsed;
+			}
+			else
+			{
+				*number.wideValue = parsed;
+			}
+			break;
+		}
+
+		if (!known)
+		{
+			sprintf_s(err, "Line %d: unknown setting '%s'\n", lineNo, key);
+			errors += err;
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+bool ServerConfig::SameStartup(const ServerConfig& other) const
+{
+	//The settings a reload can't apply, a new process has to be started for them
+	return ip == other.ip && port == other.port && tlsPort == other.tlsPort && workers == other.workers;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+
+#define CONFIG_FILE "WinWeb.conf"
+#define CONFIG_MAX_LINE 512
+
+//Tunables read from a "key = value" file, # starts a comment. -1 (or empty) is anything the file leaves out, which keeps
+//whatever the code set before Init. ip, port, tls_port and workers only take effect when a process starts, everything else
+//can be changed on a running server with a reload.
+struct ServerConfig
+{
+	std::string ip;
+	int port = -1;
+	int tlsPort = -1;
+	int workers = -1;
+	int maxConnections = -1;
+	int headerTimeoutMs = -1;
+	int bodyIdleTimeoutMs = -1;
+	int writeIdleTimeoutMs = -1;
+	int minTransferRate = -1;
+	int minRateGraceMs = -1;
+	long long bufferBudgetMb = -1;
+	int fileCacheHandles = -1;
+	int fileCacheRevalidateMs = -1;
+	int rateConnsPerIp = -1;
+	int rateRequestsPerSec = -1;
+	long long rateBytesPerSec = -1;
+	int traceSampling = -1;
+	long long sendLinkRate = -1;
+	long long sendConnectionRate = -1;
+	int sendWeightInteractive = -1;
+	int sendWeightNormal = -1;
+	int sendWeightBulk = -1;
+	int proxyConnectTimeoutMs = -1;
+	int proxyReadTimeoutMs = -1;
+	int proxyIdleTimeoutMs = -1;
+	std::string cacheIndexFile; //Open file cache entries are saved here on the way out and reopened on the way in
+	std::string adminAllow; //Who besides loopback may read metrics and traces
+	bool Load(const char* path, std::string& errors);
+	bool SameStartup(const ServerConfig& other) const;
+};
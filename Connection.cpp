@@ -1,358 +1,1668 @@
 #include "Connection.h"
+#include "RequestTarget.h"
+#include "Http2.h"
+#include "Proxy.h"
+#include "Mime.h"
+#include "Probes.h"
 #include <iostream>
 #include <fstream>
+#include <climits>
 
-Connection::Connection(SOCKET sckt, sockaddr_in info, std::function<bool(SOCKET*)> readable, std::function<bool(SOCKET*)> writable, std::function<void(const char*)> printFunc)
+Connection::Connection(SOCKET sckt, sockaddr_in info, std::function<bool(SOCKET*)> readable, std::function<bool(SOCKET*)> writable, std::function<void(const char*)> printFunc, const ServerServices& services, TlsContext* tls)
 {
 	Readable = readable;
 	Writable = writable;
 	PrintFunc = printFunc;
 	socket = sckt;
 	Info = info;
+	UseServices(services);
 
 	inet_ntop(AF_INET, &info.sin_addr, ip, INET_ADDRSTRLEN);
 	lastRecv = std::chrono::steady_clock::now();
 	initTime = std::chrono::steady_clock::now();
 
 	recvBuf = (char*)malloc(MAX_PACKET_SIZE);
+	if (recvBuf && budget)
+	{
+		budget->Charge(MAX_PACKET_SIZE);
+	}
+
+	if (tls)
+	{
+		ssl = tls->CreateSession(socket);
+		if (!ssl)
+		{
+			connected = false;
+		}
+	}
 
-	conThread = std::thread([&] {this->RunConnection(); });
-	conThread.detach();
+	//Created suspended, started on the NUMA node RSS delivers this socket's packets to when the stack says
+	root = Serve().handle;
+	serving = true;
+	ioLoop->Post(root, ioLoop->GetSocketNode(socket));
 }
 
-Connection::~Connection()
+Connection::Connection(const ServerServices& services)
 {
+	//No socket and never served, just the request handling, so it can be driven directly (WinWebBench does)
+	socket = INVALID_SOCKET;
+	memset(&Info, 0, sizeof(Info));
+	strcpy(ip, "0.0.0.0");
+	UseServices(services);
+	rateLimiter = nullptr;
+	closedEvent = NULL;
+	lastRecv = std::chrono::steady_clock::now();
+	initTime = lastRecv;
+	recvBuf = (char*)malloc(MAX_PACKET_SIZE);
+}
+
+void Connection::UseServices(const ServerServices& services)
+{
+	fileIndex = services.fileIndex;
+	defaultFileIndex = services.fileIndex;
+	defaultRouter = services.router;
+	hosts = services.hosts;
+	fileCache = services.fileCache;
+	defaultFileCache = services.fileCache;
+	budget = services.budget;
+	timeouts = services.timeouts;
+	workers = services.workers;
+	draining = services.draining;
+	flights = services.flights;
+	sends = services.sends;
+	adminAccess = services.adminAccess;
+	arena.SetBudget(budget);
+	proxy = services.proxy;
+	rateLimiter = services.rateLimiter;
+	admission = services.admission;
+	ioLoop = services.ioLoop;
+	router = services.router;
+	sitePack = services.sitePack;
+	closedEvent = services.closedEvent;
 }
 
-void Connection::RunConnection()
+Connection::~Connection()
 {
+	if (serving && root)
+	{
+		//Still parked in the loop (shutdown), destroying the top frame tears down everything it was awaiting
+		root.destroy();
+	}
+
+	if (sends)
+	{
+		//Out of the schedule before our flow goes with us
+		sends->Done(&sendFlow);
+	}
+
+	if (rateLimiter)
+	{
+		//Accept only creates us once a slot has been taken for this address
+		rateLimiter->ReleaseConnection(Info.sin_addr.s_addr);
+	}
+
 	if (recvBuf)
 	{
-		while (connected)
+		//Only still here if we were never served
+		free(recvBuf);
+	}
+}
+
+DetachedTask Connection::Serve()
+{
+	//Sampled per request, the first also gets the time from accept to a worker picking the connection up
+	traceId = Tracer::StartRequest();
+	if (traceId)
+	{
+		Tracer::Record("accept", Tracer::ToUs(initTime), Tracer::NowUs(), traceId, ip);
+	}
+
+	if (recvBuf && connected && ssl)
+	{
 		{
-			tickMutex.lock();
-			if (!connected)
-			{
-				tickMutex.unlock();
-				return;
-			}
-			memset(&recvBuf[0], 0, MAX_PACKET_SIZE);
+			TraceSpan span("tls", traceId);
+			connected = co_await TlsHandshake();
+		}
 
-			if (!RecvFromSocket(recvBuf))
-			{
-				bool kill = true;
+		if (connected && TlsContext::SelectedHttp2(ssl))
+		{
+			//ALPN picked h2, no Upgrade dance over TLS
+			co_await RunHttp2(nullptr, 0);
+			connected = false;
+		}
+	}
 
-				
-				if (keepAlive)
-				{
-					auto currTime = std::chrono::steady_clock::now();
-					auto timeDiff = std::chrono::duration_cast<std::chrono::microseconds>(currTime - lastRecv).count() / TO_SECONDS;
-					if (timeDiff < KEEP_ALIVE_TIMEOUT)
-					{
-						kill = false;
-					}
-				}
-				else 
-				{
-					//Give client time to begin sending data
-					auto currTime = std::chrono::steady_clock::now();
-					auto timeDiff = std::chrono::duration_cast<std::chrono::microseconds>(currTime - initTime).count() / TO_SECONDS;
-					if (timeDiff < KEEP_ALIVE_TIMEOUT)
-					{
-						kill = false;
-					}
-				}
+	while (connected && recvBuf)
+	{
+		int recvLen = co_await ReadRequest();
+		if (recvLen <= 0)
+		{
+			break;
+		}
 
-				if (kill)
-				{
-					tickMutex.unlock();
-					break;
-				}
-			}
-			else
-			{
-				ProcessRequest(&socket, recvBuf);
-				if (keepAlive)
-				{
-					lastRecv = std::chrono::steady_clock::now();
-				}
-			}
+		if (recvLen >= H2_PREFACE_LEN && !memcmp(recvBuf, H2_PREFACE, H2_PREFACE_LEN))
+		{
+			//h2c with prior knowledge, the session owns the connection until it closes
+			co_await RunHttp2(recvBuf, recvLen);
+			break;
+		}
+
+		requestArena = &arena;
+		sendStart = IoTime();
+		sendBytes = 0;
+		co_await ProcessRequest(recvBuf, recvLen);
+		requestArena = nullptr;
+		arena.Reset();
+		if (upgraded || !keepAlive)
+		{
+			//Whatever follows may be the unread body of a request we turned down, so it's never parsed as a new request
+			break;
+		}
 
-			tickMutex.unlock();
-			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		if (keepAlive)
+		{
+			lastRecv = std::chrono::steady_clock::now();
 		}
+		traceId = Tracer::StartRequest();
 	}
 
+	//Nothing touches this after OnDisconnect, cleanup may delete us straight away
+	serving = false;
 	OnDisconnect();
 }
 
-void Connection::OnDisconnect()
+Task<bool> Connection::TlsHandshake()
 {
-	connected = false;
-
-	if (recvBuf)
+	//Steps the handshake as far as the socket allows each time the client sends its next flight
+	IoTime deadline = initTime + std::chrono::seconds(TLS_HANDSHAKE_TIMEOUT);
+	while (true)
 	{
-		free(recvBuf);
-	}
+		TlsResult res = TlsContext::Handshake(ssl);
+		if (res == TlsResult::TLS_DONE)
+		{
+			tlsHandshakeDone = true;
+			initTime = std::chrono::steady_clock::now();
+			co_return true;
+		}
 
-	//if (socket != INVALID_SOCKET)
-	{
-		closesocket(socket);
-	}
+		IoTime now = std::chrono::steady_clock::now();
+		if (res != TlsResult::TLS_WANT_IO || now >= deadline)
+		{
+			co_return false;
+		}
 
-	pendingDelete = true;
+		//Almost always waiting to read, a short wait covers the odd time OpenSSL wants to write instead
+		IoTime retry = now + std::chrono::milliseconds(IO_TLS_RETRY_MS);
+		co_await ioLoop->WaitSocket(socket, false, retry < deadline ? retry : deadline);
+	}
 }
 
-bool Connection::RecvFromSocket(char* buf)
+Task<int> Connection::ReadRequest()
 {
-	if (!buf || !Readable(&socket))
+	//Reads until a whole request head is in recvBuf. Returns how much was read, 0 if the client closed or stayed quiet too long.
+	int have = 0;
+	recvBuf[0] = 0;
+	IoTime deadline = (keepAlive ? lastRecv : initTime) + std::chrono::seconds(KeepAliveTimeout());
+	bool deferred = false;
+
+	if (pipelined)
 	{
-		return false;
+		//Whatever the last request's body read took past its end, it may already be the whole of this head
+		memcpy(recvBuf, pipelined, pipelinedLen);
+		have = pipelinedLen;
+		recvBuf[have] = 0;
+		free(pipelined);
+		pipelined = nullptr;
+		pipelinedLen = 0;
+
+		bool preface = have >= 3 && !memcmp(recvBuf, "PRI", 3);
+		if ((preface && have >= H2_PREFACE_LEN) || (!preface && strstr(recvBuf, "\r\n\r\n")))
+		{
+			co_return have;
+		}
+		deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeouts.headerMs);
 	}
 
-	int recvBytes = 0;
-	int thisRecv = 0;
-
-	while (thisRecv != SOCKET_ERROR)
+	while (have < MAX_PACKET_SIZE - 1)
 	{
-		thisRecv = recv(socket, buf, MAX_PACKET_SIZE, 0);
-		if (thisRecv == 0)
+		if (have == 0 && budget && budget->IsExhausted() && (!keepAlive || HasData()))
 		{
-			break;
+			//Out of buffer budget, the next request stays in the socket until responses in progress have given some back.
+			//An idle keep-alive carries on to the wait below, which closes it instead.
+			IoTime now = std::chrono::steady_clock::now();
+			if (now >= deadline)
+			{
+				co_return 0;
+			}
+			if (!deferred)
+			{
+				budget->OnDeferred();
+				deferred = true;
+			}
+			co_await SleepUntil(now + std::chrono::milliseconds(BUFFER_BUDGET_WAIT_MS));
+			continue;
+		}
+
+		int got = RawRecv(recvBuf + have, MAX_PACKET_SIZE - 1 - have);
+		if (got > 0)
+		{
+			if (have == 0)
+			{
+				//Done waiting for a request, the rest of its head gets its own timeout so a client can't dribble it in forever
+				deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeouts.headerMs);
+			}
+			have += got;
+			recvBuf[have] = 0;
+
+			//The h2 preface contains a blank line of its own, don't stop at it
+			bool preface = have >= 3 && !memcmp(recvBuf, "PRI", 3);
+			if ((preface && have >= H2_PREFACE_LEN) || (!preface && strstr(recvBuf, "\r\n\r\n")))
+			{
+				co_return have;
+			}
+			continue;
 		}
-		else if (thisRecv != SOCKET_ERROR)
+		else if (got == 0 || WSAGetLastError() != WSAEWOULDBLOCK)
 		{
-			recvBytes += thisRecv;
+			co_return 0;
 		}
-		else
+
+		//An idle keep-alive is the first thing closed when memory gets short
+		bool idle = have == 0 && keepAlive && budget;
+		if (idle && !budget->ParkIdle(socket, MAX_PACKET_SIZE))
+		{
+			co_return 0;
+		}
+		if (idle && draining && *draining)
+		{
+			//Checked once parked, so a drain starting now either finds us in the idle list or we see it here
+			budget->UnparkIdle(socket);
+			co_return 0;
+		}
+
+		auto wait = ioLoop->WaitSocket(socket, false, deadline);
+		bool ready = co_await wait;
+		if (idle)
+		{
+			budget->UnparkIdle(socket);
+		}
+
+		if (!ready)
 		{
-			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			if (have == 0 && keepAlive)
+			{
+				WINWEB_PROBE_KEEPALIVE_TIMEOUT(socket, requestCount, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - lastRecv).count());
+			}
+			else if (have > 0 && budget)
+			{
+				budget->OnSlowClient();
+			}
+			co_return 0;
+		}
+
+		if (have == 0 && (admission || traceId))
+		{
+			//Time between the poller seeing the request and a worker getting to it
+			IoTime now = std::chrono::steady_clock::now();
+			long long delay = std::chrono::duration_cast<std::chrono::microseconds>(now - wait.wait.readyAt).count();
+			if (admission)
+			{
+				admission->OnQueueDelay(delay > 0 ? delay : 0);
+			}
+			if (traceId)
+			{
+				Tracer::Record("queue", Tracer::ToUs(wait.wait.readyAt), Tracer::ToUs(now), traceId);
+			}
 		}
 	}
 
-	return recvBytes <= 0 ? false : true;
+	co_return have;
 }
 
-void Connection::CopyRange(char* start, char* end, char* buf, int size)
+bool Connection::KeepPipelined(const char* data, int len)
 {
-	memset(buf, 0, size);
-	int written = 0;
-	while (start != end && written < size)
+	//Holds on to bytes that came in behind a request for ReadRequest to start from. False if they can't be kept, the connection has to close then.
+	if (len <= 0)
 	{
-		*buf = *start;
-		++buf; ++start;
+		return true;
+	}
+	if (len >= MAX_PACKET_SIZE - 1 || pipelined)
+	{
+		return false;
+	}
 
-		written++;
+	pipelined = (char*)malloc(len);
+	if (!pipelined)
+	{
+		return false;
 	}
+	memcpy(pipelined, data, len);
+	pipelinedLen = len;
+	return true;
 }
 
-int Connection::GetStrLen(char* start, char* end)
+Task<bool> Connection::Write(const char* buf, int len)
 {
-	int len = 0;
-	char* it = start;
-	while (it != end && it && end)
+	if (sendStart == IoTime())
 	{
-		++it;
+		sendStart = std::chrono::steady_clock::now();
+	}
 
-		len++;
+	int sent = 0;
+	while (sent < len)
+	{
+		int chunk = len - sent;
+		if (rateLimiter)
+		{
+			//Out of byte tokens for this address, come back when the bucket has refilled a little
+			chunk = rateLimiter->TakeBandwidth(Info.sin_addr.s_addr, chunk);
+			if (chunk == 0)
+			{
+				TraceSpan span("throttle", traceId);
+				co_await SleepUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(1));
+				continue;
+			}
+		}
+
+		if (sends)
+		{
+			//Our share of the uplink this round, the rest of what the rate limiter gave goes back
+			int granted = sends->Take(&sendFlow, chunk);
+			if (granted < chunk && rateLimiter)
+			{
+				rateLimiter->ReturnBandwidth(Info.sin_addr.s_addr, chunk - granted);
+			}
+			chunk = granted;
+			if (chunk == 0)
+			{
+				TraceSpan span("throttle", traceId);
+				co_await SleepUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(SEND_WAIT_MS));
+				continue;
+			}
+		}
+
+		int thisSent = RawSend(buf + sent, chunk);
+		if (rateLimiter)
+		{
+			rateLimiter->ReturnBandwidth(Info.sin_addr.s_addr, thisSent > 0 ? chunk - thisSent : chunk);
+		}
+		if (sends)
+		{
+			sends->Return(&sendFlow, thisSent > 0 ? chunk - thisSent : chunk);
+		}
+
+		if (thisSent > 0)
+		{
+			sent += thisSent;
+			sendBytes += thisSent;
+			continue;
+		}
+
+		if (WSAGetLastError() != WSAEWOULDBLOCK)
+		{
+			co_return false;
+		}
+
+		//Socket buffer's full, park until the client has taken some
+		TraceSpan span("send-wait", traceId);
+		if (!co_await ioLoop->WaitSocket(socket, true, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeouts.writeIdleMs)))
+		{
+			if (budget)
+			{
+				budget->OnSlowClient();
+			}
+			co_return false;
+		}
+
+		if (TooSlow(sendStart, sendBytes))
+		{
+			co_return false;
+		}
 	}
 
-	return len;
+	co_return true;
 }
 
-void Connection::ProcessRequest(SOCKET* socket, char* data)
+Task<bool> Connection::SendFile(const char* headerBuf, const char* fileName, long long size, const char* version)
 {
-	if (!Writable(socket) || !data)
+	//Requests for the same file at the same time share one read of it, once there's a second one to share with
+	Flight* flight = flights && size > 0 ? flights->Join(fileName, version, size) : nullptr;
+	if (flight && flight->data)
 	{
-		return;
+		bool headerSent = false;
+		bool shared = co_await SendShared(headerBuf, flight, headerSent);
+		flights->Release(flight);
+		if (shared || headerSent)
+		{
+			co_return shared;
+		}
+		//The shared load failed before we'd sent anything, try the disk ourselves
+		flight = nullptr;
 	}
 
-	char headerBuf[MAX_HEADER_BUF_SIZE];
+	//Streams the file out behind the header a chunk at a time, so big files never sit in memory whole
+	long long openStartUs = WINWEB_PROBE_NOW();
+	CachedFile* file = fileCache->Acquire(fileName, size);
+	WINWEB_PROBE_FILE_OPEN(fileName, size, file != nullptr, WINWEB_PROBE_NOW() - openStartUs);
+	int headerLen = (int)strlen(headerBuf);
+	char* buf = file ? (char*)arena.Alloc(headerLen + SEND_FILE_CHUNK) : nullptr;
+	if (!buf)
+	{
+		if (file)
+		{
+			fileCache->Release(file);
+		}
+		if (flight)
+		{
+			flights->Release(flight);
+		}
+		co_return false;
+	}
 
-	//Get a ptr to start of each parameter
-	char* params[MAX_PARAMS];
-	int index = 1;
+	//The header goes out in the same send as the first chunk
+	memcpy(buf, headerBuf, headerLen);
+	int fill = headerLen;
+	long long remaining = size;
+	unsigned long long offset = 0;
+	bool ok = true;
 
-	char* lst = &data[0];
-	params[0] = lst;
-	while (index < MAX_PARAMS)
+	while (ok && remaining > 0)
 	{
-		char* nxt = strchr(lst, '\r\n');
-		if (nxt)
+		DWORD want = remaining < SEND_FILE_CHUNK ? (DWORD)remaining : SEND_FILE_CHUNK;
+		DWORD read = 0;
+		long long diskStart = traceId ? Tracer::NowUs() : 0;
+		bool got = FileCache::ReadAt(file, offset, buf + fill, want, read) && read > 0;
+		if (traceId)
 		{
-			nxt += 2;
-			params[index] = nxt;
-			lst = nxt;
+			Tracer::Record("disk", diskStart, Tracer::NowUs(), traceId);
 		}
-		else
+
+		if (!got)
 		{
+			//File shrank underneath us, the length we promised can't be met
+			ok = false;
 			break;
 		}
-		++index;
+
+		remaining -= read;
+		offset += read;
+		ok = co_await Write(buf, fill + (int)read);
+		fill = 0;
 	}
 
-	char* userAgent = nullptr;
+	if (ok && fill > 0)
+	{
+		//Empty file, just the header
+		ok = co_await Write(buf, fill);
+	}
 
-	//Need to get the connection type first
-	for (int i = 0; i < index; i++)
+	fileCache->Release(file);
+	if (flight)
+	{
+		flights->Release(flight);
+	}
+	co_return ok;
+}
+
+Task<bool> Connection::SendShared(const char* headerBuf, Flight* flight, bool& headerSent)
+{
+	//Sends the shared copy as it loads. Caught up, we read the next piece ourselves, or wait for whoever is reading it.
+	long long sent = 0;
+	CachedFile* file = nullptr;
+	bool ok = true;
+	while (ok && sent < flight->capacity)
 	{
-		if (!strncmp(params[i], "Connection", 10))
+		long long loaded = flight->loaded;
+		if (loaded > sent)
 		{
-			char* req = params[i] + 11;
-			if (req)
+			int piece = loaded - sent < SEND_MAPPED_PIECE ? (int)(loaded - sent) : SEND_MAPPED_PIECE;
+			if (!headerSent)
 			{
-				++req;
-				if (!strncmp(req, "keep-alive", 10))
-				{
-					keepAlive = true;
-				}
-				else
+				//The header goes out in the same send as the first piece, the rest straight from the shared buffer
+				int headerLen = (int)strlen(headerBuf);
+				int first = piece < SEND_FILE_CHUNK ? piece : SEND_FILE_CHUNK;
+				char* buf = (char*)arena.Alloc(headerLen + first);
+				if (!buf)
 				{
-					keepAlive = false;
+					ok = false;
+					break;
 				}
+				memcpy(buf, headerBuf, headerLen);
+				memcpy(buf + headerLen, flight->data, first);
+				headerSent = true;
+				ok = co_await Write(buf, headerLen + first);
+				piece = first;
+			}
+			else
+			{
+				ok = co_await Write(flight->data + sent, piece);
 			}
+			sent += piece;
+			continue;
 		}
-		else if (!strncmp(params[i], "User-Agent", 10))
-		{
-			//This should be sent back to the client
-			char* start = params[i] + 11;
-			char* end = strchr(start, '\r\n');
 
-			if (!start || !end)
+		if (flight->state == FLIGHT_FAILED)
+		{
+			ok = false;
+		}
+		else if (flight->Claim())
+		{
+			//Nothing between here and Publish/Finish suspends, so the claim never outlives this piece
+			long long at = flight->loaded;
+			long long left = flight->capacity - at;
+			DWORD want = left < SINGLE_FLIGHT_CHUNK ? (DWORD)left : SINGLE_FLIGHT_CHUNK;
+			DWORD read = 0;
+			long long diskStart = traceId ? Tracer::NowUs() : 0;
+			if (!file)
 			{
-				continue;
+				file = fileCache->Acquire(flight->key.c_str(), flight->capacity);
+			}
+			bool got = file && FileCache::ReadAt(file, at, flight->data + at, want, read) && read > 0;
+			if (traceId)
+			{
+				Tracer::Record("disk", diskStart, Tracer::NowUs(), traceId);
 			}
 
-			int allocSize = GetStrLen(start, end) + 1;
-
-			userAgent = (char*)malloc(allocSize);
-			if (userAgent)
+			if (got)
+			{
+				flight->Publish(at + read);
+			}
+			else
 			{
-				CopyRange(start, end, userAgent, allocSize - 1);
-				userAgent[allocSize - 1] = 0;
+				flight->Finish(false);
+				ok = false;
 			}
 		}
+		else
+		{
+			co_await flight->WaitPast(sent, ioLoop);
+		}
+	}
+
+	if (file)
+	{
+		fileCache->Release(file);
+	}
+	co_return ok;
+}
+
+Task<bool> Connection::SendMapped(const char* headerBuf, const char* body, long long len)
+{
+	//The header rides along with the start of the body, everything after that goes out straight from the mapping
+	int headerLen = (int)strlen(headerBuf);
+	int first = len < SEND_FILE_CHUNK ? (int)len : SEND_FILE_CHUNK;
+	char* buf = (char*)arena.Alloc(headerLen + first);
+	if (!buf)
+	{
+		co_return false;
+	}
+
+	memcpy(buf, headerBuf, headerLen);
+	memcpy(buf + headerLen, body, first);
+	bool ok = co_await Write(buf, headerLen + first);
+
+	//Write takes an int, a body past 2GB goes in pieces
+	long long offset = first;
+	while (ok && offset < len)
+	{
+		int piece = len - offset < SEND_MAPPED_PIECE ? (int)(len - offset) : SEND_MAPPED_PIECE;
+		ok = co_await Write(body + offset, piece);
+		offset += piece;
+	}
+	co_return ok;
+}
+
+IoLoop::TimerAwaiter Connection::SleepUntil(IoTime when)
+{
+	return ioLoop->SleepUntil(when);
+}
+
+Task<void> Connection::RunHttp2(const char* initial, int initialLen)
+{
+	//The HTTP/2 session is still a blocking loop, it gets a thread of its own for as long as it runs
+	co_await ioLoop->RunBlocking([this, initial, initialLen]
+		{
+			std::lock_guard<std::mutex> lock(tickMutex);
+			Http2Session session(this);
+			session.Run(initial ? initial : recvBuf, initial ? initialLen : 0);
+		});
+}
+
+void Connection::OnDisconnect()
+{
+	connected = false;
+	WINWEB_PROBE_CLOSE(socket, requestCount, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - initTime).count());
+
+	if (ssl)
+	{
+		TlsContext::FreeSession(ssl);
+		ssl = nullptr;
+	}
+
+	if (recvBuf)
+	{
+		free(recvBuf);
+		recvBuf = nullptr;
+		if (budget)
+		{
+			budget->Refund(MAX_PACKET_SIZE);
+		}
+	}
+
+	if (pipelined)
+	{
+		free(pipelined);
+		pipelined = nullptr;
+		pipelinedLen = 0;
+	}
+
+	if (budget)
+	{
+		//Has to be out of the idle list before the socket can be closed and its handle reused
+		budget->UnparkIdle(socket);
+	}
+
+	//if (socket != INVALID_SOCKET)
+	{
+		closesocket(socket);
+	}
+
+	//Cleanup can delete us as soon as pendingDelete is set, so nothing of ours is touched after it
+	HANDLE closed = closedEvent;
+	pendingDelete = true;
+	if (closed)
+	{
+		SetEvent(closed);
+	}
+}
+
+int Connection::RecvSome(char* buf, int size)
+{
+	//Single non-blocking read: bytes read, 0 if the peer closed, -1 if there's nothing yet
+	if (!buf || size <= 0 || !HasData())
+	{
+		return -1;
+	}
+
+	int got = RawRecv(buf, size);
+	if (got == SOCKET_ERROR)
+	{
+		return WSAGetLastError() == WSAEWOULDBLOCK ? -1 : 0;
+	}
+
+	return got;
+}
+
+bool Connection::HasData()
+{
+	return TlsContext::HasPending(ssl) || Readable(&socket);
+}
+
+VirtualHost* Connection::SelectHost(const char* host, int len)
+{
+	//Points the file index, file cache, router and document root at the request's site, or the default one for unknown or missing hosts
+	VirtualHost* vhost = hosts && host ? hosts->Find(host, len) : nullptr;
+	fileIndex = vhost ? &vhost->fileIndex : defaultFileIndex;
+	fileCache = vhost ? &vhost->fileCache : defaultFileCache;
+	router = vhost ? &vhost->router : defaultRouter;
+	docRoot = vhost ? vhost->docRoot.c_str() : ".";
+	hostMaxBody = vhost ? vhost->limits.maxBody : 0;
+	return vhost;
+}
+
+bool Connection::WaitReady(bool write, int timeoutMs)
+{
+	//Blocks until the socket is ready or timeoutMs passes, only for code still running on a thread of its own (HTTP/2 sessions, proxying)
+	if (!write && TlsContext::HasPending(ssl))
+	{
+		return true;
+	}
+
+	WSAPOLLFD fd = { 0 };
+	fd.fd = socket;
+	fd.events = write ? POLLWRNORM : POLLRDNORM;
+	return WSAPoll(&fd, 1, timeoutMs > 0 ? timeoutMs : 0) > 0;
+}
+
+int Connection::RawRecv(char* buf, int size)
+{
+	//Everything that reads or writes the socket goes through these two, so TLS is transparent above them
+	if (ssl)
+	{
+		return TlsContext::Read(ssl, buf, size);
+	}
+	return recv(socket, buf, size, 0);
+}
+
+int Connection::RawSend(const char* buf, int size)
+{
+	if (ssl)
+	{
+		return TlsContext::Write(ssl, buf, size);
+	}
+	return send(socket, buf, size, 0);
+}
+
+void Connection::CopyRange(char* start, char* end, char* buf, int size)
+{
+	memset(buf, 0, size);
+	int written = 0;
+	while (start != end && written < size)
+	{
+		*buf = *start;
+		++buf; ++start;
+
+		written++;
+	}
+}
+
+int Connection::GetStrLen(char* start, char* end)
+{
+	int len = 0;
+	char* it = start;
+	while (it != end && it && end)
+	{
+		++it;
+
+		len++;
+	}
+
+	return len;
+}
+
+void Connection::ParseHead(char* data, RequestHead& head)
+{
+	//Pulls what ProcessRequest acts on out of a request head. Nothing is copied or allocated and no socket is involved.
+	//Get a ptr to start of each parameter
+	char* params[MAX_PARAMS];
+	int index = 1;
+
+	char* lst = &data[0];
+	params[0] = lst;
+	while (index < MAX_PARAMS)
+	{
+		char* nxt = strstr(lst, "\r\n");
+		if (nxt)
+		{
+			nxt += 2;
+			params[index] = nxt;
+			lst = nxt;
+		}
+		else
+		{
+			break;
+		}
+		++index;
+	}
+
+	//Something the proxy or an upstream finds in a header we never split out would be read two ways
+	head.tooManyHeaders = true;
+	for (int i = 0; i < index; i++)
+	{
+		if (params[i][0] == '\r')
+		{
+			//End of the head, anything after is body
+			head.tooManyHeaders = false;
+			break;
+		}
+		else if (!strncmp(params[i], "Connection", 10))
+		{
+			char* req = params[i] + 11;
+			if (req)
+			{
+				++req;
+				head.connectionHeader = true;
+				head.keepAlive = !strncmp(req, "keep-alive", 10);
+			}
+		}
+		else if (!strncmp(params[i], "User-Agent", 10))
+		{
+			//This should be sent back to the client
+			char* start = params[i] + 11;
+			char* end = strstr(start, "\r\n");
+
+			if (!start || !end)
+			{
+				continue;
+			}
+
+			head.userAgent = start;
+			head.userAgentLen = GetStrLen(start, end);
+		}
+		else if (!_strnicmp(params[i], "Host:", 5))
+		{
+			char* end = strstr(params[i], "\r\n");
+			head.host = params[i] + 5;
+			head.hostLen = end ? (int)(end - head.host) : (int)strlen(head.host);
+		}
+		else if (!strncmp(params[i], "Upgrade:", 8))
+		{
+			char* proto = params[i] + 8;
+			while (*proto == ' ')
+			{
+				++proto;
+			}
+			head.h2Upgrade = !strncmp(proto, "h2c", 3) && (proto[3] == '\r' || proto[3] == ',' || proto[3] == ' ');
+		}
+		else if (!strncmp(params[i], "HTTP2-Settings:", 15))
+		{
+			head.h2Settings = params[i] + 15;
+			while (*head.h2Settings == ' ')
+			{
+				++head.h2Settings;
+			}
+		}
+		else if (!_strnicmp(params[i], "Content-Length:", 15))
+		{
+			char* value = params[i] + 15;
+			while (*value == ' ' || *value == '\t')
+			{
+				++value;
+			}
+			char* end = nullptr;
+			long long len = *value >= '0' && *value <= '9' ? _strtoi64(value, &end, 10) : -1;
+			char* rest = end ? end : value;
+			while (*rest == ' ' || *rest == '\t')
+			{
+				++rest;
+			}
+
+			//Two different lengths is how requests get smuggled, refuse rather than pick one. So is "10abc", which something else might read differently.
+			if (end == value || *rest != '\r' || len < 0 || (head.body.contentLength >= 0 && head.body.contentLength != len))
+			{
+				head.body.bad = true;
+			}
+			head.body.contentLength = len;
+		}
+		else if (!_strnicmp(params[i], "Transfer-Encoding:", 18))
+		{
+			//Only chunked is understood, and it has to be the last coding applied
+			char* end = strstr(params[i], "\r\n");
+			while (end && end > params[i] && (end[-1] == ' ' || end[-1] == '\t'))
+			{
+				--end;
+			}
+
+			if (end && end - params[i] >= 18 + 7 && !_strnicmp(end - 7, "chunked", 7))
+			{
+				head.body.chunked = true;
+			}
+			else
+			{
+				head.body.bad = true;
+			}
+		}
+		else if (!_strnicmp(params[i], "Accept-Encoding:", 16))
+		{
+			//Precompressed variants only, q=0 is the one way of saying no we bother with
+			char* gzip = strstr(params[i], "gzip");
+			char* end = strstr(params[i], "\r\n");
+			head.acceptGzip = gzip && (!end || gzip < end) && strncmp(gzip + 4, ";q=0", 4);
+		}
+		else if (!_strnicmp(params[i], "Expect:", 7))
+		{
+			char* value = params[i] + 7;
+			while (*value == ' ')
+			{
+				++value;
+			}
+			head.body.expectContinue = !_strnicmp(value, "100-continue", 12);
+		}
+	}
+
+	if (head.body.chunked && head.body.contentLength >= 0)
+	{
+		head.body.bad = true;
+	}
+}
+
+Task<void> Connection::ProcessRequest(char* data, int dataLen)
+{
+	if (!data)
+	{
+		co_return;
+	}
+
+	long long requestStartUs = traceId ? Tracer::NowUs() : 0;
+	long long probeStartUs = WINWEB_PROBE_NOW();
+	if (admission && !admission->Admit())
+	{
+		//Shed before doing any work on it
+		WINWEB_PROBE_SHED("overload", ip, SERVICE_UNAVAILABLE);
+		co_await SendRejection(SERVICE_UNAVAILABLE, "Service Unavailable", OVERLOAD_RETRY_AFTER);
+		co_return;
+	}
+
+	char headerBuf[MAX_HEADER_BUF_SIZE];
+
+	RequestHead head;
+	ParseHead(data, head);
+	if (head.connectionHeader)
+	{
+		keepAlive = head.keepAlive;
+	}
+
+	char* userAgent = nullptr;
+	if (head.userAgent)
+	{
+		//Echoed back in the response header, which wants it terminated
+		userAgent = (char*)arena.Alloc(head.userAgentLen + 1);
+		if (userAgent)
+		{
+			memcpy(userAgent, head.userAgent, head.userAgentLen);
+			userAgent[head.userAgentLen] = 0;
+		}
+	}
+
+	BodyInfo& body = head.body;
+
+	if (keepAlive && ++requestCount >= KeepAliveMax())
+	{
+		//Budget for this connection used up, this response closes it
+		keepAlive = false;
+	}
+
+	if (keepAlive && draining && *draining)
+	{
+		//The process that took over our sockets gets the client's next request
+		keepAlive = false;
+	}
+
+	int retryAfter = 0;
+	if (rateLimiter && !rateLimiter->TryRequest(Info.sin_addr.s_addr, retryAfter))
+	{
+		WINWEB_PROBE_SHED("rate-request", ip, TOO_MANY_REQUESTS);
+		co_await SendRejection(TOO_MANY_REQUESTS, "Too Many Requests", retryAfter);
+		co_return;
+	}
+
+	VirtualHost* vhost = SelectHost(head.host, head.hostLen);
+	if (vhost && !vhost->TryRequest(retryAfter))
+	{
+		WINWEB_PROBE_SHED("host-rate", ip, TOO_MANY_REQUESTS);
+		co_await SendRejection(TOO_MANY_REQUESTS, "Too Many Requests", retryAfter);
+		co_return;
+	}
+
+	//Request line, METHOD SP target SP version
+	char* methodEnd = strchr(data, ' ');
+	RouteMethod method = methodEnd ? Router::ParseMethod(data, (int)(methodEnd - data)) : METHOD_OTHER;
+	char* target = methodEnd ? methodEnd + 1 : data;
+	int targetLen = methodEnd ? RequestTarget::FindTargetEnd(target, dataLen - (int)(target - data)) : 0;
+	bool isHead = method == METHOD_HEAD;
+	WINWEB_PROBE_REQUEST_PARSED(socket, (int)method, target, targetLen, WINWEB_PROBE_NOW() - probeStartUs);
+
+	char traceDetail[TRACE_DETAIL_LEN] = "";
+	long long parsedUs = 0;
+	if (traceId)
+	{
+		//"METHOD target", the status goes on the end once there is one
+		snprintf(traceDetail, TRACE_DETAIL_LEN, "%.*s", (int)(target + targetLen - data), data);
+		parsedUs = Tracer::NowUs();
+		Tracer::Record("parse", requestStartUs, parsedUs, traceId);
+	}
+
+	if (head.tooManyHeaders)
+	{
+		co_await SendRejection(REQUEST_HEADER_FIELDS_TOO_LARGE, "Request Header Fields Too Large", 0);
+		co_return;
+	}
+
+	if (body.bad)
+	{
+		//Can't tell where this request ends, so nothing after it on the connection can be trusted either
+		co_await SendRejection(BAD_REQUEST, "Bad Request", 0);
+		co_return;
+	}
+
+	if (!userAgent)
+	{
+		//Refused before any of a body is read, so nothing is left half done on the connection
+		co_await SendRejection(BAD_REQUEST, "Bad Request", 0);
+		co_return;
+	}
+
+	Response resp;
+	RoutedRequest routed;
+	routed.acceptGzip = head.acceptGzip;
+	bool resolved = RouteRequest(method, target, targetLen, resp, false, routed);
+	if (traceId)
+	{
+		//Route match and the file index lookup, disk reads show up under send
+		Tracer::Record("resolve", parsedUs, Tracer::NowUs(), traceId, routed.path);
+	}
+
+	if (!resolved)
+	{
+		const Route* route = routed.match.route;
+		if (route->kind == ROUTE_PROXY)
+		{
+			//Any method under a proxied prefix goes upstream untouched. Upstream I/O still blocks, so the exchange runs on a thread of its own.
+			{
+				TraceSpan span("proxy", traceId);
+				co_await ioLoop->RunBlocking([&]
+					{
+						std::lock_guard<std::mutex> lock(tickMutex);
+						proxy->Forward(route->proxyRoute, this, data, dataLen, keepAlive);
+						if (sends)
+						{
+							sends->Done(&sendFlow);
+						}
+					});
+			}
+
+			if (traceId)
+			{
+				Tracer::Record("request", requestStartUs, Tracer::NowUs(), traceId, traceDetail);
+			}
+			co_return;
+		}
+
+		//Uploads and handlers that take the body, whatever arrived behind the head is the start of it
+		char* bodyStart = strstr(data, "\r\n\r\n");
+		int initialLen = bodyStart ? dataLen - (int)(bodyStart + 4 - data) : 0;
+		{
+			TraceSpan span("body", traceId);
+			co_await ReceiveBody(routed.match, body, bodyStart ? bodyStart + 4 : data + dataLen, initialLen, resp);
+		}
+		if (!connected)
+		{
+			co_return;
+		}
+	}
+	else if (body.Present())
+	{
+		//Nothing here wants a body, close afterwards instead of reading through it
+		keepAlive = false;
+	}
+	else if (keepAlive && !head.h2Upgrade)
+	{
+		//A pipelined request that came in with this one
+		char* headEnd = strstr(data, "\r\n\r\n");
+		if (headEnd && !KeepPipelined(headEnd + 4, dataLen - (int)(headEnd + 4 - data)))
+		{
+			keepAlive = false;
+		}
+	}
+
+	//GetHeader(ResponseCodes::PROCESSING, userAgent, headerBuf, 0, "");
+	//SendBuffer(headerBuf, socket);
+
+	if (head.h2Upgrade && head.h2Settings && (method == METHOD_GET || isHead))
+	{
+		//h2c upgrade, the response to this request goes out as stream 1
+		char* bodyStart = strstr(data, "\r\n\r\n");
+		int leftover = bodyStart ? dataLen - (int)(bodyStart + 4 - data) : 0;
+
+		//The session's streams outlive this request, their bodies come from the heap
+		requestArena = nullptr;
+		co_await ioLoop->RunBlocking([&]
+			{
+				std::lock_guard<std::mutex> lock(tickMutex);
+				Http2Session session(this);
+				if (session.Upgrade(head.h2Settings, target, targetLen, isHead))
+				{
+					upgraded = true;
+					session.Run(bodyStart + 4, leftover > 0 ? leftover : 0);
+				}
+			});
+
+		if (upgraded)
+		{
+			FreeBody(resp);
+			co_return;
+		}
+	}
+
+	{
+		TraceSpan span("send", traceId);
+		co_await SendResponse(resp, userAgent, headerBuf, isHead);
+	}
+
+	if (traceId)
+	{
+		int detailLen = (int)strlen(traceDetail);
+		snprintf(traceDetail + detailLen, TRACE_DETAIL_LEN - detailLen, " %d", (int)resp.code);
+		Tracer::Record("request", requestStartUs, Tracer::NowUs(), traceId, traceDetail);
+	}
+}
+
+bool Connection::RouteRequest(RouteMethod method, const char* target, int targetLen, Response& resp, bool loadBody, RoutedRequest& routed)
+{
+	//Works out what a request for target should get back, shared by HTTP/1.1 and HTTP/2
+	//Returns false when the route is one the caller has to carry out itself (proxying, anything taking a body), otherwise resp is filled in
+	//Decode and canonicalise the target once, everything below works on the clean path
+	int pathLen = 0;
+	if (RequestTarget::Decode(target, targetLen, routed.path, MAX_PATH, pathLen) != DecodeResult::DECODE_OK)
+	{
+		resp.code = ResponseCodes::BAD_REQUEST;
+		return true;
+	}
+
+	RouteMatch& match = routed.match;
+	RouteResult result = router ? router->Match(method, routed.path, pathLen, match) : ROUTE_NOT_FOUND;
+	if (result != ROUTE_MATCHED)
+	{
+		resp.code = result == ROUTE_METHOD_NOT_ALLOWED ? ResponseCodes::METHOD_NOT_ALLOWED : ResponseCodes::NOT_FOUND;
+		return true;
+	}
+
+	const Route* route = match.route;
+	switch (route->kind)
+	{
+		case ROUTE_PROXY:
+		case ROUTE_UPLOAD:
+			return false;
+		case ROUTE_REDIRECT:
+			resp.code = ResponseCodes::TEMP_REDIRECT;
+			resp.location = route->target.c_str();
+			break;
+		case ROUTE_METRICS:
+		case ROUTE_TRACE:
+			//Paths and timings of other clients' requests, so not for everyone. Anyone else is told there's nothing here.
+			if (adminAccess ? !adminAccess->Allows(Info.sin_addr.s_addr) : !AccessList::IsLoopback(Info.sin_addr.s_addr))
+			{
+				resp.code = ResponseCodes::NOT_FOUND;
+			}
+			else if (route->kind == ROUTE_METRICS)
+			{
+				ResolveMetrics(resp);
+			}
+			else
+			{
+				ResolveTrace(resp);
+			}
+			break;
+		case ROUTE_CALLBACK:
+			if (route->bodyCallback)
+			{
+				return false;
+			}
+			route->callback(match, resp);
+			break;
+		case ROUTE_STATIC:
+		case ROUTE_LISTING:
+			ResolveStatic(match, routed.path, resp, loadBody);
+			break;
+		case ROUTE_PACK:
+			ResolvePack(match, resp, routed.acceptGzip);
+			break;
+	}
+
+	return true;
+}
+
+void Connection::ResolveGet(const char* target, int targetLen, Response& resp, bool loadBody)
+{
+	//For HTTP/2, which can't hand a stream to the proxy or take a body
+	RoutedRequest routed;
+	if (!RouteRequest(METHOD_GET, target, targetLen, resp, loadBody, routed))
+	{
+		resp.code = ResponseCodes::NOT_IMPLEMENTED;
+	}
+}
+
+bool Connection::GetRoutePath(const RouteMatch& match, char* diskPath, int size)
+{
+	//The route's directory plus whatever its * matched
+	const std::string& dir = match.route->target;
+	int len = dir.empty() ? snprintf(diskPath, size, "%.*s", match.restLen, match.rest) : snprintf(diskPath, size, "%s/%.*s", dir.c_str(), match.restLen, match.rest);
+	return len >= 0 && len < size;
+}
+
+void Connection::ResolveStatic(const RouteMatch& match, const char* path, Response& resp, bool loadBody)
+{
+	//File or directory is decided by the index rather than by whether there's a '.' in the name
+	char diskPath[MAX_PATH];
+	FileInfo fileInfo;
+	if (!fileIndex || !GetRoutePath(match, diskPath, MAX_PATH) || strnlen_s(diskPath, MAX_FILE_NAME_LEN) >= MAX_FILE_NAME_LEN - 2)
+	{
+		resp.code = ResponseCodes::NOT_FOUND;
+		return;
+	}
+
+	if (!fileIndex->Lookup(diskPath, fileInfo))
+	{
+		resp.code = ResponseCodes::NOT_FOUND;
+	}
+	else if (fileInfo.isDirectory)
+	{
+		char* retBuf = nullptr;
+		if (match.route->kind == ROUTE_LISTING && GetDirectoryListing(diskPath, retBuf, path) && retBuf)
+		{
+			resp.code = ResponseCodes::OK;
+			resp.body = retBuf;
+			resp.bodyInArena = requestArena != nullptr;
+			resp.bodyLen = (int)strnlen_s(retBuf, MAX_DIR_BUF_SIZE);
+			strcpy(resp.contentType, "text/html");
+		}
+		else
+		{
+			if (retBuf)
+			{
+				RequestFree(retBuf);
+			}
+			resp.code = ResponseCodes::NOT_FOUND;
+		}
+	}
+	else if (!loadBody)
+	{
+		//Caller streams it from disk
+		if (LookupFile(diskPath, resp.filePath, fileInfo))
+		{
+			resp.code = ResponseCodes::OK;
+			resp.bodyLen = (long long)fileInfo.size;
+			strcpy(resp.contentType, fileInfo.mimeType);
+			strcpy(resp.etag, fileInfo.etag);
+		}
+		else
+		{
+			resp.code = ResponseCodes::NOT_FOUND;
+		}
+	}
+	else
+	{
+		char* file = nullptr;
+		int len = 0;
+		if (GetFile(diskPath, file, len, fileInfo) && file)
+		{
+			resp.code = ResponseCodes::OK;
+			resp.body = file;
+			resp.bodyInArena = requestArena != nullptr;
+			resp.bodyLen = len;
+			strcpy(resp.contentType, fileInfo.mimeType);
+			strcpy(resp.etag, fileInfo.etag);
+		}
+		else
+		{
+			resp.code = ResponseCodes::NOT_FOUND;
+		}
+	}
+}
+
+void Connection::FormatMetrics(AdmissionController* admission, FileCache* fileCache, BufferBudget* budget, FlightGroup* flights, SendScheduler* sends, std::string& out)
+{
+	//This process's own, worker processes also publish it for the others
+	if (admission)
+	{
+		admission->FormatMetrics(out);
+	}
+	if (fileCache)
+	{
+		fileCache->FormatMetrics(out);
+	}
+	if (budget)
+	{
+		budget->FormatMetrics(out);
+	}
+	if (flights)
+	{
+		flights->FormatMetrics(out);
+	}
+	if (sends)
+	{
+		sends->FormatMetrics(out);
+	}
+
+	char arenaBuf[64];
+	sprintf_s(arenaBuf, "winweb_arena_pooled_bytes %zu\n", RequestArena::GetPooledBytes());
+	out += arenaBuf;
+}
+
+void Connection::ResolveMetrics(Response& resp)
+{
+	//From a worker, every worker's as of their last publish
+	std::string metrics;
+	if (workers)
+	{
+		workers->FormatMetrics(metrics);
+	}
+	else
+	{
+		FormatMetrics(admission, fileCache, budget, flights, sends, metrics);
+	}
+
+	resp.body = RequestAlloc(metrics.size() + 1);
+	resp.bodyInArena = requestArena != nullptr;
+	if (resp.body)
+	{
+		memcpy(resp.body, metrics.data(), metrics.size());
+		resp.bodyLen = (int)metrics.size();
+		resp.code = ResponseCodes::OK;
+		strcpy(resp.contentType, "text/plain");
+	}
+	else
+	{
+		resp.code = ResponseCodes::INTERNAL_SERVER_ERROR;
+	}
+}
+
+void Connection::ResolveTrace(Response& resp)
+{
+	//Whatever the rings hold right now, save it and open it in ui.perfetto.dev or chrome://tracing
+	std::string trace;
+	Tracer::FormatChromeTrace(trace);
+
+	resp.body = RequestAlloc(trace.size() + 1);
+	resp.bodyInArena = requestArena != nullptr;
+	if (resp.body)
+	{
+		memcpy(resp.body, trace.data(), trace.size());
+		resp.bodyLen = (int)trace.size();
+		resp.code = ResponseCodes::OK;
+		strcpy(resp.contentType, "application/json");
+	}
+	else
+	{
+		resp.code = ResponseCodes::INTERNAL_SERVER_ERROR;
+	}
+}
+
+void Connection::ResolvePack(const RouteMatch& match, Response& resp, bool acceptGzip)
+{
+	//Straight out of the mapping, the body and most of the header were built by WinWebPack
+	PackView* view = sitePack ? sitePack->Acquire() : nullptr;
+	const PackEntry* entry = SitePack::Lookup(view, match.rest, match.restLen);
+	if (!entry && view)
+	{
+		//No listings in a pack, a directory gets its index.html if it has one
+		char indexPath[SITE_PACK_MAX_PATH];
+		bool slash = match.restLen && match.rest[match.restLen - 1] != '/';
+		int len = snprintf(indexPath, SITE_PACK_MAX_PATH, "%.*s%sindex.html", match.restLen, match.rest, slash ? "/" : "");
+		if (len > 0 && len < SITE_PACK_MAX_PATH)
+		{
+			entry = SitePack::Lookup(view, indexPath, len);
+		}
+	}
+
+	if (!entry)
+	{
+		SitePack::Release(view);
+		WINWEB_PROBE_FILE_MISS(match.rest);
+		resp.code = ResponseCodes::NOT_FOUND;
+		return;
+	}
+
+	WINWEB_PROBE_FILE_HIT(match.rest, (long long)entry->bodyLen);
+	bool gzip = acceptGzip && entry->gzipLen;
+	resp.code = ResponseCodes::OK;
+	resp.pack = view;
+	resp.mappedBody = SitePack::GetData(view, gzip ? entry->gzipOffset : entry->bodyOffset);
+	resp.bodyLen = (long long)(gzip ? entry->gzipLen : entry->bodyLen);
+	resp.prebuiltHeaders = SitePack::GetData(view, gzip ? entry->gzipHeaderOffset : entry->headerOffset);
+	strncpy_s(resp.contentType, entry->mimeType, MAX_MIME_TYPE_LEN - 1);
+	strncpy_s(resp.etag, entry->etag, MAX_ETAG_LEN - 1);
+}
+
+Task<void> Connection::ReceiveBody(const RouteMatch& match, const BodyInfo& body, char* initial, int initialLen, Response& resp)
+{
+	//Upload and body taking callback routes, the body goes to disk or the handler as it arrives and never sits in memory whole
+	const Route* route = match.route;
+	long long limit = route->maxBody > 0 ? route->maxBody : (hostMaxBody > 0 ? hostMaxBody : (route->kind == ROUTE_UPLOAD ? MAX_UPLOAD_SIZE : MAX_REQUEST_BODY));
+	UploadFile upload;
+
+	if (body.contentLength > limit)
+	{
+		//Turned away before any of it is read, the rest is still on its way so the connection goes too
+		resp.code = ResponseCodes::PAYLOAD_TOO_LARGE;
+		keepAlive = false;
+		co_return;
+	}
+
+	if (route->kind == ROUTE_UPLOAD)
+	{
+		char diskPath[MAX_PATH];
+		char nameBuf[MAX_FILE_NAME_LEN];
+		FileInfo fileInfo;
+		if (!match.restLen || match.rest[match.restLen - 1] == '/' || !GetRoutePath(match, diskPath, MAX_PATH) || snprintf(nameBuf, MAX_FILE_NAME_LEN, "%s\\%s", docRoot, diskPath) >= MAX_FILE_NAME_LEN)
+		{
+			resp.code = ResponseCodes::BAD_REQUEST;
+			keepAlive = false;
+			co_return;
+		}
+
+		if (fileIndex && fileIndex->Lookup(diskPath, fileInfo) && fileInfo.isDirectory)
+		{
+			resp.code = ResponseCodes::CONFLICT;
+			keepAlive = false;
+			co_return;
+		}
+
+		if (!upload.Open(nameBuf))
+		{
+			resp.code = ResponseCodes::INTERNAL_SERVER_ERROR;
+			keepAlive = false;
+			co_return;
+		}
+	}
+
+	if (body.expectContinue && initialLen == 0 && body.Present())
+	{
+		//Client is holding the body back until we say it's wanted
+		const char* cont = HTTP_VER " 100 Continue\r\n\r\n";
+		if (!co_await Write(cont, (int)strlen(cont)))
+		{
+			connected = false;
+			co_return;
+		}
+	}
+
+	BodyResult result;
+	if (route->kind == ROUTE_UPLOAD)
+	{
+		result = co_await ReadBody(body, initial, initialLen, limit, [&upload](const char* buf, int len)
+			{
+				return upload.Write(buf, len);
+			});
+	}
+	else
+	{
+		result = co_await ReadBody(body, initial, initialLen, limit, [route, &match](const char* buf, int len)
+			{
+				return route->bodyCallback(match, buf, len);
+			});
+	}
+
+	bool replaced = false;
+	switch (result)
+	{
+		case BODY_OK:
+			if (route->kind != ROUTE_UPLOAD)
+			{
+				route->callback(match, resp);
+			}
+			else if (upload.Commit(replaced))
+			{
+				resp.code = replaced ? ResponseCodes::NO_CONTENT : ResponseCodes::CREATED;
+			}
+			else
+			{
+				resp.code = ResponseCodes::INTERNAL_SERVER_ERROR;
+			}
+			break;
+		case BODY_TOO_LARGE:
+			resp.code = ResponseCodes::PAYLOAD_TOO_LARGE;
+			keepAlive = false;
+			break;
+		case BODY_BAD:
+			resp.code = ResponseCodes::BAD_REQUEST;
+			keepAlive = false;
+			break;
+		case BODY_SINK_FAILED:
+			resp.code = ResponseCodes::INTERNAL_SERVER_ERROR;
+			keepAlive = false;
+			break;
+		case BODY_CLOSED:
+			connected = false;
+			break;
 	}
+}
 
-	if(!userAgent)
+Task<BodyResult> Connection::ReadBody(const BodyInfo& body, char* initial, int initialLen, long long limit, std::function<bool(const char*, int)> sink)
+{
+	//Reads the body a buffer at a time and hands each piece of payload to sink. initial is whatever came in behind the head.
+	//Windows has no splice, so it's a recv straight into one BODY_BUF_SIZE buffer and out to the sink from there
+	if (!body.Present())
 	{
-		return;
+		co_return BODY_OK;
 	}
 
-	//GetHeader(ResponseCodes::PROCESSING, userAgent, headerBuf, 0, "");
-	//SendBuffer(headerBuf, socket);
+	char* buf = (char*)arena.Alloc(BODY_BUF_SIZE);
+	if (!buf)
+	{
+		co_return BODY_SINK_FAILED;
+	}
 
-	bool handled = false;
+	ChunkScanner scanner;
+	long long remaining = body.contentLength;
+	long long total = 0;
+	long long received = initialLen;
+	IoTime start = std::chrono::steady_clock::now();
+	BodyResult result = BODY_OK;
 
-	for (int i = 0; i < index; i++)
+	char* pending = initial;
+	int pendingLen = initialLen;
+	while (true)
 	{
-		if (!strncmp(params[i], "GET", 3))
+		if (pendingLen == 0)
 		{
-			char temp = *&data[5];
-			if (isspace(temp)) //No site requested, redirect to index
+			if (body.chunked ? scanner.state == ChunkScanner::DONE : remaining == 0)
 			{
-				GetHeader(ResponseCodes::TEMP_REDIRECT, userAgent, headerBuf, 0, "/index.html");
-				handled = SendBuffer(headerBuf, socket);
+				break;
 			}
-			else
+
+			int want = !body.chunked && remaining < BODY_BUF_SIZE ? (int)remaining : BODY_BUF_SIZE;
+			int got = RawRecv(buf, want);
+			if (got == 0 || (got < 0 && WSAGetLastError() != WSAEWOULDBLOCK))
+			{
+				result = BODY_CLOSED;
+				break;
+			}
+			else if (got < 0)
 			{
-				char* httpVer = strchr(&data[5], 'H');
-				char* fileNameEnd = strchr(&data[5], '.');
-				char* fileExt = strchr(fileNameEnd, ' ');
-				if (fileNameEnd && fileNameEnd < httpVer)
+				if (!co_await ioLoop->WaitSocket(socket, false, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeouts.bodyIdleMs)))
 				{
-					char fileName[MAX_FILE_NAME_LEN];
-					CopyRange(&data[5], fileNameEnd, fileName, MAX_FILE_NAME_LEN);
-					char ext[MAX_FILE_NAME_LEN];
-					CopyRange(fileNameEnd, fileExt, ext, MAX_FILE_NAME_LEN);
-
-					char* file = nullptr;
-					int len = 0;
-					if (GetFile(fileName, ext, file, len))
-					{
-						if (file && len > 0) //Don't bother sending an empty file
-						{
-							char* contentType = GetTypeFromExtension(ext);
-							if (contentType)
-							{
-								GetHeader(ResponseCodes::OK, userAgent, headerBuf, len, nullptr, contentType);
-								int totalSize = 0;
-								char* resp = AppendDataToHeader(headerBuf, file, len, totalSize);
-
-								if (resp)
-								{
-									handled = SendBuffer(resp, socket, totalSize);
-									free(resp);
-								}
-
-								free(contentType);
-							}
-						}
-
-						if(file)
-						{
-							free(file);
-						}
-						else
-						{
-							goto NotFound;
-						}
-					}
-					else
+					if (budget)
 					{
-					NotFound:
-						GetHeader(ResponseCodes::NOT_FOUND, userAgent, headerBuf, 0, "");
-						handled = SendBuffer(headerBuf, socket);
+						budget->OnSlowClient();
 					}
+					result = BODY_CLOSED;
+					break;
 				}
-				else
-				{
-					//No file ext, we've requested a directory listing
-					char filePath[MAX_PATH];
-					CopyRange(&data[5], httpVer - 1, filePath, MAX_PATH);
-					char* retBuf = nullptr;
-					if (GetDirectoryListing(filePath, retBuf) && retBuf)
-					{
-						int len = strnlen_s(retBuf, MAX_DIR_BUF_SIZE);
-						char* contentType = GetTypeFromExtension((char*)".html");
-						if (contentType)
-						{
-							GetHeader(ResponseCodes::OK, userAgent, headerBuf, len, nullptr, contentType);
-							int totalSize = 0;
-							char* resp = AppendDataToHeader(headerBuf, retBuf, len, totalSize);
-							if (resp)
-							{
-								handled = SendBuffer(resp, socket, totalSize);
-								free(resp);
-							}
-							free(contentType);
-						}
 
-						free(retBuf);
-					}
+				if (TooSlow(start, received))
+				{
+					result = BODY_CLOSED;
+					break;
 				}
+				continue;
+			}
+
+			received += got;
+			pending = buf;
+			pendingLen = got;
+		}
+
+		int payloadLen = 0;
+		int consumed = 0;
+		if (body.chunked)
+		{
+			//Framing is stripped in place, the payload is never longer than what it came in
+			payloadLen = scanner.Feed(pending, pendingLen, pending, &consumed);
+			if (scanner.state == ChunkScanner::BAD)
+			{
+				result = BODY_BAD;
+				break;
 			}
 		}
+		else
+		{
+			payloadLen = pendingLen < remaining ? pendingLen : (int)remaining;
+			remaining -= payloadLen;
+			consumed = payloadLen;
+		}
+
+		//Anything past the end of the body is the next request, it goes back for ReadRequest. Payload never overlaps it.
+		if (consumed < pendingLen && !KeepPipelined(pending + consumed, pendingLen - consumed))
+		{
+			keepAlive = false;
+		}
+		pendingLen = 0;
+
+		total += payloadLen;
+		if (total > limit)
+		{
+			result = BODY_TOO_LARGE;
+			break;
+		}
 
-		if (handled)
+		if (payloadLen > 0 && !sink(pending, payloadLen))
 		{
+			result = BODY_SINK_FAILED;
 			break;
 		}
 	}
 
-	if (!handled)
+	co_return result;
+}
+
+Task<bool> Connection::SendResponse(Response& resp, char* userAgent, char* headerBuf, bool headOnly)
+{
+	GetHeader(resp.code, userAgent, headerBuf, resp.bodyLen, resp.location, resp.contentType[0] ? resp.contentType : nullptr, resp.etag, resp.prebuiltHeaders);
+	if (sends)
+	{
+		//Weighted by what it is, so a page's assets aren't stuck behind someone's installer download
+		sends->Begin(&sendFlow, SendScheduler::Classify(headOnly ? 0 : resp.bodyLen, resp.contentType));
+	}
+
+	long long sendStartUs = WINWEB_PROBE_NOW();
+	WINWEB_PROBE_SEND_START(socket, (int)resp.code, (long long)resp.bodyLen);
+	bool sent = false;
+	if (resp.mappedBody && !headOnly)
+	{
+		sent = co_await SendMapped(headerBuf, resp.mappedBody, resp.bodyLen);
+		if (!sent)
+		{
+			connected = false;
+		}
+	}
+	else if (resp.filePath[0] && !headOnly)
+	{
+		sent = co_await SendFile(headerBuf, resp.filePath, resp.bodyLen, resp.etag);
+		if (!sent)
+		{
+			//Part of a response may be out, the only safe thing left is to close
+			connected = false;
+		}
+	}
+	else if (resp.body && resp.bodyLen > 0 && !headOnly)
+	{
+		int totalSize = 0;
+		char* full = AppendDataToHeader(headerBuf, resp.body, (int)resp.bodyLen, totalSize);
+		if (full)
+		{
+			//totalSize counts the terminator AppendDataToHeader leaves on the end, which isn't part of the response
+			sent = co_await Write(full, totalSize - 1);
+		}
+	}
+	else
 	{
-		GetHeader(ResponseCodes::NOT_IMPLEMENTED, userAgent, headerBuf, 0, "");
-		SendBuffer(headerBuf, socket);
+		sent = co_await Write(headerBuf, (int)strlen(headerBuf));
 	}
 
-	free(userAgent);
+	WINWEB_PROBE_SEND_DONE(socket, (int)resp.code, (long long)resp.bodyLen, sent, WINWEB_PROBE_NOW() - sendStartUs);
+	if (sends)
+	{
+		sends->Done(&sendFlow);
+	}
+	FreeBody(resp);
+	co_return sent;
 }
 
 char* Connection::AppendDataToHeader(char* headerBuf, char* data, int dataLen, int& totalSize)
 {
 	totalSize = 1 + dataLen + strlen(headerBuf);
-	char* resp = (char*)malloc(totalSize);
+	char* resp = (char*)arena.Alloc(totalSize);
 	if (resp)
 	{
 		memset(resp, 0, totalSize);
@@ -364,7 +1674,7 @@ char* Connection::AppendDataToHeader(char* headerBuf, char* data, int dataLen, i
 	return resp;
 }
 
-void Connection::GetHeader(ResponseCodes code, char* userAgent, char* buf, int len, const char* loc, char* contentType)
+void Connection::GetHeader(ResponseCodes code, char* userAgent, char* buf, long long len, const char* loc, char* contentType, const char* etag, const char* prebuilt)
 {
 	if (!buf)
 	{
@@ -373,12 +1683,12 @@ void Connection::GetHeader(ResponseCodes code, char* userAgent, char* buf, int l
 
 	memset(buf, 0, MAX_HEADER_BUF_SIZE);
 
-	bool cleanup = false;
+	char defaultType[MAX_MIME_TYPE_LEN];
 	char* getContentType = contentType;
 	if (!getContentType)
 	{
-		cleanup = true;
-		getContentType = GetTypeFromExtension((char*)".html");
+		GetMimeType((char*)".html", defaultType, MAX_MIME_TYPE_LEN);
+		getContentType = defaultType;
 	}
 
 	struct tm lTm;
@@ -399,143 +1709,161 @@ void Connection::GetHeader(ResponseCodes code, char* userAgent, char* buf, int l
 	strncpy_s(monStr, &timeBuf[4], 3);
 
 	char keepAliveBuf[200];
-	sprintf(keepAliveBuf, "keep-alive\r\nKeep-Alive: timeout=%i, max=%i", KEEP_ALIVE_TIMEOUT, MAX_KEEP_ALIVE_REQS);
+	sprintf(keepAliveBuf, "keep-alive\r\nKeep-Alive: timeout=%i, max=%i", KeepAliveTimeout(), KeepAliveMax());
 	const char* closeStr = "close";
 
-	sprintf_s(buf, MAX_HEADER_BUF_SIZE, "%s %i \r\nConnection:%s\r\nServer:%s/%i.%i\r\nDate:%s, %i %s %i\r\nContent-Type:%s\r\nContent-Length:%i\r\nLocation:%s\r\nUser-Agent:%s\r\n\r\n", HTTP_VER, code,
-		keepAlive ? keepAliveBuf : closeStr, SERVER_NAME, SERVER_MAJOR, SERVER_MINOR, dayStr, lTm.tm_mday, monStr, START_YEAR + lTm.tm_year, getContentType, len, loc, userAgent);
-
-	buf[strlen(buf)] = 0;
+	char etagBuf[MAX_ETAG_LEN + 10];
+	etagBuf[0] = 0;
+	if (etag && etag[0])
+	{
+		sprintf_s(etagBuf, "ETag:%s\r\n", etag);
+	}
 
-	if (cleanup)
+	if (prebuilt)
+	{
+		//Site pack entries carry their own Content-Type/Length/ETag lines
+		sprintf_s(buf, MAX_HEADER_BUF_SIZE, "%s %i \r\nConnection:%s\r\nServer:%s/%i.%i\r\nDate:%s, %i %s %i\r\n%sLocation:%s\r\nUser-Agent:%s\r\n\r\n", HTTP_VER, code,
+			keepAlive ? keepAliveBuf : closeStr, SERVER_NAME, SERVER_MAJOR, SERVER_MINOR, dayStr, lTm.tm_mday, monStr, START_YEAR + lTm.tm_year, prebuilt, loc, userAgent);
+	}
+	else
 	{
-		free(getContentType);
+		sprintf_s(buf, MAX_HEADER_BUF_SIZE, "%s %i \r\nConnection:%s\r\nServer:%s/%i.%i\r\nDate:%s, %i %s %i\r\nContent-Type:%s\r\nContent-Length:%lld\r\n%sLocation:%s\r\nUser-Agent:%s\r\n\r\n", HTTP_VER, code,
+			keepAlive ? keepAliveBuf : closeStr, SERVER_NAME, SERVER_MAJOR, SERVER_MINOR, dayStr, lTm.tm_mday, monStr, START_YEAR + lTm.tm_year, getContentType, len, etagBuf, loc, userAgent);
 	}
+
+	buf[strlen(buf)] = 0;
 }
 
-bool Connection::GetDirectoryListing(char* loc, char*& retBuf)
+bool Connection::GetDirectoryListing(char* loc, char*& retBuf, const char* urlPath)
 {
-	//Get list of all files/folders in this directory
-	//Generate HTML table with hyperlink to each file/folder
-	//Return as response
+	//loc is where it is on disk, urlPath where the client asked for it (they differ when a route maps a prefix onto another directory)
+	if (!urlPath)
+	{
+		urlPath = loc;
+	}
 
-	if (strlen(loc) > MAX_PATH)
+	if (strlen(loc) >= MAX_PATH - 1 || strlen(urlPath) >= MAX_PATH - 1)
 	{
 		return false;
 	}
 
-	for (int i = 0; i < strlen(loc); i++)
+	retBuf = RequestAlloc(MAX_DIR_BUF_SIZE);
+
+	if (!retBuf)
 	{
-		if (loc[i] == '%')
-		{
-			memset(&loc[i], ' ', 3);
-			//Shunt up twice to fill gap
-			for (int j = 0; j < 2; j++)
-			{
-				for (int k = i; k < strlen(loc); k++)
-				{
-					loc[k] = loc[k + 1];
-				}
-			}
-		}
+		return false;
 	}
 
-	char basePath[MAX_PATH];
-	strcpy(basePath, loc);
+	//A herd on one directory builds its listing once, the rest copy it
+	std::string key = "listing:";
+	key += docRoot;
+	key += "|";
+	key += loc;
+	key += "|";
+	key += urlPath;
+	//Nobody waits on a build in progress, that would be a worker blocked. A copy only comes from one that's finished.
+	Flight* flight = flights ? flights->Join(key, "", MAX_DIR_BUF_SIZE) : nullptr;
+	if (flight && flight->data && flight->state == FLIGHT_DONE)
+	{
+		memcpy(retBuf, flight->data, (size_t)flight->loaded);
+	}
+	else if (flight && flight->data && flight->Claim())
+	{
+		BuildDirectoryListing(loc, flight->data, urlPath);
+		flight->loaded = strlen(flight->data) + 1;
+		flight->Finish(true);
+		memcpy(retBuf, flight->data, (size_t)flight->loaded);
+	}
+	else
+	{
+		BuildDirectoryListing(loc, retBuf, urlPath);
+	}
 
-	strcat(loc, "\\*\0");
-	WIN32_FIND_DATAA data;
-	HANDLE hFind = FindFirstFileA(loc, &data);
+	if (flight)
+	{
+		flights->Release(flight);
+	}
+	return true;
+}
 
-	retBuf = (char*)malloc(MAX_DIR_BUF_SIZE);
+void Connection::BuildDirectoryListing(char* loc, char* retBuf, const char* urlPath)
+{
+	//Get list of all files/folders in this directory
+	//Generate HTML table with hyperlink to each file/folder
+	//Into retBuf, MAX_DIR_BUF_SIZE
 
-	if (!retBuf)
+	char basePath[MAX_PATH];
+	strcpy(basePath, urlPath);
+
+	char diskPath[MAX_PATH];
+	strcpy(diskPath, loc);
+	if (diskPath[0] && diskPath[strlen(diskPath) - 1] != '/')
 	{
-		return false;
+		strcat(diskPath, "/");
 	}
 
 	char tblBuf[MAX_DIR_TABLE_SIZE];
 	tblBuf[0] = 0;
 
-	if (hFind != INVALID_HANDLE_VALUE)
+	FileInfo dirInfo;
+	if (fileIndex && fileIndex->Lookup(loc, dirInfo) && dirInfo.isDirectory)
 	{
-		while (FindNextFileA(hFind, &data) && strlen(tblBuf) < MAX_DIR_TABLE_SIZE)
-		{
-			bool isParentDir = false;
-			char parentPath[MAX_PATH];
+		char parentPath[MAX_PATH];
+		memset(parentPath, 0, MAX_PATH);
 
-			if (!strcmp(data.cFileName, "\.."))
-			{
-				char* lst = strchr(&basePath[0], '/');
-				char* lstGood = nullptr;
+		char* lst = strchr(&basePath[0], '/');
+		char* lstGood = nullptr;
 
-				while(lst)
-				{
-					lstGood = lst;
-					char* nxt = lstGood + 1;
-					if (nxt) 
-					{
-						lst = strchr(lstGood + 1, '/');
-					}
-					else
-					{
-						break;
-					}
-				}
+		while(lst)
+		{
+			lstGood = lst;
+			lst = strchr(lstGood + 1, '/');
+		}
 
-				if(lstGood)
-				{
-					CopyRange(&basePath[0], lstGood, parentPath, MAX_PATH);
-					isParentDir = true;
-				}
-				else if (!lst) 
-				{
-					isParentDir = true;
-					memset(parentPath, 0, 200);
-				}
-			}
+		if(lstGood)
+		{
+			CopyRange(&basePath[0], lstGood, parentPath, MAX_PATH);
+		}
 
-			if(basePath[strlen(basePath) - 1] != '/')
-			{
-				strcat(basePath, "/");
-			}
+		if(basePath[0] && basePath[strlen(basePath) - 1] != '/')
+		{
+			strcat(basePath, "/");
+		}
 
-			FILETIME time = data.ftLastWriteTime;
-			SYSTEMTIME sysTime;
-			FileTimeToSystemTime(&time, &sysTime);
+		char entryBuf[400 + (MAX_PATH * 2)];
+		sprintf_s(entryBuf, "<tr><td valign=\"top\">&nbsp;</td><td><a href=\"/%s\">Parent directory</a></td><td align=\"right\">  </td><td align=\"right\">  </td><td>&nbsp;</td></tr>\n", parentPath);
+		strcat(tblBuf, entryBuf);
 
-			char fileInfo[200];
+		//Served from the index, no directory scan per request
+		fileIndex->ListDirectory(diskPath, [&](const char* name, const FileInfo& info)
+			{
+				SYSTEMTIME sysTime;
+				FileTimeToSystemTime(&info.lastWrite, &sysTime);
 
-			char month[10];
-			char day[10];
-			char hour[10];
-			char minute[10];
+				char month[10];
+				char day[10];
+				char hour[10];
+				char minute[10];
 
-			GetConsistentString(month, sysTime.wMonth);
-			GetConsistentString(day, sysTime.wDay);
-			GetConsistentString(hour, sysTime.wHour);
-			GetConsistentString(minute, sysTime.wMinute);
+				GetConsistentString(month, sysTime.wMonth);
+				GetConsistentString(day, sysTime.wDay);
+				GetConsistentString(hour, sysTime.wHour);
+				GetConsistentString(minute, sysTime.wMinute);
 
-			if (!isParentDir) 
-			{
+				char fileInfo[200];
 				sprintf_s(fileInfo, "%u-%s-%s %s:%s", sysTime.wYear, month, day, hour, minute);
-			}
-			else 
-			{
-				memset(fileInfo, 0, 200);
-			}
 
-			char entryBuf[400 + (MAX_PATH * 2)];
-			sprintf_s(entryBuf, "<tr><td valign=\"top\">&nbsp;</td><td><a href=\"/%s%s\">%s</a></td><td align=\"right\">%s  </td><td align=\"right\">  </td><td>&nbsp;</td></tr>\n", isParentDir ? parentPath : basePath,
-				isParentDir ? "" : data.cFileName, isParentDir ? "Parent directory" : data.cFileName, fileInfo);
-			strcat(tblBuf, entryBuf);
-		}
+				sprintf_s(entryBuf, "<tr><td valign=\"top\">&nbsp;</td><td><a href=\"/%s%s\">%s</a></td><td align=\"right\">%s  </td><td align=\"right\">  </td><td>&nbsp;</td></tr>\n", basePath,
+					name, name, fileInfo);
 
-		FindClose(hFind);
+				if (strlen(tblBuf) + strlen(entryBuf) < MAX_DIR_TABLE_SIZE)
+				{
+					strcat(tblBuf, entryBuf);
+				}
+			});
 	}
 
 	sprintf_s(retBuf, MAX_DIR_BUF_SIZE, "<!DOCTYPE HTML - WinWeb auto-generated directory listing>\n<html>\n<head>\n<title>Index of %s</title>\n<head>\n<body>\n<h1>Index of %s</h1>\n<table>%s</table>\n</body>\n</html>", basePath, basePath, tblBuf);
-	return true;
 }
 
 void Connection::GetConsistentString(char* Buf, int Val)
@@ -550,58 +1878,98 @@ void Connection::GetConsistentString(char* Buf, int Val)
 	}
 }
 
-bool Connection::GetFile(char* name, char* ext, char*& retBuf, int& len)
+bool Connection::LookupFile(const char* path, char* nameBuf, FileInfo& info)
 {
-	//Finds file in the current directory, dynamically allocates a buffer and then returns true when completed sucessfully
-	if (strnlen_s(name, MAX_FILE_NAME_LEN) + strnlen_s(ext, MAX_FILE_NAME_LEN) > MAX_FILE_NAME_LEN)
+	//path has already been decoded and confined to the root by RequestTarget::Decode, nameBuf gets the on-disk name (MAX_FILE_NAME_LEN)
+	if (strnlen_s(path, MAX_FILE_NAME_LEN) >= MAX_FILE_NAME_LEN - 2)
 	{
 		return false;
 	}
 
-	char nameBuf[MAX_FILE_NAME_LEN];
-	sprintf_s(nameBuf, ".\\%s%s\0", name, ext);
+	if (snprintf(nameBuf, MAX_FILE_NAME_LEN, "%s\\%s", docRoot, path) >= MAX_FILE_NAME_LEN)
+	{
+		return false;
+	}
 
-	char* it = &nameBuf[0];
-	int max = strlen(nameBuf);
-	for (int i = 0; i < max - 2; i++)
+	//Misses are answered from the index without touching the disk
+	if (!fileIndex || !fileIndex->Lookup(path, info) || info.isDirectory)
 	{
-		char* first = it + 1;
-		char* second = first + 1;
+		WINWEB_PROBE_FILE_MISS(path);
+		return false;
+	}
 
-		if (!strncmp(it, "%", 1))
-		{
-			memcpy(it, second, max - i);
-			memset(it, ' ', 1);
-		}
+	WINWEB_PROBE_FILE_HIT(path, (long long)info.size);
+	return info.size <= MAX_FILE_SIZE;
+}
 
-		++it;
+bool Connection::GetFile(char* path, char*& retBuf, int& len, FileInfo& info)
+{
+	//Finds file in the current directory, dynamically allocates a buffer and then returns true when completed sucessfully
+	char nameBuf[MAX_FILE_NAME_LEN];
+	if (!LookupFile(path, nameBuf, info) || info.size > INT_MAX)
+	{
+		//Too big to hold in memory, only the streaming paths serve it
+		return false;
 	}
+	len = (int)info.size;
+
+	retBuf = RequestAlloc(len > 0 ? len : 1);
 
-	std::ifstream file(nameBuf, std::ios::binary | std::ios::ate);
-	if (!file.is_open())
+	if (!retBuf)
 	{
 		return false;
 	}
 
-	len = file.tellg();
-	if (len > MAX_FILE_SIZE)
+	CachedFile* file = fileCache->Acquire(nameBuf, info.size);
+	if (!file)
 	{
+		RequestFree(retBuf);
+		retBuf = nullptr;
 		return false;
 	}
 
-	retBuf = (char*)malloc(len);
-
-	if (!retBuf)
+	DWORD read = 0;
+	if (len > 0 && (!FileCache::ReadAt(file, 0, retBuf, (DWORD)len, read) || read != (DWORD)len))
 	{
+		//Changed between the stat and the read
+		RequestFree(retBuf);
+		retBuf = nullptr;
+		fileCache->Release(file);
 		return false;
 	}
 
-	file.seekg(0, std::ios::beg);
-	file.read(retBuf, len);
-	file.close();
+	fileCache->Release(file);
 	return true;
 }
 
+//Sleep() and sleep_for round up to the system tick, around 15ms, which would turn a 1ms wait for tokens into a stall.
+//A high resolution waitable timer wakes within the millisecond. One per thread, kept for the thread's life.
+struct SendWaitTimer
+{
+	HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	~SendWaitTimer()
+	{
+		if (timer)
+		{
+			CloseHandle(timer);
+		}
+	}
+};
+
+static void WaitMs(int ms)
+{
+	thread_local SendWaitTimer wait;
+	LARGE_INTEGER due;
+	due.QuadPart = -10000LL * ms; //Relative, in 100ns units
+	if (!wait.timer || !SetWaitableTimer(wait.timer, &due, 0, NULL, NULL, FALSE))
+	{
+		//Older than Windows 10 1803, settle for the tick
+		std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+		return;
+	}
+	WaitForSingleObject(wait.timer, INFINITE);
+}
+
 bool Connection::SendBuffer(char* buf, SOCKET* dest, int size)
 {
 	if (!buf)
@@ -619,11 +1987,48 @@ bool Connection::SendBuffer(char* buf, SOCKET* dest, int size)
 	int sentBytes = 0;
 	int retryCount = 0;
 	char* pos = &buf[0];
-	if (Writable(dest))
+	IoTime start = std::chrono::steady_clock::now();
+	//A full socket buffer is waited out the same as one that fills part way through, rather than dropping the data
+	if (Writable(dest) || WaitReady(true, timeouts.writeIdleMs))
 	{
 		while (sentBytes < sendAmount)
 		{
-			int thisSent = send(*dest, pos, sendAmount - sentBytes, 0);
+			int chunk = sendAmount - sentBytes;
+			if (rateLimiter)
+			{
+				//Out of byte tokens for this address, wait for the bucket to refill
+				chunk = rateLimiter->TakeBandwidth(Info.sin_addr.s_addr, chunk);
+				if (chunk == 0)
+				{
+					WaitMs(1);
+					continue;
+				}
+			}
+
+			if (sends)
+			{
+				int granted = sends->Take(&sendFlow, chunk);
+				if (granted < chunk && rateLimiter)
+				{
+					rateLimiter->ReturnBandwidth(Info.sin_addr.s_addr, chunk - granted);
+				}
+				chunk = granted;
+				if (chunk == 0)
+				{
+					WaitMs(SEND_WAIT_MS);
+					continue;
+				}
+			}
+
+			int thisSent = RawSend(pos, chunk);
+			if (rateLimiter)
+			{
+				rateLimiter->ReturnBandwidth(Info.sin_addr.s_addr, thisSent > 0 ? chunk - thisSent : chunk);
+			}
+			if (sends)
+			{
+				sends->Return(&sendFlow, thisSent > 0 ? chunk - thisSent : chunk);
+			}
 
 			if (thisSent == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
 			{
@@ -638,110 +2043,103 @@ bool Connection::SendBuffer(char* buf, SOCKET* dest, int size)
 				//Iterate along the buffer
 				pos += thisSent;
 			}
-
-			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			else if (!WaitReady(true, timeouts.writeIdleMs))
+			{
+				//Socket buffer stayed full, the client isn't reading
+				if (budget)
+				{
+					budget->OnSlowClient();
+				}
+				break;
+			}
+			else if (TooSlow(start, sentBytes))
+			{
+				break;
+			}
 		}
 	}
 
-	return true;
+	return sentBytes >= sendAmount;
 }
 
-char* Connection::GetTypeFromExtension(char* ext)
+Task<void> Connection::SendRejection(ResponseCodes code, const char* reason, int retryAfter)
 {
-	int max = strlen(ext);
-	char* lowerExt = (char*)malloc(max + 1);
-	char* it = ext;
-	for (int i = 0; i < max; i++)
-	{
-		char low = (char)tolower(*it);
-		memcpy(&lowerExt[i], &low, 1);
-		++it;
-	}
+	//Kept small and closes the connection, a client we're turning away doesn't get to hold a slot open
+	char buf[256];
+	sprintf_s(buf, "%s %i %s\r\nServer:%s/%i.%i\r\nRetry-After:%i\r\nContent-Length:0\r\nConnection:close\r\n\r\n", HTTP_VER, code, reason, SERVER_NAME, SERVER_MAJOR, SERVER_MINOR, retryAfter);
+	co_await Write(buf, (int)strlen(buf));
+	keepAlive = false;
+	connected = false;
+}
 
-	lowerExt[max] = 0;
-	char* retbuf = (char*)malloc(50);
-	if (!retbuf)
-	{
-		return nullptr;
-	}
+int Connection::KeepAliveTimeout()
+{
+	return admission ? admission->KeepAliveTimeout() : KEEP_ALIVE_TIMEOUT;
+}
 
-	memset(retbuf, 0, 50);
+int Connection::KeepAliveMax()
+{
+	return admission ? admission->KeepAliveMax() : MAX_KEEP_ALIVE_REQS;
+}
 
-	//Website content
-	if (!strcmp(lowerExt, ".html") || !strcmp(lowerExt, ".htm"))
-	{
-		strcpy(retbuf, "text/html");
-	}
-	else if (!strcmp(lowerExt, ".js") || !strcmp(lowerExt, ".mjs"))
-	{
-		strcpy(retbuf, "application/javascript");
-	}
-	else if (!strcmp(lowerExt, ".css"))
+bool Connection::TooSlow(IoTime start, long long bytes)
+{
+	//Averaged over the whole transfer, a client trickling a few bytes at a time stays inside the idle timeouts but not this
+	if (timeouts.minBytesPerSec <= 0)
 	{
-		strcpy(retbuf, "text/css");
+		return false;
 	}
 
-	//Media
-	else if (!strcmp(lowerExt, ".jpg") || !strcmp(lowerExt, ".jpeg"))
-	{
-		strcpy(retbuf, "image/jpg");
-	}
-	else if (!strcmp(lowerExt, ".png"))
-	{
-		strcpy(retbuf, "image/png");
-	}
-	else if (!strcmp(lowerExt, ".webp"))
-	{
-		strcpy(retbuf, "image/webp");
-	}
-	else if (!strcmp(lowerExt, ".gif"))
-	{
-		strcpy(retbuf, "image/gif");
-	}
-	else if (!strcmp(lowerExt, ".mp3"))
-	{
-		strcpy(retbuf, "audio/mpeg");
-	}
-	else if (!strcmp(lowerExt, ".mp4"))
-	{
-		strcpy(retbuf, "video/mp4");
-	}
-	else if (!strcmp(lowerExt, ".mpeg"))
+	long long elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	if (elapsedMs < timeouts.minRateGraceMs || bytes * 1000 >= (long long)timeouts.minBytesPerSec * elapsedMs)
 	{
-		strcpy(retbuf, "video/mpeg");
+		return false;
 	}
 
-	//Text/documents
-	else if (!strcmp(lowerExt, ".txt"))
-	{
-		strcpy(retbuf, "text/plain");
-	}
-	else if (!strcmp(lowerExt, ".doc"))
-	{
-		strcpy(retbuf, "application/msword");
-	}
-	else if (!strcmp(lowerExt, ".doc"))
+	if (budget)
 	{
-		strcpy(retbuf, "application/msword");
+		budget->OnSlowClient();
 	}
+	return true;
+}
+
+char* Connection::RequestAlloc(size_t size)
+{
+	//Request lifetime memory, from the arena for HTTP/1.1 and the heap for HTTP/2 streams
+	return requestArena ? (char*)requestArena->Alloc(size) : (char*)malloc(size);
+}
 
-	//Archives
-	else if (!strcmp(lowerExt, ".zip"))
+void Connection::RequestFree(void* ptr)
+{
+	//Arena memory goes back with the rest of the request
+	if (!requestArena)
 	{
-		strcpy(retbuf, "application/zip");
+		free(ptr);
 	}
-	else if (!strcmp(lowerExt, ".7z"))
+}
+
+void Connection::FreeBody(Response& resp)
+{
+	if (resp.body && !resp.bodyInArena)
 	{
-		strcpy(retbuf, "application/x-7z-compressed");
+		free(resp.body);
 	}
+	resp.body = nullptr;
 
-	//Misc/default
-	else
+	SitePack::Release(resp.pack);
+	resp.pack = nullptr;
+	resp.mappedBody = nullptr;
+	resp.prebuiltHeaders = nullptr;
+}
+
+char* Connection::GetTypeFromExtension(char* ext)
+{
+	char* retbuf = (char*)malloc(MAX_MIME_TYPE_LEN);
+	if (!retbuf)
 	{
-		//Default to binary stream
-		strcpy(retbuf, "application/octet-stream");
+		return nullptr;
 	}
 
-	free(lowerExt);
+	GetMimeType(ext, retbuf, MAX_MIME_TYPE_LEN);
 	return retbuf;
 }
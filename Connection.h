@@ -4,19 +4,47 @@
 #include <functional>
 #include <ws2tcpip.h>
 #include "Common.h"
+#include "FileIndex.h"
+#include "Tls.h"
+#include "RateLimit.h"
+#include "Overload.h"
+#include "IoLoop.h"
+#include "Task.h"
+#include "Router.h"
+#include "RequestBody.h"
+#include "SitePack.h"
+#include "Trace.h"
+#include "VirtualHost.h"
+#include "FileCache.h"
+#include "RequestArena.h"
+#include "BufferBudget.h"
+#include "WorkerPool.h"
+#include "SingleFlight.h"
+#include "SendScheduler.h"
+#include "AccessList.h"
 #include <mutex>
+#include <atomic>
 
 #define MAX_HEADER_BUF_SIZE 500
 #define MAX_KEEP_ALIVE_REQS 1000
 #define KEEP_ALIVE_TIMEOUT 5
 #define TO_SECONDS 1000000
-#define MAX_PARAMS 20
+#define MAX_PARAMS 64 //Request line and header lines, a head with more is refused rather than partly read
 #define MAX_FILE_SIZE 99999999999999999
 #define MAX_PACKET_SIZE 65535 //Max TCP packet size
 #define MAX_DIR_TABLE_SIZE 20000
 #define MAX_DIR_BUF_SIZE MAX_DIR_TABLE_SIZE + (MAX_PATH * 2)
 #define SERVER_NAME "WinWeb"
 #define MAX_FILE_NAME_LEN 200
+#define SEND_FILE_CHUNK 65536
+#define SEND_MAPPED_PIECE (1 << 30) //Most of a mapped body handed to one Write
+#define IO_WRITE_TIMEOUT_MS 30000 //Client not taking any data for this long is dropped
+#define HEADER_READ_TIMEOUT_MS 10000 //For the whole request head, from its first byte
+#define MIN_TRANSFER_RATE 1024 //Bytes per second a body or response has to average, 0 for no minimum
+#define MIN_RATE_GRACE_MS 10000 //Before the minimum rate applies, so slow starts and small transfers are left alone
+#define IO_TLS_RETRY_MS 50
+#define METRICS_PATH "/_winweb/metrics"
+#define TRACE_PATH "/_winweb/trace"
 
 
 #define HTTP_VER "HTTP/1.1"
@@ -26,46 +54,206 @@ enum ResponseCodes
 	ACCEPTED = 202,
 	PROCESSING = 102,
 	OK = 200,
+	CREATED = 201,
+	NO_CONTENT = 204,
+	BAD_REQUEST = 400,
 	INTERNAL_SERVER_ERROR = 500,
 	NOT_IMPLEMENTED = 501,
 	HTTP_VER_NOT_SUPPORTED = 503,
+	SERVICE_UNAVAILABLE = 503,
 	NOT_FOUND = 404,
-	TEMP_REDIRECT = 302
+	METHOD_NOT_ALLOWED = 405,
+	CONFLICT = 409,
+	PAYLOAD_TOO_LARGE = 413,
+	TOO_MANY_REQUESTS = 429,
+	REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
+	BAD_GATEWAY = 502,
+	TEMP_REDIRECT = 302,
+	SWITCHING_PROTOCOLS = 101
+};
+
+struct Response
+{
+	ResponseCodes code = ResponseCodes::NOT_FOUND;
+	char* body = nullptr; //malloc'd and freed by whoever sends it, unless bodyInArena
+	bool bodyInArena = false; //body came from the request arena, it goes when the request ends
+	long long bodyLen = 0; //Only files streamed from disk or the pack go past INT_MAX, bodies in memory never do
+	char contentType[MAX_MIME_TYPE_LEN] = { 0 };
+	char etag[MAX_ETAG_LEN] = { 0 };
+	const char* location = "";
+	int retryAfter = 0; //Seconds, only sent when set
+	char filePath[MAX_FILE_NAME_LEN] = { 0 }; //Set instead of body when the file is to be streamed from disk
+	const char* mappedBody = nullptr; //Set instead of body when it's in the site pack, never freed
+	const char* prebuiltHeaders = nullptr; //From the site pack, replaces Content-Type/Length/ETag
+	PackView* pack = nullptr; //Keeps the pack mappedBody and prebuiltHeaders point into mapped, released with the body
+};
+
+class ReverseProxy;
+
+//A routed request, match points into path so they live together
+struct RoutedRequest
+{
+	char path[MAX_PATH] = "";
+	RouteMatch match;
+	bool acceptGzip = false; //Client sent Accept-Encoding: gzip
+};
+
+//What ProcessRequest acts on from a request head, everything points into the receive buffer
+struct RequestHead
+{
+	char* userAgent = nullptr; //userAgentLen long, not terminated
+	int userAgentLen = 0;
+	char* host = nullptr;
+	int hostLen = 0;
+	char* h2Settings = nullptr;
+	bool h2Upgrade = false;
+	bool acceptGzip = false;
+	bool connectionHeader = false; //Without one the connection's keep-alive setting stands
+	bool keepAlive = false;
+	bool tooManyHeaders = false; //Lines past MAX_PARAMS weren't looked at, so nothing above can be trusted
+	BodyInfo body;
+};
+
+//How long a client gets for each part of a request before it's dropped
+struct ClientTimeouts
+{
+	int headerMs = HEADER_READ_TIMEOUT_MS;
+	int bodyIdleMs = BODY_READ_TIMEOUT_MS; //Nothing arriving mid-body
+	int writeIdleMs = IO_WRITE_TIMEOUT_MS; //Nothing being taken mid-response
+	int minBytesPerSec = MIN_TRANSFER_RATE;
+	int minRateGraceMs = MIN_RATE_GRACE_MS;
+};
+
+//Server owned pieces every connection shares
+struct ServerServices
+{
+	FileIndex* fileIndex = nullptr;
+	ReverseProxy* proxy = nullptr;
+	RateLimiter* rateLimiter = nullptr;
+	AdmissionController* admission = nullptr;
+	IoLoop* ioLoop = nullptr;
+	Router* router = nullptr;
+	SitePack* sitePack = nullptr;
+	HANDLE closedEvent = NULL; //Set once a connection is ready to be deleted
+	HostTable* hosts = nullptr; //Name based sites, requests for any other host get the ones above
+	FileCache* fileCache = nullptr;
+	BufferBudget* budget = nullptr;
+	ClientTimeouts timeouts;
+	WorkerBoard* workers = nullptr; //Set in worker processes, metrics then cover every worker
+	std::atomic<bool>* draining = nullptr; //Set once another process has the listening sockets, responses then close their connection
+	FlightGroup* flights = nullptr; //Concurrent reads of one file, or builds of one listing, share a single load
+	SendScheduler* sends = nullptr; //Shares the uplink out between responses once a link rate is set
+	AccessList* adminAccess = nullptr; //Who besides loopback may read metrics and traces
 };
 
 class Connection
 {
+	friend class Http2Session;
+	friend class ReverseProxy;
+	friend class ConnectionBench;
 public:
-	Connection(SOCKET sckt, sockaddr_in info, std::function<bool(SOCKET*)> readable, std::function<bool(SOCKET*)> writable, std::function<void(const char*)> printFunc);
+	Connection(SOCKET sckt, sockaddr_in info, std::function<bool(SOCKET*)> readable, std::function<bool(SOCKET*)> writable, std::function<void(const char*)> printFunc, const ServerServices& services, TlsContext* tls);
+	Connection(const ServerServices& services);
 	~Connection();
 	char ip[INET_ADDRSTRLEN];
-	bool pendingDelete = false;
+	std::atomic<bool> pendingDelete{ false }; //Set by OnDisconnect, read by cleanup and shutdown without the connection's lock
 	SOCKET socket;
 	std::mutex tickMutex;
 	void OnDisconnect();
+	static char* GetTypeFromExtension(char* ext);
+	static void FormatMetrics(AdmissionController* admission, FileCache* fileCache, BufferBudget* budget, FlightGroup* flights, SendScheduler* sends, std::string& out);
 private:
+	void UseServices(const ServerServices& services);
 	std::chrono::steady_clock::time_point lastRecv;
 	std::chrono::steady_clock::time_point initTime;
+	int requestCount = 0;
+	unsigned long long traceId = 0; //Trace id of the request in progress, 0 when it isn't sampled
 	bool connected = true;
 	bool keepAlive = false;
+	bool upgraded = false;
+	SSL* ssl = nullptr;
+	bool tlsHandshakeDone = false;
 	char* recvBuf;
-	void RunConnection();
-	bool RecvFromSocket(char* buf);
+	char* pipelined = nullptr; //Read past the end of the last request, the start of the next one
+	int pipelinedLen = 0;
+	IoTime sendStart; //First write of the response in progress, with sendBytes for the minimum rate
+	long long sendBytes = 0;
+	RequestArena arena;
+	RequestArena* requestArena = nullptr; //&arena while an HTTP/1.1 request is in progress, HTTP/2 streams outlive it and use the heap
+	DetachedTask Serve();
+	Task<bool> TlsHandshake();
+	Task<int> ReadRequest();
+	bool KeepPipelined(const char* data, int len);
+	Task<bool> Write(const char* buf, int len);
+	Task<bool> SendFile(const char* headerBuf, const char* fileName, long long size, const char* version);
+	Task<bool> SendShared(const char* headerBuf, Flight* flight, bool& headerSent);
+	Task<bool> SendMapped(const char* headerBuf, const char* body, long long len);
+	IoLoop::TimerAwaiter SleepUntil(IoTime when);
+	Task<void> RunHttp2(const char* initial, int initialLen);
+	int RecvSome(char* buf, int size);
+	bool HasData();
+	bool WaitReady(bool write, int timeoutMs);
+	VirtualHost* SelectHost(const char* host, int len);
+	int RawRecv(char* buf, int size);
+	int RawSend(const char* buf, int size);
 	void CopyRange(char* start, char* end, char* buf, int size);
-	void ProcessRequest(SOCKET* socket, char* data);
+	static void ParseHead(char* data, RequestHead& head);
+	Task<void> ProcessRequest(char* data, int dataLen);
+	bool RouteRequest(RouteMethod method, const char* target, int targetLen, Response& resp, bool loadBody, RoutedRequest& routed);
+	void ResolveGet(const char* target, int targetLen, Response& resp, bool loadBody = false);
+	void ResolveStatic(const RouteMatch& match, const char* path, Response& resp, bool loadBody);
+	void ResolveMetrics(Response& resp);
+	void ResolveTrace(Response& resp);
+	void ResolvePack(const RouteMatch& match, Response& resp, bool acceptGzip);
+	bool GetRoutePath(const RouteMatch& match, char* diskPath, int size);
+	Task<void> ReceiveBody(const RouteMatch& match, const BodyInfo& body, char* initial, int initialLen, Response& resp);
+	Task<BodyResult> ReadBody(const BodyInfo& body, char* initial, int initialLen, long long limit, std::function<bool(const char*, int)> sink);
+	Task<bool> SendResponse(Response& resp, char* userAgent, char* headerBuf, bool headOnly = false);
 	char* AppendDataToHeader(char* headerBuf, char* data, int dataLen, int& totalSize);
-	void GetHeader(ResponseCodes code, char* userAgent, char* buf, int len, const char* loc, char* contentType = nullptr);
-	bool GetDirectoryListing(char* loc, char*& retBuf);
+	void GetHeader(ResponseCodes code, char* userAgent, char* buf, long long len, const char* loc, char* contentType = nullptr, const char* etag = nullptr, const char* prebuilt = nullptr);
+	bool GetDirectoryListing(char* loc, char*& retBuf, const char* urlPath = nullptr);
+	void BuildDirectoryListing(char* loc, char* retBuf, const char* urlPath);
 	void GetConsistentString(char* Buf, int Val);
-	int GetStrLen(char* start, char* end);
-	bool GetFile(char* name, char* ext, char*& retBuf, int& len);
+	static int GetStrLen(char* start, char* end);
+	bool LookupFile(const char* path, char* nameBuf, FileInfo& info);
+	bool GetFile(char* path, char*& retBuf, int& len, FileInfo& info);
+	char* RequestAlloc(size_t size);
+	void RequestFree(void* ptr);
+	void FreeBody(Response& resp);
 	bool SendBuffer(char* buf, SOCKET* dest, int size = -1);
-	char* GetTypeFromExtension(char* ext);
-	std::thread conThread;
+	Task<void> SendRejection(ResponseCodes code, const char* reason, int retryAfter);
+	int KeepAliveTimeout();
+	int KeepAliveMax();
+	bool TooSlow(IoTime start, long long bytes);
+	std::coroutine_handle<> root;
+	bool serving = false;
 	std::function<void(SOCKET*, char*)> OnRecv;
 	std::function<bool(SOCKET*)> Readable;
 	std::function<bool(SOCKET*)> Writable;
 	std::function<void(const char*)> PrintFunc;
 	sockaddr_in Info;
+	FileIndex* fileIndex;
+	ReverseProxy* proxy;
+	RateLimiter* rateLimiter;
+	AdmissionController* admission;
+	IoLoop* ioLoop;
+	Router* router;
+	SitePack* sitePack;
+	HANDLE closedEvent;
+	HostTable* hosts;
+	FileCache* fileCache;
+	BufferBudget* budget;
+	ClientTimeouts timeouts;
+	WorkerBoard* workers;
+	std::atomic<bool>* draining;
+	FlightGroup* flights;
+	SendScheduler* sends;
+	SendFlow sendFlow;
+	AccessList* adminAccess;
+	FileIndex* defaultFileIndex;
+	FileCache* defaultFileCache;
+	Router* defaultRouter;
+	const char* docRoot = "."; //fileIndex, fileCache, router, docRoot and hostMaxBody follow the current request's host
+	long long hostMaxBody = 0;
 };
 
@@ -0,0 +1,279 @@
+#include "FileCache.h"
+#include <chrono>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+FileCache::FileCache()
+{
+}
+
+FileCache::~FileCache()
+{
+	Clear();
+}
+
+void FileCache::SetLimits(int maxHandles, int revalidateMs)
+{
+	//Call before Init, 0 keeps the default. maxHandles is a soft cap, handles still in use close when they're released.
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	this->maxHandles = maxHandles > 0 ? maxHandles : FILE_CACHE_MAX_HANDLES;
+	this->revalidateMs = revalidateMs > 0 ? revalidateMs : FILE_CACHE_REVALIDATE_MS;
+}
+
+long long FileCache::NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void FileCache::MakeKey(const char* path, std::string& key)
+{
+	//NTFS doesn't care about case or which slash, neither should the cache
+	key.clear();
+	for (const char* it = path; *it; ++it)
+	{
+		key += *it == '/' ? '\\' : (char)tolower((unsigned char)*it);
+	}
+}
+
+void FileCache::Unref(CachedFile* file)
+{
+	if (file->refs.fetch_sub(1) == 1)
+	{
+		CloseHandle(file->handle);
+		delete file;
+	}
+}
+
+void FileCache::Evict(CachedFile* file)
+{
+	//cacheMutex held. Out of the map and list now, the handle itself goes with the last reference.
+	files.erase(file->key);
+	lru.erase(file->lruPos);
+	++evictions;
+	Unref(file);
+}
+
+CachedFile* FileCache::Acquire(const char* path, long long expectedSize)
+{
+	//Returns a referenced entry, or nullptr if the file can't be opened. Every Acquire needs a Release.
+	if (!path)
+	{
+		return nullptr;
+	}
+
+	std::string key;
+	MakeKey(path, key);
+	long long now = NowMs();
+
+	bool recheck = false;
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto it = files.find(key);
+		if (it != files.end())
+		{
+			CachedFile* file = it->second;
+			if (expectedSize >= 0 && (unsigned long long)expectedSize != file->size)
+			{
+				//The index has already seen it change
+				Evict(file);
+			}
+			else if (now - file->validatedMs < revalidateMs)
+			{
+				lru.splice(lru.begin(), lru, file->lruPos);
+				++file->refs;
+				++hits;
+				return file;
+			}
+			else
+			{
+				recheck = true;
+			}
+		}
+	}
+
+	if (recheck)
+	{
+		//Stat by name outside the lock, a replaced file has a new size or mtime even though our handle still sees the old one
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		bool exists = GetFileAttributesExA(path, GetFileExInfoStandard, &attr) != 0;
+
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto it = files.find(key);
+		if (it != files.end())
+		{
+			CachedFile* file = it->second;
+			unsigned long long size = exists ? ((unsigned long long)attr.nFileSizeHigh << 32) | attr.nFileSizeLow : 0;
+			if (exists && size == file->size && !CompareFileTime(&attr.ftLastWriteTime, &file->lastWrite))
+			{
+				file->validatedMs = now;
+				lru.splice(lru.begin(), lru, file->lruPos);
+				++file->refs;
+				++hits;
+				return file;
+			}
+			Evict(file);
+		}
+	}
+
+	++misses;
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		return nullptr;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(handle, &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		CloseHandle(handle);
+		return nullptr;
+	}
+
+	CachedFile* file = new CachedFile();
+	file->key = key;
+	file->handle = handle;
+	file->size = ((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	file->lastWrite = info.ftLastWriteTime;
+	file->validatedMs = now;
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	auto it = files.find(key);
+	if (it != files.end())
+	{
+		//Someone else opened it while we were, theirs replaces it so the newest open wins
+		Evict(it->second);
+	}
+
+	files[key] = file;
+	lru.push_front(file);
+	file->lruPos = lru.begin();
+	++file->refs;
+
+	while (files.size() > (size_t)maxHandles && !lru.empty())
+	{
+		Evict(lru.back());
+	}
+	return file;
+}
+
+void FileCache::Release(CachedFile* file)
+{
+	if (file)
+	{
+		Unref(file);
+	}
+}
+
+bool FileCache::ReadAt(CachedFile* file, unsigned long long offset, char* buf, DWORD want, DWORD& read)
+{
+	//Positional, the handle's own file pointer is never relied on since other requests share it
+	OVERLAPPED overlapped = { 0 };
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	read = 0;
+	return ReadFile(file->handle, buf, want, &read, &overlapped) != 0;
+}
+
+void FileCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	while (!lru.empty())
+	{
+		Evict(lru.back());
+	}
+}
+
+bool FileCache::SaveIndex(const char* path)
+{
+	//Which files are open, most recently used first, so the next process can open the same ones before it takes traffic.
+	//Written beside path and renamed over it, a reader never sees half a file.
+	std::vector<std::string> paths;
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		for (CachedFile* file : lru)
+		{
+			paths.push_back(file->key);
+		}
+	}
+	if (paths.empty())
+	{
+		//Nothing worth replacing the last list with, we likely never served anything
+		return true;
+	}
+
+	char tempPath[MAX_PATH];
+	sprintf_s(tempPath, "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+	FILE* out = nullptr;
+	if (fopen_s(&out, tempPath, "w") || !out)
+	{
+		return false;
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < paths.size() && ok; i++)
+	{
+		ok = fprintf(out, "%s\n", paths[i].c_str()) > 0;
+	}
+	ok = !fclose(out) && ok;
+
+	if (!ok || !MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileA(tempPath);
+		return false;
+	}
+	return true;
+}
+
+int FileCache::Warm(const char* path)
+{
+	//Opens what SaveIndex wrote, returns how many could be. Files that have gone since are skipped.
+	FILE* in = nullptr;
+	if (fopen_s(&in, path, "r") || !in)
+	{
+		return 0;
+	}
+
+	std::vector<std::string> paths;
+	char line[MAX_PATH + 2];
+	while (fgets(line, sizeof(line), in) && paths.size() < (size_t)maxHandles)
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0])
+		{
+			paths.push_back(line);
+		}
+	}
+	fclose(in);
+
+	//Least recent first, so the LRU order comes out as it was saved
+	int opened = 0;
+	for (size_t i = paths.size(); i > 0; i--)
+	{
+		CachedFile* file = Acquire(paths[i - 1].c_str());
+		if (file)
+		{
+			Release(file);
+			++opened;
+		}
+	}
+	return opened;
+}
+
+void FileCache::FormatMetrics(std::string& out)
+{
+	size_t open = 0;
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		open = files.size();
+	}
+
+	char buf[256];
+	sprintf_s(buf,
+		"winweb_file_cache_open %zu\n"
+		"winweb_file_cache_hits_total %llu\n"
+		"winweb_file_cache_misses_total %llu\n"
+		"winweb_file_cache_evictions_total %llu\n",
+		open, (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)evictions);
+	out += buf;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <Windows.h>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define FILE_CACHE_MAX_HANDLES 256
+#define FILE_CACHE_REVALIDATE_MS 2000 //How long an entry is trusted before the file is stat'd again
+
+struct CachedFile
+{
+	std::string key;
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	unsigned long long size = 0;
+	FILETIME lastWrite = { 0 };
+	long long validatedMs = 0;
+	std::atomic<int> refs{ 1 }; //The cache's own reference plus one per Acquire
+	std::list<CachedFile*>::iterator lruPos;
+};
+
+//Open file handles and their size/mtime, shared between workers so a hot file isn't opened, stat'd and closed on every request.
+//Handles are opened with full sharing so deploys can still replace or delete files underneath them. A replaced file shows up
+//as a size or mtime change, either against what the caller expects or when the entry is revalidated, and is reopened.
+//Reads are positional so any number of requests can use one handle at once.
+class FileCache
+{
+public:
+	FileCache();
+	~FileCache();
+	void SetLimits(int maxHandles, int revalidateMs);
+	CachedFile* Acquire(const char* path, long long expectedSize = -1);
+	void Release(CachedFile* file);
+	static bool ReadAt(CachedFile* file, unsigned long long offset, char* buf, DWORD want, DWORD& read);
+	void Clear();
+	bool SaveIndex(const char* path);
+	int Warm(const char* path);
+	void FormatMetrics(std::string& out);
+private:
+	static long long NowMs();
+	static void MakeKey(const char* path, std::string& key);
+	void Evict(CachedFile* file);
+	void Unref(CachedFile* file);
+	std::mutex cacheMutex;
+	std::unordered_map<std::string, CachedFile*> files;
+	std::list<CachedFile*> lru; //Most recently used at the front
+	int maxHandles = FILE_CACHE_MAX_HANDLES;
+	int revalidateMs = FILE_CACHE_REVALIDATE_MS;
+	std::atomic<unsigned long long> hits{ 0 };
+	std::atomic<unsigned long long> misses{ 0 };
+	std::atomic<unsigned long long> evictions{ 0 };
+};
@@ -0,0 +1,587 @@
+#include "Connection.h"
+#include "FileIndex.h"
+#include <chrono>
+
+static bool IsUploadTemp(const std::string& key)
+{
+	//Uploads still being written, they only become visible once renamed into place
+	size_t suffixLen = strlen(UPLOAD_TEMP_SUFFIX);
+	return key.size() > suffixLen && !key.compare(key.size() - suffixLen, suffixLen, UPLOAD_TEMP_SUFFIX);
+}
+
+FileIndex::FileIndex()
+{
+	stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+}
+
+FileIndex::~FileIndex()
+{
+	StopWatching();
+
+	if (stopEvent)
+	{
+		CloseHandle(stopEvent);
+	}
+}
+
+void FileIndex::NormalisePath(const char* path, std::string& out)
+{
+	//Keys are relative to the root, lower case (NTFS is case insensitive) and use '/' separators
+	out.clear();
+	if (!path)
+	{
+		return;
+	}
+
+	if (path[0] == '.' && (path[1] == '\\' || path[1] == '/'))
+	{
+		path += 2;
+	}
+
+	while (*path == '/' || *path == '\\')
+	{
+		++path;
+	}
+
+	for (const char* it = path; *it; ++it)
+	{
+		char c = *it == '\\' ? '/' : (char)tolower(*it);
+		if (c == '/' && (out.empty() || out.back() == '/'))
+		{
+			continue;
+		}
+		out += c;
+	}
+
+	if (!out.empty() && out.back() == '/')
+	{
+		out.pop_back();
+	}
+}
+
+bool FileIndex::Build(const char* root)
+{
+	if (!root)
+	{
+		return false;
+	}
+
+	//Walked into a fresh index without the lock, a rebuild after a watch overflow can take a while on a big
+	//root and lookups carry on against the old tree until it's swapped in
+	FileIndex fresh;
+	fresh.rootPath = root;
+	fresh.memoryBudget = memoryBudget;
+	fresh.mimeOverrides = mimeOverrides;
+
+	FileInfo rootInfo;
+	rootInfo.isDirectory = true;
+	fresh.entries[""] = rootInfo;
+	fresh.AddDirectory("", fresh.rootPath.c_str());
+
+	std::unique_lock<std::shared_mutex> lock(indexMutex);
+	rootPath = fresh.rootPath;
+	entries.swap(fresh.entries);
+	children.swap(fresh.children);
+	indexedBytes = fresh.indexedBytes;
+	overBudget = fresh.overBudget;
+	return true;
+}
+
+void FileIndex::AddDirectory(const std::string& key, const char* diskPath)
+{
+	char searchPath[MAX_PATH];
+	sprintf_s(searchPath, "%s\\*", diskPath);
+
+	WIN32_FIND_DATAA data;
+	HANDLE hFind = FindFirstFileExA(searchPath, FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	std::vector<std::string> subDirs;
+	do
+	{
+		if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, ".."))
+		{
+			continue;
+		}
+
+		std::string childKey;
+		NormalisePath(data.cFileName, childKey);
+		if (!key.empty())
+		{
+			childKey = key + "/" + childKey;
+		}
+
+		if (IsUploadTemp(childKey))
+		{
+			continue;
+		}
+
+		if (!AddEntry(childKey, data))
+		{
+			continue;
+		}
+		LinkToParent(childKey, data.cFileName);
+
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			subDirs.push_back(data.cFileName);
+		}
+	} while (FindNextFileA(hFind, &data));
+
+	FindClose(hFind);
+
+	for (int i = 0; i < subDirs.size(); i++)
+	{
+		std::string childKey;
+		NormalisePath(subDirs[i].c_str(), childKey);
+		if (!key.empty())
+		{
+			childKey = key + "/" + childKey;
+		}
+
+		char childPath[MAX_PATH];
+		if (strlen(diskPath) + subDirs[i].size() + 2 > MAX_PATH)
+		{
+			continue;
+		}
+		sprintf_s(childPath, "%s\\%s", diskPath, subDirs[i].c_str());
+		AddDirectory(childKey, childPath);
+	}
+}
+
+bool FileIndex::AddEntry(const std::string& key, const WIN32_FIND_DATAA& data)
+{
+	//False when the budget is used up, the entry is then left to LookupDisk
+	auto existing = entries.find(key);
+	if (existing == entries.end())
+	{
+		size_t cost = sizeof(FileInfo) + key.size() * 2 + sizeof(void*) * 4;
+		if (memoryBudget && indexedBytes + cost > memoryBudget)
+		{
+			overBudget = true;
+			return false;
+		}
+		indexedBytes += cost;
+		existing = entries.emplace(key, FileInfo()).first;
+	}
+
+	FillInfo(data, existing->second);
+	return true;
+}
+
+void FileIndex::FillInfo(const WIN32_FIND_DATAA& data, FileInfo& info)
+{
+	info = FileInfo();
+	info.isDirectory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	info.size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	info.lastWrite = data.ftLastWriteTime;
+
+	if (!info.isDirectory)
+	{
+		const char* ext = strrchr(data.cFileName, '.');
+		if (ext && mimeOverrides)
+		{
+			//Per host types win over the built in table
+			std::string lowerExt;
+			NormalisePath(ext, lowerExt);
+			auto over = mimeOverrides->find(lowerExt);
+			if (over != mimeOverrides->end())
+			{
+				strncpy_s(info.mimeType, over->second.c_str(), MAX_MIME_TYPE_LEN - 1);
+			}
+		}
+
+		if (!info.mimeType[0])
+		{
+			char* type = Connection::GetTypeFromExtension((char*)(ext ? ext : ""));
+			if (type)
+			{
+				strncpy_s(info.mimeType, type, MAX_MIME_TYPE_LEN - 1);
+				free(type);
+			}
+		}
+
+		unsigned long long mtime = ((unsigned long long)info.lastWrite.dwHighDateTime << 32) | info.lastWrite.dwLowDateTime;
+		sprintf_s(info.etag, "\"%llx-%llx\"", mtime, info.size);
+	}
+}
+
+bool FileIndex::LookupDisk(const std::string& key, FileInfo& info)
+{
+	//Only once the budget has been hit, anything the index didn't have room for is still served
+	char diskPath[MAX_PATH];
+	if (key.empty() || IsUploadTemp(key) || rootPath.size() + key.size() + 2 > MAX_PATH)
+	{
+		return false;
+	}
+	GetDiskPath(key, diskPath, MAX_PATH);
+
+	WIN32_FIND_DATAA data;
+	HANDLE hFind = FindFirstFileA(diskPath, &data);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	FindClose(hFind);
+
+	FillInfo(data, info);
+	return true;
+}
+
+void FileIndex::SetMemoryBudget(size_t bytes)
+{
+	//Call before Build, 0 indexes everything
+	memoryBudget = bytes;
+}
+
+void FileIndex::SetMimeOverrides(const std::unordered_map<std::string, std::string>* overrides)
+{
+	//Call before Build, the map has to outlive the index
+	mimeOverrides = overrides;
+}
+
+bool FileIndex::IsOverBudget()
+{
+	std::shared_lock<std::shared_mutex> lock(indexMutex);
+	return overBudget;
+}
+
+void FileIndex::LinkToParent(const std::string& key, const char* name)
+{
+	size_t split = key.rfind('/');
+	std::string parent = split == std::string::npos ? "" : key.substr(0, split);
+
+	std::vector<std::string>& list = children[parent];
+	for (int i = 0; i < list.size(); i++)
+	{
+		if (!_stricmp(list[i].c_str(), name))
+		{
+			return;
+		}
+	}
+	list.push_back(name);
+}
+
+void FileIndex::UnlinkFromParent(const std::string& key)
+{
+	size_t split = key.rfind('/');
+	std::string parent = split == std::string::npos ? "" : key.substr(0, split);
+	const char* name = split == std::string::npos ? key.c_str() : key.c_str() + split + 1;
+
+	auto it = children.find(parent);
+	if (it == children.end())
+	{
+		return;
+	}
+
+	std::vector<std::string>& list = it->second;
+	for (int i = 0; i < list.size(); i++)
+	{
+		if (!_stricmp(list[i].c_str(), name))
+		{
+			list.erase(list.begin() + i);
+			return;
+		}
+	}
+}
+
+void FileIndex::RemoveEntry(const std::string& key)
+{
+	//Drop the entry and, if it was a directory, everything underneath it
+	RemoveTree(key);
+	UnlinkFromParent(key);
+}
+
+void FileIndex::RemoveTree(const std::string& key)
+{
+	//Found through the children lists, so removing a file costs the same however big the rest of the index is
+	auto entry = entries.find(key);
+	if (entry != entries.end())
+	{
+		size_t cost = sizeof(FileInfo) + key.size() * 2 + sizeof(void*) * 4;
+		indexedBytes = indexedBytes > cost ? indexedBytes - cost : 0;
+		entries.erase(entry);
+	}
+
+	auto list = children.find(key);
+	if (list == children.end())
+	{
+		return;
+	}
+
+	std::vector<std::string> names;
+	names.swap(list->second);
+	children.erase(list);
+
+	std::string childKey;
+	for (int i = 0; i < names.size(); i++)
+	{
+		NormalisePath(names[i].c_str(), childKey);
+		RemoveTree(key.empty() ? childKey : key + "/" + childKey);
+	}
+}
+
+void FileIndex::GetDiskPath(const std::string& key, char* buf, int size)
+{
+	sprintf_s(buf, size, "%s\\%s", rootPath.c_str(), key.c_str());
+}
+
+void FileIndex::RefreshEntry(const std::string& key)
+{
+	char diskPath[MAX_PATH];
+	if (rootPath.size() + key.size() + 2 > MAX_PATH)
+	{
+		return;
+	}
+	GetDiskPath(key, diskPath, MAX_PATH);
+
+	WIN32_FIND_DATAA data;
+	HANDLE hFind = FindFirstFileA(diskPath, &data);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		RemoveEntry(key);
+		return;
+	}
+	FindClose(hFind);
+
+	bool wasDirectory = false;
+	auto existing = entries.find(key);
+	if (existing != entries.end())
+	{
+		wasDirectory = existing->second.isDirectory;
+	}
+
+	if (!AddEntry(key, data))
+	{
+		return;
+	}
+	LinkToParent(key, data.cFileName);
+
+	if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !wasDirectory)
+	{
+		AddDirectory(key, diskPath);
+	}
+}
+
+bool FileIndex::StartWatching()
+{
+	if (watching || !stopEvent)
+	{
+		return false;
+	}
+
+	ResetEvent(stopEvent);
+	watching = true;
+	watchThread = std::thread(&FileIndex::WatchLoop, this);
+	return true;
+}
+
+void FileIndex::StopWatching()
+{
+	if (!watching)
+	{
+		return;
+	}
+
+	watching = false;
+	SetEvent(stopEvent);
+
+	if (watchThread.joinable())
+	{
+		watchThread.join();
+	}
+}
+
+void FileIndex::WatchLoop()
+{
+	//Windows equivalent of inotify, a single recursive watch on the root
+	HANDLE dir = CreateFileA(rootPath.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (dir == INVALID_HANDLE_VALUE)
+	{
+		watching = false;
+		return;
+	}
+
+	HANDLE changeEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	DWORD* watchBuf = (DWORD*)malloc(INDEX_WATCH_BUF_SIZE); //DWORD aligned as ReadDirectoryChangesW requires
+	const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+	while (watching && changeEvent && watchBuf)
+	{
+		OVERLAPPED overlapped = { 0 };
+		overlapped.hEvent = changeEvent;
+		ResetEvent(changeEvent);
+
+		if (!ReadDirectoryChangesW(dir, watchBuf, INDEX_WATCH_BUF_SIZE, TRUE, filter, NULL, &overlapped, NULL))
+		{
+			break;
+		}
+
+		HANDLE waitOn[2] = { changeEvent, stopEvent };
+		DWORD res = WaitForMultipleObjects(2, waitOn, FALSE, INFINITE);
+		if (res != WAIT_OBJECT_0)
+		{
+			DWORD cancelled = 0;
+			CancelIoEx(dir, &overlapped);
+			GetOverlappedResult(dir, &overlapped, &cancelled, TRUE);
+			break;
+		}
+
+		DWORD bytes = 0;
+		if (!GetOverlappedResult(dir, &overlapped, &bytes, FALSE))
+		{
+			break;
+		}
+
+		if (bytes == 0)
+		{
+			//Notification buffer overflowed, we've lost track so start over
+			Build(rootPath.c_str());
+			continue;
+		}
+
+		char* it = (char*)watchBuf;
+		while (true)
+		{
+			FILE_NOTIFY_INFORMATION* notify = (FILE_NOTIFY_INFORMATION*)it;
+			char relPath[MAX_PATH];
+			int len = WideCharToMultiByte(CP_ACP, 0, notify->FileName, notify->FileNameLength / sizeof(WCHAR), relPath, MAX_PATH - 1, NULL, NULL);
+			if (len > 0)
+			{
+				relPath[len] = 0;
+				OnChange(notify->Action, relPath);
+			}
+
+			if (!notify->NextEntryOffset)
+			{
+				break;
+			}
+			it += notify->NextEntryOffset;
+		}
+	}
+
+	if (watchBuf)
+	{
+		free(watchBuf);
+	}
+	if (changeEvent)
+	{
+		CloseHandle(changeEvent);
+	}
+	CloseHandle(dir);
+}
+
+void FileIndex::OnChange(DWORD action, const char* relPath)
+{
+	std::string key;
+	NormalisePath(relPath, key);
+	if (key.empty() || IsUploadTemp(key))
+	{
+		return;
+	}
+
+	std::unique_lock<std::shared_mutex> lock(indexMutex);
+
+	switch (action)
+	{
+		case FILE_ACTION_REMOVED:
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			RemoveEntry(key);
+			break;
+		case FILE_ACTION_ADDED:
+		case FILE_ACTION_MODIFIED:
+		case FILE_ACTION_RENAMED_NEW_NAME:
+			RefreshEntry(key);
+			break;
+	}
+}
+
+bool FileIndex::Lookup(const char* path, FileInfo& info)
+{
+	std::string key;
+	NormalisePath(path, key);
+
+	std::shared_lock<std::shared_mutex> lock(indexMutex);
+	auto it = entries.find(key);
+	if (it == entries.end())
+	{
+		return overBudget && LookupDisk(key, info);
+	}
+
+	info = it->second;
+	return true;
+}
+
+bool FileIndex::ListDirectory(const char* path, std::function<void(const char*, const FileInfo&)> callback)
+{
+	std::string key;
+	NormalisePath(path, key);
+
+	std::shared_lock<std::shared_mutex> lock(indexMutex);
+	auto dir = entries.find(key);
+	if (dir == entries.end() || !dir->second.isDirectory)
+	{
+		return false;
+	}
+
+	auto list = children.find(key);
+	if (list == children.end())
+	{
+		return true;
+	}
+
+	std::string childKey;
+	for (int i = 0; i < list->second.size(); i++)
+	{
+		NormalisePath(list->second[i].c_str(), childKey);
+		if (!key.empty())
+		{
+			childKey = key + "/" + childKey;
+		}
+
+		auto child = entries.find(childKey);
+		if (child != entries.end())
+		{
+			callback(list->second[i].c_str(), child->second);
+		}
+	}
+
+	return true;
+}
+
+size_t FileIndex::GetEntryCount()
+{
+	std::shared_lock<std::shared_mutex> lock(indexMutex);
+	return entries.size();
+}
+
+size_t FileIndex::GetMemoryUsage()
+{
+	//Approximate, counts node, key and child name storage plus the bucket arrays
+	std::shared_lock<std::shared_mutex> lock(indexMutex);
+
+	const size_t nodeOverhead = sizeof(void*) * 2;
+	size_t total = sizeof(*this);
+	total += entries.bucket_count() * sizeof(void*);
+	total += children.bucket_count() * sizeof(void*);
+
+	for (auto& entry : entries)
+	{
+		total += nodeOverhead + sizeof(entry) + entry.first.capacity();
+	}
+
+	for (auto& list : children)
+	{
+		total += nodeOverhead + sizeof(list) + list.first.capacity() + list.second.capacity() * sizeof(std::string);
+		for (int i = 0; i < list.second.size(); i++)
+		{
+			total += list.second[i].capacity();
+		}
+	}
+
+	return total;
+}
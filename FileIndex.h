@@ -0,0 +1,66 @@
+#pragma once
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <thread>
+#include <functional>
+#include <atomic>
+
+#define MAX_MIME_TYPE_LEN 50
+#define MAX_ETAG_LEN 40
+#define INDEX_WATCH_BUF_SIZE 65536
+
+struct FileInfo
+{
+	unsigned long long size = 0;
+	FILETIME lastWrite = { 0 };
+	bool isDirectory = false;
+	char mimeType[MAX_MIME_TYPE_LEN] = { 0 };
+	char etag[MAX_ETAG_LEN] = { 0 };
+};
+
+//In-memory view of the document root, so that lookups and 404s never touch the filesystem.
+//With a memory budget set, entries past it aren't indexed and a miss falls back to asking the disk.
+class FileIndex
+{
+public:
+	FileIndex();
+	~FileIndex();
+	bool Build(const char* root);
+	bool StartWatching();
+	void StopWatching();
+	bool Lookup(const char* path, FileInfo& info);
+	bool ListDirectory(const char* path, std::function<void(const char*, const FileInfo&)> callback);
+	size_t GetEntryCount();
+	size_t GetMemoryUsage();
+	void SetMemoryBudget(size_t bytes);
+	void SetMimeOverrides(const std::unordered_map<std::string, std::string>* overrides);
+	bool IsOverBudget();
+	static void NormalisePath(const char* path, std::string& out);
+private:
+	void AddDirectory(const std::string& key, const char* diskPath);
+	bool AddEntry(const std::string& key, const WIN32_FIND_DATAA& data);
+	void FillInfo(const WIN32_FIND_DATAA& data, FileInfo& info);
+	bool LookupDisk(const std::string& key, FileInfo& info);
+	void RemoveEntry(const std::string& key);
+	void RemoveTree(const std::string& key);
+	void RefreshEntry(const std::string& key);
+	void LinkToParent(const std::string& key, const char* name);
+	void UnlinkFromParent(const std::string& key);
+	void GetDiskPath(const std::string& key, char* buf, int size);
+	void WatchLoop();
+	void OnChange(DWORD action, const char* relPath);
+	std::string rootPath;
+	std::unordered_map<std::string, FileInfo> entries;
+	std::unordered_map<std::string, std::vector<std::string>> children;
+	std::shared_mutex indexMutex;
+	std::thread watchThread;
+	HANDLE stopEvent = NULL;
+	std::atomic<bool> watching{ false }; //Cleared by StopWatching, or the watch thread when the root can't be watched
+	size_t memoryBudget = 0;
+	size_t indexedBytes = 0; //Running estimate against memoryBudget
+	bool overBudget = false;
+	const std::unordered_map<std::string, std::string>* mimeOverrides = nullptr;
+};
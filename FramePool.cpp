@@ -0,0 +1,132 @@
+#include "FramePool.h"
+#include <Windows.h>
+#include <stdlib.h>
+#include <new>
+
+std::mutex FramePool::sharedMutex;
+std::vector<void*> FramePool::shared[FRAME_POOL_MAX_NODES][FRAME_POOL_CLASSES];
+
+static thread_local std::vector<void*> localFrames[FRAME_POOL_CLASSES];
+static thread_local int frameOsNode = -1; //-1 for threads that aren't on a node, their slabs come from malloc
+
+void FramePool::SetThreadNode(int osNode)
+{
+	frameOsNode = osNode >= 0 && osNode < FRAME_POOL_MAX_NODES ? osNode : -1;
+}
+
+void FramePool::Carve(int sizeClass, std::vector<void*>& local)
+{
+	//Slabs are never given back, frames only move between the free lists like the malloc'd ones did
+	size_t frameSize = (size_t)1 << (FRAME_POOL_MIN_SHIFT + sizeClass);
+	char* slab = nullptr;
+	if (frameOsNode >= 0)
+	{
+		slab = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL, FRAME_POOL_SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)frameOsNode);
+	}
+	if (!slab)
+	{
+		slab = (char*)malloc(FRAME_POOL_SLAB_SIZE);
+	}
+	if (!slab)
+	{
+		throw std::bad_alloc();
+	}
+
+	size_t count = FRAME_POOL_SLAB_SIZE / frameSize;
+	for (size_t i = 0; i < count; i++)
+	{
+		local.push_back(slab + i * frameSize);
+	}
+}
+
+int FramePool::ClassFor(size_t size)
+{
+	for (int i = 0; i < FRAME_POOL_CLASSES; i++)
+	{
+		if (size <= ((size_t)1 << (FRAME_POOL_MIN_SHIFT + i)))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+void* FramePool::Allocate(size_t size)
+{
+	int sizeClass = ClassFor(size);
+	if (sizeClass < 0)
+	{
+		//Bigger than anything we pool, shouldn't happen for our handlers
+		void* ptr = malloc(size);
+		if (!ptr)
+		{
+			throw std::bad_alloc();
+		}
+		return ptr;
+	}
+
+	std::vector<void*>& local = localFrames[sizeClass];
+	if (local.empty())
+	{
+		//Refill half a cache's worth at once so the shared lock is taken rarely
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		std::vector<void*>& pool = shared[frameOsNode >= 0 ? frameOsNode : 0][sizeClass];
+		while (!pool.empty() && local.size() < FRAME_POOL_LOCAL_MAX / 2)
+		{
+			local.push_back(pool.back());
+			pool.pop_back();
+		}
+	}
+
+	if (local.empty())
+	{
+		Carve(sizeClass, local);
+	}
+
+	void* ptr = local.back();
+	local.pop_back();
+	return ptr;
+}
+
+void FramePool::Free(void* ptr, size_t size)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	int sizeClass = ClassFor(size);
+	if (sizeClass < 0)
+	{
+		free(ptr);
+		return;
+	}
+
+	std::vector<void*>& local = localFrames[sizeClass];
+	local.push_back(ptr);
+
+	if (local.size() > FRAME_POOL_LOCAL_MAX)
+	{
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		while (local.size() > FRAME_POOL_LOCAL_MAX / 2)
+		{
+			shared[frameOsNode >= 0 ? frameOsNode : 0][sizeClass].push_back(local.back());
+			local.pop_back();
+		}
+	}
+}
+
+size_t FramePool::GetPooledBytes()
+{
+	//Shared lists only, per thread caches aren't visible from here
+	std::lock_guard<std::mutex> lock(sharedMutex);
+	size_t total = 0;
+	for (int node = 0; node < FRAME_POOL_MAX_NODES; node++)
+	{
+		for (int i = 0; i < FRAME_POOL_CLASSES; i++)
+		{
+			total += shared[node][i].size() * ((size_t)1 << (FRAME_POOL_MIN_SHIFT + i));
+		}
+	}
+	return total;
+}
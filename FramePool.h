@@ -0,0 +1,42 @@
+#pragma once
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+#define FRAME_POOL_CLASSES 6 //256, 512, 1K, 2K, 4K, 8K
+#define FRAME_POOL_MIN_SHIFT 8
+#define FRAME_POOL_LOCAL_MAX 64 //Per thread, per class, before frames are handed back to the shared list
+#define FRAME_POOL_MAX_NODES 16
+#define FRAME_POOL_SLAB_SIZE (64 * 1024) //New frames are carved from slabs allocated on the thread's node
+
+//Size classed free lists for coroutine frames, so suspending and resuming connections doesn't go through the global heap.
+//Frames are often freed on a different worker to the one that allocated them, so each thread keeps a small cache
+//and spills to a shared list when it grows past FRAME_POOL_LOCAL_MAX.
+//Shared lists are per NUMA node, so a worker only ever gets back frames that live in its own node's memory.
+class FramePool
+{
+public:
+	static void* Allocate(size_t size);
+	static void Free(void* ptr, size_t size);
+	static size_t GetPooledBytes();
+	static void SetThreadNode(int osNode);
+private:
+	static int ClassFor(size_t size);
+	static void Carve(int sizeClass, std::vector<void*>& local);
+	static std::mutex sharedMutex;
+	static std::vector<void*> shared[FRAME_POOL_MAX_NODES][FRAME_POOL_CLASSES];
+};
+
+//Give a promise_type pooled frames by inheriting from this
+struct PooledFrame
+{
+	static void* operator new(size_t size)
+	{
+		return FramePool::Allocate(size);
+	}
+
+	static void operator delete(void* ptr, size_t size)
+	{
+		FramePool::Free(ptr, size);
+	}
+};
@@ -0,0 +1,474 @@
+#include "Hpack.h"
+#include <string.h>
+
+struct StaticEntry
+{
+	const char* name;
+	const char* value;
+};
+
+static const StaticEntry staticTable[HPACK_STATIC_TABLE_SIZE] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+struct HuffmanCode
+{
+	unsigned int code;
+	unsigned char bits;
+};
+
+//RFC 7541 Appendix B, indexed by symbol
+static const HuffmanCode huffmanCodes[256] =
+{
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 }, { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 }, { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 }, { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 }, { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 }, { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 }, { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 }, { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 }, { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+};
+
+#define HUFFMAN_EOS_CODE 0x3fffffff
+#define HUFFMAN_EOS_BITS 30
+#define HUFFMAN_EOS_SYMBOL 256
+#define HUFFMAN_MAX_NODES 512
+
+const Huffman::Node* Huffman::GetTree()
+{
+	//Built once on first use, a binary tree walked a bit at a time
+	static Node tree[HUFFMAN_MAX_NODES];
+	static bool built = [&]()
+		{
+			int used = 1;
+			tree[0] = { { -1, -1 }, -1 };
+
+			for (int sym = 0; sym <= HUFFMAN_EOS_SYMBOL; sym++)
+			{
+				unsigned int code = sym == HUFFMAN_EOS_SYMBOL ? HUFFMAN_EOS_CODE : huffmanCodes[sym].code;
+				int bits = sym == HUFFMAN_EOS_SYMBOL ? HUFFMAN_EOS_BITS : huffmanCodes[sym].bits;
+
+				int node = 0;
+				for (int b = bits - 1; b >= 0; b--)
+				{
+					int bit = (code >> b) & 1;
+					if (tree[node].child[bit] < 0)
+					{
+						tree[used] = { { -1, -1 }, -1 };
+						tree[node].child[bit] = (short)used++;
+					}
+					node = tree[node].child[bit];
+				}
+				tree[node].symbol = (short)sym;
+			}
+			return true;
+		}();
+
+	return built ? tree : nullptr;
+}
+
+bool Huffman::Decode(const unsigned char* data, int len, std::string& out)
+{
+	const Node* tree = GetTree();
+	int node = 0;
+	int pendingBits = 0;
+	bool pendingAllOnes = true;
+
+	for (int i = 0; i < len; i++)
+	{
+		for (int b = 7; b >= 0; b--)
+		{
+			int bit = (data[i] >> b) & 1;
+			node = tree[node].child[bit];
+			if (node < 0)
+			{
+				return false;
+			}
+
+			++pendingBits;
+			pendingAllOnes = pendingAllOnes && bit;
+
+			if (tree[node].symbol >= 0)
+			{
+				if (tree[node].symbol == HUFFMAN_EOS_SYMBOL || out.size() >= HPACK_MAX_STRING_LEN)
+				{
+					return false;
+				}
+				out += (char)tree[node].symbol;
+				node = 0;
+				pendingBits = 0;
+				pendingAllOnes = true;
+			}
+		}
+	}
+
+	//Only up to 7 bits of EOS prefix are allowed as padding
+	return pendingBits <= 7 && pendingAllOnes;
+}
+
+void HpackDecoder::SetSettingsTableSize(unsigned int size)
+{
+	settingsTableSize = size;
+	if (maxTableSize > size)
+	{
+		maxTableSize = size;
+		EvictTo(maxTableSize);
+	}
+}
+
+bool HpackDecoder::DecodeInteger(const unsigned char*& it, const unsigned char* end, int prefixBits, unsigned int& value)
+{
+	if (it >= end)
+	{
+		return false;
+	}
+
+	unsigned int prefixMax = (1u << prefixBits) - 1;
+	value = *it & prefixMax;
+	++it;
+
+	if (value < prefixMax)
+	{
+		return true;
+	}
+
+	//Anything that doesn't fit in 32 bits is an error rather than wrapping round to something small
+	unsigned long long wide = value;
+	int shift = 0;
+	while (it < end)
+	{
+		unsigned char byte = *it++;
+		if (shift > 28)
+		{
+			return false;
+		}
+		wide += (unsigned long long)(byte & 0x7f) << shift;
+		if (wide > 0xffffffffULL)
+		{
+			return false;
+		}
+		value = (unsigned int)wide;
+		shift += 7;
+
+		if (!(byte & 0x80))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool HpackDecoder::DecodeString(const unsigned char*& it, const unsigned char* end, std::string& out)
+{
+	if (it >= end)
+	{
+		return false;
+	}
+
+	bool huffman = (*it & 0x80) != 0;
+	unsigned int len = 0;
+	if (!DecodeInteger(it, end, 7, len) || len > (unsigned int)(end - it) || len > HPACK_MAX_STRING_LEN)
+	{
+		return false;
+	}
+
+	out.clear();
+	if (huffman)
+	{
+		if (!Huffman::Decode(it, (int)len, out))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		out.assign((const char*)it, len);
+	}
+
+	it += len;
+	return true;
+}
+
+bool HpackDecoder::GetIndexed(unsigned int index, HpackHeader& header)
+{
+	if (index == 0)
+	{
+		return false;
+	}
+
+	if (index <= HPACK_STATIC_TABLE_SIZE)
+	{
+		header.name = staticTable[index - 1].name;
+		header.value = staticTable[index - 1].value;
+		return true;
+	}
+
+	index -= HPACK_STATIC_TABLE_SIZE + 1;
+	if (index >= dynamicTable.size())
+	{
+		return false;
+	}
+
+	header = dynamicTable[index];
+	return true;
+}
+
+void HpackDecoder::EvictTo(unsigned int size)
+{
+	while (tableSize > size && !dynamicTable.empty())
+	{
+		HpackHeader& oldest = dynamicTable.back();
+		tableSize -= (unsigned int)(oldest.name.size() + oldest.value.size() + HPACK_ENTRY_OVERHEAD);
+		dynamicTable.pop_back();
+	}
+}
+
+void HpackDecoder::AddToTable(const HpackHeader& header)
+{
+	unsigned int entrySize = (unsigned int)(header.name.size() + header.value.size() + HPACK_ENTRY_OVERHEAD);
+	if (entrySize > maxTableSize)
+	{
+		//Too big to ever fit, adding it just empties the table
+		EvictTo(0);
+		return;
+	}
+
+	EvictTo(maxTableSize - entrySize);
+	dynamicTable.push_front(header);
+	tableSize += entrySize;
+}
+
+void HpackDecoder::SetMaxListSize(unsigned int size)
+{
+	maxListSize = size;
+}
+
+bool HpackDecoder::Decode(const unsigned char* block, int len, std::vector<HpackHeader>& headers, bool* tooLarge)
+{
+	//Indexed fields can repeat a large table entry for every byte of the block, so the decoded size is checked as it grows, not the block's.
+	//Going over stops decoding part way, which leaves the dynamic table out of step with the peer's.
+	const unsigned char* it = block;
+	const unsigned char* end = block + len;
+	unsigned long long listSize = 0;
+	if (tooLarge)
+	{
+		*tooLarge = false;
+	}
+
+	while (it < end)
+	{
+		unsigned char first = *it;
+		HpackHeader header;
+		unsigned int index = 0;
+
+		if (first & 0x80)
+		{
+			//Indexed header field
+			if (!DecodeInteger(it, end, 7, index) || !GetIndexed(index, header))
+			{
+				return false;
+			}
+		}
+		else if ((first & 0xe0) == 0x20)
+		{
+			//Dynamic table size update
+			if (!DecodeInteger(it, end, 5, index) || index > settingsTableSize)
+			{
+				return false;
+			}
+			maxTableSize = index;
+			EvictTo(maxTableSize);
+			continue;
+		}
+		else
+		{
+			//Literal, with incremental indexing (01), without indexing (0000) or never indexed (0001)
+			bool addToTable = (first & 0xc0) == 0x40;
+			int prefixBits = addToTable ? 6 : 4;
+
+			if (!DecodeInteger(it, end, prefixBits, index))
+			{
+				return false;
+			}
+
+			if (index)
+			{
+				HpackHeader named;
+				if (!GetIndexed(index, named))
+				{
+					return false;
+				}
+				header.name = named.name;
+			}
+			else if (!DecodeString(it, end, header.name))
+			{
+				return false;
+			}
+
+			if (!DecodeString(it, end, header.value))
+			{
+				return false;
+			}
+
+			if (addToTable)
+			{
+				AddToTable(header);
+			}
+		}
+
+		listSize += header.name.size() + header.value.size() + HPACK_ENTRY_OVERHEAD;
+		if (maxListSize && listSize > maxListSize)
+		{
+			if (tooLarge)
+			{
+				*tooLarge = true;
+			}
+			return false;
+		}
+		headers.push_back(std::move(header));
+	}
+
+	return true;
+}
+
+void HpackEncoder::EncodeInteger(unsigned int value, int prefixBits, unsigned char firstByte, std::string& out)
+{
+	unsigned int prefixMax = (1u << prefixBits) - 1;
+	if (value < prefixMax)
+	{
+		out += (char)(firstByte | value);
+		return;
+	}
+
+	out += (char)(firstByte | prefixMax);
+	value -= prefixMax;
+	while (value >= 0x80)
+	{
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += (char)value;
+}
+
+void HpackEncoder::EncodeString(const char* str, std::string& out)
+{
+	unsigned int len = (unsigned int)strlen(str);
+	EncodeInteger(len, 7, 0x00, out);
+	out.append(str, len);
+}
+
+void HpackEncoder::Encode(const char* name, const char* value, std::string& out)
+{
+	int nameIndex = 0;
+	for (int i = 0; i < HPACK_STATIC_TABLE_SIZE; i++)
+	{
+		if (!strcmp(staticTable[i].name, name))
+		{
+			if (!strcmp(staticTable[i].value, value))
+			{
+				EncodeInteger(i + 1, 7, 0x80, out);
+				return;
+			}
+
+			if (!nameIndex)
+			{
+				nameIndex = i + 1;
+			}
+		}
+	}
+
+	//Literal without indexing
+	EncodeInteger(nameIndex, 4, 0x00, out);
+	if (!nameIndex)
+	{
+		EncodeString(name, out);
+	}
+	EncodeString(value, out);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_MAX_STRING_LEN 16384
+
+struct HpackHeader
+{
+	std::string name;
+	std::string value;
+};
+
+//RFC 7541 header compression. One decoder per connection as the dynamic table is connection state.
+class HpackDecoder
+{
+public:
+	bool Decode(const unsigned char* block, int len, std::vector<HpackHeader>& headers, bool* tooLarge = nullptr);
+	void SetSettingsTableSize(unsigned int size);
+	void SetMaxListSize(unsigned int size);
+private:
+	bool DecodeInteger(const unsigned char*& it, const unsigned char* end, int prefixBits, unsigned int& value);
+	bool DecodeString(const unsigned char*& it, const unsigned char* end, std::string& out);
+	bool GetIndexed(unsigned int index, HpackHeader& header);
+	void AddToTable(const HpackHeader& header);
+	void EvictTo(unsigned int size);
+	std::deque<HpackHeader> dynamicTable;
+	unsigned int tableSize = 0;
+	unsigned int maxTableSize = HPACK_DEFAULT_TABLE_SIZE;
+	unsigned int settingsTableSize = HPACK_DEFAULT_TABLE_SIZE;
+	unsigned int maxListSize = 0; //Name + value + 32 summed over a block, 0 for no limit
+};
+
+//Stateless encoder, uses the static table where it can and never adds to the peer's dynamic table
+class HpackEncoder
+{
+public:
+	static void Encode(const char* name, const char* value, std::string& out);
+private:
+	static void EncodeInteger(unsigned int value, int prefixBits, unsigned char firstByte, std::string& out);
+	static void EncodeString(const char* str, std::string& out);
+};
+
+class Huffman
+{
+public:
+	static bool Decode(const unsigned char* data, int len, std::string& out);
+private:
+	struct Node
+	{
+		short child[2];
+		short symbol;
+	};
+	static const Node* GetTree();
+};
@@ -0,0 +1,821 @@
+#include "Connection.h"
+#include "Http2.h"
+#include "RequestTarget.h"
+#include "FileCache.h"
+
+static unsigned int ReadUInt24(const unsigned char* p)
+{
+	return ((unsigned int)p[0] << 16) | ((unsigned int)p[1] << 8) | p[2];
+}
+
+static unsigned int ReadUInt32(const unsigned char* p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void WriteUInt32(char* p, unsigned int v)
+{
+	p[0] = (char)(v >> 24);
+	p[1] = (char)(v >> 16);
+	p[2] = (char)(v >> 8);
+	p[3] = (char)v;
+}
+
+Http2Session::Http2Session(Connection* conn)
+{
+	connection = conn;
+	readBuf.resize(H2_READ_BUF_SIZE);
+	frameBuf.resize(H2_FRAME_HEADER_LEN + H2_DEFAULT_FRAME_SIZE);
+	decoder.SetMaxListSize(H2_MAX_HEADER_LIST_SIZE);
+	lastActivity = std::chrono::steady_clock::now();
+}
+
+Http2Session::~Http2Session()
+{
+	while (!streams.empty())
+	{
+		CloseStream((int)streams.size() - 1);
+	}
+}
+
+bool Http2Session::DecodeBase64Url(const char* in, std::string& out)
+{
+	out.clear();
+	unsigned int acc = 0;
+	int bits = 0;
+
+	for (const char* it = in; *it && *it != '\r' && *it != '\n' && *it != ' '; ++it)
+	{
+		char c = *it;
+		int val = -1;
+		if (c >= 'A' && c <= 'Z') val = c - 'A';
+		else if (c >= 'a' && c <= 'z') val = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') val = c - '0' + 52;
+		else if (c == '-' || c == '+') val = 62;
+		else if (c == '_' || c == '/') val = 63;
+		else if (c == '=') break;
+		else return false;
+
+		acc = (acc << 6) | val;
+		bits += 6;
+		if (bits >= 8)
+		{
+			bits -= 8;
+			out += (char)((acc >> bits) & 0xff);
+		}
+	}
+
+	return true;
+}
+
+bool Http2Session::Upgrade(const char* settings, const char* target, int targetLen, bool headOnly)
+{
+	//HTTP2-Settings carries a SETTINGS payload, applied without an ACK as the 101 acknowledges it
+	std::string payload;
+	if (!settings || !DecodeBase64Url(settings, payload) || payload.size() % 6)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < payload.size(); i += 6)
+	{
+		const unsigned char* p = (const unsigned char*)payload.data() + i;
+		if (!ApplySetting((unsigned short)((p[0] << 8) | p[1]), ReadUInt32(p + 2)))
+		{
+			return false;
+		}
+	}
+
+	const char* switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	if (!connection->SendBuffer((char*)switching, &connection->socket))
+	{
+		return false;
+	}
+
+	SendSettings();
+
+	//The upgraded request becomes stream 1, already half closed from the client side
+	Response resp;
+	connection->ResolveGet(target, targetLen, resp);
+	lastStreamId = 1;
+	StartResponse(1, resp, headOnly);
+	return true;
+}
+
+void Http2Session::Run(const char* initial, int initialLen)
+{
+	if (!initial || initialLen > H2_READ_BUF_SIZE)
+	{
+		return;
+	}
+
+	if (lastStreamId == 0)
+	{
+		//Prior knowledge, our SETTINGS go first. The upgrade path has already sent them.
+		SendSettings();
+	}
+
+	memcpy(readBuf.data(), initial, initialLen);
+	readLen = initialLen;
+
+	while (connection->connected)
+	{
+		bool progress = false;
+
+		int got = connection->RecvSome(readBuf.data() + readLen, H2_READ_BUF_SIZE - readLen);
+		if (got == 0)
+		{
+			break;
+		}
+		else if (got > 0)
+		{
+			readLen += got;
+			progress = true;
+			lastActivity = std::chrono::steady_clock::now();
+		}
+
+		//Consume everything we have whole frames for
+		int pos = 0;
+		bool failed = false;
+
+		if (!prefaceReceived && readLen >= H2_PREFACE_LEN)
+		{
+			if (memcmp(readBuf.data(), H2_PREFACE, H2_PREFACE_LEN))
+			{
+				SendGoAway(H2_PROTOCOL_ERROR);
+				break;
+			}
+			prefaceReceived = true;
+			pos = H2_PREFACE_LEN;
+		}
+
+		while (prefaceReceived && readLen - pos >= H2_FRAME_HEADER_LEN)
+		{
+			const unsigned char* header = (const unsigned char*)readBuf.data() + pos;
+			unsigned int len = ReadUInt24(header);
+			if (len > H2_DEFAULT_FRAME_SIZE)
+			{
+				//We never raise SETTINGS_MAX_FRAME_SIZE above the default
+				SendGoAway(H2_FRAME_SIZE_ERROR);
+				failed = true;
+				break;
+			}
+
+			if (readLen - pos < (int)(H2_FRAME_HEADER_LEN + len))
+			{
+				break;
+			}
+
+			unsigned int streamId = ReadUInt32(header + 5) & 0x7fffffff;
+			if (!HandleFrame(header[3], header[4], streamId, header + H2_FRAME_HEADER_LEN, len))
+			{
+				failed = true;
+				break;
+			}
+			pos += H2_FRAME_HEADER_LEN + len;
+		}
+
+		if (failed)
+		{
+			break;
+		}
+
+		if (pos > 0)
+		{
+			memmove(readBuf.data(), readBuf.data() + pos, readLen - pos);
+			readLen -= pos;
+		}
+
+		if (PumpStreams())
+		{
+			progress = true;
+		}
+
+		if (goingAway && streams.empty())
+		{
+			break;
+		}
+
+		if (!progress)
+		{
+			auto idle = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - lastActivity).count();
+			if (streams.empty() && idle >= connection->KeepAliveTimeout())
+			{
+				SendGoAway(H2_NO_ERROR);
+				break;
+			}
+
+			//Sleep until the client sends something, every stream is waiting on it. Capped so shutdown and the idle timeout still get checked.
+			connection->tickMutex.unlock();
+			connection->WaitReady(false, H2_IDLE_WAIT_MS);
+			connection->tickMutex.lock();
+		}
+	}
+}
+
+bool Http2Session::HandleFrame(unsigned char type, unsigned char flags, unsigned int streamId, const unsigned char* payload, unsigned int len)
+{
+	if (continuationStream && (type != H2_CONTINUATION || streamId != continuationStream))
+	{
+		SendGoAway(H2_PROTOCOL_ERROR);
+		return false;
+	}
+
+	switch (type)
+	{
+		case H2_DATA:
+		{
+			if (!streamId)
+			{
+				SendGoAway(H2_PROTOCOL_ERROR);
+				return false;
+			}
+
+			//Request bodies are discarded, keep both windows open so the client isn't stalled
+			if (len)
+			{
+				SendWindowUpdate(0, len);
+				if (!(flags & H2_FLAG_END_STREAM))
+				{
+					SendWindowUpdate(streamId, len);
+				}
+			}
+			return true;
+		}
+		case H2_HEADERS:
+			return HandleHeaders(flags, streamId, payload, len);
+		case H2_CONTINUATION:
+		{
+			if (!continuationStream)
+			{
+				SendGoAway(H2_PROTOCOL_ERROR);
+				return false;
+			}
+
+			if (headerBlock.size() + len > H2_MAX_HEADER_LIST_SIZE)
+			{
+				//CONTINUATION frames without end, or just too much, are cut off before they can run us out of memory
+				SendGoAway(H2_ENHANCE_YOUR_CALM);
+				return false;
+			}
+
+			headerBlock.append((const char*)payload, len);
+			if (flags & H2_FLAG_END_HEADERS)
+			{
+				unsigned int id = continuationStream;
+				continuationStream = 0;
+				return DispatchRequest(id);
+			}
+			return true;
+		}
+		case H2_PRIORITY:
+		{
+			if (len != 5)
+			{
+				SendRstStream(streamId, H2_FRAME_SIZE_ERROR);
+			}
+			return true;
+		}
+		case H2_RST_STREAM:
+		{
+			if (!streamId || len != 4)
+			{
+				SendGoAway(len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+				return false;
+			}
+
+			for (int i = 0; i < streams.size(); i++)
+			{
+				if (streams[i].id == streamId)
+				{
+					CloseStream(i);
+					break;
+				}
+			}
+			return true;
+		}
+		case H2_SETTINGS:
+			return HandleSettings(flags, payload, len);
+		case H2_PUSH_PROMISE:
+		{
+			//Clients can't push
+			SendGoAway(H2_PROTOCOL_ERROR);
+			return false;
+		}
+		case H2_PING:
+		{
+			if (streamId || len != 8)
+			{
+				SendGoAway(len != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+				return false;
+			}
+
+			if (!(flags & H2_FLAG_ACK))
+			{
+				SendFrame(H2_PING, H2_FLAG_ACK, 0, (const char*)payload, 8);
+			}
+			return true;
+		}
+		case H2_GOAWAY:
+		{
+			goingAway = true;
+			return true;
+		}
+		case H2_WINDOW_UPDATE:
+			return HandleWindowUpdate(streamId, payload, len);
+		default:
+			//Unknown frame types must be ignored
+			return true;
+	}
+}
+
+bool Http2Session::HandleHeaders(unsigned char flags, unsigned int streamId, const unsigned char* payload, unsigned int len)
+{
+	if (!streamId || !(streamId & 1) || streamId <= lastStreamId)
+	{
+		SendGoAway(H2_PROTOCOL_ERROR);
+		return false;
+	}
+	lastStreamId = streamId;
+
+	unsigned int padLen = 0;
+	if (flags & H2_FLAG_PADDED)
+	{
+		if (len < 1)
+		{
+			SendGoAway(H2_PROTOCOL_ERROR);
+			return false;
+		}
+		padLen = payload[0];
+		++payload;
+		--len;
+	}
+
+	if (flags & H2_FLAG_PRIORITY)
+	{
+		if (len < 5)
+		{
+			SendGoAway(H2_PROTOCOL_ERROR);
+			return false;
+		}
+		payload += 5;
+		len -= 5;
+	}
+
+	if (padLen > len)
+	{
+		SendGoAway(H2_PROTOCOL_ERROR);
+		return false;
+	}
+
+	if (len - padLen > H2_MAX_HEADER_LIST_SIZE)
+	{
+		SendGoAway(H2_ENHANCE_YOUR_CALM);
+		return false;
+	}
+
+	headerBlock.assign((const char*)payload, len - padLen);
+
+	if (!(flags & H2_FLAG_END_HEADERS))
+	{
+		continuationStream = streamId;
+		return true;
+	}
+
+	return DispatchRequest(streamId);
+}
+
+bool Http2Session::DispatchRequest(unsigned int streamId)
+{
+	std::vector<HpackHeader> headers;
+	bool tooLarge = false;
+	if (!decoder.Decode((const unsigned char*)headerBlock.data(), (int)headerBlock.size(), headers, &tooLarge))
+	{
+		//The dynamic table is now out of sync with the client, nothing more can be decoded
+		SendGoAway(tooLarge ? H2_ENHANCE_YOUR_CALM : H2_COMPRESSION_ERROR);
+		return false;
+	}
+	headerBlock.clear();
+
+	if (goingAway)
+	{
+		SendRstStream(streamId, H2_REFUSED_STREAM);
+		return true;
+	}
+
+	if (streams.size() >= H2_MAX_CONCURRENT_STREAMS)
+	{
+		SendRstStream(streamId, H2_REFUSED_STREAM);
+		return true;
+	}
+
+	const std::string* method = nullptr;
+	const std::string* path = nullptr;
+	const std::string* authority = nullptr;
+	for (int i = 0; i < headers.size(); i++)
+	{
+		if (headers[i].name == ":method")
+		{
+			method = &headers[i].value;
+		}
+		else if (headers[i].name == ":path")
+		{
+			path = &headers[i].value;
+		}
+		else if (headers[i].name == ":authority" || (headers[i].name == "host" && !authority))
+		{
+			authority = &headers[i].value;
+		}
+	}
+
+	if (!method || !path)
+	{
+		SendRstStream(streamId, H2_PROTOCOL_ERROR);
+		return true;
+	}
+
+	Response resp;
+	bool headOnly = *method == "HEAD";
+	VirtualHost* vhost = connection->SelectHost(authority ? authority->c_str() : nullptr, authority ? (int)authority->size() : 0);
+	if (connection->admission && !connection->admission->Admit())
+	{
+		resp.code = ResponseCodes::SERVICE_UNAVAILABLE;
+		resp.retryAfter = OVERLOAD_RETRY_AFTER;
+	}
+	else if (connection->rateLimiter && !connection->rateLimiter->TryRequest(connection->Info.sin_addr.s_addr, resp.retryAfter))
+	{
+		resp.code = ResponseCodes::TOO_MANY_REQUESTS;
+	}
+	else if (vhost && !vhost->TryRequest(resp.retryAfter))
+	{
+		resp.code = ResponseCodes::TOO_MANY_REQUESTS;
+	}
+	else
+	{
+		//Proxied prefixes and request bodies are HTTP/1.1 only for now
+		RoutedRequest routed;
+		if (!connection->RouteRequest(Router::ParseMethod(method->c_str(), (int)method->size()), path->c_str(), (int)path->size(), resp, false, routed))
+		{
+			resp.code = ResponseCodes::NOT_IMPLEMENTED;
+		}
+	}
+
+	StartResponse(streamId, resp, headOnly);
+	return true;
+}
+
+void Http2Session::StartResponse(unsigned int streamId, Response& resp, bool headOnly)
+{
+	CachedFile* file = nullptr;
+	FileCache* cache = connection->fileCache;
+	if (resp.filePath[0] && resp.bodyLen > 0 && !headOnly)
+	{
+		//Opened before the headers go, so a file that's vanished since the lookup is still a plain 404
+		file = cache->Acquire(resp.filePath, resp.bodyLen);
+		if (!file)
+		{
+			resp.code = ResponseCodes::NOT_FOUND;
+			resp.bodyLen = 0;
+			resp.contentType[0] = 0;
+			resp.etag[0] = 0;
+		}
+	}
+
+	char numBuf[32];
+	std::string block;
+
+	sprintf_s(numBuf, "%i", (int)resp.code);
+	HpackEncoder::Encode(":status", numBuf, block);
+
+	char serverBuf[64];
+	sprintf_s(serverBuf, "%s/%i.%i", SERVER_NAME, SERVER_MAJOR, SERVER_MINOR);
+	HpackEncoder::Encode("server", serverBuf, block);
+
+	HpackEncoder::Encode("content-type", resp.contentType[0] ? resp.contentType : "text/html", block);
+
+	sprintf_s(numBuf, "%lld", resp.bodyLen);
+	HpackEncoder::Encode("content-length", numBuf, block);
+
+	if (resp.etag[0])
+	{
+		HpackEncoder::Encode("etag", resp.etag, block);
+	}
+
+	if (resp.location && resp.location[0])
+	{
+		HpackEncoder::Encode("location", resp.location, block);
+	}
+
+	if (resp.retryAfter)
+	{
+		sprintf_s(numBuf, "%i", resp.retryAfter);
+		HpackEncoder::Encode("retry-after", numBuf, block);
+	}
+
+	bool hasBody = (resp.body || resp.mappedBody || file) && resp.bodyLen > 0 && !headOnly;
+	int sendClass = SendScheduler::Classify(hasBody ? resp.bodyLen : 0, resp.contentType);
+	if (connection->sends)
+	{
+		connection->sends->Begin(&connection->sendFlow, sendClass);
+	}
+	SendFrame(H2_HEADERS, H2_FLAG_END_HEADERS | (hasBody ? 0 : H2_FLAG_END_STREAM), streamId, block.data(), (unsigned int)block.size());
+
+	if (!hasBody)
+	{
+		if (resp.body)
+		{
+			free(resp.body);
+		}
+		resp.body = nullptr;
+		SitePack::Release(resp.pack);
+		resp.pack = nullptr;
+		return;
+	}
+
+	Stream stream;
+	stream.id = streamId;
+	stream.sendWindow = peerInitialWindow;
+	stream.body = resp.body ? resp.body : resp.mappedBody;
+	stream.ownsBody = resp.body != nullptr;
+	stream.pack = resp.pack;
+	resp.pack = nullptr;
+	stream.file = file;
+	stream.cache = cache;
+	stream.bodyLen = resp.bodyLen;
+	stream.sendClass = sendClass;
+	resp.body = nullptr;
+	streams.push_back(stream);
+}
+
+bool Http2Session::PumpStreams()
+{
+	//Round robin, one frame per stream per pass, so a large download can't hold up a small one
+	bool sentAny = false;
+	int count = (int)streams.size();
+
+	for (int n = 0; n < count && !streams.empty(); n++)
+	{
+		if (nextStream >= streams.size())
+		{
+			nextStream = 0;
+		}
+
+		Stream& stream = streams[nextStream];
+		long long allowed = stream.bodyLen - stream.sent;
+		allowed = allowed < peerMaxFrameSize ? allowed : peerMaxFrameSize;
+		allowed = allowed < H2_DEFAULT_FRAME_SIZE ? allowed : H2_DEFAULT_FRAME_SIZE;
+		allowed = allowed < stream.sendWindow ? allowed : stream.sendWindow;
+		allowed = allowed < connSendWindow ? allowed : connSendWindow;
+
+		if (allowed <= 0)
+		{
+			++nextStream;
+			continue;
+		}
+
+		const char* payload = stream.body ? stream.body + stream.sent : nullptr;
+		if (stream.file)
+		{
+			//Straight into the frame buffer behind the header, SendFrame sees it's already in place
+			payload = frameBuf.data() + H2_FRAME_HEADER_LEN;
+			DWORD read = 0;
+			if (!FileCache::ReadAt(stream.file, stream.sent, (char*)payload, (DWORD)allowed, read) || read == 0)
+			{
+				//Shrank underneath us, the content-length already sent can't be met
+				SendRstStream(stream.id, H2_INTERNAL_ERROR);
+				CloseStream(nextStream);
+				continue;
+			}
+			allowed = read;
+		}
+
+		bool last = stream.sent + allowed >= stream.bodyLen;
+		if (connection->sends)
+		{
+			//Streams share the connection's flow, each frame goes at the weight of the response it belongs to
+			connection->sends->Begin(&connection->sendFlow, stream.sendClass);
+		}
+		if (!SendFrame(H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream.id, payload, (unsigned int)allowed))
+		{
+			return sentAny;
+		}
+
+		stream.sent += allowed;
+		stream.sendWindow -= allowed;
+		connSendWindow -= allowed;
+		sentAny = true;
+
+		if (last)
+		{
+			CloseStream(nextStream);
+		}
+		else
+		{
+			++nextStream;
+		}
+	}
+
+	if (streams.empty() && connection->sends)
+	{
+		//Nothing left to send, stop holding a place in the round until the next response
+		connection->sends->Done(&connection->sendFlow);
+	}
+	return sentAny;
+}
+
+void Http2Session::CloseStream(int index)
+{
+	Stream& stream = streams[index];
+	if (stream.body && stream.ownsBody)
+	{
+		free((char*)stream.body);
+	}
+	if (stream.file)
+	{
+		stream.cache->Release(stream.file);
+	}
+	SitePack::Release(stream.pack);
+	streams.erase(streams.begin() + index);
+}
+
+bool Http2Session::HandleSettings(unsigned char flags, const unsigned char* payload, unsigned int len)
+{
+	if (flags & H2_FLAG_ACK)
+	{
+		return true;
+	}
+
+	if (len % 6)
+	{
+		SendGoAway(H2_FRAME_SIZE_ERROR);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < len; i += 6)
+	{
+		if (!ApplySetting((unsigned short)((payload[i] << 8) | payload[i + 1]), ReadUInt32(payload + i + 2)))
+		{
+			return false;
+		}
+	}
+
+	SendFrame(H2_SETTINGS, H2_FLAG_ACK, 0, nullptr, 0);
+	return true;
+}
+
+bool Http2Session::ApplySetting(unsigned short id, unsigned int value)
+{
+	switch (id)
+	{
+		case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+		{
+			if (value > H2_MAX_WINDOW)
+			{
+				SendGoAway(H2_FLOW_CONTROL_ERROR);
+				return false;
+			}
+
+			//Applies retroactively to every open stream
+			long long delta = (long long)value - peerInitialWindow;
+			for (int i = 0; i < streams.size(); i++)
+			{
+				streams[i].sendWindow += delta;
+			}
+			peerInitialWindow = value;
+			break;
+		}
+		case H2_SETTINGS_MAX_FRAME_SIZE:
+		{
+			if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE)
+			{
+				SendGoAway(H2_PROTOCOL_ERROR);
+				return false;
+			}
+			peerMaxFrameSize = value;
+			break;
+		}
+		case H2_SETTINGS_ENABLE_PUSH:
+		{
+			if (value > 1)
+			{
+				SendGoAway(H2_PROTOCOL_ERROR);
+				return false;
+			}
+			break;
+		}
+		default:
+			//Header table size only matters to an encoder that indexes, ours doesn't
+			break;
+	}
+
+	return true;
+}
+
+bool Http2Session::HandleWindowUpdate(unsigned int streamId, const unsigned char* payload, unsigned int len)
+{
+	if (len != 4)
+	{
+		SendGoAway(H2_FRAME_SIZE_ERROR);
+		return false;
+	}
+
+	unsigned int increment = ReadUInt32(payload) & 0x7fffffff;
+	if (!increment)
+	{
+		if (!streamId)
+		{
+			SendGoAway(H2_PROTOCOL_ERROR);
+			return false;
+		}
+		SendRstStream(streamId, H2_PROTOCOL_ERROR);
+		return true;
+	}
+
+	if (!streamId)
+	{
+		connSendWindow += increment;
+		if (connSendWindow > H2_MAX_WINDOW)
+		{
+			SendGoAway(H2_FLOW_CONTROL_ERROR);
+			return false;
+		}
+		return true;
+	}
+
+	for (int i = 0; i < streams.size(); i++)
+	{
+		if (streams[i].id == streamId)
+		{
+			streams[i].sendWindow += increment;
+			if (streams[i].sendWindow > H2_MAX_WINDOW)
+			{
+				SendRstStream(streamId, H2_FLOW_CONTROL_ERROR);
+				CloseStream(i);
+			}
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool Http2Session::SendFrame(unsigned char type, unsigned char flags, unsigned int streamId, const char* payload, unsigned int len)
+{
+	if (len > H2_DEFAULT_FRAME_SIZE)
+	{
+		return false;
+	}
+
+	char* frame = frameBuf.data();
+	frame[0] = (char)(len >> 16);
+	frame[1] = (char)(len >> 8);
+	frame[2] = (char)len;
+	frame[3] = (char)type;
+	frame[4] = (char)flags;
+	WriteUInt32(&frame[5], streamId & 0x7fffffff);
+
+	if (len && payload != &frame[H2_FRAME_HEADER_LEN])
+	{
+		memcpy(&frame[H2_FRAME_HEADER_LEN], payload, len);
+	}
+
+	return connection->SendBuffer(frame, &connection->socket, H2_FRAME_HEADER_LEN + len);
+}
+
+void Http2Session::SendSettings()
+{
+	char payload[18];
+	payload[0] = 0;
+	payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	WriteUInt32(&payload[2], H2_MAX_CONCURRENT_STREAMS);
+	payload[6] = 0;
+	payload[7] = H2_SETTINGS_ENABLE_PUSH;
+	WriteUInt32(&payload[8], 0);
+	payload[12] = 0;
+	payload[13] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+	WriteUInt32(&payload[14], H2_MAX_HEADER_LIST_SIZE);
+	SendFrame(H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+void Http2Session::SendGoAway(H2Error err)
+{
+	char payload[8];
+	WriteUInt32(&payload[0], lastStreamId);
+	WriteUInt32(&payload[4], err);
+	SendFrame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+	goingAway = true;
+}
+
+void Http2Session::SendRstStream(unsigned int streamId, H2Error err)
+{
+	char payload[4];
+	WriteUInt32(&payload[0], err);
+	SendFrame(H2_RST_STREAM, 0, streamId, payload, sizeof(payload));
+}
+
+void Http2Session::SendWindowUpdate(unsigned int streamId, unsigned int increment)
+{
+	char payload[4];
+	WriteUInt32(&payload[0], increment & 0x7fffffff);
+	SendFrame(H2_WINDOW_UPDATE, 0, streamId, payload, sizeof(payload));
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <chrono>
+#include "Hpack.h"
+#include "SendScheduler.h"
+
+class FileCache;
+struct CachedFile;
+struct PackView;
+
+class Connection;
+struct Response;
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_FRAME_SIZE 16777215
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 2147483647
+#define H2_MAX_CONCURRENT_STREAMS 100
+#define H2_MAX_HEADER_LIST_SIZE 65536 //Advertised, and the most a header block may take across HEADERS and CONTINUATION frames
+#define H2_READ_BUF_SIZE (H2_FRAME_HEADER_LEN + H2_DEFAULT_FRAME_SIZE + 4096)
+#define H2_IDLE_WAIT_MS 1000 //Longest an idle session blocks waiting on the client before checking timeouts
+
+enum H2FrameType
+{
+	H2_DATA = 0x0,
+	H2_HEADERS = 0x1,
+	H2_PRIORITY = 0x2,
+	H2_RST_STREAM = 0x3,
+	H2_SETTINGS = 0x4,
+	H2_PUSH_PROMISE = 0x5,
+	H2_PING = 0x6,
+	H2_GOAWAY = 0x7,
+	H2_WINDOW_UPDATE = 0x8,
+	H2_CONTINUATION = 0x9
+};
+
+enum H2Flags
+{
+	H2_FLAG_END_STREAM = 0x1,
+	H2_FLAG_ACK = 0x1,
+	H2_FLAG_END_HEADERS = 0x4,
+	H2_FLAG_PADDED = 0x8,
+	H2_FLAG_PRIORITY = 0x20
+};
+
+enum H2Settings
+{
+	H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	H2_SETTINGS_ENABLE_PUSH = 0x2,
+	H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+	H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum H2Error
+{
+	H2_NO_ERROR = 0x0,
+	H2_PROTOCOL_ERROR = 0x1,
+	H2_INTERNAL_ERROR = 0x2,
+	H2_FLOW_CONTROL_ERROR = 0x3,
+	H2_STREAM_CLOSED = 0x5,
+	H2_FRAME_SIZE_ERROR = 0x6,
+	H2_REFUSED_STREAM = 0x7,
+	H2_COMPRESSION_ERROR = 0x9,
+	H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+//One HTTP/2 connection, entered either with prior knowledge (h2c preface) or from an HTTP/1.1 Upgrade.
+//Responses are multiplexed by sending one DATA frame per stream per pass, subject to flow control.
+//Files are read out of the file cache a frame at a time, the same way HTTP/1.1 streams them, so no stream holds a whole file.
+class Http2Session
+{
+public:
+	Http2Session(Connection* conn);
+	~Http2Session();
+	void Run(const char* initial, int initialLen);
+	bool Upgrade(const char* settings, const char* target, int targetLen, bool headOnly);
+private:
+	struct Stream
+	{
+		unsigned int id = 0;
+		long long sendWindow = H2_DEFAULT_WINDOW;
+		const char* body = nullptr;
+		bool ownsBody = true; //False when it points into the site pack
+		PackView* pack = nullptr; //The pack it points into, kept mapped until the stream closes
+		CachedFile* file = nullptr; //Set instead of body for files, read a frame at a time
+		FileCache* cache = nullptr; //The one file came from, which depends on the host
+		long long bodyLen = 0;
+		long long sent = 0;
+		int sendClass = SEND_NORMAL; //Picked from the response, the connection's flow takes it before each of this stream's frames
+	};
+	bool HandleFrame(unsigned char type, unsigned char flags, unsigned int streamId, const unsigned char* payload, unsigned int len);
+	bool HandleHeaders(unsigned char flags, unsigned int streamId, const unsigned char* payload, unsigned int len);
+	bool HandleSettings(unsigned char flags, const unsigned char* payload, unsigned int len);
+	bool HandleWindowUpdate(unsigned int streamId, const unsigned char* payload, unsigned int len);
+	bool ApplySetting(unsigned short id, unsigned int value);
+	bool DispatchRequest(unsigned int streamId);
+	void StartResponse(unsigned int streamId, Response& resp, bool headOnly);
+	bool PumpStreams();
+	void CloseStream(int index);
+	bool SendFrame(unsigned char type, unsigned char flags, unsigned int streamId, const char* payload, unsigned int len);
+	void SendSettings();
+	void SendGoAway(H2Error err);
+	void SendRstStream(unsigned int streamId, H2Error err);
+	void SendWindowUpdate(unsigned int streamId, unsigned int increment);
+	static bool DecodeBase64Url(const char* in, std::string& out);
+	Connection* connection;
+	HpackDecoder decoder;
+	std::vector<Stream> streams;
+	std::vector<char> readBuf;
+	std::vector<char> frameBuf;
+	std::string headerBlock;
+	int readLen = 0;
+	int nextStream = 0;
+	bool prefaceReceived = false;
+	bool goingAway = false;
+	unsigned int lastStreamId = 0;
+	unsigned int continuationStream = 0;
+	long long connSendWindow = H2_DEFAULT_WINDOW;
+	unsigned int peerInitialWindow = H2_DEFAULT_WINDOW;
+	unsigned int peerMaxFrameSize = H2_DEFAULT_FRAME_SIZE;
+	std::chrono::steady_clock::time_point lastActivity;
+};
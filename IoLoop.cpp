@@ -0,0 +1,452 @@
+#include "IoLoop.h"
+#include "FramePool.h"
+#include "RequestArena.h"
+#include <ws2tcpip.h>
+#include <algorithm>
+
+static thread_local int ioCurrentNode = -1; //Set on worker threads only
+
+static bool TimerLater(const IoTimer& a, const IoTimer& b)
+{
+	return a.when > b.when;
+}
+
+void IoLoop::SocketAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	wait.handle = handle;
+	wait.node = CurrentNode();
+	{
+		std::lock_guard<std::mutex> lock(loop->waitMutex);
+		loop->waits.push_back(&wait);
+	}
+	//May already be running again on another worker, so nothing below here touches the awaiter
+	loop->Wake();
+}
+
+void IoLoop::TimerAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	{
+		std::lock_guard<std::mutex> lock(loop->waitMutex);
+		loop->timers.push_back({ when, handle, CurrentNode() });
+		std::push_heap(loop->timers.begin(), loop->timers.end(), TimerLater);
+	}
+	loop->Wake();
+}
+
+void IoLoop::BlockingAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	IoLoop* owner = loop;
+	int node = CurrentNode();
+	{
+		std::lock_guard<std::mutex> lock(owner->blockingMutex);
+		++owner->blockingCount;
+	}
+
+	std::thread([owner, handle, node, fn = std::move(fn)]
+		{
+			fn();
+			owner->Post(handle, node);
+
+			//Notified under the lock, once it's released the loop may be gone
+			std::lock_guard<std::mutex> lock(owner->blockingMutex);
+			--owner->blockingCount;
+			owner->blockingCv.notify_all();
+		}).detach();
+}
+
+IoLoop::IoLoop()
+{
+}
+
+IoLoop::~IoLoop()
+{
+	Stop();
+}
+
+bool IoLoop::Start(int workerCount, bool pinThreads)
+{
+	//Loopback UDP socket the poller always watches, a byte sent to it interrupts WSAPoll when there's new work
+	wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (wakeSocket == INVALID_SOCKET)
+	{
+		return false;
+	}
+
+	memset(&wakeAddr, 0, sizeof(wakeAddr));
+	wakeAddr.sin_family = AF_INET;
+	wakeAddr.sin_port = 0;
+	inet_pton(AF_INET, "127.0.0.1", &wakeAddr.sin_addr);
+
+	int addrLen = sizeof(wakeAddr);
+	if (bind(wakeSocket, (SOCKADDR*)&wakeAddr, sizeof(wakeAddr)) == SOCKET_ERROR || getsockname(wakeSocket, (SOCKADDR*)&wakeAddr, &addrLen) == SOCKET_ERROR)
+	{
+		closesocket(wakeSocket);
+		wakeSocket = INVALID_SOCKET;
+		return false;
+	}
+
+	u_long nonBlock = 1;
+	ioctlsocket(wakeSocket, FIONBIO, &nonBlock);
+
+	if (workerCount < 1)
+	{
+		workerCount = 1;
+	}
+	else if (workerCount > IO_LOOP_MAX_WORKERS)
+	{
+		workerCount = IO_LOOP_MAX_WORKERS;
+	}
+
+	//Workers are spread over the nodes a core at a time, the poller takes the first core when pinning
+	topology.Detect();
+	std::vector<CpuSlot> order = topology.GetInterleaved();
+	int nodeCount = topology.GetNodeCount();
+	pinned = pinThreads;
+
+	runQueues.clear();
+	std::vector<bool> hasWorkers(nodeCount, false);
+	for (int i = 0; i < nodeCount; i++)
+	{
+		runQueues.push_back(std::make_unique<RunQueue>());
+	}
+
+	std::vector<CpuSlot> workerCpus;
+	for (int i = 0; i < workerCount; i++)
+	{
+		CpuSlot cpu = order[(i + (pinThreads ? 1 : 0)) % order.size()];
+		workerCpus.push_back(cpu);
+		hasWorkers[cpu.node] = true;
+	}
+
+	queueFor.assign(nodeCount, 0);
+	int spare = 0;
+	for (int i = 0; i < nodeCount; i++)
+	{
+		if (hasWorkers[i])
+		{
+			queueFor[i] = i;
+			continue;
+		}
+
+		//Fewer workers than nodes, hand this node's work to one that has some
+		while (!hasWorkers[spare % nodeCount])
+		{
+			++spare;
+		}
+		queueFor[i] = spare++ % nodeCount;
+	}
+
+	running = true;
+	pollThread = std::thread(&IoLoop::PollLoop, this, order[0]);
+	for (int i = 0; i < workerCount; i++)
+	{
+		workers.push_back(std::thread(&IoLoop::WorkerLoop, this, workerCpus[i].node, workerCpus[i]));
+	}
+	return true;
+}
+
+void IoLoop::Stop()
+{
+	if (!running)
+	{
+		return;
+	}
+
+	running = false;
+	for (int i = 0; i < runQueues.size(); i++)
+	{
+		std::lock_guard<std::mutex> lock(runQueues[i]->mutex);
+		runQueues[i]->cv.notify_all();
+	}
+	Wake();
+
+	if (pollThread.joinable())
+	{
+		pollThread.join();
+	}
+	for (int i = 0; i < workers.size(); i++)
+	{
+		if (workers[i].joinable())
+		{
+			workers[i].join();
+		}
+	}
+	workers.clear();
+
+	//Anything still parked belongs to a connection, which destroys its own coroutine when it's deleted
+	std::lock_guard<std::mutex> waitLock(waitMutex);
+	waits.clear();
+	timers.clear();
+	for (int i = 0; i < runQueues.size(); i++)
+	{
+		std::lock_guard<std::mutex> runLock(runQueues[i]->mutex);
+		runQueues[i]->handles.clear();
+	}
+
+	closesocket(wakeSocket);
+	wakeSocket = INVALID_SOCKET;
+}
+
+bool IoLoop::IsRunning()
+{
+	return running;
+}
+
+void IoLoop::Post(std::coroutine_handle<> handle, int node)
+{
+	//node -1 keeps it where it's running now, or node 0 from outside the workers
+	if (!running || runQueues.empty())
+	{
+		return;
+	}
+
+	if (node < 0)
+	{
+		node = CurrentNode();
+	}
+
+	RunQueue& queue = *runQueues[queueFor[node < queueFor.size() ? node : 0]];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.handles.push_back(handle);
+	}
+	queue.cv.notify_one();
+}
+
+int IoLoop::CurrentNode()
+{
+	return ioCurrentNode >= 0 ? ioCurrentNode : 0;
+}
+
+int IoLoop::GetSocketNode(SOCKET socket)
+{
+	//Where RSS steers this connection's packets, -1 to leave it to whoever posts it
+	int osNode = CpuTopology::GetSocketNode(socket);
+	return osNode >= 0 ? topology.NodeIndex(osNode) : -1;
+}
+
+int IoLoop::GetNodeCount()
+{
+	return (int)runQueues.size();
+}
+
+int IoLoop::GetWorkerCount()
+{
+	return (int)workers.size();
+}
+
+IoLoop::SocketAwaiter IoLoop::WaitSocket(SOCKET socket, bool write, IoTime deadline)
+{
+	SocketAwaiter awaiter;
+	awaiter.loop = this;
+	awaiter.wait.socket = socket;
+	awaiter.wait.write = write;
+	awaiter.wait.deadline = deadline;
+	return awaiter;
+}
+
+void IoLoop::Expire(SOCKET socket)
+{
+	//Ends any wait on socket as though its deadline had passed, the waiter resumes with false
+	{
+		std::lock_guard<std::mutex> lock(waitMutex);
+		for (int i = 0; i < waits.size(); i++)
+		{
+			if (waits[i]->socket == socket)
+			{
+				waits[i]->deadline = IoTime::min();
+			}
+		}
+	}
+	Wake();
+}
+
+IoLoop::TimerAwaiter IoLoop::SleepUntil(IoTime when)
+{
+	return { this, when };
+}
+
+IoLoop::BlockingAwaiter IoLoop::RunBlocking(std::function<void()> fn)
+{
+	return { this, std::move(fn) };
+}
+
+void IoLoop::WaitBlocking()
+{
+	//Returns once every RunBlocking thread has finished. Call after Stop, with whatever they block on (sockets) already shut,
+	//so their connections can be freed without one of them still inside.
+	std::unique_lock<std::mutex> lock(blockingMutex);
+	blockingCv.wait(lock, [this] { return blockingCount == 0; });
+}
+
+size_t IoLoop::GetParkedCount()
+{
+	std::lock_guard<std::mutex> lock(waitMutex);
+	return waits.size() + timers.size();
+}
+
+void IoLoop::Wake()
+{
+	if (wakeSocket != INVALID_SOCKET && !wakePending.exchange(true))
+	{
+		char b = 0;
+		sendto(wakeSocket, &b, 1, 0, (SOCKADDR*)&wakeAddr, sizeof(wakeAddr));
+	}
+}
+
+void IoLoop::WorkerLoop(int node, CpuSlot cpu)
+{
+	//One core when pinning, otherwise anywhere on the node so the scheduler still has some room
+	GROUP_AFFINITY nodeMask;
+	if (pinned)
+	{
+		CpuTopology::PinCurrentThread(cpu);
+	}
+	else if (topology.GetNodeCount() > 1 && topology.GetNodeMask(node, nodeMask))
+	{
+		CpuTopology::PinCurrentThreadToNode(nodeMask);
+	}
+
+	ioCurrentNode = node;
+	FramePool::SetThreadNode(topology.OsNode(node));
+	RequestArena::SetThreadNode(topology.OsNode(node));
+	RunQueue& queue = *runQueues[node];
+
+	while (running)
+	{
+		std::coroutine_handle<> handle;
+		{
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			queue.cv.wait(lock, [this, &queue] { return !queue.handles.empty() || !running; });
+			if (!running)
+			{
+				return;
+			}
+			handle = queue.handles.front();
+			queue.handles.pop_front();
+		}
+
+		handle.resume();
+	}
+}
+
+void IoLoop::PollLoop(CpuSlot cpu)
+{
+	if (pinned)
+	{
+		CpuTopology::PinCurrentThread(cpu);
+	}
+
+	std::vector<WSAPOLLFD> fds;
+	std::vector<IoWait*> polled;
+	std::vector<std::pair<std::coroutine_handle<>, int>> fired; //Handle and the node it goes back to
+
+	while (running)
+	{
+		fds.clear();
+		polled.clear();
+		fired.clear();
+
+		WSAPOLLFD wakeFd = { 0 };
+		wakeFd.fd = wakeSocket;
+		wakeFd.events = POLLRDNORM;
+		fds.push_back(wakeFd);
+
+		IoTime now = std::chrono::steady_clock::now();
+		IoTime nextDue = now + std::chrono::milliseconds(IO_LOOP_MAX_POLL_MS);
+
+		{
+			std::lock_guard<std::mutex> lock(waitMutex);
+
+			while (!timers.empty() && timers.front().when <= now)
+			{
+				fired.push_back({ timers.front().handle, timers.front().node });
+				std::pop_heap(timers.begin(), timers.end(), TimerLater);
+				timers.pop_back();
+			}
+			if (!timers.empty() && timers.front().when < nextDue)
+			{
+				nextDue = timers.front().when;
+			}
+
+			//Only this thread ever removes waits, so anything not expired here is still there after the poll
+			int kept = 0;
+			for (int i = 0; i < waits.size(); i++)
+			{
+				IoWait* wait = waits[i];
+				if (wait->deadline <= now)
+				{
+					wait->ready = false;
+					fired.push_back({ wait->handle, wait->node });
+					continue;
+				}
+
+				if (wait->deadline < nextDue)
+				{
+					nextDue = wait->deadline;
+				}
+
+				WSAPOLLFD fd = { 0 };
+				fd.fd = wait->socket;
+				fd.events = wait->write ? POLLWRNORM : POLLRDNORM;
+				fds.push_back(fd);
+				waits[kept++] = wait;
+			}
+			waits.resize(kept);
+			polled.assign(waits.begin(), waits.end());
+		}
+
+		for (int i = 0; i < fired.size(); i++)
+		{
+			Post(fired[i].first, fired[i].second);
+		}
+		fired.clear();
+
+		int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(nextDue - now).count();
+		int ret = WSAPoll(fds.data(), (ULONG)fds.size(), timeout > 0 ? timeout : 0);
+		if (ret == SOCKET_ERROR)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		if (fds[0].revents)
+		{
+			char drain[64];
+			while (recv(wakeSocket, drain, sizeof(drain), 0) > 0)
+			{
+			}
+			wakePending = false;
+		}
+
+		if (ret == 0 || (ret == 1 && fds[0].revents))
+		{
+			continue;
+		}
+
+		now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(waitMutex);
+
+		//waits[0, polled) lines up with fds[1, ...), anything registered during the poll sits after it
+		int kept = 0;
+		for (int i = 0; i < waits.size(); i++)
+		{
+			IoWait* wait = waits[i];
+			//Errors and hangups count as ready, the read or write that follows will find out
+			if (i < polled.size() && fds[i + 1].revents)
+			{
+				wait->ready = true;
+				wait->readyAt = now;
+				fired.push_back({ wait->handle, wait->node });
+				continue;
+			}
+			waits[kept++] = wait;
+		}
+		waits.resize(kept);
+
+		for (int i = 0; i < fired.size(); i++)
+		{
+			Post(fired[i].first, fired[i].second);
+		}
+	}
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <WinSock2.h>
+#include <coroutine>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include "Affinity.h"
+
+#define IO_LOOP_MAX_WORKERS 8
+#define IO_LOOP_MAX_POLL_MS 100 //Upper bound on a poll, in case a wake gets lost
+
+typedef std::chrono::steady_clock::time_point IoTime;
+
+class IoLoop;
+
+//A coroutine parked until a socket is readable/writable or its deadline passes
+struct IoWait
+{
+	SOCKET socket = INVALID_SOCKET;
+	bool write = false;
+	IoTime deadline;
+	std::coroutine_handle<> handle;
+	int node = 0; //Run queue it goes back to
+	bool ready = false;
+	IoTime readyAt; //When the poller saw it, the difference to when it runs again is queueing delay
+};
+
+struct IoTimer
+{
+	IoTime when;
+	std::coroutine_handle<> handle;
+	int node;
+};
+
+//A few worker threads resuming coroutines, fed by one thread sitting in WSAPoll over every parked socket.
+//Connections suspend on this instead of each owning a thread, so idle keep-alive connections cost a frame, not a stack.
+//Each NUMA node has its own run queue and workers, and a coroutine always goes back to the node it last ran on,
+//so a connection started on the node its packets arrive at stays there.
+class IoLoop
+{
+public:
+	struct SocketAwaiter
+	{
+		IoLoop* loop;
+		IoWait wait;
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle);
+		bool await_resume() noexcept
+		{
+			return wait.ready;
+		}
+	};
+
+	struct TimerAwaiter
+	{
+		IoLoop* loop;
+		IoTime when;
+		bool await_ready() noexcept
+		{
+			return when <= std::chrono::steady_clock::now();
+		}
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	//Runs fn on its own thread and resumes the coroutine afterwards, for code that still blocks (HTTP/2 sessions, the proxy).
+	//The threads are counted so shutdown can wait them out before freeing what they're working on, see WaitBlocking.
+	struct BlockingAwaiter
+	{
+		IoLoop* loop;
+		std::function<void()> fn;
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	IoLoop();
+	~IoLoop();
+	bool Start(int workers, bool pinThreads = false);
+	void Stop();
+	void Post(std::coroutine_handle<> handle, int node = -1);
+	SocketAwaiter WaitSocket(SOCKET socket, bool write, IoTime deadline);
+	void Expire(SOCKET socket);
+	TimerAwaiter SleepUntil(IoTime when);
+	BlockingAwaiter RunBlocking(std::function<void()> fn);
+	void WaitBlocking();
+	size_t GetParkedCount();
+	bool IsRunning();
+	int GetSocketNode(SOCKET socket);
+	int GetNodeCount();
+	int GetWorkerCount();
+	static int CurrentNode();
+private:
+	struct RunQueue
+	{
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<std::coroutine_handle<>> handles;
+	};
+	void PollLoop(CpuSlot cpu);
+	void WorkerLoop(int node, CpuSlot cpu);
+	void Wake();
+	std::atomic<bool> running{ false };
+	bool pinned = false;
+	CpuTopology topology;
+	std::vector<std::thread> workers;
+	std::thread pollThread;
+	std::vector<std::unique_ptr<RunQueue>> runQueues; //One per node
+	std::vector<int> queueFor; //Node to run queue, nodes without workers borrow another's
+	std::mutex waitMutex;
+	std::vector<IoWait*> waits;
+	std::vector<IoTimer> timers; //Min heap on when
+	SOCKET wakeSocket = INVALID_SOCKET;
+	sockaddr_in wakeAddr;
+	std::atomic<bool> wakePending{ false };
+	std::mutex blockingMutex;
+	std::condition_variable blockingCv;
+	int blockingCount = 0; //RunBlocking threads that haven't finished yet
+};
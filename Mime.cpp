@@ -0,0 +1,94 @@
+#include "Mime.h"
+#include <string.h>
+#include <ctype.h>
+
+void GetMimeType(const char* ext, char* buf, int size)
+{
+	//Shared by the server and the pack tool, ext includes the '.'
+	char lowerExt[MIME_MAX_EXT_LEN];
+	int max = (int)strnlen(ext, MIME_MAX_EXT_LEN - 1);
+	for (int i = 0; i < max; i++)
+	{
+		lowerExt[i] = (char)tolower(ext[i]);
+	}
+	lowerExt[max] = 0;
+
+	const char* type = nullptr;
+
+	//Website content
+	if (!strcmp(lowerExt, ".html") || !strcmp(lowerExt, ".htm"))
+	{
+		type = "text/html";
+	}
+	else if (!strcmp(lowerExt, ".js") || !strcmp(lowerExt, ".mjs"))
+	{
+		type = "application/javascript";
+	}
+	else if (!strcmp(lowerExt, ".css"))
+	{
+		type = "text/css";
+	}
+
+	//Media
+	else if (!strcmp(lowerExt, ".jpg") || !strcmp(lowerExt, ".jpeg"))
+	{
+		type = "image/jpg";
+	}
+	else if (!strcmp(lowerExt, ".png"))
+	{
+		type = "image/png";
+	}
+	else if (!strcmp(lowerExt, ".webp"))
+	{
+		type = "image/webp";
+	}
+	else if (!strcmp(lowerExt, ".gif"))
+	{
+		type = "image/gif";
+	}
+	else if (!strcmp(lowerExt, ".mp3"))
+	{
+		type = "audio/mpeg";
+	}
+	else if (!strcmp(lowerExt, ".mp4"))
+	{
+		type = "video/mp4";
+	}
+	else if (!strcmp(lowerExt, ".mpeg"))
+	{
+		type = "video/mpeg";
+	}
+
+	//Text/documents
+	else if (!strcmp(lowerExt, ".txt"))
+	{
+		type = "text/plain";
+	}
+	else if (!strcmp(lowerExt, ".doc"))
+	{
+		type = "application/msword";
+	}
+	else if (!strcmp(lowerExt, ".doc"))
+	{
+		type = "application/msword";
+	}
+
+	//Archives
+	else if (!strcmp(lowerExt, ".zip"))
+	{
+		type = "application/zip";
+	}
+	else if (!strcmp(lowerExt, ".7z"))
+	{
+		type = "application/x-7z-compressed";
+	}
+
+	//Misc/default
+	else
+	{
+		//Default to binary stream
+		type = "application/octet-stream";
+	}
+
+	strncpy_s(buf, size, type, _TRUNCATE);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#define MIME_MAX_EXT_LEN 16
+
+void GetMimeType(const char* ext, char* buf, int size);
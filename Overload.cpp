@@ -0,0 +1,110 @@
+#include "Overload.h"
+#include <math.h>
+#include <stdio.h>
+#include "Connection.h"
+
+AdmissionController::AdmissionController()
+{
+}
+
+AdmissionController::~AdmissionController()
+{
+}
+
+long long AdmissionController::NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AdmissionController::OnQueueDelay(long long delayUs)
+{
+	lastDelayUs = delayUs;
+	if (delayUs > maxDelayUs)
+	{
+		maxDelayUs = delayUs;
+	}
+
+	long long now = NowUs();
+	std::lock_guard<std::mutex> lock(stateMutex);
+
+	if (delayUs < OVERLOAD_TARGET_US)
+	{
+		//Queue drained, any good sample ends the episode
+		firstAboveUs = 0;
+		if (overloaded)
+		{
+			overloaded = false;
+			shedCount = 0;
+		}
+		return;
+	}
+
+	if (firstAboveUs == 0)
+	{
+		firstAboveUs = now + OVERLOAD_INTERVAL_US;
+	}
+	else if (!overloaded && now >= firstAboveUs)
+	{
+		overloaded = true;
+		++episodes;
+		nextShedUs = now;
+	}
+}
+
+bool AdmissionController::Admit()
+{
+	if (!overloaded)
+	{
+		++admitted;
+		return true;
+	}
+
+	long long now = NowUs();
+	std::lock_guard<std::mutex> lock(stateMutex);
+
+	if (!overloaded || now < nextShedUs)
+	{
+		++admitted;
+		return true;
+	}
+
+	//Control law: the gap between sheds shrinks with the square root of how many we've shed this episode
+	++shedCount;
+	nextShedUs = now + (long long)(OVERLOAD_INTERVAL_US / sqrt((double)shedCount));
+	++shed;
+	return false;
+}
+
+bool AdmissionController::IsOverloaded()
+{
+	return overloaded;
+}
+
+int AdmissionController::KeepAliveTimeout()
+{
+	return overloaded ? OVERLOAD_KEEP_ALIVE_TIMEOUT : KEEP_ALIVE_TIMEOUT;
+}
+
+int AdmissionController::KeepAliveMax()
+{
+	return overloaded ? OVERLOAD_KEEP_ALIVE_REQS : MAX_KEEP_ALIVE_REQS;
+}
+
+void AdmissionController::FormatMetrics(std::string& out)
+{
+	//Prometheus text format
+	char buf[768];
+	sprintf_s(buf,
+		"winweb_overloaded %i\n"
+		"winweb_queue_delay_us %lld\n"
+		"winweb_queue_delay_max_us %lld\n"
+		"winweb_queue_delay_target_us %i\n"
+		"winweb_requests_admitted_total %llu\n"
+		"winweb_requests_shed_total %llu\n"
+		"winweb_overload_episodes_total %llu\n"
+		"winweb_keep_alive_timeout_seconds %i\n"
+		"winweb_keep_alive_max_requests %i\n",
+		overloaded ? 1 : 0, (long long)lastDelayUs, (long long)maxDelayUs, OVERLOAD_TARGET_US, (unsigned long long)admitted, (unsigned long long)shed,
+		(unsigned long long)episodes, KeepAliveTimeout(), KeepAliveMax());
+	out += buf;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <string>
+
+#define OVERLOAD_TARGET_US 5000 //Acceptable standing queue delay
+#define OVERLOAD_INTERVAL_US 100000 //How long delay must stay above target before we act
+#define OVERLOAD_RETRY_AFTER 1
+#define OVERLOAD_KEEP_ALIVE_TIMEOUT 1 //Seconds, replaces KEEP_ALIVE_TIMEOUT while overloaded
+#define OVERLOAD_KEEP_ALIVE_REQS 10 //Replaces MAX_KEEP_ALIVE_REQS while overloaded
+
+//CoDel style admission control. Connections report how long each request waited before we got to it,
+//and once that has stayed above OVERLOAD_TARGET_US for a whole interval we start turning requests away
+//with a cheap 503, more often the longer it lasts, and hand out shorter keep-alives.
+class AdmissionController
+{
+public:
+	AdmissionController();
+	~AdmissionController();
+	void OnQueueDelay(long long delayUs);
+	bool Admit();
+	bool IsOverloaded();
+	int KeepAliveTimeout();
+	int KeepAliveMax();
+	void FormatMetrics(std::string& out);
+private:
+	static long long NowUs();
+	std::mutex stateMutex;
+	long long firstAboveUs = 0;
+	long long nextShedUs = 0;
+	unsigned int shedCount = 0; //Sheds in the current episode, drives the control law
+	std::atomic<bool> overloaded{ false };
+	std::atomic<long long> lastDelayUs{ 0 };
+	std::atomic<long long> maxDelayUs{ 0 };
+	std::atomic<unsigned long long> admitted{ 0 };
+	std::atomic<unsigned long long> shed{ 0 };
+	std::atomic<unsigned long long> episodes{ 0 };
+};
@@ -0,0 +1,7 @@
+#include "Probes.h"
+
+#ifdef WINWEB_PROBES
+
+TRACELOGGING_DEFINE_PROVIDER(winwebProvider, WINWEB_PROVIDER_NAME, (0x8e09fbb2, 0x0d31, 0x5ad0, 0xd7, 0x4a, 0x94, 0xa7, 0x67, 0x13, 0x5c, 0xd8));
+
+#endif
@@ -0,0 +1,56 @@
+#pragma once
+
+//Static probe points on the hot paths. Build with WINWEB_PROBES defined to compile them in as TraceLogging events
+//on the WinWeb ETW provider, any ETW session (wpr, tracelog, PerfView) can then turn them on against a running server.
+//Without it every probe is an empty statement and its arguments are never evaluated.
+#define WINWEB_PROVIDER_NAME "WinWeb"
+#define WINWEB_PROVIDER_GUID "{8e09fbb2-0d31-5ad0-d74a-94a767135cd8}" //Hashed from the name like EventSource does
+
+#ifdef WINWEB_PROBES
+#include <Windows.h>
+#include <TraceLoggingProvider.h>
+#include "Trace.h"
+
+TRACELOGGING_DECLARE_PROVIDER(winwebProvider);
+
+#define WINWEB_PROBES_REGISTER() TraceLoggingRegister(winwebProvider)
+#define WINWEB_PROBES_UNREGISTER() TraceLoggingUnregister(winwebProvider)
+#define WINWEB_PROBE_NOW() Tracer::NowUs()
+
+#define WINWEB_PROBE_ACCEPT(socket, ip, tls) \
+	TraceLoggingWrite(winwebProvider, "Accept", TraceLoggingUInt64((UINT64)(socket), "Socket"), TraceLoggingString(ip, "Ip"), TraceLoggingBool(tls, "Tls"))
+#define WINWEB_PROBE_CLOSE(socket, requests, lifetimeUs) \
+	TraceLoggingWrite(winwebProvider, "Close", TraceLoggingUInt64((UINT64)(socket), "Socket"), TraceLoggingInt32(requests, "Requests"), TraceLoggingInt64(lifetimeUs, "LifetimeUs"))
+#define WINWEB_PROBE_REQUEST_PARSED(socket, method, target, targetLen, parseUs) \
+	TraceLoggingWrite(winwebProvider, "RequestParsed", TraceLoggingUInt64((UINT64)(socket), "Socket"), TraceLoggingInt32(method, "Method"), \
+		TraceLoggingCountedString(target, (USHORT)(targetLen), "Target"), TraceLoggingInt64(parseUs, "ParseUs"))
+#define WINWEB_PROBE_FILE_HIT(path, size) \
+	TraceLoggingWrite(winwebProvider, "FileHit", TraceLoggingString(path, "Path"), TraceLoggingInt64(size, "Bytes"))
+#define WINWEB_PROBE_FILE_MISS(path) \
+	TraceLoggingWrite(winwebProvider, "FileMiss", TraceLoggingString(path, "Path"))
+#define WINWEB_PROBE_FILE_OPEN(path, size, ok, openUs) \
+	TraceLoggingWrite(winwebProvider, "FileOpen", TraceLoggingString(path, "Path"), TraceLoggingInt64(size, "Bytes"), TraceLoggingBool(ok, "Ok"), TraceLoggingInt64(openUs, "OpenUs"))
+#define WINWEB_PROBE_SEND_START(socket, status, bytes) \
+	TraceLoggingWrite(winwebProvider, "SendStart", TraceLoggingUInt64((UINT64)(socket), "Socket"), TraceLoggingInt32(status, "Status"), TraceLoggingInt64(bytes, "Bytes"))
+#define WINWEB_PROBE_SEND_DONE(socket, status, bytes, ok, sendUs) \
+	TraceLoggingWrite(winwebProvider, "SendDone", TraceLoggingUInt64((UINT64)(socket), "Socket"), TraceLoggingInt32(status, "Status"), TraceLoggingInt64(bytes, "Bytes"), \
+		TraceLoggingBool(ok, "Ok"), TraceLoggingInt64(sendUs, "SendUs"))
+#define WINWEB_PROBE_KEEPALIVE_TIMEOUT(socket, requests, idleUs) \
+	TraceLoggingWrite(winwebProvider, "KeepAliveTimeout", TraceLoggingUInt64((UINT64)(socket), "Socket"), TraceLoggingInt32(requests, "Requests"), TraceLoggingInt64(idleUs, "IdleUs"))
+#define WINWEB_PROBE_SHED(reason, ip, status) \
+	TraceLoggingWrite(winwebProvider, "Shed", TraceLoggingString(reason, "Reason"), TraceLoggingString(ip, "Ip"), TraceLoggingInt32(status, "Status"))
+#else
+#define WINWEB_PROBES_REGISTER() ((void)0)
+#define WINWEB_PROBES_UNREGISTER() ((void)0)
+#define WINWEB_PROBE_NOW() 0LL
+#define WINWEB_PROBE_ACCEPT(socket, ip, tls) ((void)0)
+#define WINWEB_PROBE_CLOSE(socket, requests, lifetimeUs) ((void)0)
+#define WINWEB_PROBE_REQUEST_PARSED(socket, method, target, targetLen, parseUs) ((void)0)
+#define WINWEB_PROBE_FILE_HIT(path, size) ((void)0)
+#define WINWEB_PROBE_FILE_MISS(path) ((void)0)
+#define WINWEB_PROBE_FILE_OPEN(path, size, ok, openUs) ((void)0)
+#define WINWEB_PROBE_SEND_START(socket, status, bytes) ((void)0)
+#define WINWEB_PROBE_SEND_DONE(socket, status, bytes, ok, sendUs) ((void)0)
+#define WINWEB_PROBE_KEEPALIVE_TIMEOUT(socket, requests, idleUs) ((void)0)
+#define WINWEB_PROBE_SHED(reason, ip, status) ((void)0)
+#endif
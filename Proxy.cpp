@@ -0,0 +1,850 @@
+#include "Connection.h"
+#include "Proxy.h"
+#include "RequestBody.h"
+
+ReverseProxy::ReverseProxy()
+{
+}
+
+ReverseProxy::~ReverseProxy()
+{
+	StopHealthChecks();
+
+	for (int i = 0; i < upstreams.size(); i++)
+	{
+		for (int j = 0; j < upstreams[i]->idle.size(); j++)
+		{
+			closesocket(upstreams[i]->idle[j].socket);
+		}
+		delete upstreams[i];
+	}
+
+	for (int i = 0; i < routes.size(); i++)
+	{
+		delete routes[i];
+	}
+}
+
+ProxyRoute* ReverseProxy::AddRoute(const char* prefix, const char* upstreamList)
+{
+	//upstreamList is "host:port[,host:port...]", the Router decides which requests end up here
+	if (!prefix || !upstreamList || prefix[0] != '/')
+	{
+		return nullptr;
+	}
+
+	ProxyRoute* route = new ProxyRoute();
+	route->prefix = prefix;
+
+	std::string list = upstreamList;
+	size_t start = 0;
+	while (start < list.size())
+	{
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+		{
+			end = list.size();
+		}
+
+		std::string entry = list.substr(start, end - start);
+		start = end + 1;
+
+		size_t colon = entry.rfind(':');
+		if (colon == std::string::npos)
+		{
+			continue;
+		}
+
+		std::string host = entry.substr(0, colon);
+		int port = atoi(entry.c_str() + colon + 1);
+
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* result = nullptr;
+		if (port <= 0 || getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result)
+		{
+			continue;
+		}
+
+		Upstream* upstream = new Upstream();
+		upstream->name = entry;
+		memcpy(&upstream->addr, result->ai_addr, sizeof(sockaddr_in));
+		upstream->addr.sin_port = htons(port);
+		freeaddrinfo(result);
+
+		upstreams.push_back(upstream);
+		route->upstreams.push_back(upstream);
+	}
+
+	if (route->upstreams.empty())
+	{
+		delete route;
+		return nullptr;
+	}
+
+	routes.push_back(route);
+	return route;
+}
+
+void ReverseProxy::SetTimeouts(int connectMs, int readMs, int idleMs)
+{
+	//0 (or less) leaves one as it is. Can be changed while running, exchanges already waiting finish on the old values.
+	if (connectMs > 0)
+	{
+		connectTimeoutMs = connectMs;
+	}
+	if (readMs > 0)
+	{
+		readTimeoutMs = readMs;
+	}
+	if (idleMs > 0)
+	{
+		idleTimeoutMs = idleMs;
+	}
+}
+
+Upstream* ReverseProxy::PickUpstream(ProxyRoute* route, Upstream* exclude)
+{
+	//Least connections among the healthy ones, if they're all down try anyway rather than fail outright
+	Upstream* best = nullptr;
+	for (int pass = 0; pass < 2 && !best; pass++)
+	{
+		for (int i = 0; i < route->upstreams.size(); i++)
+		{
+			Upstream* candidate = route->upstreams[i];
+			if (candidate == exclude || (pass == 0 && !candidate->healthy))
+			{
+				continue;
+			}
+
+			if (!best || candidate->active < best->active)
+			{
+				best = candidate;
+			}
+		}
+	}
+	return best;
+}
+
+bool ReverseProxy::WaitSocket(SOCKET sckt, bool write, int timeoutMs)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	FD_SET(sckt, &set);
+	timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+	int ret = select(0, write ? NULL : &set, write ? &set : NULL, NULL, &tv);
+	return ret != SOCKET_ERROR && ret > 0;
+}
+
+SOCKET ReverseProxy::ConnectUpstream(Upstream* upstream)
+{
+	SOCKET sckt = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sckt == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	u_long nonBlock = 1;
+	ioctlsocket(sckt, FIONBIO, &nonBlock);
+
+	int noDelay = 1;
+	setsockopt(sckt, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	if (connect(sckt, (SOCKADDR*)&upstream->addr, sizeof(upstream->addr)) == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+	{
+		closesocket(sckt);
+		return INVALID_SOCKET;
+	}
+
+	int soErr = 0;
+	int soErrLen = sizeof(soErr);
+	if (!WaitSocket(sckt, true, connectTimeoutMs) || getsockopt(sckt, SOL_SOCKET, SO_ERROR, (char*)&soErr, &soErrLen) == SOCKET_ERROR || soErr)
+	{
+		closesocket(sckt);
+		return INVALID_SOCKET;
+	}
+
+	return sckt;
+}
+
+SOCKET ReverseProxy::Acquire(Upstream* upstream, bool& reused)
+{
+	reused = false;
+	auto now = std::chrono::steady_clock::now();
+
+	upstream->poolMutex.lock();
+	while (!upstream->idle.empty())
+	{
+		PooledSocket pooled = upstream->idle.back();
+		upstream->idle.pop_back();
+
+		auto idleMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - pooled.idleSince).count();
+		char probe;
+		int peek = recv(pooled.socket, &probe, 1, MSG_PEEK);
+		bool alive = peek == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK;
+
+		if (idleMs < idleTimeoutMs && alive)
+		{
+			upstream->poolMutex.unlock();
+			reused = true;
+			return pooled.socket;
+		}
+
+		//Upstream closed it or sent something unsolicited, either way it's no good
+		closesocket(pooled.socket);
+	}
+	upstream->poolMutex.unlock();
+
+	return ConnectUpstream(upstream);
+}
+
+void ReverseProxy::Release(Upstream* upstream, SOCKET sckt, bool reusable)
+{
+	if (reusable)
+	{
+		std::lock_guard<std::mutex> lock(upstream->poolMutex);
+		if (upstream->idle.size() < PROXY_MAX_IDLE_PER_UPSTREAM)
+		{
+			upstream->idle.push_back({ sckt, std::chrono::steady_clock::now() });
+			return;
+		}
+	}
+
+	closesocket(sckt);
+}
+
+bool ReverseProxy::SendAll(SOCKET sckt, const char* buf, int len)
+{
+	int sent = 0;
+	while (sent < len)
+	{
+		int thisSent = send(sckt, buf + sent, len - sent, 0);
+		if (thisSent == SOCKET_ERROR)
+		{
+			if (WSAGetLastError() != WSAEWOULDBLOCK || !WaitSocket(sckt, true, readTimeoutMs))
+			{
+				return false;
+			}
+			continue;
+		}
+		sent += thisSent;
+	}
+	return true;
+}
+
+int ReverseProxy::RecvTimed(SOCKET sckt, char* buf, int len, int timeoutMs)
+{
+	//Bytes read, 0 on close, -1 on error or timeout
+	while (true)
+	{
+		int got = recv(sckt, buf, len, 0);
+		if (got >= 0)
+		{
+			return got;
+		}
+
+		if (WSAGetLastError() != WSAEWOULDBLOCK || !WaitSocket(sckt, false, timeoutMs))
+		{
+			return -1;
+		}
+	}
+}
+
+const char* ReverseProxy::FindHeader(const char* head, int headLen, const char* name, int& valueLen)
+{
+	int nameLen = (int)strlen(name);
+	const char* end = head + headLen;
+	const char* line = head;
+
+	while (line < end)
+	{
+		const char* lineEnd = line;
+		while (lineEnd < end && *lineEnd != '\r')
+		{
+			++lineEnd;
+		}
+
+		if (lineEnd - line > nameLen && line[nameLen] == ':' && !_strnicmp(line, name, nameLen))
+		{
+			const char* value = line + nameLen + 1;
+			while (value < lineEnd && (*value == ' ' || *value == '\t'))
+			{
+				++value;
+			}
+			valueLen = (int)(lineEnd - value);
+			return value;
+		}
+
+		line = lineEnd + 2;
+	}
+
+	return nullptr;
+}
+
+bool ReverseProxy::IsHopByHop(const char* line, int len)
+{
+	static const char* hopHeaders[] = { "Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Upgrade:", "Trailer:" };
+	for (int i = 0; i < sizeof(hopHeaders) / sizeof(hopHeaders[0]); i++)
+	{
+		int hopLen = (int)strlen(hopHeaders[i]);
+		if (len >= hopLen && !_strnicmp(line, hopHeaders[i], hopLen))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ReverseProxy::SendRequestHead(SOCKET sckt, const char* head, int headLen, Connection* client)
+{
+	//Request line and end-to-end headers as they came, our own hop-by-hop headers on the end
+	std::string out;
+	out.reserve(headLen + 128);
+
+	const char* end = head + headLen;
+	const char* line = head;
+	bool first = true;
+	while (line < end)
+	{
+		const char* lineEnd = line;
+		while (lineEnd < end && *lineEnd != '\r')
+		{
+			++lineEnd;
+		}
+
+		int len = (int)(lineEnd - line);
+		if (len == 0)
+		{
+			break;
+		}
+
+		if (first || !IsHopByHop(line, len))
+		{
+			out.append(line, len);
+			out += "\r\n";
+		}
+
+		first = false;
+		line = lineEnd + 2;
+	}
+
+	out += "Connection: keep-alive\r\nX-Forwarded-For: ";
+	out += client->ip;
+	out += "\r\n\r\n";
+
+	return SendAll(sckt, out.data(), (int)out.size());
+}
+
+bool ReverseProxy::RelayRequestBody(SOCKET sckt, Connection* client, const char* bodyStart, int bodyLen, long long contentLength, bool& overrun)
+{
+	//contentLength of -1 means chunked. Only the body goes upstream, overrun is set if the client sent anything after it
+	//(a pipelined request), which we don't serve, so the client connection has to close.
+	ChunkScanner scanner;
+	long long remaining = contentLength;
+	overrun = false;
+
+	if (bodyLen > 0)
+	{
+		int take = bodyLen;
+		if (contentLength >= 0)
+		{
+			take = bodyLen > remaining ? (int)remaining : bodyLen;
+			remaining -= take;
+		}
+		else
+		{
+			scanner.Feed(bodyStart, bodyLen, nullptr, &take);
+		}
+		overrun = take < bodyLen;
+
+		if (!SendAll(sckt, bodyStart, take))
+		{
+			return false;
+		}
+	}
+
+	char* buf = (char*)malloc(PROXY_BUF_SIZE);
+	if (!buf)
+	{
+		return false;
+	}
+
+	auto lastData = std::chrono::steady_clock::now();
+	bool ok = true;
+
+	while (contentLength >= 0 ? remaining > 0 : (scanner.state != ChunkScanner::DONE && scanner.state != ChunkScanner::BAD))
+	{
+		int want = contentLength >= 0 && remaining < PROXY_BUF_SIZE ? (int)remaining : PROXY_BUF_SIZE;
+		int got = client->RecvSome(buf, want);
+		if (got == 0)
+		{
+			ok = false;
+			break;
+		}
+		else if (got < 0)
+		{
+			auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastData).count();
+			if (waited > readTimeoutMs)
+			{
+				ok = false;
+				break;
+			}
+			client->WaitReady(false, (int)(readTimeoutMs - waited));
+			continue;
+		}
+
+		lastData = std::chrono::steady_clock::now();
+		int take = got;
+		if (contentLength >= 0)
+		{
+			remaining -= got;
+		}
+		else
+		{
+			scanner.Feed(buf, got, nullptr, &take);
+			overrun = overrun || take < got;
+		}
+
+		if (!SendAll(sckt, buf, take))
+		{
+			ok = false;
+			break;
+		}
+	}
+
+	free(buf);
+	return ok && scanner.state != ChunkScanner::BAD;
+}
+
+int ReverseProxy::RelayResponse(SOCKET sckt, Connection* client, bool headRequest, bool clientKeepAlive, bool& upstreamReusable, bool& clientReusable)
+{
+	//Returns the upstream status, -1 if nothing was sent to the client yet, -2 if it failed part way through, -3 if the
+	//connection failed before the upstream sent anything
+	upstreamReusable = false;
+	clientReusable = false;
+
+	char* buf = (char*)malloc(PROXY_BUF_SIZE);
+	if (!buf)
+	{
+		return -1;
+	}
+
+	int status = 0;
+	int have = 0;
+	int headLen = 0;
+	bool interimSent = false;
+
+	while (true)
+	{
+		//Read until we've got the whole head
+		char* headEnd = nullptr;
+		while (!headEnd)
+		{
+			if (have >= PROXY_MAX_HEAD_SIZE)
+			{
+				free(buf);
+				return -1;
+			}
+
+			int got = RecvTimed(sckt, buf + have, PROXY_MAX_HEAD_SIZE - have, readTimeoutMs);
+			if (got <= 0)
+			{
+				free(buf);
+				return interimSent ? -2 : (have == 0 ? -3 : -1);
+			}
+			have += got;
+
+			for (int i = 3; i < have; i++)
+			{
+				if (buf[i - 3] == '\r' && buf[i - 2] == '\n' && buf[i - 1] == '\r' && buf[i] == '\n')
+				{
+					headEnd = &buf[i + 1];
+					break;
+				}
+			}
+		}
+
+		headLen = (int)(headEnd - buf);
+		if (have < 12 || strncmp(buf, "HTTP/1.", 7))
+		{
+			free(buf);
+			return -1;
+		}
+		status = atoi(buf + 9);
+
+		if (status >= 100 && status < 200 && status != 101)
+		{
+			//Interim response, pass it on and wait for the real one
+			if (!client->SendBuffer(buf, &client->socket, headLen))
+			{
+				free(buf);
+				return -2;
+			}
+			interimSent = true;
+			memmove(buf, buf + headLen, have - headLen);
+			have -= headLen;
+			continue;
+		}
+		break;
+	}
+
+	//Work out how the body is framed
+	int valueLen = 0;
+	long long contentLength = -1;
+	bool chunked = false;
+	bool upstreamClose = false;
+
+	const char* value = FindHeader(buf, headLen, "Transfer-Encoding", valueLen);
+	if (value && valueLen >= 7 && !_strnicmp(value + valueLen - 7, "chunked", 7))
+	{
+		chunked = true;
+	}
+	value = FindHeader(buf, headLen, "Content-Length", valueLen);
+	if (value && !chunked)
+	{
+		contentLength = _strtoi64(value, nullptr, 10);
+	}
+	value = FindHeader(buf, headLen, "Connection", valueLen);
+	if (value && valueLen >= 5 && !_strnicmp(value, "close", 5))
+	{
+		upstreamClose = true;
+	}
+
+	bool noBody = headRequest || status == 204 || status == 304;
+	bool delimitedByClose = !noBody && !chunked && contentLength < 0;
+	clientReusable = clientKeepAlive && !delimitedByClose;
+
+	if (client->sends)
+	{
+		//Weighted like a file of the same size and type. Without a length only the type can tell, so it's no more than normal.
+		char typeBuf[64] = {};
+		value = FindHeader(buf, headLen, "Content-Type", valueLen);
+		if (value)
+		{
+			memcpy(typeBuf, value, valueLen < (int)sizeof(typeBuf) - 1 ? valueLen : sizeof(typeBuf) - 1);
+		}
+		long long classLen = noBody ? 0 : (contentLength >= 0 ? contentLength : SEND_INTERACTIVE_MAX + 1);
+		client->sends->Begin(&client->sendFlow, SendScheduler::Classify(classLen, typeBuf));
+	}
+
+	//Forward the head with our own Connection header for the client side
+	std::string head;
+	head.reserve(headLen + 64);
+	const char* line = buf;
+	const char* end = buf + headLen;
+	bool first = true;
+	while (line < end)
+	{
+		const char* lineEnd = line;
+		while (lineEnd < end && *lineEnd != '\r')
+		{
+			++lineEnd;
+		}
+
+		int len = (int)(lineEnd - line);
+		if (len == 0)
+		{
+			break;
+		}
+
+		if (first || !IsHopByHop(line, len))
+		{
+			head.append(line, len);
+			head += "\r\n";
+		}
+		first = false;
+		line = lineEnd + 2;
+	}
+
+	if (clientReusable)
+	{
+		char keepAliveBuf[100];
+		sprintf_s(keepAliveBuf, "Connection: keep-alive\r\nKeep-Alive: timeout=%i, max=%i\r\n\r\n", client->KeepAliveTimeout(), client->KeepAliveMax());
+		head += keepAliveBuf;
+	}
+	else
+	{
+		head += "Connection: close\r\n\r\n";
+	}
+
+	if (!client->SendBuffer((char*)head.data(), &client->socket, (int)head.size()))
+	{
+		free(buf);
+		return -2;
+	}
+
+	//Then the body, as it arrives
+	ChunkScanner scanner;
+	long long remaining = contentLength;
+	int pending = have - headLen;
+	char* pendingStart = buf + headLen;
+	bool complete = noBody;
+	bool failed = false;
+	bool upstreamOverrun = false;
+
+	while (!complete && !failed)
+	{
+		if (pending > 0)
+		{
+			int take = pending;
+			if (!chunked && contentLength >= 0 && take > remaining)
+			{
+				take = (int)remaining;
+			}
+
+			if (chunked)
+			{
+				//Only up to the end of the body, anything after it isn't part of this response
+				scanner.Feed(pendingStart, pending, nullptr, &take);
+			}
+			upstreamOverrun = take < pending;
+
+			if (!client->SendBuffer(pendingStart, &client->socket, take))
+			{
+				failed = true;
+				break;
+			}
+
+			if (chunked)
+			{
+				complete = scanner.state == ChunkScanner::DONE;
+				failed = scanner.state == ChunkScanner::BAD;
+			}
+			else if (contentLength >= 0)
+			{
+				remaining -= take;
+				complete = remaining <= 0;
+			}
+		}
+
+		if (complete || failed)
+		{
+			break;
+		}
+
+		int got = RecvTimed(sckt, buf, PROXY_BUF_SIZE, readTimeoutMs);
+		if (got == 0 && delimitedByClose)
+		{
+			complete = true;
+			break;
+		}
+		if (got <= 0)
+		{
+			failed = true;
+			break;
+		}
+
+		pending = got;
+		pendingStart = buf;
+	}
+
+	free(buf);
+
+	if (failed)
+	{
+		clientReusable = false;
+		return -2;
+	}
+
+	upstreamReusable = !upstreamClose && !delimitedByClose && !upstreamOverrun;
+	return status;
+}
+
+bool ReverseProxy::SendError(Connection* client, int code, const char* reason)
+{
+	char buf[256];
+	sprintf_s(buf, "%s %i %s\r\nServer:%s/%i.%i\r\nContent-Length:0\r\nConnection:close\r\n\r\n", HTTP_VER, code, reason, SERVER_NAME, SERVER_MAJOR, SERVER_MINOR);
+	client->SendBuffer(buf, &client->socket);
+	return true;
+}
+
+bool ReverseProxy::Forward(ProxyRoute* route, Connection* client, const char* request, int requestLen, bool& clientKeepAlive)
+{
+	const char* headEnd = strstr(request, "\r\n\r\n");
+	if (!headEnd)
+	{
+		clientKeepAlive = false;
+		return SendError(client, BAD_REQUEST, "Bad Request");
+	}
+
+	int headLen = (int)(headEnd + 4 - request);
+	bool headRequest = !strncmp(request, "HEAD ", 5);
+	bool safeMethod = headRequest || !strncmp(request, "GET ", 4);
+
+	//Request body framing, relayed as it comes in
+	int valueLen = 0;
+	long long contentLength = 0;
+	const char* value = FindHeader(request, headLen, "Transfer-Encoding", valueLen);
+	if (value && valueLen >= 7 && !_strnicmp(value + valueLen - 7, "chunked", 7))
+	{
+		contentLength = -1;
+	}
+	else if ((value = FindHeader(request, headLen, "Content-Length", valueLen)))
+	{
+		contentLength = _strtoi64(value, nullptr, 10);
+	}
+
+	Upstream* tried = nullptr;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		Upstream* upstream = PickUpstream(route, tried);
+		if (!upstream)
+		{
+			break;
+		}
+		tried = upstream;
+
+		bool reused = false;
+		SOCKET sckt = Acquire(upstream, reused);
+		if (sckt == INVALID_SOCKET)
+		{
+			if (++upstream->failures >= PROXY_FAIL_THRESHOLD)
+			{
+				upstream->healthy = false;
+			}
+			continue;
+		}
+
+		++upstream->active;
+
+		bool sentRequest = SendRequestHead(sckt, request, headLen, client);
+		bool overrun = contentLength == 0 && requestLen > headLen;
+		if (sentRequest && contentLength != 0)
+		{
+			sentRequest = RelayRequestBody(sckt, client, request + headLen, requestLen - headLen, contentLength, overrun);
+			if (!sentRequest)
+			{
+				//The client side broke, there's nothing to retry
+				--upstream->active;
+				closesocket(sckt);
+				clientKeepAlive = false;
+				return true;
+			}
+		}
+		if (overrun)
+		{
+			//The client sent more behind this request, it wasn't forwarded and isn't served, so the client is closed after this
+			clientKeepAlive = false;
+		}
+
+		bool upstreamReusable = false;
+		bool clientReusable = false;
+		int status = sentRequest ? RelayResponse(sckt, client, headRequest, clientKeepAlive, upstreamReusable, clientReusable) : -1;
+
+		--upstream->active;
+
+		if (status >= 0)
+		{
+			upstream->failures = 0;
+			Release(upstream, sckt, upstreamReusable);
+			clientKeepAlive = clientReusable;
+			return true;
+		}
+
+		closesocket(sckt);
+
+		if (status == -2)
+		{
+			//Part of the response has gone out, all we can do is drop the client
+			clientKeepAlive = false;
+			return true;
+		}
+
+		//Nothing reached the client. A stale pooled connection isn't the upstream's fault.
+		if (!reused && ++upstream->failures >= PROXY_FAIL_THRESHOLD)
+		{
+			upstream->healthy = false;
+		}
+
+		//Only resent when the upstream can't have acted on it: a GET or HEAD without a body, on a pooled connection that
+		//broke before a byte of the response came back (the upstream had closed it while it sat idle)
+		if (!reused || !safeMethod || contentLength != 0 || (sentRequest && status != -3))
+		{
+			break;
+		}
+	}
+
+	clientKeepAlive = false;
+	return SendError(client, BAD_GATEWAY, "Bad Gateway");
+}
+
+void ReverseProxy::StartHealthChecks(std::function<void(const char*)> printFunc)
+{
+	if (runHealth || upstreams.empty())
+	{
+		return;
+	}
+
+	PrintFunc = printFunc;
+	runHealth = true;
+	healthThread = std::thread(&ReverseProxy::HealthLoop, this);
+}
+
+void ReverseProxy::StopHealthChecks()
+{
+	if (!runHealth)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(healthMutex);
+		runHealth = false;
+	}
+	healthCv.notify_all();
+
+	if (healthThread.joinable())
+	{
+		healthThread.join();
+	}
+}
+
+void ReverseProxy::HealthLoop()
+{
+	while (runHealth)
+	{
+		for (int i = 0; i < upstreams.size() && runHealth; i++)
+		{
+			Upstream* upstream = upstreams[i];
+
+			//Active check, a plain TCP connect
+			SOCKET probe = ConnectUpstream(upstream);
+			bool wasHealthy = upstream->healthy;
+			if (probe != INVALID_SOCKET)
+			{
+				closesocket(probe);
+				upstream->healthy = true;
+				upstream->failures = 0;
+			}
+			else
+			{
+				upstream->healthy = false;
+			}
+
+			if (wasHealthy != upstream->healthy)
+			{
+				char msg[300];
+				sprintf_s(msg, "Upstream %s is %s", upstream->name.c_str(), upstream->healthy ? "up" : "down");
+				PrintFunc(msg);
+			}
+
+			//Drop pooled connections that have sat idle too long
+			auto now = std::chrono::steady_clock::now();
+			std::lock_guard<std::mutex> lock(upstream->poolMutex);
+			for (int j = 0; j < upstream->idle.size(); j++)
+			{
+				if (std::chrono::duration_cast<std::chrono::milliseconds>(now - upstream->idle[j].idleSince).count() >= idleTimeoutMs)
+				{
+					closesocket(upstream->idle[j].socket);
+					upstream->idle.erase(upstream->idle.begin() + j);
+					--j;
+				}
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(healthMutex);
+		healthCv.wait_for(lock, std::chrono::milliseconds(PROXY_HEALTH_INTERVAL_MS), [this] { return !runHealth; });
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+class Connection;
+
+#define PROXY_CONNECT_TIMEOUT_MS 2000
+#define PROXY_READ_TIMEOUT_MS 30000
+#define PROXY_IDLE_TIMEOUT_MS 30000
+#define PROXY_HEALTH_INTERVAL_MS 5000
+#define PROXY_MAX_IDLE_PER_UPSTREAM 32
+#define PROXY_FAIL_THRESHOLD 3
+#define PROXY_BUF_SIZE 65536
+#define PROXY_MAX_HEAD_SIZE 16384
+
+struct PooledSocket
+{
+	SOCKET socket;
+	std::chrono::steady_clock::time_point idleSince;
+};
+
+struct Upstream
+{
+	std::string name;
+	sockaddr_in addr;
+	std::atomic<int> active{ 0 };
+	std::atomic<int> failures{ 0 };
+	std::atomic<bool> healthy{ true };
+	std::mutex poolMutex;
+	std::vector<PooledSocket> idle;
+};
+
+struct ProxyRoute
+{
+	std::string prefix;
+	std::vector<Upstream*> upstreams;
+};
+
+//Forwards requests under a path prefix to a set of upstream servers over pooled keep-alive connections.
+//Both directions are relayed in PROXY_BUF_SIZE pieces, nothing is buffered whole.
+class ReverseProxy
+{
+public:
+	ReverseProxy();
+	~ReverseProxy();
+	ProxyRoute* AddRoute(const char* prefix, const char* upstreamList);
+	void SetTimeouts(int connectMs, int readMs, int idleMs);
+	bool Forward(ProxyRoute* route, Connection* client, const char* request, int requestLen, bool& clientKeepAlive);
+	void StartHealthChecks(std::function<void(const char*)> printFunc);
+	void StopHealthChecks();
+private:
+	Upstream* PickUpstream(ProxyRoute* route, Upstream* exclude);
+	SOCKET Acquire(Upstream* upstream, bool& reused);
+	void Release(Upstream* upstream, SOCKET sckt, bool reusable);
+	SOCKET ConnectUpstream(Upstream* upstream);
+	bool SendAll(SOCKET sckt, const char* buf, int len);
+	int RecvTimed(SOCKET sckt, char* buf, int len, int timeoutMs);
+	bool WaitSocket(SOCKET sckt, bool write, int timeoutMs);
+	bool SendRequestHead(SOCKET sckt, const char* head, int headLen, Connection* client);
+	bool RelayRequestBody(SOCKET sckt, Connection* client, const char* bodyStart, int bodyLen, long long contentLength, bool& overrun);
+	int RelayResponse(SOCKET sckt, Connection* client, bool headRequest, bool clientKeepAlive, bool& upstreamReusable, bool& clientReusable);
+	bool SendError(Connection* client, int code, const char* reason);
+	void HealthLoop();
+	static const char* FindHeader(const char* head, int headLen, const char* name, int& valueLen);
+	static bool IsHopByHop(const char* line, int len);
+	std::vector<ProxyRoute*> routes;
+	std::vector<Upstream*> upstreams;
+	std::thread healthThread;
+	std::atomic<bool> runHealth{ false };
+	std::mutex healthMutex;
+	std::condition_variable healthCv;
+	std::function<void(const char*)> PrintFunc;
+	std::atomic<int> connectTimeoutMs{ PROXY_CONNECT_TIMEOUT_MS }; //Atomic since a reload can change them mid exchange
+	std::atomic<int> readTimeoutMs{ PROXY_READ_TIMEOUT_MS };
+	std::atomic<int> idleTimeoutMs{ PROXY_IDLE_TIMEOUT_MS };
+};
@@ -0,0 +1,274 @@
+#include "RateLimit.h"
+
+RateLimiter::RateLimiter()
+{
+}
+
+RateLimiter::~RateLimiter()
+{
+}
+
+void RateLimiter::SetLimits(int connsPerIp, int requestsPerSec, long long bytesPerSec)
+{
+	//0 turns a limit off (they all start off), -1 keeps it. Safe to call while serving. Bursts stay at two seconds' worth
+	//and a /24 gets four addresses' connections.
+	if (connsPerIp >= 0)
+	{
+		maxConnsPerIp = connsPerIp;
+		maxConnsPerPrefix = connsPerIp * RATE_PREFIX_CONNS_FACTOR;
+	}
+	if (requestsPerSec >= 0)
+	{
+		reqsPerSec = requestsPerSec;
+	}
+	if (bytesPerSec >= 0)
+	{
+		this->bytesPerSec = (double)bytesPerSec;
+	}
+}
+
+RateShard& RateLimiter::ShardFor(unsigned long key)
+{
+	//Addresses from one network differ mostly in the last octet, mix before picking a shard
+	unsigned long h = key * 2654435761u;
+	return shards[(h >> 16) % RATE_SHARDS];
+}
+
+unsigned long RateLimiter::PrefixOf(unsigned long addr)
+{
+	return addr & htonl(0xFFFFFF00);
+}
+
+long long RateLimiter::NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RateLimiter::Refill(ClientBucket& bucket, long long now)
+{
+	if (bucket.lastRefillMs == 0)
+	{
+		//New client, starts with a full burst at whatever the limits are now
+		bucket.reqTokens = reqsPerSec * RATE_BURST_SECONDS;
+		bucket.byteTokens = bytesPerSec * RATE_BURST_SECONDS;
+		bucket.lastRefillMs = now;
+		return;
+	}
+
+	double elapsed = (now - bucket.lastRefillMs) / 1000.0;
+	if (elapsed <= 0)
+	{
+		return;
+	}
+
+	double reqRate = reqsPerSec;
+	bucket.reqTokens += elapsed * reqRate;
+	if (bucket.reqTokens > reqRate * RATE_BURST_SECONDS)
+	{
+		bucket.reqTokens = reqRate * RATE_BURST_SECONDS;
+	}
+
+	double byteRate = bytesPerSec;
+	bucket.byteTokens += elapsed * byteRate;
+	if (bucket.byteTokens > byteRate * RATE_BURST_SECONDS)
+	{
+		bucket.byteTokens = byteRate * RATE_BURST_SECONDS;
+	}
+
+	bucket.lastRefillMs = now;
+}
+
+void RateLimiter::AgeShard(RateShard& shard, long long now)
+{
+	//Called with the shard locked. Drops clients with nothing open whose buckets would have refilled anyway, and prefixes
+	//with no connections left.
+	if (now - shard.lastAgedMs < RATE_AGE_INTERVAL_MS)
+	{
+		return;
+	}
+	shard.lastAgedMs = now;
+
+	for (auto it = shard.clients.begin(); it != shard.clients.end();)
+	{
+		if (it->second.connections == 0 && now - it->second.lastRefillMs > RATE_ENTRY_TTL_MS)
+		{
+			it = shard.clients.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (auto it = shard.prefixConnections.begin(); it != shard.prefixConnections.end();)
+	{
+		if (it->second <= 0)
+		{
+			it = shard.prefixConnections.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void RateLimiter::Age()
+{
+	//Every shard, on the server's timer, so clients that never come back don't sit in shards nobody else touches
+	long long now = NowMs();
+	for (int i = 0; i < RATE_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		AgeShard(shards[i], now);
+	}
+}
+
+bool RateLimiter::TryAcquireConnection(unsigned long addr)
+{
+	long long now = NowMs();
+	unsigned long prefix = PrefixOf(addr);
+
+	//Prefix counts live in the prefix's own shard, take the two locks in a fixed order
+	RateShard& clientShard = ShardFor(addr);
+	RateShard& prefixShard = ShardFor(prefix);
+	RateShard* first = &clientShard < &prefixShard ? &clientShard : &prefixShard;
+	RateShard* second = &clientShard < &prefixShard ? &prefixShard : &clientShard;
+
+	std::unique_lock<std::mutex> firstLock(first->mutex);
+	std::unique_lock<std::mutex> secondLock;
+	if (second != first)
+	{
+		secondLock = std::unique_lock<std::mutex>(second->mutex);
+	}
+
+	AgeShard(clientShard, now);
+
+	ClientBucket& bucket = clientShard.clients[addr];
+	Refill(bucket, now);
+	int& prefixCount = prefixShard.prefixConnections[prefix];
+
+	//Counted even with no cap, so one set while serving sees the connections already open
+	int ipCap = maxConnsPerIp;
+	int prefixCap = maxConnsPerPrefix;
+	if ((ipCap > 0 && bucket.connections >= ipCap) || (prefixCap > 0 && prefixCount >= prefixCap))
+	{
+		++rejectedConnections;
+		return false;
+	}
+
+	++bucket.connections;
+	++prefixCount;
+	return true;
+}
+
+void RateLimiter::ReleaseConnection(unsigned long addr)
+{
+	unsigned long prefix = PrefixOf(addr);
+	RateShard& clientShard = ShardFor(addr);
+	RateShard& prefixShard = ShardFor(prefix);
+
+	{
+		std::lock_guard<std::mutex> lock(clientShard.mutex);
+		auto it = clientShard.clients.find(addr);
+		if (it != clientShard.clients.end() && it->second.connections > 0)
+		{
+			--it->second.connections;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(prefixShard.mutex);
+	auto it = prefixShard.prefixConnections.find(prefix);
+	if (it != prefixShard.prefixConnections.end() && --it->second <= 0)
+	{
+		prefixShard.prefixConnections.erase(it);
+	}
+}
+
+bool RateLimiter::TryRequest(unsigned long addr, int& retryAfter)
+{
+	if (reqsPerSec <= 0)
+	{
+		return true;
+	}
+
+	long long now = NowMs();
+	RateShard& shard = ShardFor(addr);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	ClientBucket& bucket = shard.clients[addr];
+	Refill(bucket, now);
+
+	if (bucket.reqTokens >= 1.0)
+	{
+		bucket.reqTokens -= 1.0;
+		return true;
+	}
+
+	//Whole seconds until a token is back, for Retry-After
+	retryAfter = (int)((1.0 - bucket.reqTokens) / reqsPerSec) + 1;
+	++rejectedRequests;
+	return false;
+}
+
+int RateLimiter::TakeBandwidth(unsigned long addr, int want)
+{
+	//Returns how many of want bytes may go out now, 0 means wait and ask again
+	if (bytesPerSec <= 0)
+	{
+		return want;
+	}
+
+	long long now = NowMs();
+	RateShard& shard = ShardFor(addr);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	ClientBucket& bucket = shard.clients[addr];
+	Refill(bucket, now);
+
+	int allowed = bucket.byteTokens >= want ? want : (int)bucket.byteTokens;
+	if (allowed < 0)
+	{
+		allowed = 0;
+	}
+
+	bucket.byteTokens -= allowed;
+	return allowed;
+}
+
+void RateLimiter::ReturnBandwidth(unsigned long addr, int unused)
+{
+	if (unused <= 0 || bytesPerSec <= 0)
+	{
+		return;
+	}
+
+	RateShard& shard = ShardFor(addr);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.clients.find(addr);
+	if (it != shard.clients.end())
+	{
+		it->second.byteTokens += unused;
+	}
+}
+
+size_t RateLimiter::GetTrackedClients()
+{
+	size_t total = 0;
+	for (int i = 0; i < RATE_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		total += shards[i].clients.size();
+	}
+	return total;
+}
+
+unsigned long long RateLimiter::GetRejectedConnections()
+{
+	return rejectedConnections;
+}
+
+unsigned long long RateLimiter::GetRejectedRequests()
+{
+	return rejectedRequests;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <WinSock2.h>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#define RATE_SHARDS 64
+#define RATE_PREFIX_CONNS_FACTOR 4 //A /24 gets this many addresses' worth of connections
+#define RATE_BURST_SECONDS 2 //Buckets hold this long's worth at the current rate
+#define RATE_AGE_INTERVAL_MS 10000
+#define RATE_ENTRY_TTL_MS 60000
+
+struct ClientBucket
+{
+	int connections = 0;
+	double reqTokens = 0;
+	double byteTokens = 0;
+	long long lastRefillMs = 0;
+};
+
+struct RateShard
+{
+	std::mutex mutex;
+	std::unordered_map<unsigned long, ClientBucket> clients;
+	std::unordered_map<unsigned long, int> prefixConnections;
+	long long lastAgedMs = 0;
+};
+
+//Per client connection caps and token buckets for requests and bytes sent, each off (0) until set.
+//Keyed on the IPv4 address (network order), spread over RATE_SHARDS independently locked shards so clients rarely contend.
+class RateLimiter
+{
+public:
+	RateLimiter();
+	~RateLimiter();
+	void SetLimits(int connsPerIp, int requestsPerSec, long long bytesPerSec);
+	bool TryAcquireConnection(unsigned long addr);
+	void ReleaseConnection(unsigned long addr);
+	bool TryRequest(unsigned long addr, int& retryAfter);
+	int TakeBandwidth(unsigned long addr, int want);
+	void ReturnBandwidth(unsigned long addr, int unused);
+	void Age();
+	size_t GetTrackedClients();
+	unsigned long long GetRejectedConnections();
+	unsigned long long GetRejectedRequests();
+private:
+	RateShard& ShardFor(unsigned long key);
+	static unsigned long PrefixOf(unsigned long addr);
+	static long long NowMs();
+	void Refill(ClientBucket& bucket, long long now);
+	void AgeShard(RateShard& shard, long long now);
+	RateShard shards[RATE_SHARDS];
+	std::atomic<int> maxConnsPerIp{ 0 };
+	std::atomic<int> maxConnsPerPrefix{ 0 };
+	std::atomic<double> reqsPerSec{ 0 };
+	std::atomic<double> bytesPerSec{ 0 };
+	std::atomic<unsigned long long> rejectedConnections{ 0 };
+	std::atomic<unsigned long long> rejectedRequests{ 0 };
+};
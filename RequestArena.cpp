@@ -0,0 +1,252 @@
+#include "RequestArena.h"
+#include "BufferBudget.h"
+#include <Windows.h>
+
+std::mutex RequestArena::sharedMutex;
+ArenaBlock* RequestArena::shared[ARENA_MAX_NODES];
+int RequestArena::sharedCount[ARENA_MAX_NODES];
+bool RequestArena::largePages = false;
+
+static thread_local ArenaBlock* localBlocks = nullptr;
+static thread_local ArenaBlock* localTail = nullptr;
+static thread_local int localCount = 0;
+static thread_local int arenaOsNode = -1; //-1 for threads that aren't on a node, their blocks are pooled with node 0's
+
+RequestArena::RequestArena()
+{
+}
+
+RequestArena::~RequestArena()
+{
+	Reset();
+}
+
+bool RequestArena::EnableLargePages()
+{
+	//Call before Init. Needs the "Lock pages in memory" right for the account, without it we carry on with normal pages.
+	HANDLE token = NULL;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+
+	TOKEN_PRIVILEGES privileges = { 0 };
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool enabled = LookupPrivilegeValueA(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS; //AdjustTokenPrivileges succeeds even when the right isn't held
+	CloseHandle(token);
+
+	size_t pageSize = GetLargePageMinimum();
+	largePages = enabled && pageSize && ARENA_SLAB_SIZE % pageSize == 0;
+	return largePages;
+}
+
+void RequestArena::SetBudget(BufferBudget* budget)
+{
+	//Blocks and oversize pages count against budget from when they're taken until Reset
+	this->budget = budget;
+}
+
+void RequestArena::SetThreadNode(int osNode)
+{
+	arenaOsNode = osNode >= 0 && osNode < ARENA_MAX_NODES ? osNode : -1;
+}
+
+void* RequestArena::AllocPages(size_t size, bool large)
+{
+	DWORD type = MEM_RESERVE | MEM_COMMIT | (large ? MEM_LARGE_PAGES : 0);
+	if (arenaOsNode >= 0)
+	{
+		return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, type, PAGE_READWRITE, (DWORD)arenaOsNode);
+	}
+	return VirtualAlloc(NULL, size, type, PAGE_READWRITE);
+}
+
+bool RequestArena::Carve()
+{
+	//Slabs are never given back, blocks only move between the free lists
+	char* slab = nullptr;
+	if (largePages)
+	{
+		slab = (char*)AllocPages(ARENA_SLAB_SIZE, true);
+		if (!slab)
+		{
+			//Large pages run out once physical memory is fragmented, stop asking
+			largePages = false;
+		}
+	}
+	if (!slab)
+	{
+		slab = (char*)AllocPages(ARENA_SLAB_SIZE, false);
+	}
+	if (!slab)
+	{
+		return false;
+	}
+
+	for (size_t offset = 0; offset + ARENA_BLOCK_SIZE <= ARENA_SLAB_SIZE; offset += ARENA_BLOCK_SIZE)
+	{
+		ArenaBlock* block = (ArenaBlock*)(slab + offset);
+		block->size = ARENA_BLOCK_SIZE - sizeof(ArenaBlock);
+		GiveBlocks(block, block, 1);
+	}
+	return true;
+}
+
+ArenaBlock* RequestArena::TakeBlock()
+{
+	if (!localBlocks)
+	{
+		//Refill half a cache's worth at once so the shared lock is taken rarely
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		int node = arenaOsNode >= 0 ? arenaOsNode : 0;
+		while (shared[node] && localCount < ARENA_LOCAL_MAX / 2)
+		{
+			ArenaBlock* block = shared[node];
+			shared[node] = block->next;
+			--sharedCount[node];
+			block->next = localBlocks;
+			localBlocks = block;
+			if (!localTail)
+			{
+				localTail = block;
+			}
+			++localCount;
+		}
+	}
+
+	if (!localBlocks && !Carve())
+	{
+		return nullptr;
+	}
+
+	ArenaBlock* block = localBlocks;
+	localBlocks = block->next;
+	if (!localBlocks)
+	{
+		localTail = nullptr;
+	}
+	--localCount;
+	block->next = nullptr;
+	return block;
+}
+
+void RequestArena::GiveBlocks(ArenaBlock* first, ArenaBlock* last, int count)
+{
+	//first..last is already linked, so this is a splice whatever the count
+	last->next = localBlocks;
+	localBlocks = first;
+	if (!localTail)
+	{
+		localTail = last;
+	}
+	localCount += count;
+
+	if (localCount > ARENA_LOCAL_MAX)
+	{
+		//Another worker on the node may be short, the whole cache goes across in one splice
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		int node = arenaOsNode >= 0 ? arenaOsNode : 0;
+		localTail->next = shared[node];
+		shared[node] = localBlocks;
+		sharedCount[node] += localCount;
+		localBlocks = nullptr;
+		localTail = nullptr;
+		localCount = 0;
+	}
+}
+
+void* RequestArena::Alloc(size_t size)
+{
+	//nullptr when out of memory, like malloc
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > ARENA_BLOCK_SIZE - sizeof(ArenaBlock))
+	{
+		ArenaBlock* big = (ArenaBlock*)AllocPages(sizeof(ArenaBlock) + size, false);
+		if (!big)
+		{
+			return nullptr;
+		}
+		big->size = size;
+		big->next = oversize;
+		oversize = big;
+		if (budget)
+		{
+			budget->Charge(sizeof(ArenaBlock) + size);
+			charged += sizeof(ArenaBlock) + size;
+		}
+		return big + 1;
+	}
+
+	if (!cursor || (size_t)(end - cursor) < size)
+	{
+		ArenaBlock* block = TakeBlock();
+		if (!block)
+		{
+			return nullptr;
+		}
+
+		if (current)
+		{
+			current->next = block;
+		}
+		else
+		{
+			first = block;
+		}
+		current = block;
+		++blockCount;
+		if (budget)
+		{
+			budget->Charge(ARENA_BLOCK_SIZE);
+			charged += ARENA_BLOCK_SIZE;
+		}
+		cursor = (char*)(block + 1);
+		end = cursor + block->size;
+	}
+
+	void* ptr = cursor;
+	cursor += size;
+	return ptr;
+}
+
+void RequestArena::Reset()
+{
+	//Everything handed out since the last Reset is gone after this
+	if (first)
+	{
+		GiveBlocks(first, current, blockCount);
+		first = nullptr;
+		current = nullptr;
+		blockCount = 0;
+		cursor = nullptr;
+		end = nullptr;
+	}
+
+	while (oversize)
+	{
+		ArenaBlock* next = oversize->next;
+		VirtualFree(oversize, 0, MEM_RELEASE);
+		oversize = next;
+	}
+
+	if (budget && charged)
+	{
+		budget->Refund(charged);
+		charged = 0;
+	}
+}
+
+size_t RequestArena::GetPooledBytes()
+{
+	//Shared lists only, per thread caches aren't visible from here
+	std::lock_guard<std::mutex> lock(sharedMutex);
+	size_t total = 0;
+	for (int node = 0; node < ARENA_MAX_NODES; node++)
+	{
+		total += (size_t)sharedCount[node] * ARENA_BLOCK_SIZE;
+	}
+	return total;
+}
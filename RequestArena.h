@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+#include <mutex>
+
+#define ARENA_BLOCK_SIZE (128 * 1024) //Room for a send chunk, its header and the request's other scratch
+#define ARENA_SLAB_SIZE (2 * 1024 * 1024) //Blocks are carved from slabs this big, one large page when those are on
+#define ARENA_LOCAL_MAX 32 //Per thread, before the thread's free blocks are handed to its node's shared list
+#define ARENA_MAX_NODES 16
+#define ARENA_ALIGN 16
+
+class BufferBudget;
+
+struct ArenaBlock
+{
+	ArenaBlock* next;
+	size_t size; //Usable bytes after this header
+};
+
+//Bump allocator for everything that lives as long as one request: parsed headers, paths, generated bodies, send buffers.
+//Nothing is freed piecemeal, Reset hands every block back at once when the response is done.
+//Blocks come from per thread free lists backed by per NUMA node shared lists, like FramePool, so an idle connection holds no memory
+//and a request never touches the global heap. Anything bigger than a block gets pages of its own, released on Reset.
+//Not thread safe, a connection only ever runs on one thread at a time.
+class RequestArena
+{
+public:
+	RequestArena();
+	~RequestArena();
+	void* Alloc(size_t size);
+	void Reset();
+	void SetBudget(BufferBudget* budget);
+	static bool EnableLargePages();
+	static void SetThreadNode(int osNode);
+	static size_t GetPooledBytes();
+private:
+	static ArenaBlock* TakeBlock();
+	static void GiveBlocks(ArenaBlock* first, ArenaBlock* last, int count);
+	static bool Carve();
+	static void* AllocPages(size_t size, bool large);
+	ArenaBlock* first = nullptr;
+	ArenaBlock* current = nullptr;
+	int blockCount = 0;
+	char* cursor = nullptr;
+	char* end = nullptr;
+	ArenaBlock* oversize = nullptr; //Own pages each, VirtualFree'd on Reset
+	BufferBudget* budget = nullptr;
+	long long charged = 0; //Charged to budget since the last Reset
+	static std::mutex sharedMutex;
+	static ArenaBlock* shared[ARENA_MAX_NODES];
+	static int sharedCount[ARENA_MAX_NODES];
+	static bool largePages;
+};
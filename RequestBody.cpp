@@ -0,0 +1,236 @@
+#include "RequestBody.h"
+#include <atomic>
+
+int ChunkScanner::Feed(const char* p, int n, char* out, int* consumed)
+{
+	int written = 0;
+	int i = 0;
+	for (; i < n && state != DONE && state != BAD; i++)
+	{
+		char c = p[i];
+		switch (state)
+		{
+			case SIZE:
+			{
+				int v = (c >= '0' && c <= '9') ? c - '0' : ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') ? (c | 0x20) - 'a' + 10 : -1;
+				if (v >= 0 && sizeDigits < 15)
+				{
+					remaining = (remaining << 4) | v;
+					++sizeDigits;
+				}
+				else if (sizeDigits && (c == ';' || c == ' ' || c == '\t'))
+				{
+					state = SIZE_EXT;
+				}
+				else if (sizeDigits && c == '\r')
+				{
+					state = SIZE_LF;
+				}
+				else
+				{
+					state = BAD;
+				}
+				break;
+			}
+			case SIZE_EXT:
+				if (c == '\r')
+				{
+					state = SIZE_LF;
+				}
+				break;
+			case SIZE_LF:
+				if (c != '\n')
+				{
+					state = BAD;
+				}
+				else if (remaining == 0)
+				{
+					state = TRAILER;
+					trailerLineLen = 0;
+				}
+				else
+				{
+					state = DATA;
+				}
+				break;
+			case DATA:
+			{
+				long long take = n - i < remaining ? n - i : remaining;
+				if (out)
+				{
+					memmove(out + written, p + i, (size_t)take);
+					written += (int)take;
+				}
+				remaining -= take;
+				i += (int)take - 1;
+				if (remaining == 0)
+				{
+					state = DATA_CR;
+				}
+				break;
+			}
+			case DATA_CR:
+				state = c == '\r' ? DATA_LF : BAD;
+				break;
+			case DATA_LF:
+				state = c == '\n' ? SIZE : BAD;
+				sizeDigits = 0;
+				break;
+			case TRAILER:
+				if (c == '\r')
+				{
+					state = TRAILER_LF;
+				}
+				else
+				{
+					++trailerLineLen;
+				}
+				break;
+			case TRAILER_LF:
+				if (c != '\n')
+				{
+					state = BAD;
+				}
+				else if (trailerLineLen == 0)
+				{
+					state = DONE;
+				}
+				else
+				{
+					trailerLineLen = 0;
+					state = TRAILER;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (consumed)
+	{
+		*consumed = i;
+	}
+	return written;
+}
+
+UploadFile::UploadFile()
+{
+}
+
+UploadFile::~UploadFile()
+{
+	Abort();
+}
+
+bool UploadFile::Open(const char* path)
+{
+	static std::atomic<unsigned int> uploadCounter{ 0 };
+
+	if (!path || !path[0] || file != INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	finalPath = path;
+	if (!CreateParentDirs(finalPath))
+	{
+		return false;
+	}
+
+	char suffix[64];
+	sprintf_s(suffix, ".%lu.%u%s", GetCurrentProcessId(), ++uploadCounter, UPLOAD_TEMP_SUFFIX);
+	tempPath = finalPath + suffix;
+
+	//Sequential write only, nobody else gets to see it until Commit
+	file = CreateFileA(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	written = 0;
+	return file != INVALID_HANDLE_VALUE;
+}
+
+bool UploadFile::Write(const char* buf, int len)
+{
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	while (len > 0)
+	{
+		DWORD done = 0;
+		if (!WriteFile(file, buf, (DWORD)len, &done, NULL) || done == 0)
+		{
+			return false;
+		}
+
+		buf += done;
+		len -= done;
+		written += done;
+	}
+	return true;
+}
+
+bool UploadFile::Commit(bool& replaced)
+{
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+
+	replaced = GetFileAttributesA(finalPath.c_str()) != INVALID_FILE_ATTRIBUTES;
+	if (!MoveFileExA(tempPath.c_str(), finalPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		DeleteFileA(tempPath.c_str());
+		tempPath.clear();
+		return false;
+	}
+
+	tempPath.clear();
+	return true;
+}
+
+void UploadFile::Abort()
+{
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+
+	if (!tempPath.empty())
+	{
+		DeleteFileA(tempPath.c_str());
+		tempPath.clear();
+	}
+}
+
+long long UploadFile::GetWritten()
+{
+	return written;
+}
+
+bool UploadFile::CreateParentDirs(const std::string& path)
+{
+	//Builds land in fresh directories (builds/1234/app.zip), make whatever's missing on the way down
+	for (size_t i = 1; i < path.size(); i++)
+	{
+		if (path[i] != '\\' && path[i] != '/')
+		{
+			continue;
+		}
+
+		std::string dir = path.substr(0, i);
+		if (dir == ".")
+		{
+			continue;
+		}
+
+		if (!CreateDirectoryA(dir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <Windows.h>
+#include <string>
+
+#define MAX_REQUEST_BODY (64LL * 1024 * 1024) //Default limit for bodies handed to a callback
+#define MAX_UPLOAD_SIZE (16LL * 1024 * 1024 * 1024) //Default limit for uploads to disk
+#define BODY_BUF_SIZE (256 * 1024)
+#define BODY_READ_TIMEOUT_MS 30000 //Client sending nothing for this long mid-body is dropped
+#define UPLOAD_TEMP_SUFFIX ".winweb-upload"
+
+enum BodyResult
+{
+	BODY_OK,
+	BODY_TOO_LARGE,
+	BODY_BAD, //Malformed chunked encoding
+	BODY_SINK_FAILED, //Disk full, handler said stop etc
+	BODY_CLOSED //Client went away or timed out
+};
+
+//What the request head says about a body
+struct BodyInfo
+{
+	long long contentLength = -1;
+	bool chunked = false;
+	bool expectContinue = false;
+	bool bad = false; //Conflicting or unparseable framing, the connection can't be trusted after this
+	bool Present() const
+	{
+		return chunked || contentLength > 0;
+	}
+};
+
+//Walks a chunked body a byte at a time, optionally copying just the payload out as it goes
+struct ChunkScanner
+{
+	enum State
+	{
+		SIZE,
+		SIZE_EXT,
+		SIZE_LF,
+		DATA,
+		DATA_CR,
+		DATA_LF,
+		TRAILER,
+		TRAILER_LF,
+		DONE,
+		BAD
+	};
+
+	State state = SIZE;
+	long long remaining = 0;
+	int sizeDigits = 0;
+	int trailerLineLen = 0;
+
+	//out may be p itself, the payload never gets ahead of the input. Returns how many payload bytes went to out, consumed
+	//gets how much of p was body, anything past it once DONE belongs to whatever comes next.
+	int Feed(const char* p, int n, char* out = nullptr, int* consumed = nullptr);
+};
+
+//Writes an upload to a temp file next to its destination and only moves it into place once the whole body is in,
+//so a half finished upload never shows up in the index or replaces a good file
+class UploadFile
+{
+public:
+	UploadFile();
+	~UploadFile();
+	bool Open(const char* path);
+	bool Write(const char* buf, int len);
+	bool Commit(bool& replaced);
+	void Abort();
+	long long GetWritten();
+private:
+	static bool CreateParentDirs(const std::string& path);
+	HANDLE file = INVALID_HANDLE_VALUE;
+	std::string finalPath;
+	std::string tempPath;
+	long long written = 0;
+};
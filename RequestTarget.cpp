@@ -0,0 +1,244 @@
+#include "RequestTarget.h"
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define REQUEST_TARGET_SSE2
+#include <emmintrin.h>
+#endif
+
+int RequestTarget::FindTargetEnd(const char* target, int maxLen)
+{
+	int i = 0;
+	while (i < maxLen && target[i] && target[i] != ' ' && target[i] != '\r' && target[i] != '\n')
+	{
+		++i;
+	}
+	return i;
+}
+
+int RequestTarget::HexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	c |= 0x20; //Lower case
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+int RequestTarget::ScanPlain(const char* target, int targetLen)
+{
+	//Returns how many leading bytes can be copied as they are: no escapes, query, '\', ':', control bytes,
+	//"//" or "/." sequences. Most targets are entirely plain so this decides the whole request in a few compares.
+	int i = 0;
+	bool prevSlash = true; //Target always begins with '/', which is stripped before we get here
+
+#ifdef REQUEST_TARGET_SSE2
+	const __m128i pct = _mm_set1_epi8('%');
+	const __m128i qry = _mm_set1_epi8('?');
+	const __m128i frag = _mm_set1_epi8('#');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i colon = _mm_set1_epi8(':');
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i dot = _mm_set1_epi8('.');
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+
+	while (i + 16 <= targetLen)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(target + i));
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, qry)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, frag), _mm_cmpeq_epi8(v, bslash)));
+		special = _mm_or_si128(special, _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, del)));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v)); //Bytes <= 0x1f
+
+		unsigned int specialMask = (unsigned int)_mm_movemask_epi8(special);
+		unsigned int slashMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+		unsigned int dotMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot));
+
+		//A '/' or '.' directly after a '/' (including one carried over from the previous block) starts a segment we have to inspect
+		unsigned int afterSlash = (slashMask << 1) | (prevSlash ? 1u : 0u);
+		specialMask |= afterSlash & (slashMask | dotMask);
+
+		if (specialMask)
+		{
+			unsigned int first = 0;
+			while (!(specialMask & (1u << first)))
+			{
+				++first;
+			}
+			return i + (int)first;
+		}
+
+		prevSlash = (slashMask & 0x8000) != 0;
+		i += 16;
+	}
+#endif
+
+	for (; i < targetLen; i++)
+	{
+		unsigned char c = (unsigned char)target[i];
+		if (c == '%' || c == '?' || c == '#' || c == '\\' || c == ':' || c <= 0x1f || c == 0x7f)
+		{
+			return i;
+		}
+		if (prevSlash && (c == '/' || c == '.'))
+		{
+			return i;
+		}
+		prevSlash = c == '/';
+	}
+
+	return targetLen;
+}
+
+bool RequestTarget::CollapseSegments(char* path, int& len)
+{
+	//Removes empty, "." and ".." segments in place, refusing to climb above the root
+	int write = 0;
+	int read = 0;
+
+	while (read < len)
+	{
+		int segEnd = read;
+		while (segEnd < len && path[segEnd] != '/')
+		{
+			++segEnd;
+		}
+
+		int segLen = segEnd - read;
+		bool last = segEnd >= len;
+
+		if (segLen == 0 || (segLen == 1 && path[read] == '.'))
+		{
+			//Nothing to keep
+		}
+		else if (segLen == 2 && path[read] == '.' && path[read + 1] == '.')
+		{
+			if (write == 0)
+			{
+				return false;
+			}
+
+			//Back up over the previous segment and its separator
+			--write;
+			while (write > 0 && path[write - 1] != '/')
+			{
+				--write;
+			}
+		}
+		else
+		{
+			memmove(&path[write], &path[read], segLen);
+			write += segLen;
+			if (!last)
+			{
+				path[write++] = '/';
+			}
+		}
+
+		read = segEnd + 1;
+	}
+
+	len = write;
+	path[len] = 0;
+	return true;
+}
+
+DecodeResult RequestTarget::Decode(const char* target, int targetLen, char* out, int outSize, int& outLen)
+{
+	outLen = 0;
+	if (!target || !out || outSize <= 0)
+	{
+		return DECODE_TOO_LONG;
+	}
+
+	//Absolute-form isn't something we proxy, only origin-form is accepted
+	while (targetLen > 0 && *target == '/')
+	{
+		++target;
+		--targetLen;
+	}
+
+	int plain = ScanPlain(target, targetLen);
+	if (plain == targetLen)
+	{
+		//Fast path, nothing to decode or collapse
+		if (targetLen >= outSize)
+		{
+			return DECODE_TOO_LONG;
+		}
+		memcpy(out, target, targetLen);
+		out[targetLen] = 0;
+		outLen = targetLen;
+		return DECODE_OK;
+	}
+
+	if (plain >= outSize)
+	{
+		return DECODE_TOO_LONG;
+	}
+	memcpy(out, target, plain);
+	int written = plain;
+
+	for (int i = plain; i < targetLen; i++)
+	{
+		char c = target[i];
+		if (c == '?' || c == '#')
+		{
+			break;
+		}
+
+		bool escaped = c == '%';
+		if (escaped)
+		{
+			if (i + 2 >= targetLen)
+			{
+				return DECODE_BAD_ESCAPE;
+			}
+
+			int hi = HexValue(target[i + 1]);
+			int lo = HexValue(target[i + 2]);
+			if (hi < 0 || lo < 0)
+			{
+				return DECODE_BAD_ESCAPE;
+			}
+
+			c = (char)((hi << 4) | lo);
+			i += 2;
+		}
+
+		//Checked after decoding so "%00" and "%3a" can't slip through either. A bare '\' is a Windows client's separator,
+		//an escaped one ("..%5c..") has no use but getting past a filter that only looks for '/'.
+		unsigned char uc = (unsigned char)c;
+		if (uc <= 0x1f || uc == 0x7f || c == ':' || (escaped && c == '\\'))
+		{
+			return DECODE_BAD_CHAR;
+		}
+		if (c == '\\')
+		{
+			c = '/';
+		}
+
+		if (written + 1 >= outSize)
+		{
+			return DECODE_TOO_LONG;
+		}
+		out[written++] = c;
+	}
+
+	out[written] = 0;
+	if (!CollapseSegments(out, written))
+	{
+		outLen = 0;
+		out[0] = 0;
+		return DECODE_OUTSIDE_ROOT;
+	}
+
+	outLen = written;
+	return DECODE_OK;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+enum DecodeResult
+{
+	DECODE_OK,
+	DECODE_BAD_ESCAPE,
+	DECODE_BAD_CHAR,
+	DECODE_TOO_LONG,
+	DECODE_OUTSIDE_ROOT
+};
+
+//Turns a raw request-target ("/a/b%20c/../d.html?x=1") into a path relative to the document root ("a/d.html")
+class RequestTarget
+{
+public:
+	static DecodeResult Decode(const char* target, int targetLen, char* out, int outSize, int& outLen);
+	static int FindTargetEnd(const char* target, int maxLen);
+private:
+	static int ScanPlain(const char* target, int targetLen);
+	static int HexValue(char c);
+	static bool CollapseSegments(char* path, int& len);
+};
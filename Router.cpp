@@ -0,0 +1,340 @@
+#include "Router.h"
+#include <string.h>
+
+Router::BuildNode::BuildNode()
+{
+	for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+	{
+		exact[i] = -1;
+		prefix[i] = -1;
+	}
+}
+
+Router::BuildNode::~BuildNode()
+{
+	for (auto& child : children)
+	{
+		delete child.second;
+	}
+	delete param;
+}
+
+Router::Router()
+{
+	buildRoot = new BuildNode();
+}
+
+Router::~Router()
+{
+	delete buildRoot;
+}
+
+RouteMethod Router::ParseMethod(const char* method, int len)
+{
+	static const char* names[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH" };
+	for (int i = 0; i < METHOD_OTHER; i++)
+	{
+		if ((int)strlen(names[i]) == len && !strncmp(method, names[i], len))
+		{
+			return (RouteMethod)i;
+		}
+	}
+	return METHOD_OTHER;
+}
+
+bool Router::Add(int methods, const char* pattern, const Route& route)
+{
+	if (compiled || !pattern || !methods)
+	{
+		return false;
+	}
+
+	//Paths are matched after RequestTarget::Decode, which leaves no leading slash
+	while (*pattern == '/')
+	{
+		++pattern;
+	}
+
+	int index = (int)routes.size();
+	routes.push_back(route);
+	routes.back().pattern = pattern;
+
+	BuildNode* node = buildRoot;
+	bool isPrefix = false;
+	for (const char* it = pattern; *it; ++it)
+	{
+		if (*it == '*')
+		{
+			//Only valid at the end
+			if (it[1])
+			{
+				routes.pop_back();
+				return false;
+			}
+			isPrefix = true;
+			break;
+		}
+		else if (*it == ':' && (it == pattern || it[-1] == '/'))
+		{
+			const char* nameEnd = it + 1;
+			while (*nameEnd && *nameEnd != '/')
+			{
+				++nameEnd;
+			}
+
+			if (!node->param)
+			{
+				node->param = new BuildNode();
+				node->param->paramName.assign(it + 1, nameEnd - it - 1);
+			}
+			node = node->param;
+			it = nameEnd - 1;
+		}
+		else
+		{
+			BuildNode*& child = node->children[*it];
+			if (!child)
+			{
+				child = new BuildNode();
+			}
+			node = child;
+		}
+	}
+
+	int* slots = isPrefix ? node->prefix : node->exact;
+	for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+	{
+		if ((methods & (1 << i)) && slots[i] < 0)
+		{
+			slots[i] = index;
+		}
+	}
+	return true;
+}
+
+bool Router::Compile()
+{
+	//Collapse single child chains into labelled edges and lay every node's children out next to each other
+	nodes.clear();
+	labels.clear();
+	paramNames.clear();
+
+	nodes.push_back(Node());
+	for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+	{
+		nodes[0].exact[i] = (short)buildRoot->exact[i];
+		nodes[0].prefix[i] = (short)buildRoot->prefix[i];
+		nodes[0].hasExact |= buildRoot->exact[i] >= 0;
+		nodes[0].hasPrefix |= buildRoot->prefix[i] >= 0;
+	}
+	EmitChildren(buildRoot, 0);
+
+	compiled = true;
+	return true;
+}
+
+int Router::Emit(BuildNode* node, const std::string& label)
+{
+	Node out;
+	out.labelStart = (unsigned int)labels.size();
+	out.labelLen = (unsigned int)label.size();
+	labels += label;
+
+	for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+	{
+		out.exact[i] = (short)node->exact[i];
+		out.prefix[i] = (short)node->prefix[i];
+		out.hasExact |= node->exact[i] >= 0;
+		out.hasPrefix |= node->prefix[i] >= 0;
+	}
+
+	nodes.push_back(out);
+	return (int)nodes.size() - 1;
+}
+
+void Router::EmitChildren(BuildNode* node, int index)
+{
+	std::vector<std::pair<std::string, BuildNode*>> edges;
+	for (auto& child : node->children)
+	{
+		std::string label(1, child.first);
+		BuildNode* end = child.second;
+		while (end->children.size() == 1 && !end->param)
+		{
+			bool hasRoute = false;
+			for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+			{
+				hasRoute |= end->exact[i] >= 0 || end->prefix[i] >= 0;
+			}
+			if (hasRoute)
+			{
+				break;
+			}
+
+			label += end->children.begin()->first;
+			end = end->children.begin()->second;
+		}
+		edges.push_back({ label, end });
+	}
+
+	//Children are contiguous, so they're all emitted before any of their own children
+	nodes[index].firstChild = (unsigned int)nodes.size();
+	nodes[index].childCount = (unsigned int)edges.size();
+	for (int i = 0; i < edges.size(); i++)
+	{
+		Emit(edges[i].second, edges[i].first);
+	}
+
+	unsigned int first = nodes[index].firstChild;
+	for (int i = 0; i < edges.size(); i++)
+	{
+		EmitChildren(edges[i].second, first + i);
+	}
+
+	if (node->param)
+	{
+		int paramIndex = Emit(node->param, "");
+		nodes[index].paramChild = paramIndex;
+		nodes[paramIndex].paramName = (int)paramNames.size();
+		paramNames.push_back(node->param->paramName);
+		EmitChildren(node->param, paramIndex);
+	}
+}
+
+int Router::PickRoute(const short* slots, RouteMethod method)
+{
+	if (slots[method] >= 0)
+	{
+		return slots[method];
+	}
+
+	//HEAD is answered by anything that answers GET
+	return method == METHOD_HEAD ? slots[METHOD_GET] : -1;
+}
+
+RouteResult Router::Match(RouteMethod method, const char* path, int pathLen, RouteMatch& match) const
+{
+	match.route = nullptr;
+	match.method = method;
+	match.path = path;
+	match.pathLen = pathLen;
+	match.paramCount = 0;
+
+	if (!compiled)
+	{
+		return ROUTE_NOT_FOUND;
+	}
+
+	MatchState state;
+	state.method = method;
+	state.path = path;
+	state.pathLen = pathLen;
+	if (MatchNode(0, 0, match, state))
+	{
+		return ROUTE_MATCHED;
+	}
+
+	if (state.bestPrefix >= 0)
+	{
+		match.route = &routes[state.bestPrefix];
+		match.rest = path + state.bestPrefixPos;
+		match.restLen = pathLen - state.bestPrefixPos;
+		match.paramCount = state.bestParamCount;
+		memcpy(match.params, state.bestParams, sizeof(RouteParam) * state.bestParamCount);
+		return ROUTE_MATCHED;
+	}
+
+	return state.otherMethod ? ROUTE_METHOD_NOT_ALLOWED : ROUTE_NOT_FOUND;
+}
+
+bool Router::MatchNode(int index, int pos, RouteMatch& match, MatchState& state) const
+{
+	//True on an exact match. Every node is reached by one path through the trie and so at one position, which keeps the backtracking linear.
+	const Node& node = nodes[index];
+	const char* path = state.path;
+	int pathLen = state.pathLen;
+
+	bool boundary = pos == 0 || pos == pathLen || path[pos - 1] == '/' || path[pos] == '/';
+	if (node.hasPrefix && boundary)
+	{
+		int route = PickRoute(node.prefix, state.method);
+		if (route < 0)
+		{
+			state.otherMethod = true;
+		}
+		else if (state.bestPrefix < 0 || pos > state.bestPrefixPos)
+		{
+			state.bestPrefix = route;
+			state.bestPrefixPos = pos;
+			state.bestParamCount = match.paramCount;
+			memcpy(state.bestParams, match.params, sizeof(RouteParam) * match.paramCount);
+		}
+	}
+
+	if (pos == pathLen)
+	{
+		if (node.hasExact)
+		{
+			int route = PickRoute(node.exact, state.method);
+			if (route >= 0)
+			{
+				match.route = &routes[route];
+				match.rest = path + pos;
+				match.restLen = 0;
+				return true;
+			}
+			state.otherMethod = true;
+		}
+		return false;
+	}
+
+	//Literal edges first, picked by their first byte
+	for (unsigned int c = node.firstChild; c < node.firstChild + node.childCount; c++)
+	{
+		const Node& child = nodes[c];
+		if (labels[child.labelStart] == path[pos])
+		{
+			if (pathLen - pos >= (int)child.labelLen && !memcmp(labels.data() + child.labelStart, path + pos, child.labelLen) && MatchNode((int)c, pos + child.labelLen, match, state))
+			{
+				return true;
+			}
+			break;
+		}
+	}
+
+	//Then the :param, e.g. /files/indexes when only /files/index is literal
+	if (node.paramChild >= 0 && path[pos] != '/')
+	{
+		int end = pos;
+		while (end < pathLen && path[end] != '/')
+		{
+			++end;
+		}
+
+		int paramCount = match.paramCount;
+		if (paramCount < ROUTE_MAX_PARAMS)
+		{
+			RouteParam& param = match.params[match.paramCount++];
+			param.name = paramNames[nodes[node.paramChild].paramName].c_str();
+			param.value = path + pos;
+			param.len = end - pos;
+		}
+
+		if (MatchNode(node.paramChild, end, match, state))
+		{
+			return true;
+		}
+		match.paramCount = paramCount;
+	}
+	return false;
+}
+
+size_t Router::GetRouteCount()
+{
+	return routes.size();
+}
+
+size_t Router::GetNodeCount()
+{
+	return nodes.size();
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+
+#define ROUTE_MAX_PARAMS 8
+
+enum RouteMethod
+{
+	METHOD_GET,
+	METHOD_HEAD,
+	METHOD_POST,
+	METHOD_PUT,
+	METHOD_DELETE,
+	METHOD_OPTIONS,
+	METHOD_PATCH,
+	METHOD_OTHER,
+	ROUTE_METHOD_COUNT
+};
+
+#define ROUTE_GET (1 << METHOD_GET)
+#define ROUTE_HEAD (1 << METHOD_HEAD)
+#define ROUTE_POST (1 << METHOD_POST)
+#define ROUTE_PUT (1 << METHOD_PUT)
+#define ROUTE_DELETE (1 << METHOD_DELETE)
+#define ROUTE_READ (ROUTE_GET | ROUTE_HEAD)
+#define ROUTE_ANY ((1 << ROUTE_METHOD_COUNT) - 1)
+
+enum RouteKind
+{
+	ROUTE_STATIC, //Files only
+	ROUTE_LISTING, //Files, and an index page for directories
+	ROUTE_PROXY,
+	ROUTE_REDIRECT,
+	ROUTE_METRICS,
+	ROUTE_TRACE,
+	ROUTE_CALLBACK,
+	ROUTE_UPLOAD, //PUT/POST bodies written to disk under the route's directory
+	ROUTE_PACK //Files out of the mapped site pack
+};
+
+enum RouteResult
+{
+	ROUTE_MATCHED,
+	ROUTE_NOT_FOUND,
+	ROUTE_METHOD_NOT_ALLOWED
+};
+
+struct Response;
+struct RouteMatch;
+struct ProxyRoute;
+
+typedef std::function<void(const RouteMatch&, Response&)> RouteCallback;
+typedef std::function<bool(const RouteMatch&, const char*, int)> RouteBodyCallback; //Called per piece of the body as it arrives, false stops the upload
+
+struct Route
+{
+	RouteKind kind = ROUTE_STATIC;
+	std::string pattern;
+	std::string target; //Directory for static/listing/upload, location for redirects
+	ProxyRoute* proxyRoute = nullptr;
+	RouteCallback callback;
+	RouteBodyCallback bodyCallback; //Optional, without it a callback route doesn't accept a body
+	long long maxBody = 0; //0 for the default limit
+};
+
+struct RouteParam
+{
+	const char* name;
+	const char* value;
+	int len;
+};
+
+//Filled in by Match, points into the path that was matched and the router, nothing is allocated
+struct RouteMatch
+{
+	const Route* route = nullptr;
+	RouteMethod method = METHOD_OTHER;
+	const char* path = nullptr;
+	int pathLen = 0;
+	const char* rest = nullptr; //What a trailing * matched
+	int restLen = 0;
+	RouteParam params[ROUTE_MAX_PARAMS];
+	int paramCount = 0;
+};
+
+//Routes are registered by method and pattern, then compiled once into a radix trie so matching costs one pass over the path however many routes there are.
+//Patterns are paths with :name for a single segment and a trailing * for everything below, e.g. /api/*, /users/:id/posts, /
+//A literal edge is tried before a :param, and if nothing under it matches the :param is tried instead. The longest * prefix is the fallback,
+//and a prefix only ends on a segment boundary, so /api* matches /api and /api/x but not /apiary. The first registration of a pattern/method wins.
+class Router
+{
+public:
+	Router();
+	~Router();
+	bool Add(int methods, const char* pattern, const Route& route);
+	bool Compile();
+	RouteResult Match(RouteMethod method, const char* path, int pathLen, RouteMatch& match) const;
+	size_t GetRouteCount();
+	size_t GetNodeCount();
+	static RouteMethod ParseMethod(const char* method, int len);
+private:
+	struct BuildNode
+	{
+		std::map<char, BuildNode*> children;
+		BuildNode* param = nullptr;
+		std::string paramName;
+		int exact[ROUTE_METHOD_COUNT];
+		int prefix[ROUTE_METHOD_COUNT];
+		BuildNode();
+		~BuildNode();
+	};
+	struct Node
+	{
+		unsigned int labelStart = 0;
+		unsigned int labelLen = 0;
+		unsigned int firstChild = 0;
+		unsigned int childCount = 0;
+		int paramChild = -1;
+		int paramName = -1; //Index into paramNames
+		short exact[ROUTE_METHOD_COUNT];
+		short prefix[ROUTE_METHOD_COUNT];
+		bool hasExact = false;
+		bool hasPrefix = false;
+	};
+	struct MatchState
+	{
+		RouteMethod method;
+		const char* path;
+		int pathLen;
+		int bestPrefix = -1;
+		int bestPrefixPos = 0;
+		RouteParam bestParams[ROUTE_MAX_PARAMS];
+		int bestParamCount = 0;
+		bool otherMethod = false;
+	};
+	bool MatchNode(int index, int pos, RouteMatch& match, MatchState& state) const;
+	int Emit(BuildNode* node, const std::string& label);
+	void EmitChildren(BuildNode* node, int index);
+	static int PickRoute(const short* routes, RouteMethod method);
+	BuildNode* buildRoot;
+	std::vector<Route> routes;
+	std::vector<Node> nodes;
+	std::string labels;
+	std::vector<std::string> paramNames;
+	bool compiled = false;
+};
@@ -0,0 +1,292 @@
+#include "SendScheduler.h"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+SendScheduler::SendScheduler()
+{
+}
+
+SendScheduler::~SendScheduler()
+{
+}
+
+long long SendScheduler::NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SendScheduler::SetRates(long long linkBytesPerSec, long long connBytesPerSec)
+{
+	//Bytes per second, 0 turns either off and -1 keeps it. The link rate should be a little under the real uplink so the queue
+	//stays here, where it's fair, and not in the network card or the router. Can be changed while running.
+	if (linkBytesPerSec >= 0)
+	{
+		linkRate = linkBytesPerSec;
+	}
+	if (connBytesPerSec >= 0)
+	{
+		connRate = connBytesPerSec;
+	}
+}
+
+void SendScheduler::SetWeights(int interactive, int normal, int bulk)
+{
+	//0 keeps a class's current weight
+	int values[SEND_CLASS_COUNT] = { interactive, normal, bulk };
+	for (int i = 0; i < SEND_CLASS_COUNT; i++)
+	{
+		if (values[i] > 0)
+		{
+			weights[i] = values[i];
+		}
+	}
+}
+
+bool SendScheduler::IsEnabled()
+{
+	return linkRate > 0 || connRate > 0;
+}
+
+int SendScheduler::Classify(long long bodyLen, const char* contentType)
+{
+	//Big is bulk whatever it is, small is what a page needs to render. In between, text and scripts still count as page.
+	if (bodyLen >= SEND_BULK_MIN)
+	{
+		return SEND_BULK;
+	}
+	if (bodyLen <= SEND_INTERACTIVE_MAX)
+	{
+		return SEND_INTERACTIVE;
+	}
+	if (contentType && (!strncmp(contentType, "text/", 5) || strstr(contentType, "javascript") || strstr(contentType, "json") || strstr(contentType, "svg")))
+	{
+		return SEND_INTERACTIVE;
+	}
+	return SEND_NORMAL;
+}
+
+void SendScheduler::Begin(SendFlow* flow, int sendClass)
+{
+	//Owner only, before its response goes out. Nothing else reads the class.
+	flow->sendClass = sendClass >= 0 && sendClass < SEND_CLASS_COUNT ? sendClass : SEND_NORMAL;
+}
+
+void SendScheduler::Refill(long long now)
+{
+	long long rate = linkRate;
+	double burst = (double)rate * SEND_BURST_MS / 1000;
+	if (burst < SEND_QUANTUM)
+	{
+		burst = SEND_QUANTUM;
+	}
+
+	if (lastRefillMs)
+	{
+		linkTokens += (double)rate * (now - lastRefillMs) / 1000;
+	}
+	else
+	{
+		linkTokens = burst;
+	}
+	lastRefillMs = now;
+
+	if (linkTokens > burst)
+	{
+		linkTokens = burst;
+	}
+}
+
+void SendScheduler::RefillCap(SendFlow* flow, long long now)
+{
+	long long rate = connRate;
+	double burst = (double)rate * SEND_BURST_MS / 1000;
+	if (burst < SEND_QUANTUM)
+	{
+		burst = SEND_QUANTUM;
+	}
+
+	if (flow->capTokens < 0)
+	{
+		flow->capTokens = burst;
+	}
+	else
+	{
+		flow->capTokens += (double)rate * (now - flow->capRefillMs) / 1000;
+	}
+	flow->capRefillMs = now;
+
+	if (flow->capTokens > burst)
+	{
+		flow->capTokens = burst;
+	}
+}
+
+void SendScheduler::Remove(SendFlow* flow)
+{
+	for (size_t i = 0; i < flows.size(); i++)
+	{
+		if (flows[i] == flow)
+		{
+			flows[i] = flows.back();
+			flows.pop_back();
+			break;
+		}
+	}
+	flow->active = false;
+	flow->deficit = 0;
+}
+
+bool SendScheduler::StartRound(long long now)
+{
+	//The next round only starts once everyone still sending has spent this one's credit. Connections waiting on a slow
+	//client, or finished without saying so, drop out rather than holding everyone else up.
+	for (size_t i = 0; i < flows.size();)
+	{
+		SendFlow* flow = flows[i];
+		if (now - flow->lastAskMs > SEND_FLOW_IDLE_MS)
+		{
+			Remove(flow);
+			continue;
+		}
+		if (flow->round == round && flow->deficit > 0)
+		{
+			return false;
+		}
+		++i;
+	}
+
+	++round;
+	++rounds;
+	return true;
+}
+
+int SendScheduler::Take(SendFlow* flow, int want)
+{
+	//Returns how many of want bytes may go out now, 0 means wait SEND_WAIT_MS and ask again
+	long long link = linkRate;
+	long long cap = connRate;
+	if ((link <= 0 && cap <= 0) || want <= 0)
+	{
+		return want;
+	}
+
+	long long now = NowMs();
+	std::lock_guard<std::mutex> lock(sendMutex);
+	int allowed = want;
+	if (cap > 0)
+	{
+		RefillCap(flow, now);
+		if (flow->capTokens < allowed)
+		{
+			allowed = flow->capTokens > 0 ? (int)flow->capTokens : 0;
+		}
+	}
+
+	if (link > 0 && allowed > 0)
+	{
+		Refill(now);
+		flow->lastAskMs = now;
+		if (!flow->active)
+		{
+			//Joins the current round
+			flow->active = true;
+			flow->deficit = 0;
+			flow->round = 0;
+			flows.push_back(flow);
+		}
+
+		if (flow->round != round || (flow->deficit <= 0 && StartRound(now)))
+		{
+			flow->deficit += (long long)SEND_QUANTUM * weights[flow->sendClass];
+			flow->round = round;
+		}
+
+		if (flow->deficit < allowed)
+		{
+			allowed = flow->deficit > 0 ? (int)flow->deficit : 0;
+		}
+		if (linkTokens < allowed)
+		{
+			allowed = linkTokens > 0 ? (int)linkTokens : 0;
+		}
+	}
+
+	if (allowed <= 0)
+	{
+		++waits;
+		return 0;
+	}
+
+	if (link > 0)
+	{
+		flow->deficit -= allowed;
+		linkTokens -= allowed;
+	}
+	if (cap > 0)
+	{
+		flow->capTokens -= allowed;
+	}
+	sentBytes[flow->sendClass] += allowed;
+	return allowed;
+}
+
+void SendScheduler::Return(SendFlow* flow, int unused)
+{
+	//Whatever the socket didn't take goes back, so a full send buffer doesn't cost a connection its turn
+	if (unused <= 0 || !IsEnabled())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(sendMutex);
+	if (flow->active)
+	{
+		flow->deficit += unused;
+		linkTokens += unused;
+	}
+	if (flow->capTokens >= 0)
+	{
+		flow->capTokens += unused;
+	}
+	sentBytes[flow->sendClass] -= unused;
+}
+
+void SendScheduler::Done(SendFlow* flow)
+{
+	//Response sent (or the connection's going), in round robin terms its queue is empty and its credit goes
+	flow->sendClass = SEND_NORMAL;
+	if (!flow->active)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(sendMutex);
+	if (flow->active)
+	{
+		Remove(flow);
+	}
+}
+
+void SendScheduler::FormatMetrics(std::string& out)
+{
+	size_t active = 0;
+	{
+		std::lock_guard<std::mutex> lock(sendMutex);
+		active = flows.size();
+	}
+
+	char buf[640];
+	sprintf_s(buf,
+		"winweb_send_link_rate_bytes %lld\n"
+		"winweb_send_connection_rate_bytes %lld\n"
+		"winweb_send_active_flows %zu\n"
+		"winweb_send_rounds_total %llu\n"
+		"winweb_send_waits_total %llu\n"
+		"winweb_send_bytes_total{class=\"interactive\"} %llu\n"
+		"winweb_send_bytes_total{class=\"normal\"} %llu\n"
+		"winweb_send_bytes_total{class=\"bulk\"} %llu\n",
+		(long long)linkRate, (long long)connRate, active, (unsigned long long)rounds, (unsigned long long)waits,
+		(unsigned long long)sentBytes[SEND_INTERACTIVE], (unsigned long long)sentBytes[SEND_NORMAL], (unsigned long long)sentBytes[SEND_BULK]);
+	out += buf;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+#define SEND_QUANTUM 16384 //Bytes a weight of 1 is credited each round
+#define SEND_WEIGHT_INTERACTIVE 16
+#define SEND_WEIGHT_NORMAL 4
+#define SEND_WEIGHT_BULK 1
+#define SEND_INTERACTIVE_MAX (256 * 1024) //Responses this small are always interactive
+#define SEND_BULK_MIN (8 * 1024 * 1024) //And this big always bulk
+#define SEND_BURST_MS 50 //The link and per connection buckets hold this long's worth at their rate
+#define SEND_FLOW_IDLE_MS 20 //A connection that hasn't asked for this long (waiting on its client) doesn't hold up a round
+#define SEND_WAIT_MS 1 //How often a connection that's out of credit asks again
+
+enum SendClass
+{
+	SEND_INTERACTIVE,
+	SEND_NORMAL,
+	SEND_BULK,
+	SEND_CLASS_COUNT
+};
+
+//A connection's place in the schedule. Owned by the connection, everything but the class is only changed under the scheduler's mutex.
+struct SendFlow
+{
+	int sendClass = SEND_NORMAL;
+	long long deficit = 0;
+	unsigned long long round = 0; //The round it was last credited for
+	long long lastAskMs = 0;
+	std::atomic<bool> active{ false }; //Read without the lock by its owner, to skip taking it when there's nothing to do
+	double capTokens = -1; //Its own bucket when connections are capped, -1 until first used
+	long long capRefillMs = 0;
+};
+
+//Shares a configured uplink between connections by deficit round robin. Each round every connection with something to
+//send is credited SEND_QUANTUM times its class weight and may send that much, the next round starts once they've all
+//spent it. Small page assets weigh more than big downloads, so a page load gets through a link full of installers.
+//Off (everything goes as fast as the socket takes it) until a link rate is set, connections can also be capped on their own.
+class SendScheduler
+{
+public:
+	SendScheduler();
+	~SendScheduler();
+	void SetRates(long long linkBytesPerSec, long long connBytesPerSec);
+	void SetWeights(int interactive, int normal, int bulk);
+	bool IsEnabled();
+	static int Classify(long long bodyLen, const char* contentType);
+	void Begin(SendFlow* flow, int sendClass);
+	int Take(SendFlow* flow, int want);
+	void Return(SendFlow* flow, int unused);
+	void Done(SendFlow* flow);
+	void FormatMetrics(std::string& out);
+private:
+	static long long NowMs();
+	void Refill(long long now);
+	void RefillCap(SendFlow* flow, long long now);
+	bool StartRound(long long now);
+	void Remove(SendFlow* flow);
+	std::mutex sendMutex;
+	std::vector<SendFlow*> flows; //Connections with a response going out
+	unsigned long long round = 1;
+	double linkTokens = 0;
+	long long lastRefillMs = 0;
+	std::atomic<long long> linkRate{ 0 };
+	std::atomic<long long> connRate{ 0 };
+	std::atomic<int> weights[SEND_CLASS_COUNT] = { SEND_WEIGHT_INTERACTIVE, SEND_WEIGHT_NORMAL, SEND_WEIGHT_BULK };
+	std::atomic<unsigned long long> sentBytes[SEND_CLASS_COUNT] = { 0, 0, 0 };
+	std::atomic<unsigned long long> rounds{ 0 };
+	std::atomic<unsigned long long> waits{ 0 };
+};
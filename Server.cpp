@@ -7,13 +7,18 @@
 #include <chrono>
 #include <vector>
 #include "Connection.h"
+#include "Probes.h"
 
 std::vector<Connection*> connections;
+std::atomic<size_t> connectionCount{ 0 }; //connections.size(), kept up to date under conMutex for threads that wait without holding it
 Server* Server::instance = NULL;
 
 Server::Server()
 {
 	instance = this;
+	stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	closedEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+	drainEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
 }
 
 Server::~Server()
@@ -32,33 +37,892 @@ Server::~Server()
 
 	conMutex.unlock();
 	inputMutex.unlock();
+
+	if (stopEvent)
+	{
+		CloseHandle(stopEvent);
+	}
+	if (closedEvent)
+	{
+		CloseHandle(closedEvent);
+	}
+	HANDLE events[3] = { drainEvent, reloadEvent, upgradeEvent };
+	for (int i = 0; i < 3; i++)
+	{
+		if (events[i])
+		{
+			CloseHandle(events[i]);
+		}
+	}
+}
+
+void Server::Init(const char* ip, int port)
+{
+	SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+
+	servState = State::STARTUP;
+
+	WSAData data;
+	int err;
+	WORD vReq = MAKEWORD(2, 2);
+	err = WSAStartup(vReq, &data);
+	WINWEB_PROBES_REGISTER();
+
+	if (err != 0)
+	{
+		ShutdownInternal(ShutdownReason::DLL_ERR);
+		return;
+	}
+
+	//The config file has the last word on startup settings, anything it leaves out keeps what we were given
+	std::string listenIp = ip;
+	if (GetFileAttributesA(configFile.c_str()) != INVALID_FILE_ATTRIBUTES && LoadConfig(config))
+	{
+		listenIp = config.ip.empty() ? listenIp : config.ip;
+		port = config.port > 0 ? config.port : port;
+		tlsPort = config.tlsPort > 0 && tlsPort ? config.tlsPort : tlsPort;
+		if (config.workers >= 0 && !isWorker)
+		{
+			SetWorkerProcesses(config.workers);
+		}
+		ApplyConfig(config);
+
+		char configBuf[MAX_PATH + 32];
+		sprintf_s(configBuf, "Loaded settings from %s", configFile.c_str());
+		PrintToLog(configBuf);
+	}
+	listenPort = port;
+
+	ShutdownReason listenErr = ShutdownReason::NONE;
+	if (isWorker)
+	{
+		//The master bound the sockets, we get duplicates of them down our stdin
+		WorkerHandoff handoff;
+		if (!WorkerPool::ReceiveHandoff(handoff) || !workerBoard.Open(handoff.masterPid, handoff.index))
+		{
+			ShutdownInternal(ShutdownReason::WORKER_ERR);
+			return;
+		}
+		workerIndex = handoff.index;
+		servSocket = WorkerPool::OpenListener(handoff.http);
+		tlsSocket = handoff.hasTls ? WorkerPool::OpenListener(handoff.https) : INVALID_SOCKET;
+		listenErr = ShutdownReason::WORKER_ERR;
+	}
+	else if (takeoverPid)
+	{
+		//Upgrading, the old process keeps accepting on these until we say we're ready
+		UpgradeHandoff handoff;
+		if (!upgrade.Take(takeoverPid, handoff))
+		{
+			ShutdownInternal(ShutdownReason::UPGRADE_ERR);
+			return;
+		}
+		servSocket = WorkerPool::OpenListener(handoff.http);
+		tlsSocket = handoff.hasTls && tlsPort ? WorkerPool::OpenListener(handoff.https) : INVALID_SOCKET;
+		listenErr = ShutdownReason::UPGRADE_ERR;
+
+		if (servSocket != INVALID_SOCKET && ProcessUpgrade::GetPort(servSocket) != port)
+		{
+			//The config has moved us, the old port closes with the old process
+			closesocket(servSocket);
+			servSocket = CreateListenSocket(listenIp.c_str(), port, listenErr);
+		}
+	}
+	else
+	{
+		servSocket = CreateListenSocket(listenIp.c_str(), port, listenErr);
+	}
+
+	if (servSocket == INVALID_SOCKET)
+	{
+		ShutdownInternal(listenErr);
+		return;
+	}
+
+	SetNonBlocking(&servSocket);
+
+	if (servState == State::SHUTDOWN)
+	{
+		return;
+	}
+
+	if (tlsPort)
+	{
+		//HTTPS is optional, if it can't be brought up we carry on serving plain HTTP
+		const char* tlsErr = nullptr;
+		if (!tlsContext.Init(tlsCertFile.c_str(), tlsKeyFile.c_str(), &tlsErr))
+		{
+			char buf[256];
+			sprintf_s(buf, "WARNING-> %s, HTTPS disabled <-WARNING", tlsErr);
+			PrintToLog(buf);
+			if (tlsSocket != INVALID_SOCKET)
+			{
+				//A copy of the master's (or the old process's) HTTPS socket, whoever else has it still accepts from it
+				closesocket(tlsSocket);
+				tlsSocket = INVALID_SOCKET;
+			}
+		}
+		else
+		{
+			if (!isWorker && (tlsSocket == INVALID_SOCKET || ProcessUpgrade::GetPort(tlsSocket) != tlsPort))
+			{
+				if (tlsSocket != INVALID_SOCKET)
+				{
+					closesocket(tlsSocket);
+				}
+				tlsSocket = CreateListenSocket(listenIp.c_str(), tlsPort, listenErr);
+			}
+
+			if (tlsSocket == INVALID_SOCKET)
+			{
+				PrintToLog("WARNING-> Failed opening HTTPS socket, HTTPS disabled <-WARNING");
+			}
+			else
+			{
+				SetNonBlocking(&tlsSocket);
+			}
+		}
+	}
+
+	readableFunc = [this](SOCKET* sckt)
+		{
+			return Readable(sckt);
+		};
+
+
+	writableFunc = [this](SOCKET* sckt)
+		{
+			return Writable(sckt);
+		};
+
+	printFunc = [this](const char* msg)
+		{
+			return PrintToLog(msg);
+		};
+
+
+	if (!headless)
+	{
+		SetConsoleCursor();
+	}
+
+	if (workerProcesses > 0 && !isWorker)
+	{
+		RunMaster();
+		return;
+	}
+
+	if (!sitePackFile.empty())
+	{
+		//Pack mode, everything static comes out of one mapping and the document root isn't looked at
+		const char* packErr = nullptr;
+		if (!sitePack.Open(sitePackFile.c_str(), &packErr))
+		{
+			PrintToLog(packErr);
+			ShutdownInternal(ShutdownReason::SITE_PACK_ERR);
+			return;
+		}
+
+		char packBuf[256];
+		sprintf_s(packBuf, "Mapped %u files from %s (%lluKB)", sitePack.GetEntryCount(), sitePackFile.c_str(), sitePack.GetSize() / 1024);
+		PrintToLog(packBuf);
+	}
+	else
+	{
+		auto indexStart = std::chrono::steady_clock::now();
+		fileIndex.Build(DOC_ROOT);
+		auto indexTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - indexStart).count();
+
+		char indexBuf[256];
+		sprintf_s(indexBuf, "Indexed %zu entries under %s in %lldms (~%zuKB)", fileIndex.GetEntryCount(), DOC_ROOT, (long long)indexTime, fileIndex.GetMemoryUsage() / 1024);
+		PrintToLog(indexBuf);
+
+		if (!fileIndex.StartWatching())
+		{
+			PrintToLog("WARNING-> Failed to watch document root, index will not update <-WARNING");
+		}
+
+		if (!cacheIndexFile.empty())
+		{
+			//What the last process had open, so the first requests after a restart or upgrade don't all miss
+			int warmed = fileCache.Warm(cacheIndexFile.c_str());
+			char warmBuf[MAX_PATH + 64];
+			sprintf_s(warmBuf, "Reopened %d files listed in %s", warmed, cacheIndexFile.c_str());
+			PrintToLog(warmBuf);
+		}
+	}
+
+	for (size_t i = 0; i < hosts.GetHostCount(); i++)
+	{
+		//Each site gets its own index and watcher, its own file cache and limits, and the same routes as the default one
+		VirtualHost* host = hosts.GetHost(i);
+		host->fileCache.SetLimits(host->limits.fileHandles ? host->limits.fileHandles : fileCacheHandles, fileCacheRevalidateMs);
+		host->fileIndex.SetMemoryBudget(host->limits.indexBudget);
+		host->fileIndex.SetMimeOverrides(&host->mimeTypes);
+		host->fileIndex.Build(host->docRoot.c_str());
+
+		char hostBuf[512];
+		sprintf_s(hostBuf, "Host %s: %zu entries under %s (~%zuKB)%s", host->name.c_str(), host->fileIndex.GetEntryCount(), host->docRoot.c_str(), host->fileIndex.GetMemoryUsage() / 1024,
+			host->fileIndex.IsOverBudget() ? ", over its index budget" : "");
+		PrintToLog(hostBuf);
+
+		if (!host->fileIndex.StartWatching())
+		{
+			sprintf_s(hostBuf, "WARNING-> Failed to watch %s, index will not update <-WARNING", host->docRoot.c_str());
+			PrintToLog(hostBuf);
+		}
+
+		for (size_t r = 0; r < userRoutes.size(); r++)
+		{
+			host->router.Add(userRoutes[r].methods, userRoutes[r].pattern.c_str(), userRoutes[r].route);
+		}
+		Route redirect;
+		redirect.kind = ROUTE_REDIRECT;
+		redirect.target = "/index.html";
+		host->router.Add(ROUTE_READ, "/", redirect);
+		Route files;
+		files.kind = ROUTE_LISTING;
+		host->router.Add(ROUTE_READ, "/*", files);
+		host->router.Compile();
+	}
+	hosts.Compile();
+
+	reverseProxy.StartHealthChecks(printFunc);
+
+	//Built in routes go in last so anything registered before Init takes precedence
+	Route metrics;
+	metrics.kind = ROUTE_METRICS;
+	router.Add(ROUTE_READ, METRICS_PATH, metrics);
+	Route trace;
+	trace.kind = ROUTE_TRACE;
+	router.Add(ROUTE_READ, TRACE_PATH, trace);
+	Route redirect;
+	redirect.kind = ROUTE_REDIRECT;
+	redirect.target = "/index.html";
+	router.Add(ROUTE_READ, "/", redirect);
+	if (sitePack.IsOpen())
+	{
+		Route pack;
+		pack.kind = ROUTE_PACK;
+		router.Add(ROUTE_READ, "/*", pack);
+	}
+	else
+	{
+		Route files;
+		files.kind = ROUTE_LISTING;
+		router.Add(ROUTE_READ, "/*", files);
+	}
+	router.Compile();
+
+	char routeBuf[128];
+	sprintf_s(routeBuf, "Compiled %zu routes into %zu trie nodes", router.GetRouteCount(), router.GetNodeCount());
+	PrintToLog(routeBuf);
+
+	if (largePages && !RequestArena::EnableLargePages())
+	{
+		PrintToLog("WARNING-> Large pages unavailable (needs the Lock pages in memory right), request arenas use normal pages <-WARNING");
+	}
+
+	//Connections are coroutines on a handful of workers, one per core up to IO_LOOP_MAX_WORKERS
+	if (!ioLoop.Start((int)std::thread::hardware_concurrency(), pinCpus))
+	{
+		ShutdownInternal(ShutdownReason::IO_LOOP_ERR);
+		return;
+	}
+
+	char loopBuf[128];
+	sprintf_s(loopBuf, "I/O loop: %d workers over %d NUMA nodes%s", ioLoop.GetWorkerCount(), ioLoop.GetNodeCount(), pinCpus ? ", pinned" : "");
+	PrintToLog(loopBuf);
+
+	if (Tracer::GetSampleRate())
+	{
+		char traceBuf[128];
+		sprintf_s(traceBuf, "Tracing 1 in %u requests, dump with 'trace' or GET %s", Tracer::GetSampleRate(), TRACE_PATH);
+		PrintToLog(traceBuf);
+	}
+
+	services.fileIndex = &fileIndex;
+	services.proxy = &reverseProxy;
+	services.rateLimiter = &rateLimiter;
+	services.admission = &admission;
+	services.ioLoop = &ioLoop;
+	services.router = &router;
+	services.sitePack = sitePack.IsOpen() ? &sitePack : nullptr;
+	services.closedEvent = closedEvent;
+	services.hosts = hosts.GetHostCount() ? &hosts : nullptr;
+	services.fileCache = &fileCache;
+	bufferBudget.SetLoop(&ioLoop);
+	services.budget = &bufferBudget;
+	flights.SetBudget(&bufferBudget);
+	services.flights = &flights;
+	services.sends = &sendScheduler;
+	services.adminAccess = &adminAccess;
+	services.workers = isWorker ? &workerBoard : nullptr;
+
+	services.draining = &draining;
+
+	if (isWorker)
+	{
+		std::thread(&Server::WorkerLoop, this).detach();
+	}
+
+	listenThread = std::thread(&Server::ListenLoop, this);
+	listenThread.detach();
+	if (!headless)
+	{
+		inputThread = std::thread(&Server::InputLoop, this);
+		inputThread.detach();
+	}
+	if (!isWorker)
+	{
+		std::thread(&Server::ControlLoop, this).detach();
+	}
+	cleanupThread = std::thread(&Server::CleanupConnections, this);
+	cleanupThread.detach();
+
+	//Only once everything is up, the old process stops accepting as soon as it hears from us
+	upgrade.SignalReady();
+}
+
+void Server::EnableTls(int port, const char* certFile, const char* keyFile)
+{
+	tlsPort = port;
+	tlsCertFile = certFile;
+	tlsKeyFile = keyFile;
+}
+
+void Server::UseSitePack(const char* path)
+{
+	//Call before Init, a pack built by WinWebPack replaces the document root entirely
+	sitePackFile = path ? path : "";
+}
+
+void Server::SetCpuPinning(bool pin)
+{
+	//Call before Init, workers are kept on their node either way, this pins each to a single core
+	pinCpus = pin;
+}
+
+void Server::SetLargePages(bool use)
+{
+	//Call before Init, backs request arenas with large pages when the account is allowed to lock them
+	largePages = use;
+}
+
+void Server::SetWorkerProcesses(int count)
+{
+	//Call before Init. This process becomes a master that only supervises, count copies of it are started to do the serving.
+	workerProcesses = count > 0 ? count : 0;
+}
+
+void Server::SetWorker(bool worker)
+{
+	//Call before Init, for processes the master started (WORKER_ARG on the command line). Workers have no console input of their own.
+	isWorker = worker;
+	if (worker)
+	{
+		headless = true;
+		//A crash should end the process so the master can restart it, not wait on an error dialog
+		SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOGPFAULTERRORBOX);
+	}
+}
+
+void Server::RunMaster()
+{
+	//Serves nothing itself, it keeps workerProcesses workers running on the sockets we've bound
+	if (!workerPool.Start(workerProcesses, servSocket, tlsSocket, printFunc))
+	{
+		ShutdownInternal(ShutdownReason::WORKER_ERR);
+		return;
+	}
+
+	char buf[128];
+	sprintf_s(buf, "Master process, %d workers sharing the listening sockets", workerProcesses);
+	PrintToLog(buf);
+
+	servState = State::RUNNING;
+	if (!headless)
+	{
+		inputThread = std::thread(&Server::InputLoop, this);
+		inputThread.detach();
+	}
+	std::thread(&Server::ControlLoop, this).detach();
+	upgrade.SignalReady();
+}
+
+void Server::WorkerLoop()
+{
+	//Publishes our metrics for whichever process is asked for them, and shuts us down when the master closes our stdin
+	std::thread([this]
+		{
+			WorkerPool::WaitForMaster();
+			Drain();
+		}).detach();
+
+	LONG generation = workerBoard.GetConfigGeneration();
+	long long sinceAgedMs = 0;
+	do
+	{
+		sinceAgedMs += WORKER_PUBLISH_MS;
+		if (sinceAgedMs >= RATE_AGE_INTERVAL_MS)
+		{
+			rateLimiter.Age();
+			sinceAgedMs = 0;
+		}
+
+		std::string metrics;
+		Connection::FormatMetrics(&admission, &fileCache, &bufferBudget, &flights, &sendScheduler, metrics);
+		workerBoard.Publish(metrics);
+
+		if (workerBoard.GetConfigGeneration() != generation)
+		{
+			//The master was asked to reload, we each read the file for ourselves
+			generation = workerBoard.GetConfigGeneration();
+			ReloadConfig();
+		}
+	} while (WaitForSingleObject(stopEvent, WORKER_PUBLISH_MS) == WAIT_TIMEOUT);
+}
+
+void Server::ControlLoop()
+{
+	//Reloads and upgrades asked for from the console or with WinWeb --signal, one at a time. Also the rate limiter's timer.
+	DWORD count = 3;
+	if (!ProcessUpgrade::CreateControlEvents(reloadEvent, upgradeEvent))
+	{
+		PrintToLog("WARNING-> Failed creating the reload and upgrade events, --signal won't reach us <-WARNING");
+		count = 1;
+	}
+
+	HANDLE handles[3] = { stopEvent, reloadEvent, upgradeEvent };
+	while (true)
+	{
+		DWORD ret = WaitForMultipleObjects(count, handles, FALSE, RATE_AGE_INTERVAL_MS);
+		if (ret == WAIT_TIMEOUT)
+		{
+			rateLimiter.Age();
+		}
+		else if (ret == WAIT_OBJECT_0 + 1)
+		{
+			ReloadConfig();
+		}
+		else if (ret == WAIT_OBJECT_0 + 2)
+		{
+			Upgrade();
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+void Server::SetConfigFile(const char* path)
+{
+	//Call before Init, CONFIG_FILE in the working directory is used otherwise. Either is optional.
+	configFile = path ? path : CONFIG_FILE;
+}
+
+void Server::TakeOver(DWORD oldPid)
+{
+	//Call before Init, for the process an upgrade started (UPGRADE_ARG on the command line)
+	takeoverPid = oldPid;
+}
+
+int Server::GetPort()
+{
+	return listenPort;
+}
+
+bool Server::LoadConfig(ServerConfig& out)
+{
+	std::string errors;
+	bool loaded = out.Load(configFile.c_str(), errors);
+	size_t start = 0;
+	while (start < errors.size())
+	{
+		size_t end = errors.find('\n', start);
+		char buf[CONFIG_MAX_LINE + 128];
+		sprintf_s(buf, "WARNING-> %s: %s <-WARNING", configFile.c_str(), errors.substr(start, end - start).c_str());
+		PrintToLog(buf);
+		start = end + 1;
+	}
+	return loaded;
+}
+
+void Server::ApplyConfig(const ServerConfig& values)
+{
+	//Only what the file sets changes. Timeouts apply to connections accepted from now on, the rest straight away.
+	if (values.maxConnections > 0)
+	{
+		maxConnections = values.maxConnections;
+		std::lock_guard<std::mutex> lock(stateMutex);
+		slotCv.notify_all();
+	}
+
+	{
+		//Connections copy these as they're created, which is under conMutex
+		std::lock_guard<std::mutex> lock(conMutex);
+		ClientTimeouts& timeouts = services.timeouts;
+		timeouts.headerMs = values.headerTimeoutMs > 0 ? values.headerTimeoutMs : timeouts.headerMs;
+		timeouts.bodyIdleMs = values.bodyIdleTimeoutMs > 0 ? values.bodyIdleTimeoutMs : timeouts.bodyIdleMs;
+		timeouts.writeIdleMs = values.writeIdleTimeoutMs > 0 ? values.writeIdleTimeoutMs : timeouts.writeIdleMs;
+		timeouts.minBytesPerSec = values.minTransferRate >= 0 ? values.minTransferRate : timeouts.minBytesPerSec;
+		timeouts.minRateGraceMs = values.minRateGraceMs > 0 ? values.minRateGraceMs : timeouts.minRateGraceMs;
+	}
+
+	if (values.bufferBudgetMb > 0)
+	{
+		bufferBudget.SetLimit(values.bufferBudgetMb * 1024 * 1024);
+	}
+	if (values.fileCacheHandles > 0 || values.fileCacheRevalidateMs > 0)
+	{
+		fileCache.SetLimits(values.fileCacheHandles, values.fileCacheRevalidateMs);
+	}
+	rateLimiter.SetLimits(values.rateConnsPerIp, values.rateRequestsPerSec, values.rateBytesPerSec);
+	if (values.traceSampling >= 0)
+	{
+		Tracer::SetSampleRate(values.traceSampling);
+	}
+	sendScheduler.SetRates(values.sendLinkRate, values.sendConnectionRate);
+	if (!values.adminAllow.empty())
+	{
+		SetAdminAccess(values.adminAllow.c_str());
+	}
+	sendScheduler.SetWeights(values.sendWeightInteractive, values.sendWeightNormal, values.sendWeightBulk);
+	reverseProxy.SetTimeouts(values.proxyConnectTimeoutMs, values.proxyReadTimeoutMs, values.proxyIdleTimeoutMs);
+
+	//Left out, whatever was set before (if anything) is kept, so a reload of a file without it doesn't stop the list being saved
+	if (!values.cacheIndexFile.empty())
+	{
+		std::lock_guard<std::mutex> lock(configMutex);
+		cacheIndexFile = values.cacheIndexFile;
+	}
+}
+
+bool Server::ReloadConfig()
+{
+	//Rereads the config file and applies what can be changed while running. Workers are told to do the same.
+	ServerConfig values;
+	if (!LoadConfig(values))
+	{
+		return false;
+	}
+
+	ApplyConfig(values);
+	if (sitePack.IsOpen())
+	{
+		//A deploy renames a new pack over the old one, map it. Responses part way out finish from the old mapping.
+		const char* packErr = nullptr;
+		char packBuf[MAX_PATH + 128];
+		if (sitePack.Reload(&packErr))
+		{
+			sprintf_s(packBuf, "Remapped %u files from %s", sitePack.GetEntryCount(), sitePackFile.c_str());
+		}
+		else
+		{
+			sprintf_s(packBuf, "WARNING-> %s, still serving the previous %s <-WARNING", packErr, sitePackFile.c_str());
+		}
+		PrintToLog(packBuf);
+	}
+	if (!values.SameStartup(config))
+	{
+		PrintToLog("WARNING-> ip, port, tls_port and workers only change on a restart or upgrade <-WARNING");
+	}
+	if (workerProcesses > 0 && !isWorker)
+	{
+		workerPool.RequestReload();
+	}
+
+	char buf[MAX_PATH + 32];
+	sprintf_s(buf, "Reloaded settings from %s", configFile.c_str());
+	PrintToLog(buf);
+	return true;
+}
+
+bool Server::Upgrade()
+{
+	//Starts a new copy of the executable on our sockets and drains once it's accepting. False, and we carry on, if it never is.
+	if (isWorker || draining || servState != State::RUNNING || upgrading.exchange(true))
+	{
+		return false;
+	}
+
+	SaveCacheIndex();
+	bool ok = upgrade.Offer(servSocket, tlsSocket, printFunc);
+	upgrading = false;
+	if (ok)
+	{
+		Drain();
+	}
+	return ok;
+}
+
+void Server::Drain()
+{
+	//Stops accepting, closes idle keep-alives and lets requests in progress finish, then shuts down. Returns once it has.
+	if (draining.exchange(true))
+	{
+		return;
+	}
+
+	SetEvent(drainEvent);
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		slotCv.notify_all();
+	}
+	bufferBudget.CloseIdle();
+
+	char buf[128];
+	sprintf_s(buf, "Draining %zu connections", connectionCount.load());
+	PrintToLog(buf);
+
+	{
+		std::unique_lock<std::mutex> lock(stateMutex);
+		slotCv.wait_for(lock, std::chrono::milliseconds(DRAIN_TIMEOUT_MS), [this] { return !connectionCount || servState == State::SHUTDOWN; });
+	}
+
+	if (connectionCount)
+	{
+		sprintf_s(buf, "WARNING-> %zu connections still open after %ds, closing them <-WARNING", connectionCount.load(), DRAIN_TIMEOUT_MS / 1000);
+		PrintToLog(buf);
+	}
+	if (servState != State::SHUTDOWN)
+	{
+		ShutdownInternal(ShutdownReason::NONE);
+	}
+}
+
+void Server::SaveCacheIndex()
+{
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(configMutex);
+		path = cacheIndexFile;
+	}
+
+	if (!path.empty() && !fileCache.SaveIndex(path.c_str()))
+	{
+		char buf[MAX_PATH + 64];
+		sprintf_s(buf, "WARNING-> Failed saving the open file list to %s <-WARNING", path.c_str());
+		PrintToLog(buf);
+	}
+}
+
+void Server::SetHeadless(bool noConsole)
+{
+	//Call before Init. No console input or prompt, logging goes to stdout as plain lines, for running as a daemon.
+	headless = noConsole;
+}
+
+void Server::WaitForShutdown()
+{
+	//Blocks the caller until shutdown has finished, however it was started
+	std::unique_lock<std::mutex> lock(stateMutex);
+	stateCv.wait(lock, [this] { return stopped; });
+}
+
+bool Server::AddVirtualHost(const char* names, const char* docRoot)
+{
+	//Call before Init. names is comma separated ("example.com,www.example.com"), requests for any other host get the default site.
+	return hosts.Add(names, docRoot) != nullptr;
+}
+
+bool Server::SetHostMimeType(const char* host, const char* ext, const char* type)
+{
+	//Call before Init, ext with its dot (".wasm")
+	char nameBuf[VHOST_MAX_NAME];
+	VirtualHost* vhost = host && HostTable::NormaliseHost(host, (int)strlen(host), nameBuf, VHOST_MAX_NAME) > 0 ? hosts.Get(nameBuf) : nullptr;
+	if (!vhost || !ext || ext[0] != '.' || !type || strlen(type) >= MAX_MIME_TYPE_LEN)
+	{
+		return false;
+	}
+
+	std::string key;
+	FileIndex::NormalisePath(ext, key);
+	vhost->mimeTypes[key] = type;
+	return true;
+}
+
+bool Server::SetHostLimits(const char* host, long long maxBody, int requestsPerSecond, size_t indexBudget, int fileHandles)
+{
+	//Call before Init, 0 leaves each one at the server wide default
+	char nameBuf[VHOST_MAX_NAME];
+	VirtualHost* vhost = host && HostTable::NormaliseHost(host, (int)strlen(host), nameBuf, VHOST_MAX_NAME) > 0 ? hosts.Get(nameBuf) : nullptr;
+	if (!vhost)
+	{
+		return false;
+	}
+
+	vhost->limits.maxBody = maxBody;
+	vhost->limits.requestsPerSecond = requestsPerSecond;
+	vhost->limits.indexBudget = indexBudget;
+	vhost->limits.fileHandles = fileHandles > 0 ? fileHandles : 0;
+	return true;
+}
+
+void Server::SetTraceSampling(unsigned int oneIn)
+{
+	//0 (the default) records nothing, 1 traces every request. Can be changed while running.
+	Tracer::SetSampleRate(oneIn);
 }
 
-void Server::Init(const char* ip, int port)
+void Server::SetFileCacheLimits(int maxHandles, int revalidateMs)
 {
-	SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+	//Call before Init. Handles stay open until evicted, so keep maxHandles well under what the process may have open.
+	fileCache.SetLimits(maxHandles, revalidateMs);
+	fileCacheHandles = maxHandles > 0 ? maxHandles : 0;
+	fileCacheRevalidateMs = revalidateMs > 0 ? revalidateMs : 0;
+}
 
-	servState = State::STARTUP;
+void Server::SetClientTimeouts(int headerMs, int bodyIdleMs, int writeIdleMs)
+{
+	//Call before Init, 0 leaves each one at its default
+	services.timeouts.headerMs = headerMs > 0 ? headerMs : HEADER_READ_TIMEOUT_MS;
+	services.timeouts.bodyIdleMs = bodyIdleMs > 0 ? bodyIdleMs : BODY_READ_TIMEOUT_MS;
+	services.timeouts.writeIdleMs = writeIdleMs > 0 ? writeIdleMs : IO_WRITE_TIMEOUT_MS;
+}
 
-	WSAData data;
-	int err;
-	WORD vReq = MAKEWORD(2, 2);
-	err = WSAStartup(vReq, &data);
+void Server::SetMinTransferRate(int bytesPerSec, int graceMs)
+{
+	//Call before Init. Bodies and responses slower than bytesPerSec on average once graceMs in are dropped, 0 turns it off.
+	services.timeouts.minBytesPerSec = bytesPerSec > 0 ? bytesPerSec : 0;
+	services.timeouts.minRateGraceMs = graceMs > 0 ? graceMs : MIN_RATE_GRACE_MS;
+}
 
-	if (err != 0)
+void Server::SetBufferBudget(long long bytes)
+{
+	//Call before Init, 0 keeps the default. Covers receive buffers and request arenas, not HTTP/2 sessions or the proxy.
+	bufferBudget.SetLimit(bytes);
+}
+
+void Server::SetRateLimits(int connsPerIp, int requestsPerSec, long long bytesPerSec)
+{
+	//Per client address, all off by default, 0 leaves one off. Clients behind one NAT share an address, so leave room for them.
+	rateLimiter.SetLimits(connsPerIp > 0 ? connsPerIp : 0, requestsPerSec > 0 ? requestsPerSec : 0, bytesPerSec > 0 ? bytesPerSec : 0);
+}
+
+void Server::SetSendRates(long long linkBytesPerSec, long long connBytesPerSec)
+{
+	//linkBytesPerSec is shared out between responses by weight, set it a little under the uplink. connBytesPerSec caps each
+	//connection on its own. 0 (the default) turns either off.
+	sendScheduler.SetRates(linkBytesPerSec > 0 ? linkBytesPerSec : 0, connBytesPerSec > 0 ? connBytesPerSec : 0);
+}
+
+bool Server::SetAdminAccess(const char* allow)
+{
+	//Besides loopback, the addresses or CIDR ranges that may read /_winweb/metrics and /_winweb/trace. False, and nothing
+	//changes, if any of them doesn't parse. Can be changed while running.
+	if (!adminAccess.Set(allow))
 	{
-		ShutdownInternal(ShutdownReason::DLL_ERR);
-		return;
+		PrintToLog("WARNING-> Couldn't parse the admin access list, it's unchanged <-WARNING");
+		return false;
 	}
+	return true;
+}
 
-	servSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (servSocket == INVALID_SOCKET)
+void Server::SetSendWeights(int interactive, int normal, int bulk)
+{
+	//Relative shares of the link, 0 keeps a class's default. Interactive is small responses and page text, bulk anything 8MB or over.
+	sendScheduler.SetWeights(interactive, normal, bulk);
+}
+
+void Server::SetProxyTimeouts(int connectMs, int readMs, int idleMs)
+{
+	//How long to wait for an upstream to accept, to send each piece of its response and to sit idle in the pool. 0 keeps
+	//each one's default (2s, 30s and 30s). Can be changed while running.
+	reverseProxy.SetTimeouts(connectMs, readMs, idleMs);
+}
+
+bool Server::AddProxyRoute(const char* prefix, const char* upstreams)
+{
+	//Call before Init, routes aren't locked once connections are being served
+	ProxyRoute* proxyRoute = reverseProxy.AddRoute(prefix, upstreams);
+	if (!proxyRoute)
 	{
-		ShutdownInternal(ShutdownReason::SOCKET_CREATE_ERR);
-		return;
+		return false;
+	}
+
+	//Every method under the prefix goes upstream
+	Route route;
+	route.kind = ROUTE_PROXY;
+	route.proxyRoute = proxyRoute;
+	return AddUserRoute(ROUTE_ANY, (std::string(prefix) + "*").c_str(), route);
+}
+
+bool Server::AddRoute(int methods, const char* pattern, RouteCallback callback)
+{
+	//Callback fills in the Response, it runs on an I/O worker so it mustn't block
+	Route route;
+	route.kind = ROUTE_CALLBACK;
+	route.callback = callback;
+	return AddUserRoute(methods, pattern, route);
+}
+
+bool Server::AddRedirect(const char* pattern, const char* location)
+{
+	Route route;
+	route.kind = ROUTE_REDIRECT;
+	route.target = location;
+	return AddUserRoute(ROUTE_READ, pattern, route);
+}
+
+bool Server::AddStaticDir(const char* pattern, const char* dir, bool listing)
+{
+	//dir is relative to DOC_ROOT, pattern should end in * to serve what's below it
+	Route route;
+	route.kind = listing ? ROUTE_LISTING : ROUTE_STATIC;
+	route.target = dir;
+	return AddUserRoute(ROUTE_READ, pattern, route);
+}
+
+bool Server::AddUploadDir(const char* pattern, const char* dir, long long maxBytes)
+{
+	//PUT/POST under pattern writes the body to dir, relative to DOC_ROOT. 0 for MAX_UPLOAD_SIZE.
+	Route route;
+	route.kind = ROUTE_UPLOAD;
+	route.target = dir;
+	route.maxBody = maxBytes;
+	return AddUserRoute(ROUTE_PUT | ROUTE_POST, pattern, route);
+}
+
+bool Server::AddBodyRoute(int methods, const char* pattern, RouteBodyCallback onBody, RouteCallback onDone, long long maxBytes)
+{
+	//onBody gets the body a piece at a time, onDone builds the response once it's all in. 0 for MAX_REQUEST_BODY.
+	Route route;
+	route.kind = ROUTE_CALLBACK;
+	route.bodyCallback = onBody;
+	route.callback = onDone;
+	route.maxBody = maxBytes;
+	return AddUserRoute(methods, pattern, route);
+}
+
+bool Server::AddUserRoute(int methods, const char* pattern, const Route& route)
+{
+	//Call before Init. Kept so Init can give every virtual host the same routes as the default site.
+	if (!router.Add(methods, pattern, route))
+	{
+		return false;
+	}
+
+	UserRoute added;
+	added.methods = methods;
+	added.pattern = pattern;
+	added.route = route;
+	userRoutes.push_back(added);
+	return true;
+}
+
+SOCKET Server::CreateListenSocket(const char* ip, int port, ShutdownReason& err)
+{
+	SOCKET sckt = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sckt == INVALID_SOCKET)
+	{
+		err = ShutdownReason::SOCKET_CREATE_ERR;
+		return INVALID_SOCKET;
 	}
 
 	sockaddr_in service;
+	memset(&service, 0, sizeof(service));
 	service.sin_family = AF_INET;
 
 	if (!strcmp(ip, "ANY"))
@@ -67,57 +931,25 @@ void Server::Init(const char* ip, int port)
 	}
 	else
 	{
-		char buf[INET_ADDRSTRLEN];
-		buf[INET_ADDRSTRLEN - 1] = 0;
-		inet_pton(AF_INET, ip, &buf);
-		service.sin_addr.s_addr = (ULONG)buf;
+		inet_pton(AF_INET, ip, &service.sin_addr);
 	}
 	service.sin_port = htons(port);
 
-	if (bind(servSocket, (SOCKADDR*)&service, sizeof(service)) == SOCKET_ERROR)
-	{
-		ShutdownInternal(ShutdownReason::SOCKET_BIND_ERR);
-		return;
-	}
-
-	if (listen(servSocket, 1) == SOCKET_ERROR)
+	if (bind(sckt, (SOCKADDR*)&service, sizeof(service)) == SOCKET_ERROR)
 	{
-		ShutdownInternal(ShutdownReason::SOCKET_LISTEN_ERR);
-		return;
+		err = ShutdownReason::SOCKET_BIND_ERR;
+		closesocket(sckt);
+		return INVALID_SOCKET;
 	}
 
-	SetNonBlocking(&servSocket);
-
-	if (servState == State::SHUTDOWN)
+	if (listen(sckt, 1) == SOCKET_ERROR)
 	{
-		return;
+		err = ShutdownReason::SOCKET_LISTEN_ERR;
+		closesocket(sckt);
+		return INVALID_SOCKET;
 	}
 
-	readableFunc = [this](SOCKET* sckt)
-		{
-			return Readable(sckt);
-		};
-
-
-	writableFunc = [this](SOCKET* sckt)
-		{
-			return Writable(sckt);
-		};
-
-	printFunc = [this](const char* msg)
-		{
-			return PrintToLog(msg);
-		};
-
-
-	SetConsoleCursor();
-
-	listenThread = std::thread(&Server::ListenLoop, this);
-	listenThread.detach();
-	inputThread = std::thread(&Server::InputLoop, this);
-	inputThread.detach();
-	cleanupThread = std::thread(&Server::CleanupConnections, this);
-	cleanupThread.detach();
+	return sckt;
 }
 
 void Server::InputLoop()
@@ -155,6 +987,14 @@ void Server::InputLoop()
 					PrintToLogNoLock("Help - Displays this menu");
 					PrintToLogNoLock("Connections - Displays the current connections");
 					PrintToLogNoLock("Ver - Displays the current server version");
+					PrintToLogNoLock("Limits - Displays rate limiting counters");
+					PrintToLogNoLock("Overload - Displays admission control state");
+					PrintToLogNoLock("Files - Displays open file cache counters");
+					PrintToLogNoLock("Memory - Displays buffer budget usage");
+					PrintToLogNoLock("Workers - Displays worker processes and their metrics");
+				PrintToLogNoLock("Reload - Rereads the config file and applies what it can");
+				PrintToLogNoLock("Upgrade - Hands the sockets to a new copy of WinWeb and drains this one");
+					PrintToLogNoLock("Trace - Writes sampled request spans to " TRACE_FILE);
 				}
 				else if (cpyBuf == "shutdown")
 				{
@@ -162,6 +1002,76 @@ void Server::InputLoop()
 					ShutdownInternal(ShutdownReason::REQUESTED);
 					return;
 				}
+				else if (cpyBuf == "reload" || cpyBuf == "upgrade")
+				{
+					//Done by the control thread, an upgrade blocks until the new process is up and we've drained
+					HANDLE event = cpyBuf == "reload" ? reloadEvent : upgradeEvent;
+					if (!event || !SetEvent(event))
+					{
+						PrintToLogNoLock("Reload and upgrade aren't available, see the warning at startup");
+					}
+				}
+				else if (cpyBuf == "limits")
+				{
+					char buf[256];
+					sprintf_s(buf, "%zu tracked clients, %llu connections and %llu requests refused", rateLimiter.GetTrackedClients(), rateLimiter.GetRejectedConnections(), rateLimiter.GetRejectedRequests());
+					PrintToLogNoLock(buf);
+				}
+				else if (cpyBuf == "overload" || cpyBuf == "files" || cpyBuf == "memory" || cpyBuf == "workers" || cpyBuf == "sends")
+				{
+					std::string metrics;
+					if (cpyBuf == "overload")
+					{
+						admission.FormatMetrics(metrics);
+					}
+					else if (cpyBuf == "files")
+					{
+						fileCache.FormatMetrics(metrics);
+						flights.FormatMetrics(metrics);
+					}
+					else if (cpyBuf == "sends")
+					{
+						sendScheduler.FormatMetrics(metrics);
+					}
+					else if (cpyBuf == "workers")
+					{
+						if (!workerProcesses)
+						{
+							metrics = "Single process, call SetWorkerProcesses before Init for workers\n";
+						}
+						workerPool.FormatStatus(metrics);
+						workerPool.FormatMetrics(metrics);
+					}
+					else
+					{
+						bufferBudget.FormatMetrics(metrics);
+					}
+					size_t start = 0;
+					while (start < metrics.size())
+					{
+						size_t end = metrics.find('\n', start);
+						PrintToLogNoLock(metrics.substr(start, end - start).c_str());
+						start = end + 1;
+					}
+				}
+				else if (cpyBuf == "trace")
+				{
+					char buf[256];
+					if (!Tracer::GetSampleRate())
+					{
+						PrintToLogNoLock("Tracing is off, call SetTraceSampling before Init");
+					}
+					else if (Tracer::WriteChromeTrace(TRACE_FILE))
+					{
+						sprintf_s(buf, "Wrote %s, open it in ui.perfetto.dev or chrome://tracing", TRACE_FILE);
+						PrintToLogNoLock(buf);
+					}
+					else
+					{
+						sprintf_s(buf, "Failed writing %s", TRACE_FILE);
+						PrintToLogNoLock(buf);
+					}
+				}
 				else if (cpyBuf == "connections")
 				{
 					PrintToLogNoLock("---------------- Connections ----------------");
@@ -214,8 +1124,6 @@ void Server::InputLoop()
 			//RedrawInputPrompt();
 			inputMutex.unlock();
 		}
-
-		std::this_thread::sleep_for(std::chrono::microseconds(500));
 	}
 }
 
@@ -237,7 +1145,26 @@ void Server::SetNonBlocking(SOCKET* socket)
 
 void Server::ShutdownInternal(ShutdownReason err)
 {
-	servState = State::SHUTDOWN;
+	//Both the console handler and whatever was running when it fired can get here, only the first one tears down
+	if (shutdownStarted.exchange(true))
+	{
+		return;
+	}
+
+	{
+		//Under stateMutex so a thread about to wait on slotCv sees it
+		std::lock_guard<std::mutex> lock(stateMutex);
+		servState = State::SHUTDOWN;
+	}
+	slotCv.notify_all();
+	if (stopEvent)
+	{
+		SetEvent(stopEvent);
+	}
+	if (closedEvent)
+	{
+		SetEvent(closedEvent);
+	}
 
 	switch (err)
 	{
@@ -253,12 +1180,49 @@ void Server::ShutdownInternal(ShutdownReason err)
 		case SOCKET_LISTEN_ERR:
 			PrintToLog("ERROR-> Failed listening on socket <-ERROR");
 			break;
+		case IO_LOOP_ERR:
+			PrintToLog("ERROR-> Failed starting I/O loop <-ERROR");
+			break;
+		case SITE_PACK_ERR:
+			PrintToLog("ERROR-> Failed loading site pack <-ERROR");
+			break;
+		case WORKER_ERR:
+			PrintToLog("ERROR-> Failed starting worker processes, or taking over the master's sockets <-ERROR");
+			break;
+		case UPGRADE_ERR:
+			PrintToLog("ERROR-> Failed taking over the old process's sockets <-ERROR");
+			break;
 		case REQUESTED:
 			PrintToLog("WARNING-> Requested shutdown <-WARNING");
 		case NONE:
 			break;
 	}
 
+	fileIndex.StopWatching();
+	for (size_t i = 0; i < hosts.GetHostCount(); i++)
+	{
+		hosts.GetHost(i)->fileIndex.StopWatching();
+	}
+	reverseProxy.StopHealthChecks();
+	workerPool.Stop();
+	SaveCacheIndex();
+
+	//Workers stop before connections are torn down, so none of them can be mid-resume when they're deleted
+	ioLoop.Stop();
+
+	//HTTP/2 sessions and proxied requests run on threads of their own. Shutting their sockets ends them, and they're waited
+	//out before any connection is deleted. Nothing closes a socket once the workers have stopped, so the handles are still ours.
+	conMutex.lock();
+	for (int i = 0; i < connections.size(); i++)
+	{
+		if (connections[i] && !connections[i]->pendingDelete && connections[i]->socket != INVALID_SOCKET)
+		{
+			shutdown(connections[i]->socket, SD_BOTH);
+		}
+	}
+	conMutex.unlock();
+	ioLoop.WaitBlocking();
+
 	conMutex.lock();
 
 	TerminateAllConnections();
@@ -268,9 +1232,21 @@ void Server::ShutdownInternal(ShutdownReason err)
 		closesocket(servSocket);
 	}
 
+	if (tlsSocket != INVALID_SOCKET)
+	{
+		closesocket(tlsSocket);
+	}
+
 	WSACleanup();
+	WINWEB_PROBES_UNREGISTER();
 
 	conMutex.unlock();
+
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		stopped = true;
+	}
+	stateCv.notify_all();
 }
 
 void Server::PrintToLogNoLock(const char* msg)
@@ -287,12 +1263,29 @@ void Server::PrintToLog(const char* msg, bool ShouldLock)
 
 	char msgBuf[512];
 	memset(msgBuf, 0, 512);
-	sprintf_s(msgBuf, "\r%s\033[K\n", msg);
-
 	HANDLE handle = GetStdHandle(STD_OUTPUT_HANDLE);
-	WriteConsoleA(handle, msgBuf, strnlen_s(msgBuf, 511), NULL, nullptr);
 
-	RedrawInputPrompt();
+	if (headless)
+	{
+		//No prompt to keep at the bottom, and stdout is likely a file or pipe that WriteConsole can't write to
+		if (workerIndex >= 0)
+		{
+			//Sharing the master's stdout
+			sprintf_s(msgBuf, "[worker %d] %s\n", workerIndex, msg);
+		}
+		else
+		{
+			sprintf_s(msgBuf, "%s\n", msg);
+		}
+		DWORD written = 0;
+		WriteFile(handle, msgBuf, (DWORD)strnlen_s(msgBuf, 511), &written, NULL);
+	}
+	else
+	{
+		sprintf_s(msgBuf, "\r%s\033[K\n", msg);
+		WriteConsoleA(handle, msgBuf, strnlen_s(msgBuf, 511), NULL, nullptr);
+		RedrawInputPrompt();
+	}
 
 	if (ShouldLock)
 	{
@@ -390,10 +1383,11 @@ void Server::DebugLoop()
 	{
 		conMutex.lock();
 
-		if (connections.size() < MAX_CONNECTIONS)
+		if (connections.size() < (size_t)maxConnections)
 		{
-			Connection* newCon = new Connection(INVALID_SOCKET, acceptInfo, readableFunc, writableFunc, printFunc);
+			Connection* newCon = new Connection(INVALID_SOCKET, acceptInfo, readableFunc, writableFunc, printFunc, services, nullptr);
 			connections.push_back(newCon);
+			connectionCount = connections.size();
 			char buf[256];
 			sprintf_s(buf, "Fake connections: %i", connections.size());
 			PrintToLog(buf);
@@ -416,39 +1410,160 @@ void Server::ListenLoop()
 
 	servState = State::RUNNING;
 
-	SOCKET acceptSocket;
+	//DebugLoop();
 
-	sockaddr_in acceptInfo;
-	int acceptSize = sizeof(acceptInfo);
+	//Sleeps in WaitForMultipleObjects until a listen socket has a connection waiting, or shutdown or a drain sets its event
+	SOCKET* listenSockets[2] = { &servSocket, &tlsSocket };
+	WSAEVENT acceptEvents[2] = { WSA_INVALID_EVENT, WSA_INVALID_EVENT };
+	HANDLE waitHandles[4] = { stopEvent, drainEvent };
+	int listenerFor[4] = { -1, -1 };
+	DWORD handleCount = 2;
+
+	//A socket has one event select across every process sharing it, so workers and a process that took over from
+	//another don't use one. The old process goes on accepting with its own until we're ready.
+	bool shared = isWorker || takeoverPid;
+	for (int l = 0; l < 2; l++)
+	{
+		if (*listenSockets[l] == INVALID_SOCKET || shared)
+		{
+			continue;
+		}
 
-	//DebugLoop();
+		acceptEvents[l] = WSACreateEvent();
+		if (acceptEvents[l] == WSA_INVALID_EVENT || WSAEventSelect(*listenSockets[l], acceptEvents[l], FD_ACCEPT) == SOCKET_ERROR)
+		{
+			ShutdownInternal(ShutdownReason::SOCKET_LISTEN_ERR);
+			break;
+		}
+		waitHandles[handleCount] = acceptEvents[l];
+		listenerFor[handleCount++] = l;
+	}
 
-	while (servState == State::RUNNING)
+	while (servState == State::RUNNING && !draining)
 	{
-		if (connections.size() < MAX_CONNECTIONS && Readable(&servSocket))
 		{
-			acceptSocket = accept(servSocket, (SOCKADDR*)&acceptInfo, &acceptSize);
+			//At the cap, wait for cleanup to free a slot rather than accepting
+			std::unique_lock<std::mutex> lock(stateMutex);
+			slotCv.wait(lock, [this] { return connectionCount < (size_t)maxConnections || servState != State::RUNNING || draining; });
+		}
+
+		//FD_ACCEPT is only signalled again after an accept call, so drain whatever is queued before waiting
+		for (int l = 0; l < 2; l++)
+		{
+			while (servState == State::RUNNING && !draining && *listenSockets[l] != INVALID_SOCKET && connectionCount < (size_t)maxConnections && AcceptConnection(l))
+			{
+			}
+		}
+
+		if (connectionCount >= (size_t)maxConnections)
+		{
+			continue;
+		}
 
-			if (acceptSocket == INVALID_SOCKET)
+		if (shared)
+		{
+			//Every process polls the same sockets, whichever accepts first gets the connection and the rest find nothing
+			WSAPOLLFD fds[2];
+			ULONG fdCount = 0;
+			for (int l = 0; l < 2; l++)
+			{
+				if (*listenSockets[l] != INVALID_SOCKET)
+				{
+					fds[fdCount].fd = *listenSockets[l];
+					fds[fdCount].events = POLLRDNORM;
+					fds[fdCount++].revents = 0;
+				}
+			}
+			if (WSAPoll(fds, fdCount, WORKER_ACCEPT_POLL_MS) == SOCKET_ERROR)
 			{
-				continue;
+				break;
 			}
+			continue;
+		}
+
+		DWORD ret = WaitForMultipleObjects(handleCount, waitHandles, FALSE, INFINITE);
+		if (ret < WAIT_OBJECT_0 + 2 || ret >= WAIT_OBJECT_0 + handleCount)
+		{
+			//Shutdown or a drain, or the wait itself failed
+			break;
+		}
 
-			SetNonBlocking(&acceptSocket);
-			conMutex.lock();
+		int l = listenerFor[ret - WAIT_OBJECT_0];
+		WSANETWORKEVENTS networkEvents;
+		WSAEnumNetworkEvents(*listenSockets[l], acceptEvents[l], &networkEvents);
+	}
 
-			Connection* newCon = new Connection(acceptSocket, acceptInfo, readableFunc, writableFunc, printFunc);
-			connections.push_back(newCon);
-			char logBuf[200];
-			sprintf_s(logBuf, "Accepted connection from %s", newCon->ip);
-			PrintToLog(logBuf);
-			conMutex.unlock();
+	for (int l = 0; l < 2; l++)
+	{
+		if (acceptEvents[l] != WSA_INVALID_EVENT)
+		{
+			WSACloseEvent(acceptEvents[l]);
 		}
+	}
 
-		std::this_thread::sleep_for(std::chrono::microseconds(500));
+	if (draining)
+	{
+		//Only closes our copies, whoever took over keeps accepting from theirs
+		conMutex.lock();
+		for (int l = 0; l < 2; l++)
+		{
+			if (*listenSockets[l] != INVALID_SOCKET)
+			{
+				closesocket(*listenSockets[l]);
+				*listenSockets[l] = INVALID_SOCKET;
+			}
+		}
+		conMutex.unlock();
 	}
 }
 
+bool Server::AcceptConnection(int listener)
+{
+	//Takes one waiting connection off the listener, false once there are none left
+	SOCKET* listenSocket = listener == 0 ? &servSocket : &tlsSocket;
+	sockaddr_in acceptInfo;
+	int acceptSize = sizeof(acceptInfo);
+	SOCKET acceptSocket = accept(*listenSocket, (SOCKADDR*)&acceptInfo, &acceptSize);
+
+	if (acceptSocket == INVALID_SOCKET)
+	{
+		return false;
+	}
+
+	//Accepted sockets inherit the listener's event select, the I/O loop polls them instead
+	WSAEventSelect(acceptSocket, NULL, 0);
+
+	if (!rateLimiter.TryAcquireConnection(acceptInfo.sin_addr.s_addr))
+	{
+		//Over the per address or per /24 cap. Plain HTTP gets told why, a TLS client would only see garbage.
+#ifdef WINWEB_PROBES
+		char shedIp[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &acceptInfo.sin_addr, shedIp, INET_ADDRSTRLEN);
+		WINWEB_PROBE_SHED("rate-connection", shedIp, TOO_MANY_REQUESTS);
+#endif
+		if (listener == 0)
+		{
+			static const char tooMany[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After:1\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
+			send(acceptSocket, tooMany, sizeof(tooMany) - 1, 0);
+		}
+		closesocket(acceptSocket);
+		return true;
+	}
+
+	SetNonBlocking(&acceptSocket);
+	conMutex.lock();
+
+	Connection* newCon = new Connection(acceptSocket, acceptInfo, readableFunc, writableFunc, printFunc, services, listener == 0 ? nullptr : &tlsContext);
+	connections.push_back(newCon);
+	connectionCount = connections.size();
+	WINWEB_PROBE_ACCEPT(acceptSocket, newCon->ip, listener != 0);
+	char logBuf[200];
+	sprintf_s(logBuf, "Accepted %s connection from %s", listener == 0 ? "HTTP" : "HTTPS", newCon->ip);
+	PrintToLog(logBuf);
+	conMutex.unlock();
+	return true;
+}
+
 void Server::TerminateAllConnections()
 {
 	if (connections.size() == 0)
@@ -463,9 +1578,13 @@ void Server::TerminateAllConnections()
 			continue;
 		}
 
-		connections[i]->tickMutex.lock();
-		connections[i]->OnDisconnect();
-		connections[i]->tickMutex.unlock();
+		//Ones that already finished are only waiting on cleanup, disconnecting them again would close the socket twice
+		if (!connections[i]->pendingDelete)
+		{
+			connections[i]->tickMutex.lock();
+			connections[i]->OnDisconnect();
+			connections[i]->tickMutex.unlock();
+		}
 
 		char logBuf[200];
 		sprintf_s(logBuf, "Terminated connection from %s for shutdown", connections[i]->ip);
@@ -476,32 +1595,45 @@ void Server::TerminateAllConnections()
 	}
 
 	connections.clear();
+	connectionCount = 0;
 }
 
 void Server::CleanupConnections()
 {
 	while (servState != State::SHUTDOWN)
 	{
-		if (connections.size() > 0)
+		//Connections set closedEvent as they finish, nothing runs here in between
+		WaitForSingleObject(closedEvent, INFINITE);
+		if (servState == State::SHUTDOWN)
 		{
-			conMutex.lock();
+			break;
+		}
+
+		conMutex.lock();
 
-			for (int i = 0; i < connections.size(); i++)
+		bool freed = false;
+		for (int i = 0; i < connections.size(); i++)
+		{
+			if (connections[i] != nullptr && connections[i]->pendingDelete)
 			{
-				if (connections[i] != nullptr && connections[i]->pendingDelete)
-				{
-					char logBuf[200];
-					sprintf_s(logBuf, "Closing connection from %s", connections[i]->ip);
-					PrintToLog(logBuf);
-
-					Connection* toDel = connections[i];
-					delete toDel;
-					connections.erase(connections.begin() + i);
-					i = 0;
-				}
+				char logBuf[200];
+				sprintf_s(logBuf, "Closing connection from %s", connections[i]->ip);
+				PrintToLog(logBuf);
+
+				Connection* toDel = connections[i];
+				delete toDel;
+				connections.erase(connections.begin() + i);
+				--i;
+				freed = true;
 			}
-			conMutex.unlock();
-			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		}
+		connectionCount = connections.size();
+		conMutex.unlock();
+
+		if (freed)
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			slotCv.notify_all();
 		}
 	}
 }
@@ -3,6 +3,18 @@
 #include <thread>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "FileIndex.h"
+#include "Tls.h"
+#include "Proxy.h"
+#include "RateLimit.h"
+#include "Overload.h"
+#include "IoLoop.h"
+#include "Connection.h"
+#include "WorkerPool.h"
+#include "Config.h"
+#include "Upgrade.h"
 
 enum ShutdownReason 
 {
@@ -11,6 +23,10 @@ enum ShutdownReason
 	SOCKET_BIND_ERR,
 	SOCKET_LISTEN_ERR,
 	SET_NON_BLOCK_ERR,
+	IO_LOOP_ERR,
+	SITE_PACK_ERR,
+	WORKER_ERR,
+	UPGRADE_ERR,
 	REQUESTED,
 	NONE
 };
@@ -23,18 +39,36 @@ enum State
 	SHUTDOWN
 };
 
-//TODO expose this and the port we run on in a config file
-#define MAX_CONNECTIONS 1000
+#define MAX_CONNECTIONS 1000 //Default, max_connections in the config file changes it
+#define DOC_ROOT "."
+#define WORKER_ACCEPT_POLL_MS 250 //Shared listeners can't be event selected, this bounds how long shutdown waits on the poll
 
 class Server
 {
 private:
+	struct UserRoute
+	{
+		int methods;
+		std::string pattern;
+		Route route;
+	};
 	void ListenLoop();
+	void RunMaster();
+	void WorkerLoop();
+	void ControlLoop();
+	void Drain();
+	bool LoadConfig(ServerConfig& out);
+	void ApplyConfig(const ServerConfig& values);
+	void SaveCacheIndex();
+	bool AcceptConnection(int listener);
 	void TerminateAllConnections();
 	void CleanupConnections();
 	void ShutdownInternal(ShutdownReason err);
 	void PrintToLogNoLock(const char* msg);
+	bool AddUserRoute(int methods, const char* pattern, const Route& route);
 	SOCKET servSocket = INVALID_SOCKET;
+	SOCKET tlsSocket = INVALID_SOCKET;
+	SOCKET CreateListenSocket(const char* ip, int port, ShutdownReason& err);
 	void PrintToLog(const char* msg, bool ShouldLock = true);
 	void RedrawInputPrompt();
 	void AppendChar(char* newChar);
@@ -54,12 +88,94 @@ private:
 	std::function<void(const char*)> printFunc;
 	static Server* instance;
 	std::mutex conMutex;
+	std::mutex stateMutex;
+	std::condition_variable stateCv; //Signalled once shutdown has finished tearing everything down
+	std::condition_variable slotCv; //Signalled when cleanup frees a connection slot
+	bool stopped = false;
+	HANDLE stopEvent = NULL; //Manual reset, wakes the listen thread for shutdown
+	HANDLE closedEvent = NULL; //Auto reset, connections set it as they finish so cleanup has something to do
+	HANDLE drainEvent = NULL; //Manual reset, wakes the listen thread to stop accepting
+	HANDLE reloadEvent = NULL; //Named, see ProcessUpgrade::CreateControlEvents
+	HANDLE upgradeEvent = NULL;
+	bool headless = false;
 	std::mutex inputMutex;
 	std::string inputBuffer;
+	FileIndex fileIndex;
+	TlsContext tlsContext;
+	ReverseProxy reverseProxy;
+	RateLimiter rateLimiter;
+	AdmissionController admission;
+	IoLoop ioLoop;
+	Router router;
+	HostTable hosts;
+	std::vector<UserRoute> userRoutes; //Registered before Init, every virtual host's router gets them too
+	FileCache fileCache;
+	int fileCacheHandles = 0; //As given to SetFileCacheLimits, for virtual hosts without a limit of their own
+	int fileCacheRevalidateMs = 0;
+	BufferBudget bufferBudget;
+	FlightGroup flights;
+	SendScheduler sendScheduler;
+	AccessList adminAccess;
+	int workerProcesses = 0; //Master mode when set
+	bool isWorker = false;
+	int workerIndex = -1;
+	WorkerPool workerPool;
+	WorkerBoard workerBoard;
+	std::string configFile = CONFIG_FILE;
+	ServerConfig config; //As read at startup, reloads are compared against it
+	std::mutex configMutex;
+	std::string cacheIndexFile;
+	std::atomic<int> maxConnections{ MAX_CONNECTIONS };
+	DWORD takeoverPid = 0;
+	ProcessUpgrade upgrade;
+	std::atomic<bool> upgrading{ false };
+	std::atomic<bool> draining{ false };
+	std::atomic<bool> shutdownStarted{ false };
+	int listenPort = 0;
+	SitePack sitePack;
+	std::string sitePackFile;
+	bool pinCpus = false;
+	bool largePages = false;
+	ServerServices services;
+	int tlsPort = 0;
+	std::string tlsCertFile;
+	std::string tlsKeyFile;
 public:
 	Server();
 	~Server();
 	void Init(const char* ip, int port);
+	void EnableTls(int port, const char* certFile, const char* keyFile);
+	void UseSitePack(const char* path);
+	void SetCpuPinning(bool pin);
+	void SetLargePages(bool use);
+	void SetTraceSampling(unsigned int oneIn);
+	void SetFileCacheLimits(int maxHandles, int revalidateMs);
+	void SetClientTimeouts(int headerMs, int bodyIdleMs, int writeIdleMs);
+	void SetMinTransferRate(int bytesPerSec, int graceMs);
+	void SetBufferBudget(long long bytes);
+	void SetRateLimits(int connsPerIp, int requestsPerSec, long long bytesPerSec);
+	void SetSendRates(long long linkBytesPerSec, long long connBytesPerSec);
+	void SetSendWeights(int interactive, int normal, int bulk);
+	void SetProxyTimeouts(int connectMs, int readMs, int idleMs);
+	bool SetAdminAccess(const char* allow);
+	void SetWorkerProcesses(int count);
+	void SetWorker(bool worker);
+	void SetConfigFile(const char* path);
+	void TakeOver(DWORD oldPid);
+	bool ReloadConfig();
+	bool Upgrade();
+	int GetPort();
+	void SetHeadless(bool noConsole);
+	void WaitForShutdown();
+	bool AddVirtualHost(const char* names, const char* docRoot);
+	bool SetHostMimeType(const char* host, const char* ext, const char* type);
+	bool SetHostLimits(const char* host, long long maxBody, int requestsPerSecond, size_t indexBudget, int fileHandles = 0);
+	bool AddProxyRoute(const char* prefix, const char* upstreams);
+	bool AddRoute(int methods, const char* pattern, RouteCallback callback);
+	bool AddRedirect(const char* pattern, const char* location);
+	bool AddStaticDir(const char* pattern, const char* dir, bool listing);
+	bool AddUploadDir(const char* pattern, const char* dir, long long maxBytes = 0);
+	bool AddBodyRoute(int methods, const char* pattern, RouteBodyCallback onBody, RouteCallback onDone, long long maxBytes = 0);
 	State servState = State::UNINITIALISED;
 };
 
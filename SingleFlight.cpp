@@ -0,0 +1,178 @@
+#include "SingleFlight.h"
+#include "BufferBudget.h"
+#include "IoLoop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+bool Flight::Claim()
+{
+	//True if the caller gets to read the next piece, it has to Publish or Finish before its next co_await
+	std::lock_guard<std::mutex> lock(mutex);
+	if (claimed || state != FLIGHT_LOADING)
+	{
+		return false;
+	}
+	claimed = true;
+	return true;
+}
+
+void Flight::Publish(long long bytes)
+{
+	//Claimant only, bytes is the total so far. The last piece completes the flight.
+	std::unique_lock<std::mutex> lock(mutex);
+	loaded = bytes;
+	if (bytes >= capacity)
+	{
+		state = FLIGHT_DONE;
+	}
+	claimed = false;
+	WakeAll(lock);
+}
+
+void Flight::Finish(bool ok)
+{
+	//Claimant only. Readers see loaded is final as soon as state changes.
+	std::unique_lock<std::mutex> lock(mutex);
+	state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+	claimed = false;
+	WakeAll(lock);
+}
+
+void Flight::WakeAll(std::unique_lock<std::mutex>& lock)
+{
+	//Posted outside the lock, a waiter may resume, find it has caught up again and park before we're done
+	std::vector<FlightWaiter> woken;
+	woken.swap(waiters);
+	lock.unlock();
+	for (int i = 0; i < woken.size(); i++)
+	{
+		woken[i].loop->Post(woken[i].handle, woken[i].node);
+	}
+}
+
+Flight::Awaiter Flight::WaitPast(long long sent, IoLoop* loop)
+{
+	//Resumes once there's more than sent loaded, the load ends, or nobody is reading (so the caller can claim the next piece)
+	return { this, sent, loop };
+}
+
+bool Flight::Awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	//Checked under the same lock Publish and Finish take, so a piece published now either shows here or wakes us
+	std::lock_guard<std::mutex> lock(flight->mutex);
+	if (flight->loaded > sent || flight->state != FLIGHT_LOADING || !flight->claimed)
+	{
+		return false;
+	}
+	flight->waiters.push_back({ loop, handle, IoLoop::CurrentNode() });
+	return true;
+}
+
+FlightGroup::FlightGroup()
+{
+}
+
+FlightGroup::~FlightGroup()
+{
+}
+
+void FlightGroup::SetBudget(BufferBudget* budget)
+{
+	this->budget = budget;
+}
+
+Flight* FlightGroup::Join(const std::string& key, const char* version, long long capacity)
+{
+	//Always a flight to Release, but only one with data is shared. Without, the caller reads for itself: nobody else wanted
+	//it yet, it's too big to hold, or memory is already short.
+	std::lock_guard<std::mutex> lock(flightMutex);
+	auto it = flights.find(key);
+	if (it != flights.end() && it->second->version == version && it->second->state != FLIGHT_FAILED)
+	{
+		Flight* flight = it->second;
+		++flight->refs;
+		if (flight->data)
+		{
+			++joins;
+			return flight;
+		}
+
+		//Someone is already reading this alone, from here on it's worth sharing
+		if (capacity > 0 && capacity <= SINGLE_FLIGHT_MAX_BYTES && !(budget && budget->IsPressured()))
+		{
+			char* data = (char*)malloc((size_t)capacity);
+			if (data)
+			{
+				std::lock_guard<std::mutex> flightLock(flight->mutex);
+				flight->data = data;
+				flight->capacity = capacity;
+				heldBytes += capacity;
+				if (budget)
+				{
+					budget->Charge(capacity);
+				}
+				++loads;
+			}
+		}
+		return flight;
+	}
+
+	//A stale or failed flight is left to whoever still holds it, new joiners get this one
+	Flight* flight = new (std::nothrow) Flight();
+	if (!flight)
+	{
+		return nullptr;
+	}
+	flight->key = key;
+	flight->version = version;
+	flights[key] = flight;
+	return flight;
+}
+
+void FlightGroup::Release(Flight* flight)
+{
+	{
+		//Under the lock, so Join can't hand out a flight whose last reference is going
+		std::lock_guard<std::mutex> lock(flightMutex);
+		if (--flight->refs > 0)
+		{
+			return;
+		}
+
+		auto it = flights.find(flight->key);
+		if (it != flights.end() && it->second == flight)
+		{
+			flights.erase(it);
+		}
+	}
+
+	if (flight->data)
+	{
+		heldBytes -= flight->capacity;
+		if (budget)
+		{
+			budget->Refund(flight->capacity);
+		}
+		free(flight->data);
+	}
+	delete flight;
+}
+
+void FlightGroup::FormatMetrics(std::string& out)
+{
+	size_t inFlight = 0;
+	{
+		std::lock_guard<std::mutex> lock(flightMutex);
+		inFlight = flights.size();
+	}
+
+	char buf[256];
+	sprintf_s(buf,
+		"winweb_single_flight_active %zu\n"
+		"winweb_single_flight_bytes %lld\n"
+		"winweb_single_flight_loads_total %llu\n"
+		"winweb_single_flight_joins_total %llu\n",
+		inFlight, (long long)heldBytes, (unsigned long long)loads, (unsigned long long)joins);
+	out += buf;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <coroutine>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define SINGLE_FLIGHT_MAX_BYTES (32LL * 1024 * 1024) //Bigger than this, each request reads for itself
+#define SINGLE_FLIGHT_CHUNK (256 * 1024) //Loaded this much at a time, readers can send each piece as soon as it's in
+
+class BufferBudget;
+class IoLoop;
+
+enum FlightState
+{
+	FLIGHT_LOADING,
+	FLIGHT_DONE,
+	FLIGHT_FAILED
+};
+
+//A coroutine parked until the flight has more than it's sent so far
+struct FlightWaiter
+{
+	IoLoop* loop;
+	std::coroutine_handle<> handle;
+	int node;
+};
+
+//One load that every request wanting the same thing at the same time shares. data is filled from the front, loaded says how
+//far, so readers can start on it before it's complete. It stays joinable for as long as anyone holds it.
+//There's no loader of its own: a reader that has sent everything loaded so far claims the next piece and reads it, anyone
+//else caught up meanwhile parks on the IoLoop until that piece is published. The load goes at the fastest reader's pace.
+//data is nullptr while only one request is reading, that one streams from the file cache without sharing.
+struct Flight
+{
+	struct Awaiter
+	{
+		Flight* flight;
+		long long sent;
+		IoLoop* loop;
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+		bool await_suspend(std::coroutine_handle<> handle);
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	std::string key;
+	std::string version; //A flight for an older version of the same key isn't joined
+	char* data = nullptr;
+	long long capacity = 0;
+	std::atomic<long long> loaded{ 0 };
+	std::atomic<int> state{ FLIGHT_LOADING };
+	int refs = 1; //Under the group's mutex
+	std::mutex mutex;
+	bool claimed = false; //Someone is reading the next piece, under mutex
+	std::vector<FlightWaiter> waiters; //Under mutex
+	bool Claim();
+	void Publish(long long bytes);
+	void Finish(bool ok);
+	Awaiter WaitPast(long long sent, IoLoop* loop);
+private:
+	void WakeAll(std::unique_lock<std::mutex>& lock);
+};
+
+//Coalesces concurrent loads of the same key. The first to Join gets a flight with no buffer and reads alone, the second
+//finds it in progress and gives it one to share, everyone after joins that until the last Release.
+//A herd of N requests for one uncached file is two reads, and a file nobody else wants costs no copy at all.
+class FlightGroup
+{
+public:
+	FlightGroup();
+	~FlightGroup();
+	void SetBudget(BufferBudget* budget);
+	Flight* Join(const std::string& key, const char* version, long long capacity);
+	void Release(Flight* flight);
+	void FormatMetrics(std::string& out);
+private:
+	std::mutex flightMutex;
+	std::unordered_map<std::string, Flight*> flights;
+	BufferBudget* budget = nullptr;
+	std::atomic<long long> heldBytes{ 0 };
+	std::atomic<unsigned long long> loads{ 0 };
+	std::atomic<unsigned long long> joins{ 0 };
+};
@@ -0,0 +1,274 @@
+#include "SitePack.h"
+#include <string.h>
+#include <ctype.h>
+
+SitePack::SitePack()
+{
+}
+
+SitePack::~SitePack()
+{
+	Close();
+}
+
+unsigned int SitePack::Hash(const char* key, int len, unsigned int seed)
+{
+	//FNV-1a with the seed folded into the basis, then a murmur finaliser so nearby seeds give unrelated slots
+	unsigned int h = 2166136261u ^ (seed * 0x9E3779B9u);
+	for (int i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static bool InBounds(unsigned long long offset, unsigned long long len, unsigned long long size)
+{
+	//Written so a huge offset or length can't wrap past the check
+	return offset <= size && len <= size - offset;
+}
+
+bool SitePack::Open(const char* path, const char** err)
+{
+	//Maps path and makes it the current pack. On failure whatever was current stays.
+	PackView* view = path ? Map(path, err) : nullptr;
+	if (!view)
+	{
+		return false;
+	}
+
+	PackView* old = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(packMutex);
+		packPath = path;
+		old = current;
+		current = view;
+	}
+	Release(old);
+	return true;
+}
+
+bool SitePack::Reload(const char** err)
+{
+	//The same path again, to pick up a pack a deploy has renamed over it. Responses part way through keep the old mapping.
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(packMutex);
+		path = packPath;
+	}
+	if (path.empty())
+	{
+		if (err)
+		{
+			*err = "No site pack to reload";
+		}
+		return false;
+	}
+	return Open(path.c_str(), err);
+}
+
+PackView* SitePack::Map(const char* path, const char** err)
+{
+	PackView* view = new PackView();
+	view->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (view->file == INVALID_HANDLE_VALUE)
+	{
+		if (err)
+		{
+			*err = "Failed opening site pack";
+		}
+		Unmap(view);
+		return nullptr;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(view->file, &size) || size.QuadPart < (LONGLONG)sizeof(PackHeader))
+	{
+		if (err)
+		{
+			*err = "Site pack is truncated";
+		}
+		Unmap(view);
+		return nullptr;
+	}
+
+	view->mapping = CreateFileMappingA(view->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	view->base = view->mapping ? (const char*)MapViewOfFile(view->mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view->base)
+	{
+		if (err)
+		{
+			*err = "Failed mapping site pack";
+		}
+		Unmap(view);
+		return nullptr;
+	}
+
+	view->header = (const PackHeader*)view->base;
+	if (view->header->fileSize != (unsigned long long)size.QuadPart || !Validate(view))
+	{
+		if (err)
+		{
+			*err = "Site pack is corrupt or from another version";
+		}
+		Unmap(view);
+		return nullptr;
+	}
+
+	view->seeds = (const unsigned int*)(view->base + view->header->bucketsOffset);
+	view->slots = (const unsigned int*)(view->base + view->header->slotsOffset);
+	view->entries = (const PackEntry*)(view->base + view->header->entriesOffset);
+	return view;
+}
+
+bool SitePack::Validate(const PackView* view)
+{
+	//Everything is bounds checked once here, so lookups can trust the offsets
+	const PackHeader* header = view->header;
+	const char* base = view->base;
+	unsigned long long size = header->fileSize;
+	if (memcmp(header->magic, SITE_PACK_MAGIC, 8) || header->version != SITE_PACK_VERSION || !header->bucketCount || header->slotCount < header->entryCount)
+	{
+		return false;
+	}
+
+	if (!InBounds(header->bucketsOffset, header->bucketCount * 4ULL, size) || !InBounds(header->slotsOffset, header->slotCount * 4ULL, size) || !InBounds(header->entriesOffset, header->entryCount * (unsigned long long)sizeof(PackEntry), size))
+	{
+		return false;
+	}
+
+	const unsigned int* slotTable = (const unsigned int*)(base + header->slotsOffset);
+	for (unsigned int i = 0; i < header->slotCount; i++)
+	{
+		if (slotTable[i] != SITE_PACK_EMPTY_SLOT && slotTable[i] >= header->entryCount)
+		{
+			return false;
+		}
+	}
+
+	const PackEntry* table = (const PackEntry*)(base + header->entriesOffset);
+	for (unsigned int i = 0; i < header->entryCount; i++)
+	{
+		const PackEntry& entry = table[i];
+		if (!InBounds(entry.pathOffset, entry.pathLen, size) || !InBounds(entry.bodyOffset, entry.bodyLen, size) || !InBounds(entry.gzipOffset, entry.gzipLen, size) || entry.headerOffset >= size || entry.gzipHeaderOffset >= size)
+		{
+			return false;
+		}
+
+		if (!memchr(base + entry.headerOffset, 0, (size_t)(size - entry.headerOffset)) || !memchr(base + entry.gzipHeaderOffset, 0, (size_t)(size - entry.gzipHeaderOffset)) || !memchr(entry.mimeType, 0, SITE_PACK_MIME_LEN) || !memchr(entry.etag, 0, SITE_PACK_ETAG_LEN))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void SitePack::Unmap(PackView* view)
+{
+	if (view->base)
+	{
+		UnmapViewOfFile(view->base);
+	}
+
+	if (view->mapping)
+	{
+		CloseHandle(view->mapping);
+	}
+
+	if (view->file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(view->file);
+	}
+	delete view;
+}
+
+void SitePack::Close()
+{
+	PackView* old = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(packMutex);
+		old = current;
+		current = nullptr;
+	}
+	Release(old);
+}
+
+bool SitePack::IsOpen()
+{
+	std::lock_guard<std::mutex> lock(packMutex);
+	return current != nullptr;
+}
+
+PackView* SitePack::Acquire()
+{
+	//Pair with Release once nothing points into the view any more
+	std::lock_guard<std::mutex> lock(packMutex);
+	if (current)
+	{
+		current->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+	return current;
+}
+
+void SitePack::Release(PackView* view)
+{
+	if (view && view->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		Unmap(view);
+	}
+}
+
+const PackEntry* SitePack::Lookup(const PackView* view, const char* path, int len)
+{
+	//path is a decoded request path, keys are lower case like FileIndex's since NTFS doesn't care
+	if (!view || len < 0 || len >= SITE_PACK_MAX_PATH || !view->header->entryCount)
+	{
+		return nullptr;
+	}
+
+	char key[SITE_PACK_MAX_PATH];
+	for (int i = 0; i < len; i++)
+	{
+		key[i] = (char)tolower((unsigned char)path[i]);
+	}
+
+	unsigned int bucket = Hash(key, len, 0) % view->header->bucketCount;
+	unsigned int slot = Hash(key, len, view->seeds[bucket]) % view->header->slotCount;
+	unsigned int index = view->slots[slot];
+	if (index == SITE_PACK_EMPTY_SLOT)
+	{
+		return nullptr;
+	}
+
+	//A perfect hash only promises no collisions among the keys it was built from, anything else has to be checked
+	const PackEntry* entry = &view->entries[index];
+	if (entry->pathLen != (unsigned int)len || memcmp(view->base + entry->pathOffset, key, len))
+	{
+		return nullptr;
+	}
+	return entry;
+}
+
+const char* SitePack::GetData(const PackView* view, unsigned long long offset)
+{
+	return view ? view->base + offset : nullptr;
+}
+
+unsigned int SitePack::GetEntryCount()
+{
+	std::lock_guard<std::mutex> lock(packMutex);
+	return current ? current->header->entryCount : 0;
+}
+
+unsigned long long SitePack::GetSize()
+{
+	std::lock_guard<std::mutex> lock(packMutex);
+	return current ? current->header->fileSize : 0;
+}
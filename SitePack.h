@@ -0,0 +1,85 @@
+#pragma once
+#include <Windows.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#define SITE_PACK_MAGIC "WWPACK01"
+#define SITE_PACK_VERSION 1
+#define SITE_PACK_ALIGN 64 //Bodies start on a cache line
+#define SITE_PACK_EMPTY_SLOT 0xFFFFFFFF
+#define SITE_PACK_MIME_LEN 64
+#define SITE_PACK_ETAG_LEN 40
+#define SITE_PACK_MAX_PATH 1024
+
+//On disk layout, every offset is from the start of the file:
+//PackHeader | seed per bucket | entry index per slot | PackEntry[] | paths, prebuilt headers, bodies
+struct PackHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int entryCount;
+	unsigned int bucketCount;
+	unsigned int slotCount;
+	unsigned long long bucketsOffset;
+	unsigned long long slotsOffset;
+	unsigned long long entriesOffset;
+	unsigned long long fileSize;
+};
+
+struct PackEntry
+{
+	unsigned long long pathOffset; //Normalised the same way as FileIndex keys
+	unsigned long long bodyOffset;
+	unsigned long long bodyLen;
+	unsigned long long gzipOffset; //0 when it wasn't worth compressing
+	unsigned long long gzipLen;
+	unsigned long long headerOffset; //"Content-Type..Content-Length..ETag" lines, NUL terminated
+	unsigned long long gzipHeaderOffset; //The same for the gzip variant, plus Content-Encoding and Vary
+	unsigned int pathLen;
+	unsigned int reserved;
+	char mimeType[SITE_PACK_MIME_LEN];
+	char etag[SITE_PACK_ETAG_LEN];
+};
+
+//One mapping of a pack. Responses hold a reference while they send out of it, so a reload can swap the new pack in
+//straight away and this one is unmapped when the last of them is done.
+struct PackView
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	const char* base = nullptr;
+	const PackHeader* header = nullptr;
+	const unsigned int* seeds = nullptr;
+	const unsigned int* slots = nullptr;
+	const PackEntry* entries = nullptr;
+	std::atomic<int> refs{ 1 }; //The pack's own reference while it's current, plus one per Acquire
+};
+
+//A whole document root compiled by WinWebPack into one file and mapped read only.
+//Lookups go through a perfect hash (bucket seed, then slot) so a hit or miss is two hashes and one compare, with no filesystem access at all.
+//The file is opened with FILE_SHARE_DELETE so a deploy can rename a new pack over it while this one is mapped, then Reload maps the new one.
+class SitePack
+{
+public:
+	SitePack();
+	~SitePack();
+	bool Open(const char* path, const char** err = nullptr);
+	bool Reload(const char** err = nullptr);
+	void Close();
+	bool IsOpen();
+	PackView* Acquire();
+	static void Release(PackView* view);
+	static const PackEntry* Lookup(const PackView* view, const char* path, int len);
+	static const char* GetData(const PackView* view, unsigned long long offset);
+	unsigned int GetEntryCount();
+	unsigned long long GetSize();
+	static unsigned int Hash(const char* key, int len, unsigned int seed);
+private:
+	static PackView* Map(const char* path, const char** err);
+	static bool Validate(const PackView* view);
+	static void Unmap(PackView* view);
+	std::mutex packMutex;
+	std::string packPath;
+	PackView* current = nullptr;
+};
@@ -0,0 +1,228 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "FramePool.h"
+
+//Lazy coroutine result. Nothing runs until it's co_awaited, and when it finishes it resumes whoever awaited it directly
+//(symmetric transfer), so deep chains of awaits don't grow the stack.
+template<typename T>
+class Task
+{
+public:
+	struct promise_type : PooledFrame
+	{
+		T value{};
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object()
+		{
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				std::coroutine_handle<> next = handle.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+
+			void await_resume() noexcept
+			{
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_value(T val)
+		{
+			value = std::move(val);
+		}
+
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr))
+	{
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume()
+	{
+		return std::move(handle.promise().value);
+	}
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) : handle(h)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+template<>
+class Task<void>
+{
+public:
+	struct promise_type : PooledFrame
+	{
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object()
+		{
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				std::coroutine_handle<> next = handle.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+
+			void await_resume() noexcept
+			{
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void()
+		{
+		}
+
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr))
+	{
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	void await_resume()
+	{
+	}
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) : handle(h)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+//Top level coroutine that owns itself. Created suspended so the caller can hand it to the I/O loop,
+//and frees its frame as soon as it returns.
+class DetachedTask
+{
+public:
+	struct promise_type : PooledFrame
+	{
+		DetachedTask get_return_object()
+		{
+			return DetachedTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void()
+		{
+		}
+
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	std::coroutine_handle<> handle;
+
+private:
+	explicit DetachedTask(std::coroutine_handle<promise_type> h) : handle(h)
+	{
+	}
+};
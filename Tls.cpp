@@ -0,0 +1,361 @@
+#include "Tls.h"
+#include <string.h>
+
+#ifdef WINWEB_TLS
+#include <openssl/rand.h>
+#include <chrono>
+
+static const unsigned char sessionIdContext[] = "WinWeb";
+
+//OpenSSL 3 hands ticket callbacks an EVP_MAC_CTX, 1.1.1 an HMAC_CTX (deprecated in 3)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+typedef EVP_MAC_CTX TicketMac;
+
+static bool InitTicketMac(TicketMac* mac, unsigned char* key)
+{
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, TLS_TICKET_KEY_LEN);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(mac, params) == 1;
+}
+#define SetTicketKeyCallback SSL_CTX_set_tlsext_ticket_key_evp_cb
+#else
+typedef HMAC_CTX TicketMac;
+
+static bool InitTicketMac(TicketMac* mac, unsigned char* key)
+{
+	return HMAC_Init_ex(mac, key, TLS_TICKET_KEY_LEN, EVP_sha256(), NULL) == 1;
+}
+#define SetTicketKeyCallback SSL_CTX_set_tlsext_ticket_key_cb
+#endif
+
+static int TicketKeyCallback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, TicketMac* mac, int encrypt)
+{
+	//Returns 1 to use the ticket, 2 to use it and issue a fresh one, 0 for a full handshake (or no ticket) and -1 on error
+	TlsContext* tls = (TlsContext*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	TicketKey key;
+	if (encrypt)
+	{
+		if (!tls->GetTicketKey(key) || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+		{
+			return -1;
+		}
+		memcpy(name, key.name, TLS_TICKET_NAME_LEN);
+		if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1 || !InitTicketMac(mac, key.hmacKey))
+		{
+			return -1;
+		}
+		return 1;
+	}
+
+	bool renew = false;
+	if (!tls->FindTicketKey(name, key, renew))
+	{
+		return 0;
+	}
+	if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1 || !InitTicketMac(mac, key.hmacKey))
+	{
+		return -1;
+	}
+	return renew ? 2 : 1;
+}
+
+static int SelectAlpn(SSL* ssl, const unsigned char** out, unsigned char* outLen, const unsigned char* in, unsigned int inLen, void* arg)
+{
+	//Prefer h2, fall back to http/1.1, and carry on without ALPN if the client offers neither
+	static const unsigned char preferred[] = "\x02h2\x08http/1.1";
+	unsigned char* selected = nullptr;
+	if (SSL_select_next_proto(&selected, outLen, preferred, sizeof(preferred) - 1, in, inLen) != OPENSSL_NPN_NEGOTIATED)
+	{
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext()
+{
+}
+
+TlsContext::~TlsContext()
+{
+	if (ctx)
+	{
+		SSL_CTX_free(ctx);
+	}
+}
+
+bool TlsContext::Init(const char* certFile, const char* keyFile, const char** error)
+{
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+	{
+		*error = "Failed creating TLS context";
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1)
+	{
+		*error = "Failed loading TLS certificate";
+		return false;
+	}
+
+	if (SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+	{
+		*error = "Failed loading TLS private key";
+		return false;
+	}
+
+	//Resumption: a server side session cache for TLS 1.2 session IDs plus stateless tickets. OpenSSL's own ticket key is made
+	//once and kept for the life of the context, so ours is replaced every TLS_TICKET_KEY_LIFETIME instead. Both are per process.
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+	SSL_CTX_set_session_id_context(ctx, sessionIdContext, sizeof(sessionIdContext) - 1);
+	SSL_CTX_set_num_tickets(ctx, TLS_NUM_TICKETS);
+	SSL_CTX_set_app_data(ctx, this);
+	if (!RotateTicketKeys() || SetTicketKeyCallback(ctx, TicketKeyCallback) != 1)
+	{
+		*error = "Failed setting up TLS session tickets";
+		return false;
+	}
+
+	//Non-blocking sockets: SSL_write may be retried with a different pointer and can complete partially
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	//Only takes effect where the kernel supports it (Linux), elsewhere OpenSSL keeps doing the record layer itself
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	SSL_CTX_set_alpn_select_cb(ctx, SelectAlpn, nullptr);
+	return true;
+}
+
+SSL* TlsContext::CreateSession(SOCKET socket)
+{
+	if (!ctx)
+	{
+		return nullptr;
+	}
+
+	SSL* ssl = SSL_new(ctx);
+	if (!ssl)
+	{
+		return nullptr;
+	}
+
+	SSL_set_fd(ssl, (int)socket);
+	SSL_set_accept_state(ssl);
+	return ssl;
+}
+
+void TlsContext::FreeSession(SSL* ssl)
+{
+	if (ssl)
+	{
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+}
+
+TlsResult TlsContext::Handshake(SSL* ssl)
+{
+	//Called repeatedly from the connection loop until it stops asking for I/O, never blocks
+	ERR_clear_error();
+	int ret = SSL_do_handshake(ssl);
+	if (ret == 1)
+	{
+		return TLS_DONE;
+	}
+
+	int err = SSL_get_error(ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	{
+		return TLS_WANT_IO;
+	}
+
+	return err == SSL_ERROR_ZERO_RETURN ? TLS_CLOSED : TLS_ERROR;
+}
+
+int TlsContext::Read(SSL* ssl, char* buf, int size)
+{
+	//Same convention as recv on a non-blocking socket: bytes, 0 on close, SOCKET_ERROR with WSAEWOULDBLOCK when there's nothing yet
+	ERR_clear_error();
+	int ret = SSL_read(ssl, buf, size);
+	if (ret > 0)
+	{
+		return ret;
+	}
+
+	int err = SSL_get_error(ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return SOCKET_ERROR;
+	}
+
+	return err == SSL_ERROR_ZERO_RETURN ? 0 : SOCKET_ERROR;
+}
+
+int TlsContext::Write(SSL* ssl, const char* buf, int size)
+{
+	ERR_clear_error();
+	int ret = SSL_write(ssl, buf, size);
+	if (ret > 0)
+	{
+		return ret;
+	}
+
+	int err = SSL_get_error(ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+	}
+	else
+	{
+		WSASetLastError(WSAECONNRESET);
+	}
+	return SOCKET_ERROR;
+}
+
+bool TlsContext::HasPending(SSL* ssl)
+{
+	//Decrypted bytes can be sitting in OpenSSL's buffer while the socket itself has nothing to read
+	return ssl && SSL_pending(ssl) > 0;
+}
+
+bool TlsContext::SelectedHttp2(SSL* ssl)
+{
+	const unsigned char* proto = nullptr;
+	unsigned int len = 0;
+	SSL_get0_alpn_selected(ssl, &proto, &len);
+	return proto && len == 2 && !memcmp(proto, "h2", 2);
+}
+
+bool TlsContext::Resumed(SSL* ssl)
+{
+	return SSL_session_reused(ssl) == 1;
+}
+
+bool TlsContext::Available()
+{
+	return true;
+}
+
+bool TlsContext::RotateTicketKeys()
+{
+	//Under ticketMutex (or before any handshake). The current key becomes the previous one, still accepted until the next rotation.
+	TicketKey fresh;
+	if (RAND_bytes(fresh.name, TLS_TICKET_NAME_LEN) != 1 || RAND_bytes(fresh.aesKey, TLS_TICKET_KEY_LEN) != 1 || RAND_bytes(fresh.hmacKey, TLS_TICKET_KEY_LEN) != 1)
+	{
+		return false;
+	}
+
+	ticketKeys[1] = ticketKeys[0];
+	ticketKeys[0] = fresh;
+	ticketKeyCount = ticketKeyCount < 2 ? ticketKeyCount + 1 : 2;
+	ticketKeyBornMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	OPENSSL_cleanse(&fresh, sizeof(fresh));
+	return true;
+}
+
+bool TlsContext::GetTicketKey(TicketKey& key)
+{
+	//The key new tickets are issued under, replaced once it's TLS_TICKET_KEY_LIFETIME old
+	std::lock_guard<std::mutex> lock(ticketMutex);
+	long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	if (now - ticketKeyBornMs >= TLS_TICKET_KEY_LIFETIME * 1000LL && !RotateTicketKeys())
+	{
+		return false;
+	}
+
+	key = ticketKeys[0];
+	return true;
+}
+
+bool TlsContext::FindTicketKey(const unsigned char* name, TicketKey& key, bool& renew)
+{
+	//A ticket under the previous key still resumes, but gets a new one under the current key
+	std::lock_guard<std::mutex> lock(ticketMutex);
+	for (int i = 0; i < ticketKeyCount; i++)
+	{
+		if (!memcmp(ticketKeys[i].name, name, TLS_TICKET_NAME_LEN))
+		{
+			key = ticketKeys[i];
+			renew = i > 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+#else
+
+//Built without OpenSSL, HTTPS is reported as unavailable at startup
+
+TlsContext::TlsContext()
+{
+}
+
+TlsContext::~TlsContext()
+{
+}
+
+bool TlsContext::Init(const char* certFile, const char* keyFile, const char** error)
+{
+	*error = "Built without TLS support (define WINWEB_TLS and link OpenSSL)";
+	return false;
+}
+
+SSL* TlsContext::CreateSession(SOCKET socket)
+{
+	return nullptr;
+}
+
+void TlsContext::FreeSession(SSL* ssl)
+{
+}
+
+TlsResult TlsContext::Handshake(SSL* ssl)
+{
+	return TLS_ERROR;
+}
+
+int TlsContext::Read(SSL* ssl, char* buf, int size)
+{
+	return SOCKET_ERROR;
+}
+
+int TlsContext::Write(SSL* ssl, const char* buf, int size)
+{
+	return SOCKET_ERROR;
+}
+
+bool TlsContext::HasPending(SSL* ssl)
+{
+	return false;
+}
+
+bool TlsContext::SelectedHttp2(SSL* ssl)
+{
+	return false;
+}
+
+bool TlsContext::Resumed(SSL* ssl)
+{
+	return false;
+}
+
+bool TlsContext::Available()
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+#include <WinSock2.h>
+#include <mutex>
+
+//Building with TLS needs OpenSSL 1.1.1+ on the include/lib paths and WINWEB_TLS defined
+#ifdef WINWEB_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#else
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+#endif
+
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 3600
+#define TLS_NUM_TICKETS 2
+#define TLS_HANDSHAKE_TIMEOUT 5
+#define TLS_TICKET_KEY_LIFETIME TLS_SESSION_TIMEOUT //Seconds a ticket key issues tickets for, it's accepted for as long again after
+#define TLS_TICKET_NAME_LEN 16
+#define TLS_TICKET_KEY_LEN 32
+
+struct TicketKey
+{
+	unsigned char name[TLS_TICKET_NAME_LEN];
+	unsigned char aesKey[TLS_TICKET_KEY_LEN];
+	unsigned char hmacKey[TLS_TICKET_KEY_LEN];
+};
+
+enum TlsResult
+{
+	TLS_DONE,
+	TLS_WANT_IO,
+	TLS_CLOSED,
+	TLS_ERROR
+};
+
+//Shared server side context, one per listening port. Holds the session cache and ticket keys so resumption works across connections.
+//Both are per process, in worker mode a client only resumes on the worker that issued its session.
+class TlsContext
+{
+public:
+	TlsContext();
+	~TlsContext();
+	bool Init(const char* certFile, const char* keyFile, const char** error);
+	SSL* CreateSession(SOCKET socket);
+	static void FreeSession(SSL* ssl);
+	static TlsResult Handshake(SSL* ssl);
+	static int Read(SSL* ssl, char* buf, int size);
+	static int Write(SSL* ssl, const char* buf, int size);
+	static bool HasPending(SSL* ssl);
+	static bool SelectedHttp2(SSL* ssl);
+	static bool Resumed(SSL* ssl);
+	static bool Available();
+	bool GetTicketKey(TicketKey& key);
+	bool FindTicketKey(const unsigned char* name, TicketKey& key, bool& renew);
+private:
+	bool RotateTicketKeys();
+	SSL_CTX* ctx = nullptr;
+	std::mutex ticketMutex;
+	TicketKey ticketKeys[2] = {}; //Current, then the one before it
+	int ticketKeyCount = 0;
+	long long ticketKeyBornMs = 0;
+};
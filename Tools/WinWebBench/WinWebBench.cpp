@@ -0,0 +1,570 @@
+#include "Connection.h"
+#include "RequestTarget.h"
+#include <Windows.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <chrono>
+
+//Microbenchmarks for the request hot path, run without a server or a socket
+//Usage: WinWebBench [--filter <substring>] [--min-time <seconds>] [--json <file>] [--scratch <dir>]
+//JSON output follows Google Benchmark's layout so the usual comparison and trend tools can read it
+
+#define BENCH_MIN_TIME 0.5 //Seconds each benchmark runs for at least
+#define BENCH_MAX_ITERATIONS 1000000000LL
+#define BENCH_SCRATCH_DIR "WinWebBench"
+#define BENCH_DONE_MARKER "complete" //Written once a synthetic directory is fully populated, so later runs reuse it
+
+struct BenchResult
+{
+	std::string name;
+	long long iterations;
+	double realNs; //Per iteration
+	double cpuNs;
+	double bytesPerSecond; //0 when the benchmark doesn't process a byte count
+};
+
+static std::vector<BenchResult> results;
+static std::string filter;
+static double minTime = BENCH_MIN_TIME;
+static volatile size_t sink; //Results are folded in here so the optimiser can't drop the work
+
+static double ThreadCpuSeconds()
+{
+	FILETIME created, exited, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+	{
+		return 0;
+	}
+
+	unsigned long long k = ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	unsigned long long u = ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) / 1e7;
+}
+
+static double WallSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Run(const std::string& name, long long bytesPerIteration, const std::function<void(long long)>& body)
+{
+	//body runs the operation n times. n doubles (or jumps towards the target) until a run takes minTime, that run is reported.
+	if (!filter.empty() && name.find(filter) == std::string::npos)
+	{
+		return;
+	}
+
+	long long iterations = 1;
+	while (true)
+	{
+		double wallStart = WallSeconds();
+		double cpuStart = ThreadCpuSeconds();
+		body(iterations);
+		double wall = WallSeconds() - wallStart;
+		double cpu = ThreadCpuSeconds() - cpuStart;
+
+		if (wall >= minTime || iterations >= BENCH_MAX_ITERATIONS)
+		{
+			BenchResult result;
+			result.name = name;
+			result.iterations = iterations;
+			result.realNs = wall * 1e9 / iterations;
+			result.cpuNs = cpu * 1e9 / iterations;
+			result.bytesPerSecond = bytesPerIteration && wall > 0 ? (double)bytesPerIteration * iterations / wall : 0;
+			results.push_back(result);
+
+			if (result.bytesPerSecond > 0)
+			{
+				printf("%-44s %14.0f ns %14.0f ns %12lld %10.1f MB/s\n", name.c_str(), result.realNs, result.cpuNs, iterations, result.bytesPerSecond / (1024.0 * 1024.0));
+			}
+			else
+			{
+				printf("%-44s %14.0f ns %14.0f ns %12lld\n", name.c_str(), result.realNs, result.cpuNs, iterations);
+			}
+			return;
+		}
+
+		//Aim a little past minTime so the next run is usually the last
+		long long next = wall > 0 ? (long long)(iterations * minTime * 1.4 / wall) : iterations * 10;
+		next = next > iterations * 10 ? iterations * 10 : next;
+		iterations = next > iterations ? next : iterations * 2;
+		iterations = iterations < BENCH_MAX_ITERATIONS ? iterations : BENCH_MAX_ITERATIONS;
+	}
+}
+
+//Reaches into Connection for the functions being measured, everything else about it stays private
+class ConnectionBench
+{
+public:
+	ConnectionBench(const ServerServices& services, const char* root) : conn(services)
+	{
+		conn.docRoot = root;
+		conn.keepAlive = true;
+	}
+
+	void BeginRequest()
+	{
+		conn.requestArena = &conn.arena;
+	}
+
+	void EndRequest()
+	{
+		//The reset is part of what a request costs, so it's measured too
+		conn.requestArena = nullptr;
+		conn.arena.Reset();
+	}
+
+	void GetHeader(char* userAgent, char* buf, int len, char* contentType, const char* etag, const char* prebuilt)
+	{
+		conn.GetHeader(ResponseCodes::OK, userAgent, buf, len, "", contentType, etag, prebuilt);
+	}
+
+	char* AppendDataToHeader(char* headerBuf, char* data, int dataLen, int& totalSize)
+	{
+		return conn.AppendDataToHeader(headerBuf, data, dataLen, totalSize);
+	}
+
+	bool GetDirectoryListing(char* loc, char*& retBuf)
+	{
+		return conn.GetDirectoryListing(loc, retBuf);
+	}
+
+	bool GetFile(char* path, char*& retBuf, int& len)
+	{
+		FileInfo info;
+		return conn.GetFile(path, retBuf, len, info);
+	}
+
+	void FreeBody(char* body)
+	{
+		conn.RequestFree(body);
+	}
+
+	static void ParseHead(char* data, RequestHead& head)
+	{
+		Connection::ParseHead(data, head);
+	}
+
+private:
+	Connection conn;
+};
+
+static bool WriteFileOfSize(const std::string& path, long long size)
+{
+	//Left alone if it's already there at the right size
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if (GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attr) && (((long long)attr.nFileSizeHigh << 32) | attr.nFileSizeLow) == size)
+	{
+		return true;
+	}
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	std::vector<char> chunk(65536);
+	for (size_t i = 0; i < chunk.size(); i++)
+	{
+		chunk[i] = (char)('a' + i % 26);
+	}
+
+	long long remaining = size;
+	bool ok = true;
+	while (ok && remaining > 0)
+	{
+		DWORD want = remaining < (long long)chunk.size() ? (DWORD)remaining : (DWORD)chunk.size();
+		DWORD written = 0;
+		ok = WriteFile(file, chunk.data(), want, &written, NULL) && written == want;
+		remaining -= written;
+	}
+	CloseHandle(file);
+	return ok;
+}
+
+static bool MakeDirectoryOf(const std::string& dir, int entries)
+{
+	//entries empty .html files, the slow part for 100k so it's only ever done once
+	std::string marker = dir + "\\" + BENCH_DONE_MARKER;
+	if (GetFileAttributesA(marker.c_str()) != INVALID_FILE_ATTRIBUTES)
+	{
+		return true;
+	}
+
+	CreateDirectoryA(dir.c_str(), NULL);
+	char name[64];
+	for (int i = 0; i < entries; i++)
+	{
+		sprintf_s(name, "\\f%06d.html", i);
+		HANDLE file = CreateFileA((dir + name).c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		CloseHandle(file);
+	}
+	return WriteFileOfSize(marker, 0);
+}
+
+static const int dirSizes[] = { 10, 1000, 10000, 100000 };
+static const long long fileSizes[] = { 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+static bool PrepareScratch(const std::string& root)
+{
+	printf("Preparing %s (first run builds a 100k entry directory, this takes a while)\n", root.c_str());
+	CreateDirectoryA(root.c_str(), NULL);
+	CreateDirectoryA((root + "\\dirs").c_str(), NULL);
+	CreateDirectoryA((root + "\\files").c_str(), NULL);
+
+	char name[64];
+	for (int i = 0; i < sizeof(dirSizes) / sizeof(dirSizes[0]); i++)
+	{
+		sprintf_s(name, "\\dirs\\d%d", dirSizes[i]);
+		if (!MakeDirectoryOf(root + name, dirSizes[i]))
+		{
+			return false;
+		}
+	}
+
+	for (int i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); i++)
+	{
+		sprintf_s(name, "\\files\\f%lld.bin", fileSizes[i]);
+		if (!WriteFileOfSize(root + name, fileSizes[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static const char* browserRequest =
+	"GET /assets/app.js?v=12 HTTP/1.1\r\n"
+	"Host: localhost:4000\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Windows\"\r\n"
+	"Accept: */*\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Referer: http://localhost:4000/\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-GB,en;q=0.9\r\n"
+	"\r\n";
+
+static const char* curlRequest = "GET / HTTP/1.1\r\nHost: localhost:4000\r\nUser-Agent: curl/8.4.0\r\nAccept: */*\r\n\r\n";
+
+static const char* uploadRequest =
+	"PUT /artifacts/1234/build.zip HTTP/1.1\r\n"
+	"Host: localhost:4000\r\n"
+	"User-Agent: curl/8.4.0\r\n"
+	"Content-Length: 104857600\r\n"
+	"Expect: 100-continue\r\n"
+	"\r\n";
+
+static void BenchParseHead()
+{
+	const char* requests[] = { browserRequest, curlRequest, uploadRequest };
+	const char* names[] = { "ParseHead/browser", "ParseHead/curl", "ParseHead/upload" };
+	for (int r = 0; r < 3; r++)
+	{
+		std::string copy = requests[r];
+		Run(names[r], (long long)copy.size(), [&copy](long long n)
+			{
+				for (long long i = 0; i < n; i++)
+				{
+					RequestHead head;
+					ConnectionBench::ParseHead(&copy[0], head);
+					sink += head.userAgentLen + head.hostLen;
+				}
+			});
+	}
+}
+
+static void BenchDecode()
+{
+	const char* targets[] = { "/index.html", "/assets/js/vendor/app.min.js?v=1234", "/docs/My%20Report%20(final).pdf", "/a/./b/../c//d/%2e%2e/e.html" };
+	const char* names[] = { "Decode/simple", "Decode/query", "Decode/escaped", "Decode/dot_segments" };
+	for (int t = 0; t < 4; t++)
+	{
+		const char* target = targets[t];
+		int targetLen = (int)strlen(target);
+		Run(names[t], targetLen, [target, targetLen](long long n)
+			{
+				char out[MAX_PATH];
+				for (long long i = 0; i < n; i++)
+				{
+					int outLen = 0;
+					RequestTarget::Decode(target, targetLen, out, MAX_PATH, outLen);
+					sink += outLen;
+				}
+			});
+	}
+}
+
+static void BenchGetTypeFromExtension()
+{
+	const char* exts[] = { ".html", ".png", ".webmanifest", ".nosuchtype" };
+	const char* names[] = { "GetTypeFromExtension/html", "GetTypeFromExtension/png", "GetTypeFromExtension/webmanifest", "GetTypeFromExtension/unknown" };
+	for (int e = 0; e < 4; e++)
+	{
+		char* ext = (char*)exts[e];
+		Run(names[e], 0, [ext](long long n)
+			{
+				for (long long i = 0; i < n; i++)
+				{
+					char* type = Connection::GetTypeFromExtension(ext);
+					sink += type ? type[0] : 0;
+					free(type);
+				}
+			});
+	}
+}
+
+static void BenchGetHeader(ConnectionBench& bench)
+{
+	char buf[MAX_HEADER_BUF_SIZE];
+	char userAgent[] = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36";
+	char contentType[] = "text/html";
+	const char* prebuilt = "Content-Type:text/html\r\nContent-Length:5120\r\nETag:\"5f3a-1400\"\r\n";
+
+	Run("GetHeader/typed", 0, [&](long long n)
+		{
+			for (long long i = 0; i < n; i++)
+			{
+				bench.GetHeader(userAgent, buf, 5120, contentType, "\"5f3a-1400\"", nullptr);
+				sink += buf[9];
+			}
+		});
+	Run("GetHeader/default_type", 0, [&](long long n)
+		{
+			for (long long i = 0; i < n; i++)
+			{
+				bench.GetHeader(userAgent, buf, 5120, nullptr, nullptr, nullptr);
+				sink += buf[9];
+			}
+		});
+	Run("GetHeader/prebuilt", 0, [&](long long n)
+		{
+			for (long long i = 0; i < n; i++)
+			{
+				bench.GetHeader(userAgent, buf, 5120, nullptr, nullptr, prebuilt);
+				sink += buf[9];
+			}
+		});
+}
+
+static void BenchAppendDataToHeader(ConnectionBench& bench)
+{
+	char header[MAX_HEADER_BUF_SIZE];
+	char userAgent[] = "curl/8.4.0";
+	char contentType[] = "application/octet-stream";
+	int sizes[] = { 0, 1024, 64 * 1024, 1024 * 1024 };
+	for (int s = 0; s < 4; s++)
+	{
+		int size = sizes[s];
+		std::vector<char> body(size > 0 ? size : 1, 'x');
+		bench.GetHeader(userAgent, header, size, contentType, nullptr, nullptr);
+
+		char name[64];
+		sprintf_s(name, "AppendDataToHeader/%d", size);
+		Run(name, size + (long long)strlen(header), [&](long long n)
+			{
+				for (long long i = 0; i < n; i++)
+				{
+					bench.BeginRequest();
+					int total = 0;
+					char* full = bench.AppendDataToHeader(header, body.data(), size, total);
+					sink += full ? full[total / 2] : 0;
+					bench.EndRequest();
+				}
+			});
+	}
+}
+
+static void BenchGetDirectoryListing(ConnectionBench& bench)
+{
+	for (int d = 0; d < sizeof(dirSizes) / sizeof(dirSizes[0]); d++)
+	{
+		char loc[64];
+		sprintf_s(loc, "dirs/d%d", dirSizes[d]);
+		char name[64];
+		sprintf_s(name, "GetDirectoryListing/%d", dirSizes[d]);
+		Run(name, 0, [&](long long n)
+			{
+				for (long long i = 0; i < n; i++)
+				{
+					bench.BeginRequest();
+					char* listing = nullptr;
+					if (bench.GetDirectoryListing(loc, listing) && listing)
+					{
+						sink += listing[0];
+					}
+					bench.EndRequest();
+				}
+			});
+	}
+}
+
+static void BenchGetFile(ConnectionBench& bench)
+{
+	for (int f = 0; f < sizeof(fileSizes) / sizeof(fileSizes[0]); f++)
+	{
+		char path[64];
+		sprintf_s(path, "files/f%lld.bin", fileSizes[f]);
+		char name[64];
+		sprintf_s(name, "GetFile/%lld", fileSizes[f]);
+		Run(name, fileSizes[f], [&](long long n)
+			{
+				for (long long i = 0; i < n; i++)
+				{
+					bench.BeginRequest();
+					char* body = nullptr;
+					int len = 0;
+					if (bench.GetFile(path, body, len) && body)
+					{
+						sink += body[len - 1];
+					}
+					bench.EndRequest();
+				}
+			});
+	}
+}
+
+static void JsonEscape(const std::string& in, std::string& out)
+{
+	out.clear();
+	for (size_t i = 0; i < in.size(); i++)
+	{
+		if (in[i] == '"' || in[i] == '\\')
+		{
+			out += '\\';
+		}
+		out += in[i];
+	}
+}
+
+static bool WriteJson(const char* path, const char* exe)
+{
+	FILE* file = fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
+
+	SYSTEMTIME now;
+	GetLocalTime(&now);
+	char host[256] = "";
+	DWORD hostLen = sizeof(host);
+	GetComputerNameA(host, &hostLen);
+
+	std::string escaped;
+	JsonEscape(exe, escaped);
+	fprintf(file, "{\n  \"context\": {\n");
+	fprintf(file, "    \"date\": \"%04u-%02u-%02uT%02u:%02u:%02u\",\n", now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+	fprintf(file, "    \"host_name\": \"%s\",\n", host);
+	fprintf(file, "    \"executable\": \"%s\",\n", escaped.c_str());
+	fprintf(file, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef _DEBUG
+	fprintf(file, "    \"library_build_type\": \"debug\"\n");
+#else
+	fprintf(file, "    \"library_build_type\": \"release\"\n");
+#endif
+	fprintf(file, "  },\n  \"benchmarks\": [\n");
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		JsonEscape(r.name, escaped);
+		fprintf(file, "    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"iteration\",\n", escaped.c_str(), escaped.c_str());
+		fprintf(file, "      \"iterations\": %lld,\n      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"", r.iterations, r.realNs, r.cpuNs);
+		if (r.bytesPerSecond > 0)
+		{
+			fprintf(file, ",\n      \"bytes_per_second\": %.1f", r.bytesPerSecond);
+		}
+		fprintf(file, "\n    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(file, "  ]\n}\n");
+	fclose(file);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	std::string jsonFile;
+	char tempPath[MAX_PATH];
+	GetTempPathA(MAX_PATH, tempPath);
+	std::string scratch = std::string(tempPath) + BENCH_SCRATCH_DIR;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+		{
+			filter = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--min-time") && i + 1 < argc)
+		{
+			minTime = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+		{
+			jsonFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--scratch") && i + 1 < argc)
+		{
+			scratch = argv[++i];
+		}
+		else
+		{
+			printf("Usage: WinWebBench [--filter <substring>] [--min-time <seconds>] [--json <file>] [--scratch <dir>]\n");
+			return 1;
+		}
+	}
+
+	if (!PrepareScratch(scratch))
+	{
+		printf("Failed preparing %s\n", scratch.c_str());
+		return 1;
+	}
+
+	//The same index and handle cache the server would have over this root
+	FileIndex fileIndex;
+	FileCache fileCache;
+	if (!fileIndex.Build(scratch.c_str()))
+	{
+		printf("Failed indexing %s\n", scratch.c_str());
+		return 1;
+	}
+
+	ServerServices services;
+	services.fileIndex = &fileIndex;
+	services.fileCache = &fileCache;
+	ConnectionBench bench(services, scratch.c_str());
+
+	printf("%-44s %17s %17s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+	BenchParseHead();
+	BenchDecode();
+	BenchGetTypeFromExtension();
+	BenchGetHeader(bench);
+	BenchAppendDataToHeader(bench);
+	BenchGetDirectoryListing(bench);
+	BenchGetFile(bench);
+
+	if (!jsonFile.empty())
+	{
+		if (!WriteJson(jsonFile.c_str(), argv[0]))
+		{
+			printf("Can't write %s\n", jsonFile.c_str());
+			return 1;
+		}
+		printf("Results written to %s\n", jsonFile.c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,1143 @@
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+//Drives load at a running WinWeb and reports throughput and latency percentiles
+//Usage: WinWebLoad [options] [host[:port]]
+//       WinWebLoad --scenarios <file> [--save <baseline>] [--compare <baseline>] [host[:port]]
+
+#define LOAD_DEFAULT_PORT 4000
+#define LOAD_MAX_THREADS 64
+#define LOAD_MAX_PIPELINE 64
+#define LOAD_MAX_HEAD 16384 //A response head longer than this is treated as garbage
+#define LOAD_RECV_CHUNK 65536
+#define LOAD_POLL_MS 50
+#define LOAD_RECONNECT_DELAY_US 100000 //After a failed connect, so a down server isn't hammered
+#define LOAD_TIMEOUT_US (10LL * 1000 * 1000) //No progress for this long and the requests on the connection count as timed out
+#define LOAD_MAX_BACKLOG 1000000 //Open loop sends waiting for a free connection, past this they're dropped and counted
+#define LOAD_COMPARE_TOLERANCE 5.0 //Percent a result can get worse before --compare calls it a regression
+#define HIST_SUB_BITS 10
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS) //Steps per power of two, about 0.1% precision
+#define HIST_MAX_SHIFT 26 //Covers well past an hour in microseconds
+
+//Log linear histogram in the style of HdrHistogram: exact below 2048us, then 1024 steps per doubling
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() : counts(2 * HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_SUB_COUNT, 0)
+	{
+	}
+
+	void Record(long long value)
+	{
+		if (value < 0)
+		{
+			value = 0;
+		}
+		++counts[IndexFor(value)];
+		++total;
+		sum += value;
+		max = value > max ? value : max;
+	}
+
+	void Merge(const LatencyHistogram& other)
+	{
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			counts[i] += other.counts[i];
+		}
+		total += other.total;
+		sum += other.sum;
+		max = other.max > max ? other.max : max;
+	}
+
+	long long Percentile(double percent)
+	{
+		//Upper edge of the bucket the percentile lands in, so it never under reports
+		if (!total)
+		{
+			return 0;
+		}
+
+		long long target = (long long)(percent / 100.0 * total + 0.5);
+		target = target < 1 ? 1 : target;
+		long long seen = 0;
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			seen += counts[i];
+			if (seen >= target)
+			{
+				long long value = ValueFor((int)i);
+				return value < max ? value : max;
+			}
+		}
+		return max;
+	}
+
+	long long GetCount()
+	{
+		return total;
+	}
+
+	long long GetMax()
+	{
+		return max;
+	}
+
+	double GetMean()
+	{
+		return total ? (double)sum / total : 0;
+	}
+
+private:
+	static int IndexFor(long long value)
+	{
+		if (value < 2 * HIST_SUB_COUNT)
+		{
+			return (int)value;
+		}
+
+		int msb = 0;
+		while ((value >> (msb + 1)) != 0)
+		{
+			++msb;
+		}
+
+		int shift = msb - HIST_SUB_BITS;
+		if (shift > HIST_MAX_SHIFT)
+		{
+			return 2 * HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_SUB_COUNT - 1;
+		}
+		return 2 * HIST_SUB_COUNT + (shift - 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+	}
+
+	static long long ValueFor(int index)
+	{
+		if (index < 2 * HIST_SUB_COUNT)
+		{
+			return index;
+		}
+
+		int shift = (index - 2 * HIST_SUB_COUNT) / HIST_SUB_COUNT + 1;
+		long long sub = (index - 2 * HIST_SUB_COUNT) % HIST_SUB_COUNT + HIST_SUB_COUNT;
+		return ((sub + 1) << shift) - 1;
+	}
+
+	std::vector<long long> counts;
+	long long total = 0;
+	long long sum = 0;
+	long long max = 0;
+};
+
+struct LoadOptions
+{
+	std::string name = "default";
+	std::string host = "127.0.0.1";
+	int port = LOAD_DEFAULT_PORT;
+	int threads = 2;
+	int connections = 64;
+	int seconds = 10;
+	int warmup = 1; //Seconds at the start that are driven but not recorded
+	double rate = 0; //Requests per second across all threads, 0 for closed loop
+	int pipeline = 1;
+	bool keepAlive = true;
+	std::string root = "DemoWebsite";
+	std::string mixFile;
+	std::vector<std::string> paths; //From -u, replaces the document root walk
+};
+
+struct MixEntry
+{
+	std::string request;
+	double weight;
+};
+
+struct LoadResults
+{
+	LatencyHistogram latency;
+	long long requests = 0;
+	long long bytes = 0;
+	long long clientErrors = 0; //4xx
+	long long serverErrors = 0; //5xx
+	long long socketErrors = 0; //Requests lost to a failed or reset connection
+	long long timeouts = 0;
+	long long dropped = 0; //Open loop only, the backlog overflowed
+	long long connects = 0;
+	double seconds = 0;
+
+	void Merge(const LoadResults& other)
+	{
+		latency.Merge(other.latency);
+		requests += other.requests;
+		bytes += other.bytes;
+		clientErrors += other.clientErrors;
+		serverErrors += other.serverErrors;
+		socketErrors += other.socketErrors;
+		timeouts += other.timeouts;
+		dropped += other.dropped;
+		connects += other.connects;
+	}
+
+	long long GetErrors()
+	{
+		return clientErrors + serverErrors + socketErrors + timeouts + dropped;
+	}
+};
+
+struct LoadPlan
+{
+	sockaddr_storage addr;
+	int addrLen = 0;
+	std::vector<MixEntry> mix;
+	std::vector<double> cumulative; //Running total of the mix weights, for picking
+	int pipeline = 1;
+	bool keepAlive = true;
+	long long startUs = 0;
+	long long warmupEndUs = 0;
+	long long endUs = 0;
+};
+
+struct LoadConnection
+{
+	SOCKET socket = INVALID_SOCKET;
+	bool connected = false;
+	long long retryAtUs = 0;
+	long long progressUs = 0; //Last time it connected, sent or received anything
+	std::string out;
+	size_t outSent = 0;
+	std::deque<long long> inFlight; //When each outstanding request was meant to go out, oldest first
+	std::vector<char> in;
+	size_t inLen = 0;
+};
+
+static long long NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned int NextRandom(unsigned int& state)
+{
+	//xorshift32, one per thread so nothing is shared
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static const std::string& PickRequest(const LoadPlan& plan, unsigned int& rng)
+{
+	if (plan.mix.size() == 1)
+	{
+		return plan.mix[0].request;
+	}
+
+	double at = (NextRandom(rng) / 4294967296.0) * plan.cumulative.back();
+	size_t i = std::upper_bound(plan.cumulative.begin(), plan.cumulative.end(), at) - plan.cumulative.begin();
+	return plan.mix[i < plan.mix.size() ? i : plan.mix.size() - 1].request;
+}
+
+static void CloseConnection(LoadConnection& conn)
+{
+	if (conn.socket != INVALID_SOCKET)
+	{
+		closesocket(conn.socket);
+	}
+	conn.socket = INVALID_SOCKET;
+	conn.connected = false;
+	conn.out.clear();
+	conn.outSent = 0;
+	conn.inFlight.clear();
+	conn.inLen = 0;
+}
+
+static bool OpenConnection(LoadConnection& conn, const LoadPlan& plan, long long now)
+{
+	conn.socket = socket(plan.addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (conn.socket == INVALID_SOCKET)
+	{
+		return false;
+	}
+
+	u_long nonBlocking = 1;
+	ioctlsocket(conn.socket, FIONBIO, &nonBlocking);
+	int noDelay = 1;
+	setsockopt(conn.socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	if (connect(conn.socket, (const sockaddr*)&plan.addr, plan.addrLen) == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+	{
+		CloseConnection(conn);
+		return false;
+	}
+
+	conn.progressUs = now;
+	return true;
+}
+
+static const char* FindHeadEnd(const char* buf, size_t len)
+{
+	for (size_t i = 0; i + 3 < len; i++)
+	{
+		if (buf[i] == '\r' && !memcmp(buf + i, "\r\n\r\n", 4))
+		{
+			return buf + i;
+		}
+	}
+	return nullptr;
+}
+
+static bool LineHas(const char* start, const char* end, const char* word)
+{
+	size_t wordLen = strlen(word);
+	for (const char* it = start; it + wordLen <= end; ++it)
+	{
+		if (!_strnicmp(it, word, wordLen))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static long long ResponseLength(const char* buf, size_t len, int& status, bool& close)
+{
+	//Bytes the response at the front of buf takes, 0 if it isn't all here yet, -1 if it can't be parsed
+	const char* headEnd = FindHeadEnd(buf, len);
+	if (!headEnd)
+	{
+		return len > LOAD_MAX_HEAD ? -1 : 0;
+	}
+
+	if (headEnd - buf < 12 || strncmp(buf, "HTTP/1.", 7))
+	{
+		return -1;
+	}
+	status = atoi(buf + 9);
+
+	long long contentLength = 0;
+	close = false;
+	const char* line = buf;
+	while (line < headEnd)
+	{
+		const char* lineEnd = (const char*)memchr(line, '\r', headEnd + 2 - line);
+		if (!lineEnd)
+		{
+			break;
+		}
+
+		if (lineEnd - line > 15 && !_strnicmp(line, "Content-Length:", 15))
+		{
+			contentLength = _strtoi64(line + 15, nullptr, 10);
+		}
+		else if (lineEnd - line > 11 && !_strnicmp(line, "Connection:", 11))
+		{
+			close = LineHas(line + 11, lineEnd, "close");
+		}
+		line = lineEnd + 2;
+	}
+
+	if (contentLength < 0)
+	{
+		return -1;
+	}
+
+	long long total = (long long)(headEnd + 4 - buf) + contentLength;
+	return (long long)len >= total ? total : 0;
+}
+
+static void FailConnection(LoadConnection& conn, LoadResults& results, long long now, bool timedOut)
+{
+	//Whatever was outstanding is lost, the next pass reconnects. A connect that never completed counts once.
+	if (!conn.connected)
+	{
+		++results.socketErrors;
+	}
+	if (timedOut)
+	{
+		results.timeouts += (long long)conn.inFlight.size();
+	}
+	else
+	{
+		results.socketErrors += (long long)conn.inFlight.size();
+	}
+	CloseConnection(conn);
+	conn.retryAtUs = now + LOAD_RECONNECT_DELAY_US;
+}
+
+static bool ReadResponses(LoadConnection& conn, const LoadPlan& plan, LoadResults& results, long long now)
+{
+	//Drains the socket and completes every whole response. False once the connection has to be redone.
+	while (true)
+	{
+		if (conn.in.size() - conn.inLen < LOAD_RECV_CHUNK)
+		{
+			conn.in.resize(conn.inLen + LOAD_RECV_CHUNK);
+		}
+
+		int got = recv(conn.socket, conn.in.data() + conn.inLen, (int)(conn.in.size() - conn.inLen), 0);
+		if (got > 0)
+		{
+			conn.inLen += got;
+			conn.progressUs = now;
+			continue;
+		}
+		if (got < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+		{
+			break;
+		}
+
+		//Closed, fine if it said it would and nothing is left outstanding
+		if (conn.inLen == 0 && conn.inFlight.empty())
+		{
+			CloseConnection(conn);
+			return false;
+		}
+		break;
+	}
+
+	size_t used = 0;
+	bool close = false;
+	while (!conn.inFlight.empty() && !close)
+	{
+		int status = 0;
+		long long len = ResponseLength(conn.in.data() + used, conn.inLen - used, status, close);
+		if (len < 0)
+		{
+			FailConnection(conn, results, now, false);
+			return false;
+		}
+		if (len == 0)
+		{
+			break;
+		}
+
+		long long intended = conn.inFlight.front();
+		conn.inFlight.pop_front();
+		used += (size_t)len;
+
+		if (intended >= plan.warmupEndUs)
+		{
+			//From when it was meant to go out, not when it did, so a stall shows up in every request it held back
+			results.latency.Record(now - intended);
+			++results.requests;
+			results.bytes += len;
+			if (status >= 500)
+			{
+				++results.serverErrors;
+			}
+			else if (status >= 400)
+			{
+				++results.clientErrors;
+			}
+		}
+	}
+
+	if (used > 0)
+	{
+		memmove(conn.in.data(), conn.in.data() + used, conn.inLen - used);
+		conn.inLen -= used;
+	}
+
+	if (close || (!plan.keepAlive && conn.inFlight.empty()))
+	{
+		FailConnection(conn, results, now, false);
+		conn.retryAtUs = 0;
+		return false;
+	}
+	return true;
+}
+
+static void RunWorker(const LoadPlan& plan, int connections, double rate, unsigned int seed, LoadResults& results)
+{
+	//Many non-blocking connections on one thread, WSAPoll standing in for epoll
+	std::vector<LoadConnection> conns(connections);
+	std::vector<WSAPOLLFD> fds;
+	std::vector<int> fdConn;
+	std::deque<long long> backlog;
+	unsigned int rng = seed ? seed : 1;
+	double interval = rate > 0 ? 1000000.0 / rate : 0;
+	long long sendIndex = 0;
+	long long nextSendUs = plan.startUs;
+
+	while (true)
+	{
+		long long now = NowUs();
+		if (now >= plan.endUs)
+		{
+			break;
+		}
+
+		if (rate > 0)
+		{
+			//Open loop: requests fall due on a fixed schedule whether or not the server has kept up
+			while (nextSendUs <= now)
+			{
+				if (backlog.size() < LOAD_MAX_BACKLOG)
+				{
+					backlog.push_back(nextSendUs);
+				}
+				else if (nextSendUs >= plan.warmupEndUs)
+				{
+					++results.dropped;
+				}
+				++sendIndex;
+				nextSendUs = plan.startUs + (long long)(sendIndex * interval);
+			}
+		}
+
+		fds.clear();
+		fdConn.clear();
+		for (int i = 0; i < connections; i++)
+		{
+			LoadConnection& conn = conns[i];
+			if (conn.socket == INVALID_SOCKET)
+			{
+				if (now < conn.retryAtUs)
+				{
+					continue;
+				}
+				if (!OpenConnection(conn, plan, now))
+				{
+					++results.socketErrors;
+					conn.retryAtUs = now + LOAD_RECONNECT_DELAY_US;
+					continue;
+				}
+			}
+
+			if (now - conn.progressUs > LOAD_TIMEOUT_US && (!conn.connected || !conn.inFlight.empty()))
+			{
+				FailConnection(conn, results, now, true);
+				continue;
+			}
+
+			if (conn.connected)
+			{
+				int room = plan.keepAlive ? plan.pipeline - (int)conn.inFlight.size() : (conn.inFlight.empty() ? 1 : 0);
+				while (room-- > 0)
+				{
+					long long intended = now;
+					if (rate > 0)
+					{
+						if (backlog.empty())
+						{
+							break;
+						}
+						intended = backlog.front();
+						backlog.pop_front();
+					}
+
+					if (conn.outSent == conn.out.size())
+					{
+						conn.out.clear();
+						conn.outSent = 0;
+					}
+					conn.out += PickRequest(plan, rng);
+					conn.inFlight.push_back(intended);
+				}
+			}
+
+			WSAPOLLFD fd;
+			fd.fd = conn.socket;
+			fd.events = POLLRDNORM;
+			fd.revents = 0;
+			if (!conn.connected || conn.outSent < conn.out.size())
+			{
+				fd.events |= POLLWRNORM;
+			}
+			fds.push_back(fd);
+			fdConn.push_back(i);
+		}
+
+		int waitMs = LOAD_POLL_MS;
+		if (rate > 0)
+		{
+			long long untilNext = (nextSendUs - now) / 1000;
+			waitMs = untilNext < waitMs ? (int)(untilNext > 0 ? untilNext : 0) : waitMs;
+		}
+
+		if (fds.empty())
+		{
+			Sleep(waitMs);
+			continue;
+		}
+
+		if (WSAPoll(fds.data(), (ULONG)fds.size(), waitMs) <= 0)
+		{
+			continue;
+		}
+
+		now = NowUs();
+		for (size_t f = 0; f < fds.size(); f++)
+		{
+			LoadConnection& conn = conns[fdConn[f]];
+			short revents = fds[f].revents;
+			if (!revents)
+			{
+				continue;
+			}
+
+			if ((revents & (POLLERR | POLLNVAL)) || ((revents & POLLHUP) && !(revents & POLLRDNORM)))
+			{
+				FailConnection(conn, results, now, false);
+				continue;
+			}
+
+			if ((revents & POLLWRNORM) && !conn.connected)
+			{
+				conn.connected = true;
+				conn.progressUs = now;
+				++results.connects;
+			}
+
+			if ((revents & POLLWRNORM) && conn.outSent < conn.out.size())
+			{
+				int sent = send(conn.socket, conn.out.data() + conn.outSent, (int)(conn.out.size() - conn.outSent), 0);
+				if (sent > 0)
+				{
+					conn.outSent += sent;
+					conn.progressUs = now;
+				}
+				else if (WSAGetLastError() != WSAEWOULDBLOCK)
+				{
+					FailConnection(conn, results, now, false);
+					continue;
+				}
+			}
+
+			if (revents & (POLLRDNORM | POLLHUP))
+			{
+				ReadResponses(conn, plan, results, now);
+			}
+		}
+	}
+
+	for (int i = 0; i < connections; i++)
+	{
+		CloseConnection(conns[i]);
+	}
+}
+
+static void UrlEncode(const std::string& path, std::string& out)
+{
+	static const char* hex = "0123456789ABCDEF";
+	out.clear();
+	for (size_t i = 0; i < path.size(); i++)
+	{
+		unsigned char c = (unsigned char)path[i];
+		if (isalnum(c) || strchr("/-._~", c))
+		{
+			out += (char)c;
+		}
+		else
+		{
+			out += '%';
+			out += hex[c >> 4];
+			out += hex[c & 15];
+		}
+	}
+}
+
+static void WalkRoot(const std::string& dir, const std::string& rel, std::vector<std::string>& paths)
+{
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &found);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	do
+	{
+		if (!strcmp(found.cFileName, ".") || !strcmp(found.cFileName, ".."))
+		{
+			continue;
+		}
+
+		std::string childRel = rel + "/" + found.cFileName;
+		if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			WalkRoot(dir + "\\" + found.cFileName, childRel, paths);
+		}
+		else
+		{
+			paths.push_back(childRel);
+		}
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+}
+
+static bool BuildMix(const LoadOptions& opts, LoadPlan& plan)
+{
+	//-u paths, else a mix file of "weight path" lines, else every file under the document root equally
+	std::vector<std::pair<std::string, double>> entries;
+	if (!opts.paths.empty())
+	{
+		for (size_t i = 0; i < opts.paths.size(); i++)
+		{
+			entries.push_back({ opts.paths[i], 1.0 });
+		}
+	}
+	else if (!opts.mixFile.empty())
+	{
+		FILE* file = fopen(opts.mixFile.c_str(), "r");
+		if (!file)
+		{
+			printf("Can't open mix file %s\n", opts.mixFile.c_str());
+			return false;
+		}
+
+		char line[1024];
+		while (fgets(line, sizeof(line), file))
+		{
+			double weight = 0;
+			char path[1024];
+			if (line[0] != '#' && sscanf(line, "%lf %1023s", &weight, path) == 2 && weight > 0)
+			{
+				entries.push_back({ path, weight });
+			}
+		}
+		fclose(file);
+	}
+	else
+	{
+		std::vector<std::string> files;
+		WalkRoot(opts.root, "", files);
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			entries.push_back({ files[i], 1.0 });
+		}
+	}
+
+	if (entries.empty())
+	{
+		printf("Nothing to request, give -u, --mix or a --root with files in it\n");
+		return false;
+	}
+
+	char hostBuf[300];
+	sprintf_s(hostBuf, "%s:%d", opts.host.c_str(), opts.port);
+	double total = 0;
+	plan.mix.clear();
+	plan.cumulative.clear();
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		std::string encoded;
+		UrlEncode(entries[i].first, encoded);
+
+		//WinWeb only answers requests that carry a User-Agent
+		MixEntry entry;
+		entry.request = "GET " + encoded + " HTTP/1.1\r\nHost: " + hostBuf + "\r\nUser-Agent: WinWebLoad\r\nConnection: " + (opts.keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+		entry.weight = entries[i].second;
+		total += entry.weight;
+		plan.mix.push_back(entry);
+		plan.cumulative.push_back(total);
+	}
+	return true;
+}
+
+static bool Resolve(const LoadOptions& opts, LoadPlan& plan)
+{
+	addrinfo hints = { 0 };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	char portBuf[16];
+	sprintf_s(portBuf, "%d", opts.port);
+	if (getaddrinfo(opts.host.c_str(), portBuf, &hints, &result) || !result)
+	{
+		printf("Can't resolve %s\n", opts.host.c_str());
+		return false;
+	}
+
+	memcpy(&plan.addr, result->ai_addr, result->ai_addrlen);
+	plan.addrLen = (int)result->ai_addrlen;
+	freeaddrinfo(result);
+	return true;
+}
+
+static bool RunLoad(const LoadOptions& opts, LoadResults& total)
+{
+	LoadPlan plan;
+	if (!Resolve(opts, plan) || !BuildMix(opts, plan))
+	{
+		return false;
+	}
+
+	int threads = opts.threads < opts.connections ? opts.threads : opts.connections;
+	plan.pipeline = opts.keepAlive ? opts.pipeline : 1;
+	plan.keepAlive = opts.keepAlive;
+	plan.startUs = NowUs() + 100000; //Let every thread get going before the schedule starts
+	plan.warmupEndUs = plan.startUs + opts.warmup * 1000000LL;
+	plan.endUs = plan.warmupEndUs + opts.seconds * 1000000LL;
+
+	std::vector<LoadResults> results(threads);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++)
+	{
+		//Connections and rate split evenly, the first threads take any remainder
+		int connections = opts.connections / threads + (i < opts.connections % threads ? 1 : 0);
+		workers.emplace_back([&plan, &results, &opts, connections, threads, i]
+			{
+				while (NowUs() < plan.startUs)
+				{
+					Sleep(1);
+				}
+				RunWorker(plan, connections, opts.rate / threads, 0x9E3779B9u * (i + 1), results[i]);
+			});
+	}
+
+	for (int i = 0; i < threads; i++)
+	{
+		workers[i].join();
+		total.Merge(results[i]);
+	}
+	total.seconds = opts.seconds;
+	return true;
+}
+
+static void PrintResults(const LoadOptions& opts, LoadResults& r)
+{
+	printf("%s: %d connections on %d threads, %s, pipeline %d, %s\n", opts.name.c_str(), opts.connections, opts.threads, opts.keepAlive ? "keep-alive" : "close",
+		opts.keepAlive ? opts.pipeline : 1, opts.rate > 0 ? "open loop" : "closed loop");
+	if (opts.rate > 0)
+	{
+		printf("  target %.0f req/s\n", opts.rate);
+	}
+	printf("  %lld requests in %.1fs, %.1f req/s, %.2f MB/s, %lld connects\n", r.requests, r.seconds, r.requests / r.seconds, r.bytes / r.seconds / (1024.0 * 1024.0), r.connects);
+	printf("  errors: %lld 4xx, %lld 5xx, %lld socket, %lld timeouts, %lld dropped\n", r.clientErrors, r.serverErrors, r.socketErrors, r.timeouts, r.dropped);
+	printf("  latency (us): mean %.0f, p50 %lld, p75 %lld, p90 %lld, p99 %lld, p99.9 %lld, p99.99 %lld, max %lld\n", r.latency.GetMean(), r.latency.Percentile(50), r.latency.Percentile(75),
+		r.latency.Percentile(90), r.latency.Percentile(99), r.latency.Percentile(99.9), r.latency.Percentile(99.99), r.latency.GetMax());
+}
+
+static void PrintUsage()
+{
+	printf("Usage: WinWebLoad [options] [host[:port]]\n");
+	printf("  -t <n>               threads (2)\n");
+	printf("  -c <n>               connections, spread over the threads (64)\n");
+	printf("  -d <seconds>         recorded duration (10)\n");
+	printf("  -w <seconds>         warmup before recording starts (1)\n");
+	printf("  -r <req/s>           open loop at a constant total rate, latency counted from when each request was due (0, closed loop)\n");
+	printf("  -p <depth>           requests pipelined per connection (1)\n");
+	printf("  -k <0|1>             keep-alive, 0 sends Connection: close and reconnects for every request (1)\n");
+	printf("  -u <path>            request this path, repeat for several\n");
+	printf("  --root <dir>         request every file under dir equally (DemoWebsite)\n");
+	printf("  --mix <file>         weighted paths, one \"weight path\" per line\n");
+	printf("  --scenarios <file>   one run per line, \"name options...\" on top of the command line's options\n");
+	printf("  --save <file>        write each run's results as a baseline\n");
+	printf("  --compare <file>     compare each run against a saved baseline, exits 1 on a regression\n");
+}
+
+static bool ParseOption(std::vector<std::string>& args, size_t& i, LoadOptions& opts)
+{
+	//Options shared by the command line and scenario lines. False for anything not understood.
+	const std::string& arg = args[i];
+	bool hasValue = i + 1 < args.size();
+	const char* value = hasValue ? args[i + 1].c_str() : "";
+
+	if (arg[0] != '-')
+	{
+		//host, host:port, [v6] or [v6]:port
+		size_t close = arg[0] == '[' ? arg.find(']') : std::string::npos;
+		size_t colon = close != std::string::npos ? arg.find(':', close) : arg.find(':');
+		if (close == std::string::npos && colon != arg.rfind(':'))
+		{
+			//Bare IPv6, no port
+			colon = std::string::npos;
+		}
+
+		opts.host = close != std::string::npos ? arg.substr(1, close - 1) : arg.substr(0, colon);
+		if (colon != std::string::npos)
+		{
+			opts.port = atoi(arg.c_str() + colon + 1);
+		}
+		return true;
+	}
+
+	if (!hasValue)
+	{
+		return false;
+	}
+
+	if (arg == "-t")
+	{
+		opts.threads = atoi(value);
+	}
+	else if (arg == "-c")
+	{
+		opts.connections = atoi(value);
+	}
+	else if (arg == "-d")
+	{
+		opts.seconds = atoi(value);
+	}
+	else if (arg == "-w")
+	{
+		opts.warmup = atoi(value);
+	}
+	else if (arg == "-r")
+	{
+		opts.rate = atof(value);
+	}
+	else if (arg == "-p")
+	{
+		opts.pipeline = atoi(value);
+	}
+	else if (arg == "-k")
+	{
+		opts.keepAlive = atoi(value) != 0;
+	}
+	else if (arg == "-u")
+	{
+		opts.paths.push_back(value);
+	}
+	else if (arg == "--root")
+	{
+		opts.root = value;
+	}
+	else if (arg == "--mix")
+	{
+		opts.mixFile = value;
+	}
+	else
+	{
+		return false;
+	}
+
+	++i;
+	return true;
+}
+
+static bool CheckOptions(const LoadOptions& opts)
+{
+	if (opts.threads < 1 || opts.threads > LOAD_MAX_THREADS || opts.connections < 1 || opts.seconds < 1 || opts.warmup < 0 || opts.rate < 0 ||
+		opts.pipeline < 1 || opts.pipeline > LOAD_MAX_PIPELINE || opts.port <= 0 || opts.port > 65535)
+	{
+		printf("%s: options out of range\n", opts.name.c_str());
+		return false;
+	}
+	return true;
+}
+
+struct Baseline
+{
+	std::string name;
+	double rps;
+	long long p50;
+	long long p90;
+	long long p99;
+	long long p999;
+	long long max;
+	long long errors;
+};
+
+static void LoadBaselines(const char* path, std::vector<Baseline>& out)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		return;
+	}
+
+	char line[512];
+	while (fgets(line, sizeof(line), file))
+	{
+		char name[256];
+		Baseline b;
+		if (line[0] != '#' && sscanf(line, "%255s %lf %lld %lld %lld %lld %lld %lld", name, &b.rps, &b.p50, &b.p90, &b.p99, &b.p999, &b.max, &b.errors) == 8)
+		{
+			b.name = name;
+			out.push_back(b);
+		}
+	}
+	fclose(file);
+}
+
+static bool SaveBaselines(const char* path, const std::vector<Baseline>& results)
+{
+	FILE* file = fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
+
+	fprintf(file, "#name req/s p50us p90us p99us p99.9us maxus errors\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Baseline& b = results[i];
+		fprintf(file, "%s %.1f %lld %lld %lld %lld %lld %lld\n", b.name.c_str(), b.rps, b.p50, b.p90, b.p99, b.p999, b.max, b.errors);
+	}
+	fclose(file);
+	return true;
+}
+
+static double PercentChange(double before, double after)
+{
+	return before > 0 ? (after - before) * 100.0 / before : 0;
+}
+
+static bool Compare(const Baseline& before, const Baseline& after)
+{
+	//Regressed if throughput fell, or p99 rose, by more than the tolerance, or errors appeared
+	double rpsChange = PercentChange(before.rps, after.rps);
+	double p99Change = PercentChange((double)before.p99, (double)after.p99);
+	bool regressed = rpsChange < -LOAD_COMPARE_TOLERANCE || p99Change > LOAD_COMPARE_TOLERANCE || (after.errors > 0 && before.errors == 0);
+	printf("  vs baseline: req/s %.1f -> %.1f (%+.1f%%), p50 %lld -> %lld, p99 %lld -> %lld (%+.1f%%), p99.9 %lld -> %lld, errors %lld -> %lld%s\n",
+		before.rps, after.rps, rpsChange, before.p50, after.p50, before.p99, after.p99, p99Change, before.p999, after.p999, before.errors, after.errors,
+		regressed ? "  REGRESSION" : "");
+	return !regressed;
+}
+
+int main(int argc, char** argv)
+{
+	LoadOptions base;
+	std::string scenarioFile;
+	std::string saveFile;
+	std::string compareFile;
+
+	std::vector<std::string> args(argv + 1, argv + argc);
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		if (args[i] == "-h" || args[i] == "--help")
+		{
+			PrintUsage();
+			return 0;
+		}
+		else if (args[i] == "--scenarios" && i + 1 < args.size())
+		{
+			scenarioFile = args[++i];
+		}
+		else if (args[i] == "--save" && i + 1 < args.size())
+		{
+			saveFile = args[++i];
+		}
+		else if (args[i] == "--compare" && i + 1 < args.size())
+		{
+			compareFile = args[++i];
+		}
+		else if (!ParseOption(args, i, base))
+		{
+			printf("Unknown option %s\n", args[i].c_str());
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	std::vector<LoadOptions> runs;
+	if (scenarioFile.empty())
+	{
+		runs.push_back(base);
+	}
+	else
+	{
+		FILE* file = fopen(scenarioFile.c_str(), "r");
+		if (!file)
+		{
+			printf("Can't open scenario file %s\n", scenarioFile.c_str());
+			return 1;
+		}
+
+		char line[1024];
+		while (fgets(line, sizeof(line), file))
+		{
+			std::vector<std::string> tokens;
+			char* context = nullptr;
+			for (char* token = strtok_s(line, " \t\r\n", &context); token; token = strtok_s(nullptr, " \t\r\n", &context))
+			{
+				tokens.push_back(token);
+			}
+			if (tokens.empty() || tokens[0][0] == '#')
+			{
+				continue;
+			}
+
+			LoadOptions opts = base;
+			opts.name = tokens[0];
+			for (size_t i = 1; i < tokens.size(); i++)
+			{
+				if (tokens[i][0] != '-' || !ParseOption(tokens, i, opts))
+				{
+					printf("%s: unknown option %s\n", opts.name.c_str(), tokens[i].c_str());
+					fclose(file);
+					return 1;
+				}
+			}
+			runs.push_back(opts);
+		}
+		fclose(file);
+	}
+
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		if (!CheckOptions(runs[i]))
+		{
+			return 1;
+		}
+	}
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData))
+	{
+		printf("WSAStartup failed\n");
+		return 1;
+	}
+
+	std::vector<Baseline> baselines;
+	if (!compareFile.empty())
+	{
+		LoadBaselines(compareFile.c_str(), baselines);
+	}
+
+	std::vector<Baseline> measured;
+	bool passed = true;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		LoadResults results;
+		if (!RunLoad(runs[i], results))
+		{
+			WSACleanup();
+			return 1;
+		}
+		PrintResults(runs[i], results);
+
+		Baseline b;
+		b.name = runs[i].name;
+		b.rps = results.requests / results.seconds;
+		b.p50 = results.latency.Percentile(50);
+		b.p90 = results.latency.Percentile(90);
+		b.p99 = results.latency.Percentile(99);
+		b.p999 = results.latency.Percentile(99.9);
+		b.max = results.latency.GetMax();
+		b.errors = results.GetErrors();
+		measured.push_back(b);
+
+		for (size_t j = 0; j < baselines.size(); j++)
+		{
+			if (baselines[j].name == b.name)
+			{
+				passed = Compare(baselines[j], b) && passed;
+				break;
+			}
+		}
+	}
+
+	WSACleanup();
+
+	if (!saveFile.empty())
+	{
+		if (!SaveBaselines(saveFile.c_str(), measured))
+		{
+			printf("Can't write baseline %s\n", saveFile.c_str());
+			return 1;
+		}
+		printf("Baseline saved to %s\n", saveFile.c_str());
+	}
+	return passed ? 0 : 1;
+}
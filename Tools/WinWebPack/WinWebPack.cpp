@@ -0,0 +1,402 @@
+#include <Windows.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "SitePack.h"
+#include "Mime.h"
+#ifdef WINWEB_ZLIB
+#include <zlib.h>
+#endif
+
+//Compiles a document root into a site pack for WinWeb to map and serve from
+//Usage: WinWebPack <document root> <output pack>
+
+#define PACK_MAX_FILE_SIZE 0x7FFFFFFF //Response lengths are ints on the serving side
+#define PACK_MAX_SEED_TRIES (1 << 20)
+#define PACK_MIN_GZIP_SAVING 8 //Only keep a gzip variant if it's at least 1/8th smaller
+
+struct PackFile
+{
+	std::string key;
+	std::vector<char> body;
+	std::vector<char> gzip;
+	char mimeType[SITE_PACK_MIME_LEN];
+	char etag[SITE_PACK_ETAG_LEN];
+};
+
+static void NormaliseKey(const std::string& relPath, std::string& out)
+{
+	//Same rules as FileIndex::NormalisePath: lower case, '/' separators, nothing leading
+	out.clear();
+	for (int i = 0; i < relPath.size(); i++)
+	{
+		char c = relPath[i] == '\\' ? '/' : (char)tolower((unsigned char)relPath[i]);
+		if (c == '/' && (out.empty() || out.back() == '/'))
+		{
+			continue;
+		}
+		out += c;
+	}
+}
+
+static bool IsCompressible(const char* mimeType)
+{
+	return !strncmp(mimeType, "text/", 5) || strstr(mimeType, "javascript") || strstr(mimeType, "json") || strstr(mimeType, "xml") || strstr(mimeType, "svg");
+}
+
+static bool Compress(const std::vector<char>& in, std::vector<char>& out)
+{
+#ifdef WINWEB_ZLIB
+	//windowBits 15 + 16 gets a gzip wrapper rather than a bare zlib stream
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	out.resize(deflateBound(&zs, (uLong)in.size()));
+	zs.next_in = (Bytef*)in.data();
+	zs.avail_in = (uInt)in.size();
+	zs.next_out = (Bytef*)out.data();
+	zs.avail_out = (uInt)out.size();
+	int ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+	{
+		//A stream cut off part way isn't a gzip variant, leave none rather than a truncated one
+		out.clear();
+		return false;
+	}
+	out.resize(zs.total_out);
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool ReadWholeFile(const char* path, std::vector<char>& out)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	bool ok = GetFileSizeEx(file, &size) && size.QuadPart <= PACK_MAX_FILE_SIZE;
+	if (ok)
+	{
+		out.resize((size_t)size.QuadPart);
+		DWORD read = 0;
+		ok = out.empty() || (ReadFile(file, out.data(), (DWORD)out.size(), &read, NULL) && read == out.size());
+	}
+
+	CloseHandle(file);
+	return ok;
+}
+
+static void CollectFiles(const std::string& root, const std::string& rel, const std::string& skip, std::vector<PackFile>& files)
+{
+	WIN32_FIND_DATAA data;
+	std::string search = root + (rel.empty() ? "" : "\\" + rel) + "\\*";
+	HANDLE hFind = FindFirstFileExA(search.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	do
+	{
+		if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, "..") || (data.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN))
+		{
+			continue;
+		}
+
+		std::string childRel = rel.empty() ? data.cFileName : rel + "\\" + data.cFileName;
+		std::string diskPath = root + "\\" + childRel;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			CollectFiles(root, childRel, skip, files);
+			continue;
+		}
+
+		if (!_stricmp(diskPath.c_str(), skip.c_str()))
+		{
+			//Packing into the document root, don't swallow the previous pack
+			continue;
+		}
+
+		PackFile file;
+		NormaliseKey(childRel, file.key);
+		if (file.key.size() >= SITE_PACK_MAX_PATH || !ReadWholeFile(diskPath.c_str(), file.body))
+		{
+			std::cout << "Skipping " << childRel << std::endl;
+			continue;
+		}
+
+		const char* ext = strrchr(data.cFileName, '.');
+		GetMimeType(ext ? ext : "", file.mimeType, SITE_PACK_MIME_LEN);
+
+		//Content hash rather than mtime, so an unchanged file keeps its ETag across deploys
+		unsigned long long h = 14695981039346656037ULL;
+		for (int i = 0; i < file.body.size(); i++)
+		{
+			h ^= (unsigned char)file.body[i];
+			h *= 1099511628211ULL;
+		}
+		sprintf_s(file.etag, "\"%llx-%zx\"", h, file.body.size());
+
+		if (IsCompressible(file.mimeType) && Compress(file.body, file.gzip) && file.gzip.size() > file.body.size() - file.body.size() / PACK_MIN_GZIP_SAVING)
+		{
+			file.gzip.clear();
+		}
+
+		files.push_back(std::move(file));
+	} while (FindNextFileA(hFind, &data));
+
+	FindClose(hFind);
+}
+
+static bool BuildPerfectHash(const std::vector<PackFile>& files, std::vector<unsigned int>& seeds, std::vector<unsigned int>& slots)
+{
+	//Hash and displace: keys are split into buckets, then the biggest buckets first each search for a seed that puts all of their keys in free slots
+	unsigned int count = (unsigned int)files.size();
+	unsigned int bucketCount = count / 4 + 1;
+
+	for (unsigned int slotCount = count + count / 8 + 1; slotCount <= count * 2 + 8; slotCount += count / 8 + 1)
+	{
+		std::vector<std::vector<unsigned int>> buckets(bucketCount);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			buckets[SitePack::Hash(files[i].key.data(), (int)files[i].key.size(), 0) % bucketCount].push_back(i);
+		}
+
+		std::vector<unsigned int> order(bucketCount);
+		for (unsigned int i = 0; i < bucketCount; i++)
+		{
+			order[i] = i;
+		}
+		std::sort(order.begin(), order.end(), [&buckets](unsigned int a, unsigned int b) { return buckets[a].size() > buckets[b].size(); });
+
+		seeds.assign(bucketCount, 0);
+		slots.assign(slotCount, SITE_PACK_EMPTY_SLOT);
+		bool failed = false;
+		std::vector<unsigned int> picked;
+
+		for (unsigned int b = 0; b < bucketCount && !failed; b++)
+		{
+			const std::vector<unsigned int>& bucket = buckets[order[b]];
+			if (bucket.empty())
+			{
+				break;
+			}
+
+			bool placed = false;
+			for (unsigned int seed = 1; seed < PACK_MAX_SEED_TRIES && !placed; seed++)
+			{
+				picked.clear();
+				placed = true;
+				for (int k = 0; k < bucket.size(); k++)
+				{
+					const std::string& key = files[bucket[k]].key;
+					unsigned int slot = SitePack::Hash(key.data(), (int)key.size(), seed) % slotCount;
+					if (slots[slot] != SITE_PACK_EMPTY_SLOT || std::find(picked.begin(), picked.end(), slot) != picked.end())
+					{
+						placed = false;
+						break;
+					}
+					picked.push_back(slot);
+				}
+
+				if (placed)
+				{
+					seeds[order[b]] = seed;
+					for (int k = 0; k < bucket.size(); k++)
+					{
+						slots[picked[k]] = bucket[k];
+					}
+				}
+			}
+			failed = !placed;
+		}
+
+		if (!failed)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static unsigned long long Align(unsigned long long offset)
+{
+	return (offset + SITE_PACK_ALIGN - 1) & ~(unsigned long long)(SITE_PACK_ALIGN - 1);
+}
+
+static bool WritePack(const char* outPath, const std::vector<PackFile>& files, const std::vector<unsigned int>& seeds, const std::vector<unsigned int>& slots)
+{
+	PackHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SITE_PACK_MAGIC, 8);
+	header.version = SITE_PACK_VERSION;
+	header.entryCount = (unsigned int)files.size();
+	header.bucketCount = (unsigned int)seeds.size();
+	header.slotCount = (unsigned int)slots.size();
+	header.bucketsOffset = sizeof(PackHeader);
+	header.slotsOffset = header.bucketsOffset + seeds.size() * 4;
+	header.entriesOffset = Align(header.slotsOffset + slots.size() * 4);
+
+	//Lay out the data region: paths and headers first, then every body on its own cache line
+	std::vector<PackEntry> entries(files.size());
+	std::vector<std::string> headers(files.size() * 2);
+	unsigned long long offset = header.entriesOffset + entries.size() * sizeof(PackEntry);
+	for (int i = 0; i < files.size(); i++)
+	{
+		const PackFile& file = files[i];
+		PackEntry& entry = entries[i];
+		memset(&entry, 0, sizeof(entry));
+		strncpy_s(entry.mimeType, file.mimeType, SITE_PACK_MIME_LEN - 1);
+		strncpy_s(entry.etag, file.etag, SITE_PACK_ETAG_LEN - 1);
+
+		//Matches what Connection::GetHeader writes for these, the server only adds the per request lines
+		const char* vary = file.gzip.empty() ? "" : "Vary:Accept-Encoding\r\n";
+		char buf[512];
+		sprintf_s(buf, "Content-Type:%s\r\nContent-Length:%zu\r\nETag:%s\r\n%s", file.mimeType, file.body.size(), file.etag, vary);
+		headers[i * 2] = buf;
+		sprintf_s(buf, "Content-Type:%s\r\nContent-Length:%zu\r\nETag:%s\r\nContent-Encoding:gzip\r\n%s", file.mimeType, file.gzip.size(), file.etag, vary);
+		headers[i * 2 + 1] = file.gzip.empty() ? "" : buf;
+
+		entry.pathOffset = offset;
+		entry.pathLen = (unsigned int)file.key.size();
+		offset += file.key.size();
+		entry.headerOffset = offset;
+		offset += headers[i * 2].size() + 1;
+		entry.gzipHeaderOffset = offset;
+		offset += headers[i * 2 + 1].size() + 1;
+	}
+
+	for (int i = 0; i < files.size(); i++)
+	{
+		offset = Align(offset);
+		entries[i].bodyOffset = offset;
+		entries[i].bodyLen = files[i].body.size();
+		offset += files[i].body.size();
+
+		if (!files[i].gzip.empty())
+		{
+			offset = Align(offset);
+			entries[i].gzipOffset = offset;
+			entries[i].gzipLen = files[i].gzip.size();
+			offset += files[i].gzip.size();
+		}
+	}
+	header.fileSize = offset;
+
+	//Written beside the destination and renamed over it, so a running server never sees half a pack
+	std::string tempPath = std::string(outPath) + ".tmp";
+	HANDLE out = CreateFileA(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (out == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	unsigned long long written = 0;
+	bool ok = true;
+	auto put = [&](const void* data, unsigned long long len)
+		{
+			DWORD done = 0;
+			ok = ok && (len == 0 || (WriteFile(out, data, (DWORD)len, &done, NULL) && done == len));
+			written += len;
+		};
+	auto padTo = [&](unsigned long long target)
+		{
+			static const char zeros[SITE_PACK_ALIGN] = { 0 };
+			put(zeros, target - written);
+		};
+
+	put(&header, sizeof(header));
+	put(seeds.data(), seeds.size() * 4);
+	put(slots.data(), slots.size() * 4);
+	padTo(header.entriesOffset);
+	put(entries.data(), entries.size() * sizeof(PackEntry));
+	for (int i = 0; i < files.size(); i++)
+	{
+		put(files[i].key.data(), files[i].key.size());
+		put(headers[i * 2].c_str(), headers[i * 2].size() + 1);
+		put(headers[i * 2 + 1].c_str(), headers[i * 2 + 1].size() + 1);
+	}
+	for (int i = 0; i < files.size(); i++)
+	{
+		padTo(entries[i].bodyOffset);
+		put(files[i].body.data(), files[i].body.size());
+		if (entries[i].gzipOffset)
+		{
+			padTo(entries[i].gzipOffset);
+			put(files[i].gzip.data(), files[i].gzip.size());
+		}
+	}
+
+	ok = ok && written == header.fileSize && FlushFileBuffers(out);
+	CloseHandle(out);
+
+	if (!ok || !MoveFileExA(tempPath.c_str(), outPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		DeleteFileA(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cout << "Usage: WinWebPack <document root> <output pack>" << std::endl;
+		return 1;
+	}
+
+	std::string root = argv[1];
+	while (root.size() > 1 && (root.back() == '\\' || root.back() == '/'))
+	{
+		root.pop_back();
+	}
+
+	char fullOut[MAX_PATH];
+	char fullRoot[MAX_PATH];
+	GetFullPathNameA(argv[2], MAX_PATH, fullOut, NULL);
+	GetFullPathNameA(root.c_str(), MAX_PATH, fullRoot, NULL);
+
+	std::vector<PackFile> files;
+	CollectFiles(fullRoot, "", fullOut, files);
+	if (files.empty())
+	{
+		std::cout << "Nothing to pack under " << root << std::endl;
+		return 1;
+	}
+
+	std::vector<unsigned int> seeds;
+	std::vector<unsigned int> slots;
+	if (!BuildPerfectHash(files, seeds, slots))
+	{
+		std::cout << "Failed building the path index" << std::endl;
+		return 1;
+	}
+
+	if (!WritePack(argv[2], files, seeds, slots))
+	{
+		std::cout << "Failed writing " << argv[2] << std::endl;
+		return 1;
+	}
+
+	unsigned long long raw = 0;
+	int gzipped = 0;
+	for (int i = 0; i < files.size(); i++)
+	{
+		raw += files[i].body.size();
+		gzipped += files[i].gzip.empty() ? 0 : 1;
+	}
+	std::cout << "Packed " << files.size() << " files (" << raw / 1024 << "KB, " << gzipped << " with gzip variants) into " << argv[2] << std::endl;
+	return 0;
+}
@@ -0,0 +1,255 @@
+#include "Hpack.h"
+#include "RequestTarget.h"
+#include "Router.h"
+#include <stdio.h>
+#include <string.h>
+
+//Unit tests for the parts of the request path that decide what a client can reach, run without a server or a socket
+//Usage: WinWebTests, prints each failure and exits 1 if there were any
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) Check((cond), #cond, __FILE__, __LINE__)
+
+static void Check(bool passed, const char* what, const char* file, int line)
+{
+	++checks;
+	if (!passed)
+	{
+		++failures;
+		printf("FAIL %s:%d %s\n", file, line, what);
+	}
+}
+
+static const char* ResultName(DecodeResult result)
+{
+	switch (result)
+	{
+	case DECODE_OK:
+		return "ok";
+	case DECODE_BAD_ESCAPE:
+		return "bad escape";
+	case DECODE_BAD_CHAR:
+		return "bad char";
+	case DECODE_TOO_LONG:
+		return "too long";
+	case DECODE_OUTSIDE_ROOT:
+		return "outside root";
+	}
+	return "?";
+}
+
+//Decodes target and checks both the result and, when it's DECODE_OK, the path it came out as
+static void ExpectDecode(const char* target, DecodeResult expected, const char* expectedPath, int outSize = 256)
+{
+	char out[256];
+	int outLen = -1;
+	DecodeResult result = RequestTarget::Decode(target, (int)strlen(target), out, outSize, outLen);
+
+	++checks;
+	if (result != expected)
+	{
+		++failures;
+		printf("FAIL \"%s\" gave %s, expected %s\n", target, ResultName(result), ResultName(expected));
+		return;
+	}
+	if (expected == DECODE_OK && (outLen != (int)strlen(expectedPath) || strcmp(out, expectedPath)))
+	{
+		++failures;
+		printf("FAIL \"%s\" decoded to \"%.*s\", expected \"%s\"\n", target, outLen, out, expectedPath);
+	}
+}
+
+static void TestEscapes()
+{
+	ExpectDecode("/index.html", DECODE_OK, "index.html");
+	ExpectDecode("/a/b%20c.html", DECODE_OK, "a/b c.html");
+	ExpectDecode("/%41%62%63", DECODE_OK, "Abc");
+	ExpectDecode("/%4a%4A", DECODE_OK, "JJ");
+	ExpectDecode("/caf%C3%A9.txt", DECODE_OK, "caf\xC3\xA9.txt");
+
+	//Malformed escapes, at the end, short and not hex
+	ExpectDecode("/a%", DECODE_BAD_ESCAPE, nullptr);
+	ExpectDecode("/a%4", DECODE_BAD_ESCAPE, nullptr);
+	ExpectDecode("/a%zz", DECODE_BAD_ESCAPE, nullptr);
+	ExpectDecode("/a%g0b", DECODE_BAD_ESCAPE, nullptr);
+	ExpectDecode("/a%0gb", DECODE_BAD_ESCAPE, nullptr);
+	ExpectDecode("/a%%41", DECODE_BAD_ESCAPE, nullptr);
+}
+
+static void TestTraversal()
+{
+	ExpectDecode("/a/b%20c/../d.html?x=1", DECODE_OK, "a/d.html");
+	ExpectDecode("/a/./b/../c", DECODE_OK, "a/c");
+	ExpectDecode("//a///b/.", DECODE_OK, "a/b/");
+	ExpectDecode("/a/b/", DECODE_OK, "a/b/");
+	ExpectDecode("/a/%2e%2e/b", DECODE_OK, "b");
+	ExpectDecode("/..a/b..", DECODE_OK, "..a/b..");
+
+	ExpectDecode("/../etc/passwd", DECODE_OUTSIDE_ROOT, nullptr);
+	ExpectDecode("/a/../../b", DECODE_OUTSIDE_ROOT, nullptr);
+	ExpectDecode("/..", DECODE_OUTSIDE_ROOT, nullptr);
+	ExpectDecode("/%2e%2e/etc/passwd", DECODE_OUTSIDE_ROOT, nullptr);
+	ExpectDecode("/%2E%2e/etc/passwd", DECODE_OUTSIDE_ROOT, nullptr);
+	ExpectDecode("/a/%2e%2e/%2e%2e/b", DECODE_OUTSIDE_ROOT, nullptr);
+	ExpectDecode("/.%2e/b", DECODE_OUTSIDE_ROOT, nullptr);
+
+	//A bare backslash is a separator like '/', so it's confined the same way
+	ExpectDecode("/a\\b", DECODE_OK, "a/b");
+	ExpectDecode("/a\\..\\..\\b", DECODE_OUTSIDE_ROOT, nullptr);
+
+	//Long enough that the plain prefix is scanned 16 bytes at a time before the ".." turns up
+	ExpectDecode("/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/bbbbbbbbbbbbbbbb.html", DECODE_OK, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/bbbbbbbbbbbbbbbb.html");
+	ExpectDecode("/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/../../b", DECODE_OUTSIDE_ROOT, nullptr);
+}
+
+static void TestRejectedChars()
+{
+	ExpectDecode("/a%00b", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/a.html%00.png", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/a%1fb", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/a%7fb", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/a%3ab", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/c:/windows", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/a%5cb", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/..%5c..%5cwindows", DECODE_BAD_CHAR, nullptr);
+	ExpectDecode("/a%5Cb", DECODE_BAD_CHAR, nullptr);
+}
+
+static void TestQueryStripped()
+{
+	ExpectDecode("/index.html?x=1", DECODE_OK, "index.html");
+	ExpectDecode("/index.html#top", DECODE_OK, "index.html");
+	ExpectDecode("/a?", DECODE_OK, "a");
+	ExpectDecode("/?x=1", DECODE_OK, "");
+
+	//Nothing after the '?' is decoded or confined, it isn't part of the path
+	ExpectDecode("/a?x=%zz", DECODE_OK, "a");
+	ExpectDecode("/a?x=%00", DECODE_OK, "a");
+	ExpectDecode("/a?x=../../../b", DECODE_OK, "a");
+
+	//An escaped '?' is part of the name
+	ExpectDecode("/a%3fb", DECODE_OK, "a?b");
+}
+
+static void TestLength()
+{
+	ExpectDecode("/abcdef", DECODE_OK, "abcdef", 7);
+	ExpectDecode("/abcdefg", DECODE_TOO_LONG, nullptr, 7);
+	ExpectDecode("/abc%20efg", DECODE_TOO_LONG, nullptr, 7);
+}
+
+static void TestTargetEnd()
+{
+	const char* line = "/a/b.html HTTP/1.1\r\n";
+	CHECK(RequestTarget::FindTargetEnd(line, (int)strlen(line)) == 9);
+	CHECK(RequestTarget::FindTargetEnd("/a", 2) == 2);
+}
+
+//Matches path (no leading slash, as RequestTarget::Decode leaves it) and returns the pattern that won, or "" for none
+static std::string MatchPattern(const Router& router, RouteMethod method, const char* path, RouteResult expected = ROUTE_MATCHED)
+{
+	RouteMatch match;
+	RouteResult result = router.Match(method, path, (int)strlen(path), match);
+	CHECK(result == expected);
+	return result == ROUTE_MATCHED ? match.route->pattern : "";
+}
+
+static void TestRouteBacktracking()
+{
+	Router router;
+	Route route;
+	router.Add(ROUTE_READ, "/files/index", route);
+	router.Add(ROUTE_READ, "/files/:name", route);
+	router.Add(ROUTE_READ, "/files/:name/meta", route);
+	router.Add(ROUTE_READ, "/users/:id/posts", route);
+	router.Add(ROUTE_READ, "/users/me", route);
+	router.Compile();
+
+	CHECK(MatchPattern(router, METHOD_GET, "files/index") == "files/index");
+	CHECK(MatchPattern(router, METHOD_GET, "files/indexes") == "files/:name");
+	CHECK(MatchPattern(router, METHOD_GET, "files/ind") == "files/:name");
+	CHECK(MatchPattern(router, METHOD_GET, "files/index/meta") == "files/:name/meta");
+	CHECK(MatchPattern(router, METHOD_GET, "users/me/posts") == "users/:id/posts");
+	CHECK(MatchPattern(router, METHOD_GET, "users/me") == "users/me");
+	MatchPattern(router, METHOD_GET, "files/index/other", ROUTE_NOT_FOUND);
+	MatchPattern(router, METHOD_POST, "files/indexes", ROUTE_METHOD_NOT_ALLOWED);
+
+	//The param has to be the one from the branch that matched, not one left over from a branch that didn't
+	RouteMatch match;
+	CHECK(router.Match(METHOD_GET, "files/indexes", 13, match) == ROUTE_MATCHED);
+	CHECK(match.paramCount == 1 && match.params[0].len == 7 && !strncmp(match.params[0].value, "indexes", 7));
+}
+
+static void TestRoutePrefixBoundary()
+{
+	Router router;
+	Route route;
+	router.Add(ROUTE_ANY, "/api*", route);
+	router.Add(ROUTE_READ, "/static/*", route);
+	router.Add(ROUTE_READ, "/*", route);
+	router.Compile();
+
+	CHECK(MatchPattern(router, METHOD_GET, "api") == "api*");
+	CHECK(MatchPattern(router, METHOD_POST, "api/users") == "api*");
+	CHECK(MatchPattern(router, METHOD_GET, "apiary.html") == "*");
+	CHECK(MatchPattern(router, METHOD_GET, "static/a.css") == "static/*");
+	CHECK(MatchPattern(router, METHOD_GET, "staticx") == "*");
+	CHECK(MatchPattern(router, METHOD_GET, "") == "*");
+	MatchPattern(router, METHOD_POST, "apiary.html", ROUTE_METHOD_NOT_ALLOWED);
+
+	RouteMatch match;
+	CHECK(router.Match(METHOD_GET, "api/users", 9, match) == ROUTE_MATCHED && match.restLen == 6 && !strncmp(match.rest, "/users", 6));
+}
+
+static void TestHpackListSize()
+{
+	//One 4000 byte value added to the dynamic table, then referenced again by a single byte each time
+	std::string block;
+	block += (char)0x40;
+	block += (char)1;
+	block += 'x';
+	block += (char)0x7f;
+	unsigned int valueLen = 4000 - 0x7f;
+	while (valueLen >= 0x80)
+	{
+		block += (char)(0x80 | (valueLen & 0x7f));
+		valueLen >>= 7;
+	}
+	block += (char)valueLen;
+	block.append(4000, 'v');
+
+	std::vector<HpackHeader> headers;
+	bool tooLarge = false;
+	HpackDecoder small;
+	small.SetMaxListSize(65536);
+	CHECK(small.Decode((const unsigned char*)block.data(), (int)block.size(), headers, &tooLarge) && !tooLarge && headers.size() == 1);
+
+	block.append(100, (char)(0x80 | 62));
+	headers.clear();
+	HpackDecoder limited;
+	limited.SetMaxListSize(65536);
+	CHECK(!limited.Decode((const unsigned char*)block.data(), (int)block.size(), headers, &tooLarge) && tooLarge);
+	CHECK(headers.size() < 17);
+
+	headers.clear();
+	HpackDecoder unlimited;
+	CHECK(unlimited.Decode((const unsigned char*)block.data(), (int)block.size(), headers, &tooLarge) && headers.size() == 101);
+}
+
+int main()
+{
+	TestEscapes();
+	TestTraversal();
+	TestRejectedChars();
+	TestQueryStripped();
+	TestLength();
+	TestTargetEnd();
+	TestRouteBacktracking();
+	TestRoutePrefixBoundary();
+	TestHpackListSize();
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures ? 1 : 0;
+}
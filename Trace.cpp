@@ -0,0 +1,228 @@
+#include "Trace.h"
+#include <Windows.h>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+std::atomic<unsigned int> Tracer::sampleRate{ 0 };
+std::atomic<unsigned long long> Tracer::nextRequestId{ 0 };
+
+struct TraceRing
+{
+	TraceEvent events[TRACE_RING_EVENTS];
+	std::atomic<unsigned long long> seq[TRACE_RING_EVENTS] = {}; //Odd while the slot is being written, (n + 1) * 2 once event n is in it
+	std::atomic<unsigned long long> head{ 0 }; //Events ever written, only the owning thread moves it
+	std::atomic<bool> owned{ true };
+};
+
+static std::mutex ringsMutex;
+static std::vector<TraceRing*> rings; //Never freed, a ring left by a thread that exited is handed to the next one
+static const std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+
+struct RingHolder
+{
+	TraceRing* ring = nullptr;
+	bool full = false; //Couldn't get one, don't keep asking
+
+	~RingHolder()
+	{
+		if (ring)
+		{
+			ring->owned = false;
+		}
+	}
+};
+
+static thread_local RingHolder localRing;
+static thread_local unsigned int sampleCounter = 0;
+
+static TraceRing* GetLocalRing()
+{
+	if (localRing.ring || localRing.full)
+	{
+		return localRing.ring;
+	}
+
+	std::lock_guard<std::mutex> lock(ringsMutex);
+	for (int i = 0; i < rings.size(); i++)
+	{
+		bool expected = false;
+		if (rings[i]->owned.compare_exchange_strong(expected, true))
+		{
+			localRing.ring = rings[i];
+			return localRing.ring;
+		}
+	}
+
+	if (rings.size() >= TRACE_MAX_RINGS)
+	{
+		localRing.full = true;
+		return nullptr;
+	}
+
+	TraceRing* ring = new (std::nothrow) TraceRing();
+	if (ring)
+	{
+		rings.push_back(ring);
+	}
+	localRing.ring = ring;
+	return ring;
+}
+
+void Tracer::SetSampleRate(unsigned int oneIn)
+{
+	//0 turns tracing off, 1 traces every request, 100 one in a hundred on each worker
+	sampleRate = oneIn;
+}
+
+unsigned int Tracer::GetSampleRate()
+{
+	return sampleRate;
+}
+
+unsigned long long Tracer::StartRequest()
+{
+	//Returns the new request's trace id, or 0 if it isn't being traced
+	unsigned int rate = sampleRate.load(std::memory_order_relaxed);
+	if (!rate || ++sampleCounter % rate)
+	{
+		return 0;
+	}
+	return ++nextRequestId;
+}
+
+long long Tracer::NowUs()
+{
+	return ToUs(std::chrono::steady_clock::now());
+}
+
+long long Tracer::ToUs(std::chrono::steady_clock::time_point when)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(when - traceEpoch).count();
+}
+
+void Tracer::Record(const char* name, long long startUs, long long endUs, unsigned long long requestId, const char* detail)
+{
+	TraceRing* ring = GetLocalRing();
+	if (!ring)
+	{
+		return;
+	}
+
+	unsigned long long head = ring->head.load(std::memory_order_relaxed);
+	std::atomic<unsigned long long>& seq = ring->seq[head % TRACE_RING_EVENTS];
+	seq.store(head * 2 + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	TraceEvent& event = ring->events[head % TRACE_RING_EVENTS];
+	event.name = name;
+	event.startUs = startUs;
+	event.durUs = endUs > startUs ? endUs - startUs : 0;
+	event.requestId = requestId;
+	event.threadId = GetCurrentThreadId();
+	event.detail[0] = 0;
+	if (detail)
+	{
+		strncpy_s(event.detail, detail, _TRUNCATE);
+	}
+	seq.store((head + 1) * 2, std::memory_order_release);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void AppendJsonString(std::string& out, const char* str)
+{
+	for (; *str; str++)
+	{
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += (char)c;
+		}
+		else if (c < 0x20 || c >= 0x80)
+		{
+			//Paths are still percent encoded or decoded bytes, neither has to be valid UTF-8
+			char esc[8];
+			sprintf_s(esc, "\\u%04x", c);
+			out += esc;
+		}
+		else
+		{
+			out += (char)c;
+		}
+	}
+}
+
+void Tracer::FormatChromeTrace(std::string& out)
+{
+	//Copies each ring while its thread carries on writing. A slot is only kept if its sequence number says it holds the event
+	//expected there, and still says so after the copy, so nothing half written or overwritten part way through gets out.
+	out = "{\"traceEvents\":[";
+	bool first = true;
+	std::vector<TraceEvent> copy;
+
+	std::lock_guard<std::mutex> lock(ringsMutex);
+	for (int r = 0; r < rings.size(); r++)
+	{
+		TraceRing* ring = rings[r];
+		unsigned long long end = ring->head.load(std::memory_order_acquire);
+		unsigned long long begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+
+		copy.clear();
+		for (unsigned long long i = begin; i < end; i++)
+		{
+			std::atomic<unsigned long long>& seq = ring->seq[i % TRACE_RING_EVENTS];
+			unsigned long long before = seq.load(std::memory_order_acquire);
+			if (before != (i + 1) * 2)
+			{
+				continue;
+			}
+
+			TraceEvent event = ring->events[i % TRACE_RING_EVENTS];
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) != before)
+			{
+				continue;
+			}
+			event.detail[TRACE_DETAIL_LEN - 1] = 0;
+			copy.push_back(event);
+		}
+
+		for (int i = 0; i < copy.size(); i++)
+		{
+			const TraceEvent& event = copy[i];
+			char buf[256];
+			sprintf_s(buf, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"request\":%llu",
+				first ? "" : ",\n", event.name, event.startUs, event.durUs, event.threadId, event.requestId);
+			out += buf;
+			if (event.detail[0])
+			{
+				out += ",\"detail\":\"";
+				AppendJsonString(out, event.detail);
+				out += '"';
+			}
+			out += "}}";
+			first = false;
+		}
+	}
+
+	out += "],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+bool Tracer::WriteChromeTrace(const char* path)
+{
+	std::string json;
+	FormatChromeTrace(json);
+
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	DWORD written = 0;
+	bool ok = WriteFile(file, json.data(), (DWORD)json.size(), &written, NULL) && written == json.size();
+	CloseHandle(file);
+	return ok;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#define TRACE_RING_EVENTS 4096 //Per thread, oldest are overwritten
+#define TRACE_MAX_RINGS 64 //Threads that can record at once, anything past this is dropped
+#define TRACE_DETAIL_LEN 64
+#define TRACE_FILE "winweb-trace.json"
+
+struct TraceEvent
+{
+	const char* name; //Always a literal, only the pointer is kept
+	long long startUs;
+	long long durUs;
+	unsigned long long requestId;
+	unsigned int threadId;
+	char detail[TRACE_DETAIL_LEN];
+};
+
+//Sampled per request spans, recorded into a ring per thread so the hot path never takes a lock,
+//and dumped on demand as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev).
+//Off until a sample rate is set, every call is then a load and a branch.
+class Tracer
+{
+public:
+	static void SetSampleRate(unsigned int oneIn);
+	static unsigned int GetSampleRate();
+	static unsigned long long StartRequest();
+	static long long NowUs();
+	static long long ToUs(std::chrono::steady_clock::time_point when);
+	static void Record(const char* name, long long startUs, long long endUs, unsigned long long requestId, const char* detail = nullptr);
+	static void FormatChromeTrace(std::string& out);
+	static bool WriteChromeTrace(const char* path);
+private:
+	static std::atomic<unsigned int> sampleRate;
+	static std::atomic<unsigned long long> nextRequestId;
+};
+
+//Records a span from construction to destruction, does nothing for requests that weren't sampled.
+//Fine across co_await, the span just ends on whichever worker resumed it.
+struct TraceSpan
+{
+	TraceSpan(const char* spanName, unsigned long long id) : name(spanName), requestId(id), startUs(id ? Tracer::NowUs() : 0)
+	{
+	}
+
+	~TraceSpan()
+	{
+		if (requestId)
+		{
+			Tracer::Record(name, startUs, Tracer::NowUs(), requestId);
+		}
+	}
+
+	const char* name;
+	unsigned long long requestId;
+	long long startUs;
+};
@@ -0,0 +1,279 @@
+#include "Upgrade.h"
+#include <stdio.h>
+#include <vector>
+
+ProcessUpgrade::ProcessUpgrade()
+{
+}
+
+ProcessUpgrade::~ProcessUpgrade()
+{
+	if (pipe != INVALID_HANDLE_VALUE)
+	{
+		//Never got as far as ready, the old process sees the pipe break and keeps serving
+		CloseHandle(pipe);
+	}
+}
+
+void ProcessUpgrade::MakePipeName(DWORD pid, char* buf, int size)
+{
+	sprintf_s(buf, size, "\\\\.\\pipe\\WinWeb-%lu-upgrade", (unsigned long)pid);
+}
+
+void ProcessUpgrade::MakeEventName(DWORD pid, const char* command, char* buf, int size)
+{
+	sprintf_s(buf, size, "Local\\WinWeb-%lu-%s", (unsigned long)pid, command);
+}
+
+void ProcessUpgrade::MakeCommandLine(std::string& out)
+{
+	//Our own command line, so the new process is set up the way we were, less any takeover of our own
+	out = GetCommandLineA();
+	size_t pos;
+	while ((pos = out.find(" " UPGRADE_ARG " ")) != std::string::npos)
+	{
+		size_t end = out.find(' ', pos + sizeof(UPGRADE_ARG) + 1);
+		out.erase(pos, end == std::string::npos ? std::string::npos : end - pos);
+	}
+
+	char arg[32];
+	sprintf_s(arg, " " UPGRADE_ARG " %lu", (unsigned long)GetCurrentProcessId());
+	out += arg;
+}
+
+bool ProcessUpgrade::StartProcess(std::string& commandLine, PROCESS_INFORMATION& info)
+{
+	//Only our std handles are inherited. Client sockets are inheritable by default and one open in the new process
+	//would keep its connection alive after we've closed it.
+	HANDLE stdHandles[3] = { GetStdHandle(STD_INPUT_HANDLE), GetStdHandle(STD_OUTPUT_HANDLE), GetStdHandle(STD_ERROR_HANDLE) };
+	HANDLE inherit[3];
+	int inheritCount = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		bool seen = false;
+		for (int j = 0; j < inheritCount; j++)
+		{
+			seen = seen || inherit[j] == stdHandles[i];
+		}
+		if (stdHandles[i] && stdHandles[i] != INVALID_HANDLE_VALUE && !seen && SetHandleInformation(stdHandles[i], HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT))
+		{
+			inherit[inheritCount++] = stdHandles[i];
+		}
+	}
+
+	SIZE_T attrSize = 0;
+	InitializeProcThreadAttributeList(NULL, 1, 0, &attrSize);
+	std::vector<char> attrBuf(attrSize);
+	LPPROC_THREAD_ATTRIBUTE_LIST attrs = (LPPROC_THREAD_ATTRIBUTE_LIST)attrBuf.data();
+	if (!InitializeProcThreadAttributeList(attrs, 1, 0, &attrSize))
+	{
+		return false;
+	}
+
+	STARTUPINFOEXA startup = { 0 };
+	startup.StartupInfo.cb = sizeof(startup);
+	startup.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+	startup.StartupInfo.hStdInput = stdHandles[0];
+	startup.StartupInfo.hStdOutput = stdHandles[1];
+	startup.StartupInfo.hStdError = stdHandles[2];
+	startup.lpAttributeList = attrs;
+
+	std::vector<char> cmd(commandLine.begin(), commandLine.end());
+	cmd.push_back(0);
+	BOOL created = (!inheritCount || UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherit, inheritCount * sizeof(HANDLE), NULL, NULL))
+		&& CreateProcessA(NULL, cmd.data(), NULL, NULL, inheritCount > 0, EXTENDED_STARTUPINFO_PRESENT, NULL, NULL, &startup.StartupInfo, &info);
+	DeleteProcThreadAttributeList(attrs);
+	return created != FALSE;
+}
+
+bool ProcessUpgrade::WaitIo(HANDLE pipe, OVERLAPPED& overlapped, BOOL started, HANDLE process, DWORD timeoutMs, DWORD& transferred)
+{
+	//Finishes an overlapped operation on pipe, false if it failed, timed out or the new process exited first
+	transferred = 0;
+	if (!started)
+	{
+		DWORD err = GetLastError();
+		if (err == ERROR_PIPE_CONNECTED)
+		{
+			return true;
+		}
+		if (err != ERROR_IO_PENDING)
+		{
+			return false;
+		}
+	}
+
+	HANDLE handles[2] = { overlapped.hEvent, process };
+	if (WaitForMultipleObjects(2, handles, FALSE, timeoutMs) != WAIT_OBJECT_0)
+	{
+		//overlapped has to outlive the operation, so it's cancelled and waited out before we return
+		CancelIo(pipe);
+		GetOverlappedResult(pipe, &overlapped, &transferred, TRUE);
+		return false;
+	}
+	return GetOverlappedResult(pipe, &overlapped, &transferred, FALSE) != 0;
+}
+
+bool ProcessUpgrade::Offer(SOCKET http, SOCKET https, std::function<void(const char*)> log)
+{
+	//Old side. Blocks until the new process is accepting (true, we should drain) or has failed (false, we carry on serving).
+	char name[64];
+	MakePipeName(GetCurrentProcessId(), name, sizeof(name));
+	HANDLE server = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, sizeof(UpgradeHandoff), sizeof(UpgradeHandoff), 0, NULL);
+	if (server == INVALID_HANDLE_VALUE)
+	{
+		log("WARNING-> Failed creating the upgrade pipe, is an upgrade already in progress? <-WARNING");
+		return false;
+	}
+
+	OVERLAPPED overlapped = { 0 };
+	overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	std::string commandLine;
+	MakeCommandLine(commandLine);
+	PROCESS_INFORMATION info = { 0 };
+	if (!overlapped.hEvent || !StartProcess(commandLine, info))
+	{
+		log("WARNING-> Failed starting the new process, carrying on as we are <-WARNING");
+		if (overlapped.hEvent)
+		{
+			CloseHandle(overlapped.hEvent);
+		}
+		CloseHandle(server);
+		return false;
+	}
+	CloseHandle(info.hThread);
+
+	char buf[160];
+	sprintf_s(buf, "Started pid %lu to take over the listening sockets", (unsigned long)info.dwProcessId);
+	log(buf);
+
+	//Anyone on this machine could open the pipe, only the process we started gets the sockets
+	DWORD transferred = 0;
+	ULONG clientPid = 0;
+	bool ok = WaitIo(server, overlapped, ConnectNamedPipe(server, &overlapped), info.hProcess, UPGRADE_CONNECT_WAIT_MS, transferred)
+		&& GetNamedPipeClientProcessId(server, &clientPid) && clientPid == info.dwProcessId;
+
+	UpgradeHandoff handoff;
+	handoff.oldPid = GetCurrentProcessId();
+	handoff.hasTls = https != INVALID_SOCKET;
+	ok = ok && WSADuplicateSocketW(http, info.dwProcessId, &handoff.http) == 0
+		&& (!handoff.hasTls || WSADuplicateSocketW(https, info.dwProcessId, &handoff.https) == 0);
+
+	if (ok)
+	{
+		ResetEvent(overlapped.hEvent);
+		ok = WaitIo(server, overlapped, WriteFile(server, &handoff, sizeof(handoff), NULL, &overlapped), info.hProcess, UPGRADE_CONNECT_WAIT_MS, transferred)
+			&& transferred == sizeof(handoff);
+	}
+
+	if (ok)
+	{
+		//Building the index and warming the cache happen before it says it's ready, we keep accepting meanwhile
+		char ready = 0;
+		ResetEvent(overlapped.hEvent);
+		ok = WaitIo(server, overlapped, ReadFile(server, &ready, 1, NULL, &overlapped), info.hProcess, UPGRADE_READY_WAIT_MS, transferred)
+			&& transferred == 1;
+	}
+
+	if (ok)
+	{
+		sprintf_s(buf, "Pid %lu is accepting, draining our connections", (unsigned long)info.dwProcessId);
+		log(buf);
+	}
+	else
+	{
+		//Two servers half set up is worse than one, whatever didn't make it to ready is ended
+		TerminateProcess(info.hProcess, 1);
+		sprintf_s(buf, "WARNING-> Pid %lu didn't take over, carrying on as we are <-WARNING", (unsigned long)info.dwProcessId);
+		log(buf);
+	}
+
+	CloseHandle(info.hProcess);
+	CloseHandle(overlapped.hEvent);
+	CloseHandle(server);
+	return ok;
+}
+
+bool ProcessUpgrade::Take(DWORD oldPid, UpgradeHandoff& handoff)
+{
+	//New side, the old process created the pipe before starting us
+	char name[64];
+	MakePipeName(oldPid, name, sizeof(name));
+	pipe = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (pipe == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	char* pos = (char*)&handoff;
+	DWORD remaining = sizeof(handoff);
+	while (remaining > 0)
+	{
+		DWORD read = 0;
+		if (!ReadFile(pipe, pos, remaining, &read, NULL) || read == 0)
+		{
+			return false;
+		}
+		pos += read;
+		remaining -= read;
+	}
+	return handoff.magic == UPGRADE_HANDOFF_MAGIC && handoff.oldPid == oldPid;
+}
+
+void ProcessUpgrade::SignalReady()
+{
+	//We're accepting, the old process can stop
+	if (pipe == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	char ready = 1;
+	DWORD written = 0;
+	WriteFile(pipe, &ready, 1, &written, NULL);
+	CloseHandle(pipe);
+	pipe = INVALID_HANDLE_VALUE;
+}
+
+bool ProcessUpgrade::CreateControlEvents(HANDLE& reload, HANDLE& upgrade)
+{
+	//Named after our pid so WinWeb --signal can reach a server that has no console
+	char name[64];
+	MakeEventName(GetCurrentProcessId(), "reload", name, sizeof(name));
+	reload = CreateEventA(NULL, FALSE, FALSE, name);
+	MakeEventName(GetCurrentProcessId(), "upgrade", name, sizeof(name));
+	upgrade = CreateEventA(NULL, FALSE, FALSE, name);
+	return reload && upgrade;
+}
+
+bool ProcessUpgrade::Signal(const char* command, DWORD pid)
+{
+	if (strcmp(command, "reload") && strcmp(command, "upgrade"))
+	{
+		return false;
+	}
+
+	char name[64];
+	MakeEventName(pid, command, name, sizeof(name));
+	HANDLE event = OpenEventA(EVENT_MODIFY_STATE, FALSE, name);
+	if (!event)
+	{
+		return false;
+	}
+
+	BOOL set = SetEvent(event);
+	CloseHandle(event);
+	return set != FALSE;
+}
+
+int ProcessUpgrade::GetPort(SOCKET sckt)
+{
+	sockaddr_in addr;
+	int len = sizeof(addr);
+	if (sckt == INVALID_SOCKET || getsockname(sckt, (SOCKADDR*)&addr, &len) == SOCKET_ERROR)
+	{
+		return -1;
+	}
+	return ntohs(addr.sin_port);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <WinSock2.h>
+#include <Windows.h>
+#include <string>
+#include <functional>
+
+#define UPGRADE_ARG "--takeover" //Followed by the pid of the process whose sockets we take over
+#define SIGNAL_ARG "--signal" //WinWeb --signal reload|upgrade <pid>, for servers without a console
+#define UPGRADE_HANDOFF_MAGIC 0x50555757 //"WWUP"
+#define UPGRADE_CONNECT_WAIT_MS 10000 //For the new process to come up and ask for the sockets
+#define UPGRADE_READY_WAIT_MS 120000 //For it to index the document root, warm its caches and start accepting
+#define DRAIN_TIMEOUT_MS 30000 //Connections still open this long after we stopped accepting are closed
+
+//What the old process writes back once the new one has told it its pid
+struct UpgradeHandoff
+{
+	DWORD magic = UPGRADE_HANDOFF_MAGIC;
+	DWORD oldPid = 0;
+	BOOL hasTls = FALSE;
+	WSAPROTOCOL_INFOW http;
+	WSAPROTOCOL_INFOW https;
+};
+
+//Hands the listening sockets to a new copy of the executable so it can be upgraded, or restarted with new startup settings,
+//without the port ever closing. The old process starts the new one with UPGRADE_ARG, they meet on a named pipe, the sockets
+//are duplicated across (WSADuplicateSocket) and once the new one says it's accepting the old one drains and exits.
+class ProcessUpgrade
+{
+public:
+	ProcessUpgrade();
+	~ProcessUpgrade();
+	bool Offer(SOCKET http, SOCKET https, std::function<void(const char*)> log);
+	bool Take(DWORD oldPid, UpgradeHandoff& handoff);
+	void SignalReady();
+	static bool CreateControlEvents(HANDLE& reload, HANDLE& upgrade);
+	static bool Signal(const char* command, DWORD pid);
+	static int GetPort(SOCKET sckt);
+private:
+	static void MakePipeName(DWORD pid, char* buf, int size);
+	static void MakeEventName(DWORD pid, const char* command, char* buf, int size);
+	static void MakeCommandLine(std::string& out);
+	static bool StartProcess(std::string& commandLine, PROCESS_INFORMATION& info);
+	static bool WaitIo(HANDLE pipe, OVERLAPPED& overlapped, BOOL started, HANDLE process, DWORD timeoutMs, DWORD& transferred);
+	HANDLE pipe = INVALID_HANDLE_VALUE; //New side, held until we're ready
+};
@@ -0,0 +1,223 @@
+#include "VirtualHost.h"
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+
+VirtualHost::VirtualHost(const char* hostName, const char* root)
+{
+	name = hostName ? hostName : "";
+	docRoot = root && root[0] ? root : ".";
+}
+
+bool VirtualHost::TryRequest(int& retryAfter)
+{
+	//One bucket for the whole host, so a busy site can't starve the others sharing the workers
+	if (limits.requestsPerSecond <= 0)
+	{
+		return true;
+	}
+
+	long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	std::lock_guard<std::mutex> lock(bucketMutex);
+	if (lastRefillMs == 0)
+	{
+		tokens = limits.requestsPerSecond;
+	}
+	else
+	{
+		tokens += (now - lastRefillMs) * limits.requestsPerSecond / 1000.0;
+		if (tokens > limits.requestsPerSecond)
+		{
+			tokens = limits.requestsPerSecond;
+		}
+	}
+	lastRefillMs = now;
+
+	if (tokens < 1.0)
+	{
+		retryAfter = 1;
+		return false;
+	}
+	tokens -= 1.0;
+	return true;
+}
+
+unsigned int HostTable::Hash(const char* name, int len)
+{
+	unsigned int h = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int HostTable::NormaliseHost(const char* host, int len, char* out, int size)
+{
+	//Lower case, port and any trailing dot dropped, so "Example.COM.:4000" finds example.com. -1 if it won't fit.
+	while (len > 0 && (*host == ' ' || *host == '\t'))
+	{
+		++host;
+		--len;
+	}
+
+	int end = 0;
+	if (len > 0 && host[0] == '[')
+	{
+		//IPv6 literal, the port comes after the bracket
+		while (end < len && host[end] != ']')
+		{
+			++end;
+		}
+		end = end < len ? end + 1 : len;
+	}
+	else
+	{
+		while (end < len && host[end] != ':' && host[end] != ' ' && host[end] != '\t' && host[end] != '\r')
+		{
+			++end;
+		}
+	}
+
+	while (end > 0 && host[end - 1] == '.')
+	{
+		--end;
+	}
+
+	if (end >= size)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < end; i++)
+	{
+		out[i] = (char)tolower((unsigned char)host[i]);
+	}
+	out[end] = 0;
+	return end;
+}
+
+VirtualHost* HostTable::Add(const char* hostNames, const char* docRoot)
+{
+	//hostNames is comma separated, the first is the host's name and the rest are aliases. Call before Compile.
+	if (!hostNames || !hostNames[0])
+	{
+		return nullptr;
+	}
+
+	std::vector<std::string> parsed;
+	const char* start = hostNames;
+	while (*start)
+	{
+		const char* end = strchr(start, ',');
+		int len = end ? (int)(end - start) : (int)strlen(start);
+		char nameBuf[VHOST_MAX_NAME];
+		int nameLen = NormaliseHost(start, len, nameBuf, VHOST_MAX_NAME);
+		if (nameLen < 0)
+		{
+			return nullptr;
+		}
+		if (nameLen > 0)
+		{
+			parsed.push_back(nameBuf);
+		}
+		start = end ? end + 1 : start + len;
+	}
+
+	if (parsed.empty())
+	{
+		return nullptr;
+	}
+
+	for (int i = 0; i < parsed.size(); i++)
+	{
+		if (Get(parsed[i].c_str()))
+		{
+			//Each name can only point at one site
+			return nullptr;
+		}
+	}
+
+	std::unique_ptr<VirtualHost> host = std::make_unique<VirtualHost>(parsed[0].c_str(), docRoot);
+	for (int i = 0; i < parsed.size(); i++)
+	{
+		host->aliases.push_back(parsed[i]);
+		names.push_back({ parsed[i], host.get() });
+	}
+	hosts.push_back(std::move(host));
+	return hosts.back().get();
+}
+
+VirtualHost* HostTable::Get(const char* name)
+{
+	//Linear, for configuration before Compile
+	for (int i = 0; i < names.size(); i++)
+	{
+		if (names[i].first == name)
+		{
+			return names[i].second;
+		}
+	}
+	return nullptr;
+}
+
+bool HostTable::Compile()
+{
+	unsigned int size = 1;
+	while (size < names.size() * VHOST_TABLE_LOAD)
+	{
+		size <<= 1;
+	}
+
+	mask = size - 1;
+	slots.assign(size, -1);
+	for (int i = 0; i < names.size(); i++)
+	{
+		unsigned int slot = Hash(names[i].first.data(), (int)names[i].first.size()) & mask;
+		while (slots[slot] != -1)
+		{
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = i;
+	}
+	return true;
+}
+
+VirtualHost* HostTable::Find(const char* host, int len)
+{
+	//Host header value as sent, nullptr for anything not configured so the caller falls back to the default site
+	if (slots.empty() || !host)
+	{
+		return nullptr;
+	}
+
+	char nameBuf[VHOST_MAX_NAME];
+	int nameLen = NormaliseHost(host, len, nameBuf, VHOST_MAX_NAME);
+	if (nameLen <= 0)
+	{
+		return nullptr;
+	}
+
+	unsigned int slot = Hash(nameBuf, nameLen) & mask;
+	while (slots[slot] != -1)
+	{
+		const std::string& candidate = names[slots[slot]].first;
+		if (candidate.size() == (size_t)nameLen && !memcmp(candidate.data(), nameBuf, nameLen))
+		{
+			return names[slots[slot]].second;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return nullptr;
+}
+
+size_t HostTable::GetHostCount()
+{
+	return hosts.size();
+}
+
+VirtualHost* HostTable::GetHost(size_t i)
+{
+	return i < hosts.size() ? hosts[i].get() : nullptr;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "FileIndex.h"
+#include "Router.h"
+#include "FileCache.h"
+
+#define VHOST_MAX_NAME 256
+#define VHOST_TABLE_LOAD 2 //Slots per host, keeps probe chains short
+
+struct HostLimits
+{
+	long long maxBody = 0; //Default for routes that don't set one, 0 for the built in limits
+	int requestsPerSecond = 0; //Across every client of the host, 0 for no limit
+	size_t indexBudget = 0; //Bytes the host's file index may use, 0 for no limit
+	int fileHandles = 0; //Handles the host's file cache keeps open, 0 for the server wide limit
+};
+
+//One name based site: its own document root, file index, open file cache, routes, MIME overrides and limits
+class VirtualHost
+{
+public:
+	VirtualHost(const char* hostName, const char* root);
+	bool TryRequest(int& retryAfter);
+	std::string name;
+	std::string docRoot;
+	std::vector<std::string> aliases;
+	FileIndex fileIndex;
+	FileCache fileCache; //Separate so one busy site can't evict another's handles
+	Router router;
+	HostLimits limits;
+	std::unordered_map<std::string, std::string> mimeTypes; //Lower case extension with the dot, overrides Mime.cpp
+private:
+	std::mutex bucketMutex;
+	double tokens = 0;
+	long long lastRefillMs = 0;
+};
+
+//Host header to VirtualHost. Built once at startup into an open addressed table, so a lookup is one hash and a probe or two.
+class HostTable
+{
+public:
+	VirtualHost* Add(const char* names, const char* docRoot);
+	VirtualHost* Get(const char* name);
+	bool Compile();
+	VirtualHost* Find(const char* host, int len);
+	size_t GetHostCount();
+	VirtualHost* GetHost(size_t i);
+	static int NormaliseHost(const char* host, int len, char* out, int size);
+private:
+	static unsigned int Hash(const char* name, int len);
+	std::vector<std::unique_ptr<VirtualHost>> hosts;
+	std::vector<std::pair<std::string, VirtualHost*>> names;
+	std::vector<int> slots; //Index into names, -1 for empty
+	unsigned int mask = 0;
+};
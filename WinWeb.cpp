@@ -2,21 +2,79 @@
 #include "Server.h"
 #include <chrono>
 #include "Common.h"
+#include <string.h>
 
 #define PORT 4000 //Linux Server is using 4000 (Ignore if you're not me)
-int main()
+#define TLS_PORT 4443
+#define TLS_CERT_FILE "WinWeb.crt"
+#define TLS_KEY_FILE "WinWeb.key"
+int main(int argc, char** argv)
 {
+	if (argc == 4 && !strcmp(argv[1], SIGNAL_ARG))
+	{
+		//WinWeb --signal reload|upgrade <pid>, for a server running without a console
+		bool sent = ProcessUpgrade::Signal(argv[2], strtoul(argv[3], nullptr, 10));
+		std::cout << (sent ? "Sent " : "Failed sending ") << argv[2] << " to " << argv[3] << std::endl;
+		return sent ? 0 : 1;
+	}
+
 	Server* newServer = new Server();
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--headless"))
+		{
+			//No console input, for running under a service manager or with output redirected
+			newServer->SetHeadless(true);
+		}
+		else if (!strcmp(argv[i], "--workers") && i + 1 < argc)
+		{
+			//Serve from this many worker processes, this one stays as their master
+			newServer->SetWorkerProcesses(atoi(argv[++i]));
+		}
+		else if (!strcmp(argv[i], WORKER_ARG))
+		{
+			newServer->SetWorker(true);
+		}
+		else if (!strcmp(argv[i], "--config") && i + 1 < argc)
+		{
+			newServer->SetConfigFile(argv[++i]);
+		}
+		else if (!strcmp(argv[i], UPGRADE_ARG) && i + 1 < argc)
+		{
+			//Started by an upgrade, the old process hands us its sockets
+			newServer->TakeOver(strtoul(argv[++i], nullptr, 10));
+		}
+	}
+	if (TlsContext::Available())
+	{
+		newServer->EnableTls(TLS_PORT, TLS_CERT_FILE, TLS_KEY_FILE);
+	}
+	//newServer->AddProxyRoute("/api/", "127.0.0.1:8080,127.0.0.1:8081");
+	//newServer->SetProxyTimeouts(1000, 60000, 0);
+	//newServer->AddRedirect("/docs", "/docs/");
+	//newServer->AddUploadDir("/artifacts/*", "artifacts");
+	//newServer->UseSitePack("site.pack");
+	//newServer->SetCpuPinning(true);
+	//newServer->SetLargePages(true);
+	//newServer->SetTraceSampling(100);
+	//newServer->SetFileCacheLimits(512, 5000);
+	//newServer->SetClientTimeouts(5000, 15000, 15000);
+	//newServer->SetMinTransferRate(4096, 5000);
+	//newServer->SetBufferBudget(256LL * 1024 * 1024);
+	//newServer->SetRateLimits(32, 50, 8 * 1024 * 1024);
+	//newServer->SetSendRates(110LL * 1024 * 1024, 0);
+	//newServer->SetSendWeights(32, 4, 1);
+	//newServer->SetAdminAccess("10.0.0.0/8");
+	//newServer->SetConfigFile("C:\\winweb\\WinWeb.conf");
+	//newServer->AddVirtualHost("example.com,www.example.com", "C:\\sites\\example");
+	//newServer->SetHostLimits("example.com", 0, 200, 4 * 1024 * 1024, 64);
 	newServer->Init("ANY", PORT); 
 
 	if(newServer->servState != State::SHUTDOWN)
 	{
-		std::cout << "WinWeb " << SERVER_MAJOR << "." << SERVER_MINOR << "a, listening for connections on port " << PORT <<  "..." << std::endl;
+		std::cout << "WinWeb " << SERVER_MAJOR << "." << SERVER_MINOR << "a, listening for connections on port " << newServer->GetPort() <<  "..." << std::endl;
 
-		while (newServer->servState != State::SHUTDOWN)
-		{
-			std::this_thread::sleep_for(std::chrono::microseconds(10));
-		}
+		newServer->WaitForShutdown();
 	}
 
 	delete newServer;
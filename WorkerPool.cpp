@@ -0,0 +1,466 @@
+#include "WorkerPool.h"
+#include <chrono>
+#include <stdio.h>
+
+WorkerBoard::WorkerBoard()
+{
+}
+
+WorkerBoard::~WorkerBoard()
+{
+	if (data)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mapping)
+	{
+		CloseHandle(mapping);
+	}
+}
+
+void WorkerBoard::MakeName(DWORD masterPid, char* buf, int size)
+{
+	sprintf_s(buf, size, "Local\\WinWeb-%lu-workers", (unsigned long)masterPid);
+}
+
+bool WorkerBoard::Create(int workers)
+{
+	//Master only, the mapping lives as long as the master does
+	char name[64];
+	MakeName(GetCurrentProcessId(), name, sizeof(name));
+	mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(WorkerBoardData), name);
+	if (!mapping)
+	{
+		return false;
+	}
+
+	data = (WorkerBoardData*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(WorkerBoardData));
+	if (!data)
+	{
+		return false;
+	}
+
+	memset(data, 0, sizeof(WorkerBoardData));
+	data->workers = workers;
+	return true;
+}
+
+bool WorkerBoard::Open(DWORD masterPid, int index)
+{
+	if (index < 0 || index >= WORKER_MAX_PROCESSES)
+	{
+		return false;
+	}
+
+	char name[64];
+	MakeName(masterPid, name, sizeof(name));
+	mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (!mapping)
+	{
+		return false;
+	}
+
+	data = (WorkerBoardData*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(WorkerBoardData));
+	if (!data)
+	{
+		return false;
+	}
+
+	this->index = index;
+	WorkerSlot& slot = data->slots[index];
+	if (slot.seq & 1)
+	{
+		//The worker before us died mid write
+		InterlockedIncrement(&slot.seq);
+	}
+	slot.pid = GetCurrentProcessId();
+	return true;
+}
+
+void WorkerBoard::Publish(const std::string& metrics)
+{
+	//Seqlock, readers in other processes retry if they catch us part way through
+	if (!data || index < 0)
+	{
+		return;
+	}
+
+	WorkerSlot& slot = data->slots[index];
+	InterlockedIncrement(&slot.seq);
+	size_t len = metrics.size() < WORKER_METRICS_SIZE - 1 ? metrics.size() : WORKER_METRICS_SIZE - 1;
+	memcpy(slot.metrics, metrics.data(), len);
+	slot.metrics[len] = 0;
+	InterlockedIncrement(&slot.seq);
+}
+
+void WorkerBoard::OnRestart()
+{
+	if (data)
+	{
+		InterlockedIncrement(&data->restarts);
+	}
+}
+
+void WorkerBoard::RequestReload()
+{
+	if (data)
+	{
+		InterlockedIncrement(&data->configGeneration);
+	}
+}
+
+LONG WorkerBoard::GetConfigGeneration()
+{
+	return data ? data->configGeneration : 0;
+}
+
+void WorkerBoard::FormatMetrics(std::string& out)
+{
+	//Every worker's last published metrics, each line labelled with the worker it came from so they can be summed or compared
+	if (!data)
+	{
+		return;
+	}
+
+	char buf[128];
+	sprintf_s(buf, "winweb_workers %ld\nwinweb_worker_restarts_total %ld\n", data->workers, data->restarts);
+	out += buf;
+
+	std::string copy;
+	for (int w = 0; w < data->workers && w < WORKER_MAX_PROCESSES; w++)
+	{
+		WorkerSlot& slot = data->slots[w];
+		bool consistent = false;
+		for (int attempt = 0; attempt < 100 && !consistent; attempt++)
+		{
+			LONG before = slot.seq;
+			MemoryBarrier();
+			if (before & 1)
+			{
+				YieldProcessor();
+				continue;
+			}
+			copy.assign(slot.metrics, strnlen_s(slot.metrics, WORKER_METRICS_SIZE));
+			MemoryBarrier();
+			consistent = slot.seq == before;
+		}
+		if (!consistent)
+		{
+			continue;
+		}
+
+		char label[32];
+		sprintf_s(label, "{worker=\"%d\"}", w);
+		size_t start = 0;
+		while (start < copy.size())
+		{
+			size_t end = copy.find('\n', start);
+			if (end == std::string::npos)
+			{
+				end = copy.size();
+			}
+			size_t space = copy.find(' ', start);
+			if (space != std::string::npos && space < end)
+			{
+				out.append(copy, start, space - start);
+				out += label;
+				out.append(copy, space, end - space);
+				out += '\n';
+			}
+			start = end + 1;
+		}
+	}
+}
+
+WorkerPool::WorkerPool()
+{
+	stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+}
+
+WorkerPool::~WorkerPool()
+{
+	Stop();
+	if (stopEvent)
+	{
+		CloseHandle(stopEvent);
+	}
+}
+
+long long WorkerPool::NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool WorkerPool::Start(int count, SOCKET http, SOCKET https, std::function<void(const char*)> log)
+{
+	count = count < WORKER_MAX_PROCESSES ? count : WORKER_MAX_PROCESSES;
+	this->http = http;
+	this->https = https;
+	this->log = log;
+	if (count <= 0 || !stopEvent || !board.Create(count))
+	{
+		return false;
+	}
+
+	//Workers are this same executable with the same arguments, so they set themselves up exactly as we were asked to
+	commandLine = GetCommandLineA();
+	commandLine += " " WORKER_ARG;
+
+	//Workers write their log lines straight to our stdout
+	SetHandleInformation(GetStdHandle(STD_OUTPUT_HANDLE), HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	SetHandleInformation(GetStdHandle(STD_ERROR_HANDLE), HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+
+	workers.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		if (!Spawn(i))
+		{
+			Stop();
+			return false;
+		}
+	}
+
+	superviseThread = std::thread(&WorkerPool::Supervise, this);
+	return true;
+}
+
+bool WorkerPool::Spawn(int index)
+{
+	//workersMutex held, or not yet needed
+	SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	HANDLE readEnd = NULL;
+	HANDLE writeEnd = NULL;
+	if (!CreatePipe(&readEnd, &writeEnd, &inherit, 0))
+	{
+		return false;
+	}
+	SetHandleInformation(writeEnd, HANDLE_FLAG_INHERIT, 0);
+
+	STARTUPINFOA startup = { 0 };
+	startup.cb = sizeof(startup);
+	startup.dwFlags = STARTF_USESTDHANDLES;
+	startup.hStdInput = readEnd;
+	startup.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	//Own process group, Ctrl+C only reaches the master, which then stops the workers itself
+	PROCESS_INFORMATION info = { 0 };
+	std::vector<char> cmd(commandLine.begin(), commandLine.end());
+	cmd.push_back(0);
+	BOOL created = CreateProcessA(NULL, cmd.data(), NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP, NULL, NULL, &startup, &info);
+	CloseHandle(readEnd);
+	if (!created)
+	{
+		CloseHandle(writeEnd);
+		return false;
+	}
+	CloseHandle(info.hThread);
+
+	WorkerHandoff handoff;
+	handoff.masterPid = GetCurrentProcessId();
+	handoff.index = index;
+	handoff.hasTls = https != INVALID_SOCKET;
+	bool ok = WSADuplicateSocketW(http, info.dwProcessId, &handoff.http) == 0
+		&& (!handoff.hasTls || WSADuplicateSocketW(https, info.dwProcessId, &handoff.https) == 0);
+
+	DWORD written = 0;
+	ok = ok && WriteFile(writeEnd, &handoff, sizeof(handoff), &written, NULL) && written == sizeof(handoff);
+	if (!ok)
+	{
+		TerminateProcess(info.hProcess, 1);
+		CloseHandle(info.hProcess);
+		CloseHandle(writeEnd);
+		return false;
+	}
+
+	WorkerProcess& worker = workers[index];
+	worker.process = info.hProcess;
+	worker.pipe = writeEnd;
+	worker.pid = info.dwProcessId;
+	worker.startedMs = NowMs();
+	worker.restartAtMs = 0;
+
+	char buf[128];
+	sprintf_s(buf, "Started worker %d (pid %lu)", index, (unsigned long)info.dwProcessId);
+	log(buf);
+	return true;
+}
+
+void WorkerPool::Supervise()
+{
+	//Sleeps until a worker exits, a crash looping one is due to start again, or Stop
+	while (true)
+	{
+		HANDLE handles[WORKER_MAX_PROCESSES + 1];
+		int owner[WORKER_MAX_PROCESSES + 1];
+		DWORD count = 0;
+		handles[count] = stopEvent;
+		owner[count++] = -1;
+
+		long long now = NowMs();
+		long long nextRestart = 0;
+		{
+			std::lock_guard<std::mutex> lock(workersMutex);
+			for (int i = 0; i < workers.size(); i++)
+			{
+				if (workers[i].process)
+				{
+					handles[count] = workers[i].process;
+					owner[count++] = i;
+				}
+				else if (workers[i].restartAtMs && (!nextRestart || workers[i].restartAtMs < nextRestart))
+				{
+					nextRestart = workers[i].restartAtMs;
+				}
+			}
+		}
+
+		DWORD timeout = nextRestart ? (DWORD)(nextRestart > now ? nextRestart - now : 0) : INFINITE;
+		DWORD ret = WaitForMultipleObjects(count, handles, FALSE, timeout);
+		if (ret == WAIT_OBJECT_0 || ret == WAIT_FAILED)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(workersMutex);
+		now = NowMs();
+		if (ret > WAIT_OBJECT_0 && ret < WAIT_OBJECT_0 + count)
+		{
+			WorkerProcess& worker = workers[owner[ret - WAIT_OBJECT_0]];
+			DWORD exitCode = 0;
+			GetExitCodeProcess(worker.process, &exitCode);
+			CloseHandle(worker.process);
+			CloseHandle(worker.pipe);
+			worker.process = NULL;
+			worker.pipe = NULL;
+
+			//Straight back up unless it's dying as fast as we can start it
+			bool looping = now - worker.startedMs < WORKER_MIN_UPTIME_MS;
+			worker.restartAtMs = looping ? now + WORKER_RESTART_DELAY_MS : now;
+
+			char buf[160];
+			sprintf_s(buf, "WARNING-> Worker %d (pid %lu) exited with 0x%08lx, restarting%s <-WARNING", owner[ret - WAIT_OBJECT_0], (unsigned long)worker.pid,
+				(unsigned long)exitCode, looping ? " after a delay" : "");
+			log(buf);
+		}
+
+		for (int i = 0; i < workers.size(); i++)
+		{
+			if (!workers[i].process && workers[i].restartAtMs && workers[i].restartAtMs <= now)
+			{
+				++workers[i].restarts;
+				board.OnRestart();
+				if (!Spawn(i))
+				{
+					workers[i].restartAtMs = now + WORKER_RESTART_DELAY_MS;
+				}
+			}
+		}
+	}
+}
+
+void WorkerPool::Stop()
+{
+	if (stopEvent)
+	{
+		SetEvent(stopEvent);
+	}
+	if (superviseThread.joinable())
+	{
+		superviseThread.join();
+	}
+
+	//Closing a worker's pipe is its signal to shut down, whatever hasn't after WORKER_STOP_WAIT_MS is ended
+	std::lock_guard<std::mutex> lock(workersMutex);
+	for (int i = 0; i < workers.size(); i++)
+	{
+		if (workers[i].pipe)
+		{
+			CloseHandle(workers[i].pipe);
+			workers[i].pipe = NULL;
+		}
+	}
+
+	long long deadline = NowMs() + WORKER_STOP_WAIT_MS;
+	for (int i = 0; i < workers.size(); i++)
+	{
+		if (!workers[i].process)
+		{
+			continue;
+		}
+
+		long long left = deadline - NowMs();
+		if (WaitForSingleObject(workers[i].process, left > 0 ? (DWORD)left : 0) != WAIT_OBJECT_0)
+		{
+			TerminateProcess(workers[i].process, 1);
+		}
+		CloseHandle(workers[i].process);
+		workers[i].process = NULL;
+		workers[i].restartAtMs = 0;
+	}
+}
+
+void WorkerPool::FormatStatus(std::string& out)
+{
+	std::lock_guard<std::mutex> lock(workersMutex);
+	long long now = NowMs();
+	for (int i = 0; i < workers.size(); i++)
+	{
+		char buf[128];
+		if (workers[i].process)
+		{
+			sprintf_s(buf, "Worker %d: pid %lu, up %llds, %u restarts\n", i, (unsigned long)workers[i].pid, (now - workers[i].startedMs) / 1000, workers[i].restarts);
+		}
+		else
+		{
+			sprintf_s(buf, "Worker %d: down, %u restarts\n", i, workers[i].restarts);
+		}
+		out += buf;
+	}
+}
+
+void WorkerPool::FormatMetrics(std::string& out)
+{
+	board.FormatMetrics(out);
+}
+
+void WorkerPool::RequestReload()
+{
+	//Picked up by each worker on its next publish
+	board.RequestReload();
+}
+
+bool WorkerPool::ReceiveHandoff(WorkerHandoff& handoff)
+{
+	//Worker side, the first thing the master writes to our stdin
+	HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+	char* pos = (char*)&handoff;
+	DWORD remaining = sizeof(handoff);
+	while (remaining > 0)
+	{
+		DWORD read = 0;
+		if (!ReadFile(in, pos, remaining, &read, NULL) || read == 0)
+		{
+			return false;
+		}
+		pos += read;
+		remaining -= read;
+	}
+	return handoff.magic == WORKER_HANDOFF_MAGIC;
+}
+
+SOCKET WorkerPool::OpenListener(WSAPROTOCOL_INFOW& info)
+{
+	return WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+}
+
+void WorkerPool::WaitForMaster()
+{
+	//Returns once the master closes our stdin, whether it's stopping us or has itself gone away
+	HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+	char drain[16];
+	DWORD read = 0;
+	while (ReadFile(in, drain, sizeof(drain), &read, NULL) && read > 0)
+	{
+	}
+}
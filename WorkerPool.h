@@ -0,0 +1,103 @@
+#pragma once
+#include <WinSock2.h>
+#include <Windows.h>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+
+#define WORKER_MAX_PROCESSES 32
+#define WORKER_ARG "--worker" //Added to the master's own command line for each worker it starts
+#define WORKER_HANDOFF_MAGIC 0x4b525757 //"WWRK"
+#define WORKER_METRICS_SIZE 8192 //Per worker, what it last published
+#define WORKER_PUBLISH_MS 1000
+#define WORKER_MIN_UPTIME_MS 5000 //A worker dying sooner than this is crash looping
+#define WORKER_RESTART_DELAY_MS 1000 //How long a crash looping worker waits before it's started again
+#define WORKER_STOP_WAIT_MS 35000 //For workers to drain and shut down before they're terminated, a little over DRAIN_TIMEOUT_MS
+
+//Sent down a new worker's stdin. The listening sockets are duplicated into the worker, so every process accepts from the same ones.
+struct WorkerHandoff
+{
+	DWORD magic = WORKER_HANDOFF_MAGIC;
+	DWORD masterPid = 0;
+	int index = 0;
+	BOOL hasTls = FALSE;
+	WSAPROTOCOL_INFOW http;
+	WSAPROTOCOL_INFOW https;
+};
+
+struct WorkerSlot
+{
+	volatile LONG seq; //Odd while the worker is writing
+	DWORD pid;
+	char metrics[WORKER_METRICS_SIZE];
+};
+
+struct WorkerBoardData
+{
+	LONG workers;
+	volatile LONG restarts;
+	volatile LONG configGeneration; //Bumped by the master on a reload, workers reread the config when it changes
+	WorkerSlot slots[WORKER_MAX_PROCESSES];
+};
+
+//Named shared memory the master creates and each worker writes its metrics into, so any of them can report on all of them
+class WorkerBoard
+{
+public:
+	WorkerBoard();
+	~WorkerBoard();
+	bool Create(int workers);
+	bool Open(DWORD masterPid, int index);
+	void Publish(const std::string& metrics);
+	void OnRestart();
+	void RequestReload();
+	LONG GetConfigGeneration();
+	void FormatMetrics(std::string& out);
+private:
+	static void MakeName(DWORD masterPid, char* buf, int size);
+	HANDLE mapping = NULL;
+	WorkerBoardData* data = nullptr;
+	int index = -1; //Our slot, -1 in the master
+};
+
+struct WorkerProcess
+{
+	HANDLE process = NULL;
+	HANDLE pipe = NULL; //Write end of its stdin, closing it tells the worker to stop
+	DWORD pid = 0;
+	long long startedMs = 0;
+	long long restartAtMs = 0; //Non zero while it's waiting out a crash loop
+	unsigned int restarts = 0;
+};
+
+//Master side of multi process mode. Binds nothing itself, it's handed the listening sockets, starts count copies of this
+//executable with WORKER_ARG, gives each a duplicate of the sockets and restarts any that exit. A crash only takes one worker's clients with it.
+class WorkerPool
+{
+public:
+	WorkerPool();
+	~WorkerPool();
+	bool Start(int count, SOCKET http, SOCKET https, std::function<void(const char*)> log);
+	void Stop();
+	void FormatStatus(std::string& out);
+	void FormatMetrics(std::string& out);
+	void RequestReload();
+	static bool ReceiveHandoff(WorkerHandoff& handoff);
+	static SOCKET OpenListener(WSAPROTOCOL_INFOW& info);
+	static void WaitForMaster();
+private:
+	bool Spawn(int index);
+	void Supervise();
+	static long long NowMs();
+	std::vector<WorkerProcess> workers;
+	std::mutex workersMutex;
+	SOCKET http = INVALID_SOCKET;
+	SOCKET https = INVALID_SOCKET;
+	std::string commandLine;
+	std::function<void(const char*)> log;
+	WorkerBoard board;
+	HANDLE stopEvent = NULL;
+	std::thread superviseThread;
+};